@@ -11,14 +11,39 @@
 #define ASSERT(x) kassert(x)
 #define DPRINTF(fmt, ...) kprintf("memfile: %s: " fmt, __func__, ##__VA_ARGS__)
 
+#define MEMFILE_VM_SIZE SIZE_1GB
+
+// files of at least 2MB are mapped in multiples of 2MB so that they are backed
+// by 2MB pages
+static inline size_t memfile_map_size(size_t size) {
+  if (size >= SIZE_2MB) {
+    return align(size, SIZE_2MB);
+  }
+  return page_align(size);
+}
+
+static uintptr_t memfile_map(size_t map_size) {
+  if (map_size == 0) {
+    return 0; // empty files are not mapped
+  }
+  return vmap_anon(MEMFILE_VM_SIZE, 0, map_size, VM_WRITE, "memfile");
+}
+
+static void memfile_unmap(uintptr_t base, size_t map_size) {
+  if (base != 0 && vmap_free(base, map_size) < 0) {
+    DPRINTF("failed to free vm mapping\n");
+  }
+}
+
 //
 
 memfile_t *memfile_alloc(size_t size) {
   memfile_t *memf = kmallocz(sizeof(memfile_t));
   memf->size = size;
+  memf->map_size = memfile_map_size(size);
 
-  uintptr_t vaddr = vmap_anon(SIZE_1GB, 0, size, VM_WRITE, "memfile");
-  if (vaddr == 0) {
+  uintptr_t vaddr = memfile_map(memf->map_size);
+  if (vaddr == 0 && memf->map_size > 0) {
     DPRINTF("failed to allocate vm mapping\n");
     kfree(memf);
     return NULL;
@@ -28,9 +53,7 @@ memfile_t *memfile_alloc(size_t size) {
 }
 
 void memfile_free(memfile_t *memf) {
-  if (vmap_free(memf->base, memf->size) < 0) {
-    DPRINTF("failed to free vm mapping\n");
-  }
+  memfile_unmap(memf->base, memf->map_size);
   kfree(memf);
 }
 
@@ -38,16 +61,50 @@ __ref page_t *memfile_getpage(memfile_t *memf, off_t off) {
   if (off >= memf->size) {
     return NULL;
   }
-  return vm_getpage(memf->base + off);
+
+  page_t *page = vm_getpage(memf->base + off);
+  if (page != NULL && pg_flags_to_size(page->flags) != PAGE_SIZE) {
+    // callers only deal with 4K pages so hand out the piece of the big page
+    size_t pg_size = pg_flags_to_size(page->flags);
+    page_t *subpage = alloc_subpage(page, align_down(off, PAGE_SIZE) & (pg_size - 1));
+    drop_pages(&page);
+    page = subpage;
+  }
+  memf->exported = true;
+  return page;
 }
 
 int memfile_falloc(memfile_t *memf, size_t newsize) {
   int res;
-  if ((res = vmap_resize(memf->base, memf->size, newsize, /*allow_move=*/true, &memf->base)) < 0) {
+  size_t map_size = memfile_map_size(newsize);
+  if (map_size == memf->map_size) {
+    memf->size = newsize;
+    return 0;
+  }
+
+  if (memf->base == 0 || (map_size >= SIZE_2MB && memf->map_size < SIZE_2MB && !memf->exported)) {
+    // move to a new mapping which is backed by 2MB pages once the file is large
+    // enough. this can only be done while no pages have been handed out since
+    // they would no longer be part of the file
+    uintptr_t vaddr = memfile_map(map_size);
+    if (vaddr == 0) {
+      DPRINTF("failed to allocate vm mapping\n");
+      return -ENOMEM;
+    }
+
+    memcpy((void *) vaddr, (void *) memf->base, min(memf->size, newsize));
+    memfile_unmap(memf->base, memf->map_size);
+    memf->base = vaddr;
+  } else if (map_size == 0) {
+    memfile_unmap(memf->base, memf->map_size);
+    memf->base = 0;
+  } else if ((res = vmap_resize(memf->base, memf->map_size, map_size, /*allow_move=*/true, &memf->base)) < 0) {
     DPRINTF("failed to resize vm mapping\n");
     return res;
   }
+
   memf->size = newsize;
+  memf->map_size = map_size;
   return 0;
 }
 
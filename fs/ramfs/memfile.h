@@ -15,6 +15,8 @@
 typedef struct memfile {
   uintptr_t base;
   size_t size;
+  size_t map_size;  // size of the backing mapping
+  bool exported;    // pages have been handed out by memfile_getpage
 } memfile_t;
 
 // memfile api
@@ -7,6 +7,7 @@
 
 #include <kernel/vfs/vnode.h>
 #include <kernel/vfs/ventry.h>
+#include <kernel/mm/pmalloc.h>
 
 #include <kernel/panic.h>
 #include <kernel/printf.h>
@@ -90,6 +91,13 @@ int ramfs_vn_getpage(vnode_t *vn, off_t off, __move page_t **result) {
   return -EIO;
 }
 
+int ramfs_vn_putpage(vnode_t *vn, off_t off, __move page_t *page) {
+  // the pages handed out by getpage are the memory of the file itself so there
+  // is nothing to write back
+  drop_pages(&page);
+  return 0;
+}
+
 //
 
 int ramfs_vn_readlink(vnode_t *vn, struct kio *kio) {
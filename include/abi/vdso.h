@@ -0,0 +1,26 @@
+#ifndef INCLUDE_ABI_VDSO_H
+#define INCLUDE_ABI_VDSO_H
+
+#define VDSO_CLOCK_NONE 0 // time must be read with a syscall
+#define VDSO_CLOCK_TSC  1 // time can be computed from rdtsc
+
+/*
+ * The vvar page.
+ *
+ * This page is mapped read-only right below the vdso image in every process
+ * and holds the timekeeping data the vdso needs to answer time queries without
+ * entering the kernel. The kernel increments `seq` before and after every update
+ * so readers retry whenever it is odd or changes while they are reading.
+ */
+struct vdso_data {
+  volatile uint32_t seq;
+  uint32_t clock_mode;          // VDSO_CLOCK_*
+  uint32_t shift;
+  uint32_t has_rdtscp;          // IA32_TSC_AUX holds the cpu id
+  uint64_t mult;
+  uint64_t base_count;          // counter value at base_ns
+  uint64_t base_ns;             // monotonic time in nanoseconds
+  uint64_t boot_time;           // realtime at boot in seconds since the epoch
+};
+
+#endif
@@ -5,9 +5,10 @@
 #ifndef KERNEL_ATOMIC_H
 #define KERNEL_ATOMIC_H
 
-#define atomic_ordered_cmpxchg(ptr, old, _new, order) ({ \
-    __typeof__(*(ptr)) __old = (old); \
-    __atomic_compare_exchange_n(ptr, &__old, _new, false, order, order); \
+// the cast drops any qualifiers of *ptr so that volatile words can be passed
+#define atomic_ordered_cmpxchg(ptr, old, _new, order, fail_order) ({ \
+    __typeof__((__typeof__(*(ptr))) *(ptr)) __old = (old); \
+    __atomic_compare_exchange_n(ptr, &__old, _new, false, order, fail_order); \
 })
 #define atomic_ordered_cmpxchgp(ptr, old, _newp, order) ({ \
     __typeof__(*(ptr)) __old = (old); \
@@ -43,11 +44,12 @@
  *   else
  *     *old = *ptr;
  *
- * Returns true if the exchange was successful.
+ * Returns true if the exchange was successful. A failed exchange is only a load
+ * so it can not have release semantics and uses relaxed ordering instead.
  */
-#define atomic_cmpxchg(ptr, old, _new) atomic_ordered_cmpxchg(ptr, old, _new, __ATOMIC_SEQ_CST)
-#define atomic_cmpxchg_acq(ptr, old, _new) atomic_ordered_cmpxchg(ptr, old, _new, __ATOMIC_ACQUIRE)
-#define atomic_cmpxchg_rel(ptr, old, _new) atomic_ordered_cmpxchg(ptr, old, _new, __ATOMIC_RELEASE)
+#define atomic_cmpxchg(ptr, old, _new) atomic_ordered_cmpxchg(ptr, old, _new, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define atomic_cmpxchg_acq(ptr, old, _new) atomic_ordered_cmpxchg(ptr, old, _new, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)
+#define atomic_cmpxchg_rel(ptr, old, _new) atomic_ordered_cmpxchg(ptr, old, _new, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
 #define atomic_cmpxchgp(ptr, old, _newp) atomic_ordered_cmpxchgp(ptr, old, _newp, __ATOMIC_SEQ_CST)
 #define atomic_cmpxchgp_acq(ptr, old, _newp) atomic_ordered_cmpxchgp(ptr, old, _newp, __ATOMIC_ACQUIRE)
 
@@ -17,12 +17,18 @@
  * Clock source
  *
  * A clock source is a hardware device that provides a time source for the kernel.
+ *
+ * Lockless sources are counters that can be read from any cpu at any time without
+ * synchronization (eg. the invariant tsc). They are not used as the reference clock
+ * but are calibrated against it and then read directly by the clock functions.
  */
 typedef struct clock_source {
   /* driver fields */
   const char *name;
+  uint32_t flags;
   uint32_t scale_ns;
   uint64_t value_mask;
+  uint64_t freq;      // counts per second (0 if it must be calibrated)
 
   int (*enable)(struct clock_source *);
   int (*disable)(struct clock_source *);
@@ -36,6 +42,9 @@ typedef struct clock_source {
   LIST_ENTRY(struct clock_source) list;
 } clock_source_t;
 
+#define CLOCK_SOURCE_LOCKLESS 0x1
+#define CLOCK_SOURCE_VDSO     0x2 // can also be read from userspace by the vdso
+
 /*
  * Alarm source
  *
@@ -69,6 +78,7 @@ typedef struct alarm_source {
 #define ALARM_PERIODIC  0x4
 
 void register_alarm_source(alarm_source_t *as);
+alarm_source_t *alarm_source_find_by_cap(uint32_t cap);
 void register_clock_source(clock_source_t *cs);
 
 void clock_init();
@@ -87,7 +97,7 @@ uint64_t clock_wait_sync_nanos();
 /// the approximate time in nanoseconds.
 uint64_t clock_try_sync_nanos();
 
-/// Returns the number of kernel clock ticks.
+/// Returns the number of kernel clock ticks (HZ per second) since boot.
 uint64_t clock_get_ticks();
 /// Returns the number of seconds since boot.
 uint64_t clock_get_uptime();
@@ -16,19 +16,28 @@
  *
  * A condition variable is a synchronization primitive that is used in conjunction
  * with a mutex to wait for a particular condition to become true.
+ *
+ * Waiters sleep on a waitqueue keyed by the address of the condition variable.
+ * The waiter count is bumped before the lock is released so signalling a cond
+ * with no waiters is a single load, as long as the condition is changed under
+ * the same lock the waiters use.
  */
 typedef struct cond {
   const char *description;
-  int waiters;
+  volatile int waiters;
 } cond_t;
 
 void cond_init(cond_t *cond, const char *desc);
 void cond_destroy(cond_t *cond);
 
+/// Releases the lock and waits for the cond to be signalled. The lock is held again
+/// on return. The lock may be a spin mutex, mutex or rwlock but must not be recursed.
 void cond_wait(cond_t *cond, struct lock_object *lock);
+/// Same as cond_wait but returns -EINTR if the wait was interrupted.
 int cond_wait_sig(cond_t *cond, struct lock_object *lock);
+/// Same as cond_wait but gives up after timeout ns and returns -ETIMEDOUT. A timeout
+/// of 0 waits forever.
 int cond_timedwait(cond_t *cond, struct lock_object *lock, uint64_t timeout);
-// int cond_timedwait_sig(cond_t *cond, )
 
 void cond_signal(cond_t *cond);
 void cond_broadcast(cond_t *cond);
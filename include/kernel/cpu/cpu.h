@@ -25,6 +25,7 @@
 #define IA32_LSTAR_MSR          0xC0000082 // rip syscall entry for 64-bit software
 #define IA32_CSTAR_MSR          0xC0000083 // rip syscall entry for compatibility mode
 #define IA32_SFMASK_MSR         0xC0000084 // syscall flag mask
+#define IA32_XSS_MSR            0xDA0      // supervisor xsave state components
 #define IA32_TSC_AUX_MSR        0xC0000103
 #define IA32_FS_BASE_MSR        0xC0000100
 #define IA32_GS_BASE_MSR        0xC0000101
@@ -93,8 +94,10 @@ typedef union cpuid_bits {
 
 #define CPUID_BIT_SSE3          _CPUID_BIT(ecx_0_1, 0)
 #define CPUID_BIT_DTES64        _CPUID_BIT(ecx_0_1, 2)
+#define CPUID_BIT_MONITOR       _CPUID_BIT(ecx_0_1, 3)
 #define CPUID_BIT_DS_CPL        _CPUID_BIT(ecx_0_1, 4)
 #define CPUID_BIT_SSSE3         _CPUID_BIT(ecx_0_1, 9)
+#define CPUID_BIT_PCID          _CPUID_BIT(ecx_0_1, 17)
 #define CPUID_BIT_SSE4_1        _CPUID_BIT(ecx_0_1, 19)
 #define CPUID_BIT_SSE4_2        _CPUID_BIT(ecx_0_1, 20)
 #define CPUID_BIT_X2APIC        _CPUID_BIT(ecx_0_1, 21)
@@ -113,6 +116,7 @@ typedef union cpuid_bits {
 #define CPUID_BIT_AVX2          _CPUID_BIT(ebx_0_7, 5)
 #define CPUID_BIT_SMEP          _CPUID_BIT(ebx_0_7, 7)
 #define CPUID_BIT_BMI2          _CPUID_BIT(ebx_0_7, 8)
+#define CPUID_BIT_INVPCID       _CPUID_BIT(ebx_0_7, 10)
 #define CPUID_BIT_AVX512_F      _CPUID_BIT(ebx_0_7, 16)
 
 #define CPUID_BIT_UMIP          _CPUID_BIT(ecx_0_7, 2)
@@ -161,6 +165,36 @@ typedef struct cpu_irq_stack {
 #define temp_irq_save(flags) ({ ASSERT_IS_TYPE(uint64_t, flags); (flags) = cpu_save_clear_interrupts(); (flags); })
 #define temp_irq_restore(flags) ({ ASSERT_IS_TYPE(uint64_t, flags); cpu_restore_interrupts(flags); })
 
+#define INVPCID_ADDR        0 // single address in one pcid
+#define INVPCID_CONTEXT     1 // all non-global entries of one pcid
+#define INVPCID_ALL_GLOBAL  2 // all entries of all pcids including globals
+#define INVPCID_ALL         3 // all non-global entries of all pcids
+
+#define cpu_invpcid(type, pcid, addr) ({ \
+  struct { uint64_t __pcid; uint64_t __addr; } __desc = { (pcid), (uintptr_t)(addr) }; \
+  __asm volatile("invpcid %0, [%1]" :: "r" ((uint64_t)(type)), "r" (&__desc) : "memory"); \
+})
+
+// arms the monitor on the cache line containing addr
+#define cpu_monitor(addr) ({ __asm volatile("monitor" :: "a" ((uintptr_t)(addr)), "c" (0), "d" (0) : "memory"); })
+// enables interrupts and waits, an interrupt that is pending when sti executes will wake the cpu
+#define cpu_sti_mwait(hint) ({ __asm volatile("sti; mwait" :: "a" ((uint32_t)(hint)), "c" (0) : "memory"); })
+#define cpu_sti_hlt() ({ __asm volatile("sti; hlt" ::: "memory"); })
+
+// reads the tsc once all prior instructions have completed
+#define cpu_rdtsc_ordered() ({ \
+  uint32_t __lo, __hi; \
+  __asm volatile("lfence; rdtsc" : "=a" (__lo), "=d" (__hi) :: "memory"); \
+  ((uint64_t) __hi << 32) | __lo; \
+})
+// reads the tsc along with IA32_TSC_AUX
+#define cpu_rdtscp(auxp) ({ \
+  uint32_t __lo, __hi, __aux; \
+  __asm volatile("rdtscp" : "=a" (__lo), "=d" (__hi), "=c" (__aux) :: "memory"); \
+  *(auxp) = __aux; \
+  ((uint64_t) __hi << 32) | __lo; \
+})
+
 #define cpu_invlpg(addr) ({ uintptr_t __x = (uintptr_t)(addr); __asm volatile("invlpg [%0]" :: "r" (__x) : "memory"); })
 
 extern uint8_t cpu_bsp_id;
@@ -195,6 +229,7 @@ void cpu_load_tr(uint16_t tr);
 void cpu_set_cs(uint16_t cs);
 void cpu_set_ds(uint16_t ds);
 void cpu_flush_tlb();
+void cpu_flush_tlb_global();
 
 uint64_t cpu_read_msr(uint32_t msr);
 uint64_t cpu_write_msr(uint32_t msr, uint64_t value);
@@ -216,9 +251,19 @@ void __write_cr3(uint64_t cr3);
 uint64_t __read_cr4();
 void __write_cr4(uint64_t cr4);
 
+void __clts();
+
 uint64_t __xgetbv(uint32_t index);
 void __xsetbv(uint32_t index, uint64_t value);
 
+void __fxsave(void *area);
+void __fxrstor(void *area);
+void __xsave(void *area, uint64_t mask);
+void __xsaveopt(void *area, uint64_t mask);
+void __xsaves(void *area, uint64_t mask);
+void __xrstor(void *area, uint64_t mask);
+void __xrstors(void *area, uint64_t mask);
+
 int syscall(int call);
 noreturn void sysret(uintptr_t rip, uintptr_t rsp);
 
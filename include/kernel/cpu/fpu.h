@@ -2,11 +2,24 @@
 // Created by Aaron Gill-Braun on 2023-12-10.
 //
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifndef KERNEL_CPU_FPU_H
 #define KERNEL_CPU_FPU_H
 
+struct thread;
+struct trapframe;
+
+// xsave state components
+#define XFEATURE_X87        (1ULL << 0)
+#define XFEATURE_SSE        (1ULL << 1)
+#define XFEATURE_AVX        (1ULL << 2)
+#define XFEATURE_OPMASK     (1ULL << 5) // AVX-512 k0-k7
+#define XFEATURE_ZMM_HI256  (1ULL << 6) // AVX-512 upper halves of zmm0-15
+#define XFEATURE_HI16_ZMM   (1ULL << 7) // AVX-512 zmm16-31
+#define XFEATURE_AVX512     (XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
 // fxsave area
 struct fpu_area {
   uint16_t fcw;            // control word
@@ -27,7 +40,50 @@ struct fpu_area {
 };
 _Static_assert(sizeof(struct fpu_area) == 512);
 
+// xsave header (follows the fxsave area when xsave is used)
+struct xsave_header {
+  uint64_t xstate_bv;      // components not in their init state
+  uint64_t xcomp_bv;       // compacted format components (xsaves)
+  uint64_t rsvd[6];
+};
+_Static_assert(sizeof(struct xsave_header) == 64);
+
+struct fpu_stats {
+  uint64_t traps;          // #NM faults taken
+  uint64_t restores;       // state loaded from the save area
+  uint64_t reloads;        // traps where the registers still held the state
+  uint64_t saves;          // state written back on switch out
+};
+
+/*
+ * Lazy fpu switching.
+ *
+ * The fpu/vector state of a thread is only saved when it is switched out after
+ * having used the fpu during its timeslice, and it is only restored once the
+ * thread touches the fpu again. Every switch leaves CR0.TS set so the first fpu
+ * instruction raises #NM and the handler loads the state. Threads that never
+ * touch the vector registers do not pay for either.
+ *
+ * The save area is sized from CPUID leaf 0xD and holds every component enabled
+ * in XCR0 (x87, SSE, AVX and AVX-512 when present). XSAVES or XSAVEOPT are used
+ * when available so unmodified components are not written back. Each cpu also
+ * remembers whose state its registers still hold so a thread that comes back
+ * to the same cpu without anyone else using the fpu in between skips the load.
+ *
+ * Kernel code that uses floating point runs on the state of the current thread.
+ */
+extern size_t fpu_area_size;
+extern uint64_t fpu_xfeatures;
+
+void fpu_init();
+
 struct fpu_area *fpu_area_alloc();
 void fpu_area_free(struct fpu_area **fpa);
 
+void fpu_switch_out(struct thread *td);
+void fpu_nm_handler(struct trapframe *frame);
+
+void fpu_get_stats(struct fpu_stats *stats);
+void fpu_dump_stats();
+
 #endif
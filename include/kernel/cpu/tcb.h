@@ -28,11 +28,12 @@ struct tcb {
   uint64_t dr7;
   struct fpu_area *fpu;
   int tcb_flags;
+  int fpu_cpu; // cpu the fpu state was last loaded on
 };
 _Static_assert(sizeof(struct tcb) == 0x98, ""); // referenced in switch.asm
 
 #define TCB_KERNEL  0x01 // kernel thread context
-#define TCB_FPU     0x02 // save fpu registers
+#define TCB_FPU     0x02 // has fpu state
 #define TCB_DEBUG   0x04 // save debug registers
 #define TCB_IRETQ   0x08 // first return via iretq
 #define TCB_SYSRET  0x10 // first return via systet
@@ -9,6 +9,7 @@
 #include <kernel/mm_types.h>
 
 #define LIBC_BASE_ADDR 0x7FC0000000
+#define VDSO_BASE_ADDR 0x7FB0000000 // vvar page followed by the vdso image
 
 struct pcreds;
 struct pstrings;
@@ -0,0 +1,9 @@
+#ifndef KERNEL_HW_TSC_H
+#define KERNEL_HW_TSC_H
+
+#include <kernel/base.h>
+
+void tsc_sync_source(int cpu);
+void tsc_sync_target();
+
+#endif
@@ -65,6 +65,8 @@ struct lock_class {
 #define LO_RECURSABLE   0x0400 // lock is recursable
 #define LO_SLEEPABLE    0x0800 // can sleep while holding lock
 #define LO_INITIALIZED  0x1000 // lock has been initialized
+#define LO_NOBLOCK      0x2000 // contended lockers spin instead of blocking
+#define LO_CONTENDED    0x4000 // lock has been contended (stats are kept)
 #define LO_FLAGS_MASK   0xffff
 
 // === lock assertions ===
@@ -102,6 +104,32 @@ void lock_claim_list_free(struct lock_claim_list **listp);
 void lock_claim_list_add(struct lock_claim_list *list, struct lock_object *lock, uintptr_t how, const char *file, int line);
 void lock_claim_list_remove(struct lock_claim_list *list, struct lock_object *lock);
 
+////////////////////
+// lock stats api
+
+/*
+ * Lock contention statistics.
+ *
+ * Stats are kept in a fixed size table keyed by the lock object rather than in
+ * the lock itself. A lock is given an entry the first time it is contended and
+ * only from then on are its acquisitions counted, so locks that never see any
+ * contention pay nothing for it.
+ */
+struct lock_stats {
+  struct lock_object *lock; // the lock (NULL if the entry was never used)
+  const char *name;         // lock name
+  uint64_t acquisitions;    // acquisitions since the first contention
+  uint64_t contended;       // acquisitions that had to wait
+  uint64_t spin_ns;         // time spent spinning on a running owner
+  uint64_t sleep_ns;        // time spent blocked on the lockqueue
+};
+
+void lock_stats_record_acquire(struct lock_object *lock);
+void lock_stats_record_contention(struct lock_object *lock, uint64_t spin_ns, uint64_t sleep_ns);
+void lock_stats_remove(struct lock_object *lock);
+int lock_stats_get(struct lock_object *lock, struct lock_stats *stats);
+void lock_stats_dump();
+
 ////////////////////
 // spin delay api
 
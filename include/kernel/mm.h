@@ -8,6 +8,8 @@
 #include <kernel/base.h>
 #include <kernel/mm_types.h>
 #include <kernel/mm/heap.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/tlb.h>
 #include <kernel/mm/pmalloc.h>
 #include <kernel/mm/vmalloc.h>
 #include <kernel/mm/init.h>
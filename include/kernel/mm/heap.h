@@ -6,46 +6,36 @@
 #define KERNEL_MM_HEAP_H
 
 #include <kernel/base.h>
-#include <kernel/mutex.h>
 
-// TODO: switch to better allocator for large sizes
-#define CHUNK_MIN_SIZE   8
-#define CHUNK_MAX_SIZE   524288
-#define CHUNK_SIZE_ALIGN 8
-#define CHUNK_MIN_ALIGN  4
+// allocations up to KMALLOC_MAX_SIZE are served from the size class caches
+// and anything larger is mapped directly into kernel space
+#define KMALLOC_MIN_SIZE    8
+#define KMALLOC_MAX_SIZE    8192
+#define KMALLOC_NUM_CLASSES 34
 
-#define CHUNK_MAGIC 0xC0DE
-#define HOLE_MAGIC 0xDEAD
-
-typedef struct page page_t;
-
-typedef struct mm_chunk {
-  uint16_t magic;                   // magic number
-  uint16_t prev_offset;             // offset to previous chunk
-  uint32_t size : 31;               // size of chunk
-  uint32_t free : 1;                // chunk free/used
-  LIST_ENTRY(struct mm_chunk) list; // links to free chunks (if free)
-} mm_chunk_t;
-static_assert(sizeof(mm_chunk_t) == 24);
+typedef struct kmem_cache kmem_cache_t;
 
 typedef struct mm_heap {
-  uintptr_t phys_addr;          // physical address of heap
-  uintptr_t virt_addr;          // virtual address of heap base
-  mm_chunk_t *last_chunk;       // the last created chunk
-  LIST_HEAD(mm_chunk_t) chunks; // linked list of free chunks
-  mtx_t lock;                   // heap lock (must be held to alloc/free)
+  kmem_cache_t *classes[KMALLOC_NUM_CLASSES]; // size class caches
 
-  size_t size;                  // the size of the heap
+  size_t size;                  // the number of bytes backing the heap
   size_t used;                  // the total number of bytes used
   struct {
     size_t alloc_count;         // the number of times malloc was called
     size_t free_count;          // the number of times free was called
-    size_t alloc_sizes[9];      // a histogram of alloc request sizes
+    size_t large_alloc_count;   // allocations larger than KMALLOC_MAX_SIZE
+    size_t large_free_count;    // frees of large allocations
+    struct {
+      size_t size;              // size of the objects in the class
+      size_t active;            // number of objects in use
+      size_t cached;            // number of free objects in the per-cpu caches
+      size_t alloc_count;
+      size_t free_count;
+    } classes[KMALLOC_NUM_CLASSES];
   } stats;
 } mm_heap_t;
 
 void mm_init_kheap();
-uintptr_t kheap_phys_addr();
 
 void *kmalloc(size_t size) __malloc_like;
 void *kmallocz(size_t size) __malloc_like;
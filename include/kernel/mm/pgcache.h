@@ -7,6 +7,7 @@
 
 #include <kernel/mm_types.h>
 
+#include <kernel/mutex.h>
 #include <kernel/ref.h>
 
 #define PGCACHE_MAX_ORDER   8
@@ -35,16 +36,44 @@
 
 struct pgcache_node;
 
+#define PGCACHE_RECLAIM 0x1 // pages may be evicted under memory pressure
+
+/*
+ * A page cache.
+ *
+ * The cache is a radix tree of pages indexed by offset. All operations on the
+ * tree are done under the cache lock. Caches marked with pgcache_set_reclaimable
+ * take part in page reclaim, which ages their pages with a CLOCK sweep over the
+ * leaf nodes. A page that was looked up since the hand last passed is moved to
+ * the active set, an active page that was not is moved back to the inactive
+ * set, and inactive pages that are only referenced by the cache are evicted.
+ */
 struct pgcache {
   uint16_t order;         // order (depth) of the cache tree
   uint16_t bits_per_lvl;  // bits of key used per level to index
   uint32_t pg_size;       // size of each page
+  uint16_t flags;         // pgcache flags
   size_t max_capacity;    // the maximum cachable memory capacity
   size_t count;           // number of pages in the cache
+  size_t active;          // number of pages in the active set
+  size_t empty_leaves;    // number of leaf nodes without pages (excluding the root)
   _refcount;              // reference count
 
+  mtx_t lock;
   struct pgcache_node *root;
+  struct pgcache_node *hand; // next leaf visited by the reclaim sweep
   LIST_HEAD(struct pgcache_node) leaf_nodes;
+  LIST_ENTRY(struct pgcache) list; // reclaimable caches
+};
+
+struct pgcache_stats {
+  size_t cached;          // pages held by reclaimable caches
+  size_t active;          // pages referenced since they were last aged
+  size_t inactive;        // pages that are candidates for eviction
+  size_t empty_leaves;    // leaf nodes that can be pruned
+  uint64_t scanned;       // pages looked at by the reclaim sweep
+  uint64_t reclaimed;     // pages evicted by the reclaim sweep
+  uint64_t nodes_freed;   // tree nodes pruned
 };
 
 
@@ -57,6 +86,8 @@ void pgcache_remove(struct pgcache *cache, size_t off, __move page_t **out_page)
 
 typedef void (*pgcache_visit_t)(page_t **pagesref, size_t off, void *data);
 void pgcache_visit_pages(struct pgcache *cache, size_t start_off, size_t end_off, pgcache_visit_t fn, void *data);
+void pgcache_set_reclaimable(struct pgcache *cache);
+void pgcache_get_stats(struct pgcache_stats *stats);
 
 static inline size_t pgcache_size_to_order(size_t total_size, size_t pg_size) {
   size_t order = 0;
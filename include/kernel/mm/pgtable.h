@@ -9,6 +9,9 @@
 #include <kernel/mm_types.h>
 #include <kernel/kio.h>
 
+#define PGTABLE_NUM_ENTRIES 512 // entries per page table
+#define KMAP_BATCH_MAX      32  // max pages mapped by kmap_local_pages
+
 void *early_map_entries(uintptr_t vaddr, uintptr_t paddr, size_t count, uint32_t vm_flags);
 
 void init_recursive_pgtable();
@@ -16,6 +19,7 @@ uintptr_t get_current_pgtable();
 void set_current_pgtable(uintptr_t table_phys);
 
 void pgtable_update_entry_flags(uintptr_t vaddr, uint64_t *pte, uint32_t vm_flags);
+bool pgtable_map_empty_entry(uint64_t *pte, uintptr_t paddr, uint32_t vm_flags);
 bool pgtable_get_entry_dirty(const uint64_t *pte);
 void pgtable_clear_entry_dirty(uint64_t *pte);
 
@@ -24,8 +28,13 @@ void recursive_unmap_entry(uintptr_t vaddr, uint32_t vm_flags);
 void recursive_update_entry(uintptr_t vaddr, uint32_t vm_flags);
 void recursive_update_range(uintptr_t vaddr, size_t size, uint32_t vm_flags);
 
+void *kmap_local(page_t *page);
+void *kmap_local_pages(page_t *pages, size_t count);
+void kunmap_local(void *ptr);
+
 void fill_unmapped_page(page_t *page, uint8_t v, size_t off, size_t len);
 void fill_unmapped_pages(page_t *pages, uint8_t v, size_t off, size_t len);
+void copy_unmapped_page(page_t *page, const void *src);
 size_t rw_unmapped_page(page_t *page, size_t off, kio_t *kio);
 size_t rw_unmapped_pages(page_t *pages, size_t off, kio_t *kio);
 
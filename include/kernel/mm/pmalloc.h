@@ -53,21 +53,64 @@ struct frame_allocator_impl {
   intptr_t (*fa_alloc)(frame_allocator_t *fa, size_t count, size_t pagesize);
   int (*fa_reserve)(frame_allocator_t *fa, uintptr_t frame, size_t count, size_t pagesize);
   void (*fa_free)(frame_allocator_t *fa, uintptr_t frame, size_t count, size_t pagesize);
+  // bulk 4k frame operations done under a single lock acquisition
+  size_t (*fa_alloc_bulk)(frame_allocator_t *fa, uintptr_t *frames, size_t n);
+  void (*fa_free_bulk)(frame_allocator_t *fa, const uintptr_t *frames, size_t n);
+};
+
+/*
+ * Per-CPU page frame cache statistics.
+ */
+struct pcp_stats {
+  uint64_t alloc_hits;    // allocations served from the cache
+  uint64_t alloc_misses;  // allocations that needed a refill or fell through
+  uint64_t free_hits;     // frees that were absorbed by the cache
+  uint64_t refills;       // batches taken from the zone allocators
+  uint64_t drains;        // batches returned to the zone allocators
+};
+
+/*
+ * Free page watermarks.
+ *
+ * The reclaim thread is woken when the number of free pages drops below the low
+ * watermark and keeps shrinking caches until it is back above the high one.
+ */
+enum pg_wmark {
+  PG_WMARK_LOW,
+  PG_WMARK_HIGH,
+  MAX_PG_WMARK,
 };
 
 void init_mem_zones();
 int reserve_pages(enum pg_rsrv_kind kind, uintptr_t address, size_t count, size_t pagesize);
+size_t pmalloc_free_pages();
+size_t pmalloc_watermark(enum pg_wmark wmark);
 
 // page allocation api
 
 __ref page_t *alloc_pages_zone(zone_type_t zone_type, size_t count, size_t pagesize);
 __ref page_t *alloc_pages_size(size_t count, size_t pagesize);
+__ref page_t *try_alloc_pages_size(size_t count, size_t pagesize);
 __ref page_t *alloc_pages(size_t count);
 __ref page_t *alloc_pages_at(uintptr_t address, size_t count, size_t pagesize);
 __ref page_t *alloc_nonowned_pages_at(uintptr_t address, size_t count, size_t pagesize);
 __ref page_t *alloc_cow_pages(page_t *pages);
 __ref page_t *alloc_shared_pages(page_t *pages);
+__ref page_t *alloc_subpage(page_t *page, size_t off);
 void drop_pages(__move page_t **pagesref);
+void drop_pages_unlinked(__move page_t **pagesref);
+
+// raw frame api
+
+intptr_t alloc_frames(size_t count, size_t pagesize);
+void free_frames(uintptr_t frame, size_t count, size_t pagesize);
+
+// per-cpu page cache api
+
+void pcp_drain_cpu(int cpu);
+void pcp_drain_all();
+void pcp_get_stats(int cpu, struct pcp_stats *stats);
+void pcp_dump_stats();
 
 // page struct api
 
@@ -78,6 +121,8 @@ void page_add_mapping(page_t *page, struct pte *pte);
 struct pte *page_remove_mapping(page_t *page, vm_mapping_t *vm);
 struct pte *page_get_mapping(page_t *page, vm_mapping_t *vm);
 void page_update_flags(page_t *page, uint32_t flags);
+__ref page_t *page_split_frames(page_t *page, size_t pg_size);
+__ref page_t *page_split_shared(page_t *page, size_t pg_size);
 
 __ref page_t *page_list_join(__ref page_t *head, __ref page_t *tail);
 __ref page_t *page_list_split(__ref page_t *pages, size_t count, __out page_t **tailref);
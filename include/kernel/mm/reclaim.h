@@ -0,0 +1,44 @@
+#ifndef KERNEL_MM_RECLAIM_H
+#define KERNEL_MM_RECLAIM_H
+
+#include <kernel/base.h>
+#include <kernel/queue.h>
+
+/*
+ * A shrinker gives memory back under memory pressure.
+ *
+ * Caches that can drop objects on demand register a shrinker. When the number
+ * of free pages falls below the low watermark the reclaim thread asks each
+ * shrinker in registration order to free some of its objects until the high
+ * watermark is reached. The count callback returns the number of objects that
+ * could be freed and scan tries to free up to nr of them and returns the number
+ * that were actually freed. Both are called from a context that can block with
+ * the shrinker list locked, so they must not register or unregister shrinkers.
+ */
+struct shrinker {
+  const char *name;
+  size_t (*count)(struct shrinker *shrinker);
+  size_t (*scan)(struct shrinker *shrinker, size_t nr);
+  void *data;
+
+  uint64_t freed;                   // objects freed by this shrinker
+  LIST_ENTRY(struct shrinker) list;
+};
+
+struct reclaim_stats {
+  uint64_t wakeups;     // times the reclaim thread was woken by the allocator
+  uint64_t direct;      // reclaims done by an allocation that ran out of memory
+  uint64_t passes;      // passes over the shrinkers
+  uint64_t freed;       // objects freed by all shrinkers
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+
+void reclaim_wakeup();
+size_t reclaim_direct(size_t nr_pages);
+
+void reclaim_get_stats(struct reclaim_stats *stats);
+void reclaim_dump_stats();
+
+#endif
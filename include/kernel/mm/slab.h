@@ -0,0 +1,45 @@
+#ifndef KERNEL_MM_SLAB_H
+#define KERNEL_MM_SLAB_H
+
+#include <kernel/base.h>
+#include <kernel/mm_types.h>
+
+// kmem_cache flags
+#define KMEM_NOMAG  (1 << 0) // do not use per-cpu magazines
+
+typedef struct kmem_cache kmem_cache_t;
+
+/*
+ * Object cache usage statistics.
+ */
+struct kmem_cache_stats {
+  size_t obj_size;      // size of each object including padding
+  size_t slab_size;     // size of each slab
+  size_t num_slabs;     // number of slabs owned by the cache
+  size_t num_objs;      // total number of objects in all slabs
+  size_t active;        // number of objects allocated from the slabs
+  size_t cached;        // number of free objects held in the magazines
+  uint64_t allocs;      // total number of allocations
+  uint64_t frees;       // total number of frees
+  uint64_t mag_hits;    // allocations served from a per-cpu magazine
+  uint64_t mag_misses;  // allocations that had to refill a magazine
+};
+
+void mm_init_kmem();
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t alignment, uint32_t flags);
+void *kmem_cache_alloc(kmem_cache_t *cache) __malloc_like;
+void *kmem_cache_allocz(kmem_cache_t *cache) __malloc_like;
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+kmem_cache_t *kmem_ptr_to_cache(void *ptr);
+uintptr_t kmem_ptr_to_phys(void *ptr);
+
+static inline bool kmem_is_slab_ptr(void *ptr) {
+  return (uintptr_t) ptr >= KERNEL_SLAB_VA && (uintptr_t) ptr < KERNEL_SLAB_VA + KERNEL_SLAB_SIZE;
+}
+
+void kmem_cache_get_stats(kmem_cache_t *cache, struct kmem_cache_stats *stats);
+void kmem_dump_stats();
+
+#endif
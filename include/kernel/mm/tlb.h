@@ -0,0 +1,56 @@
+#ifndef KERNEL_MM_TLB_H
+#define KERNEL_MM_TLB_H
+
+#include <kernel/base.h>
+#include <kernel/mm_types.h>
+
+#define TLB_BATCH_MAX   8   // max ranges carried by a single shootdown
+#define TLB_FLUSH_MAX   32  // pages above which a full flush is used instead
+
+struct tlb_range {
+  uintptr_t start;
+  uintptr_t end;
+  size_t pg_size;
+};
+
+/*
+ * A batch of stale translations.
+ *
+ * Ranges are collected while page table entries are being removed or downgraded
+ * and then invalidated on every cpu that may have them cached with a single call
+ * to tlb_batch_flush. Once the batch overflows or covers too many pages it is
+ * turned into a full flush.
+ */
+typedef struct tlb_batch {
+  address_space_t *space;
+  uint16_t count;
+  bool full;                        // flush the entire tlb
+  bool global;                      // the batch contains kernel addresses
+  size_t pages;
+  struct tlb_range ranges[TLB_BATCH_MAX];
+} tlb_batch_t;
+
+struct tlb_stats {
+  uint64_t shootdowns;              // batches that needed other cpus
+  uint64_t ipis_sent;               // ipis sent to other cpus
+  uint64_t pages_flushed;           // pages invalidated with invlpg
+  uint64_t full_flushes;            // full tlb flushes
+  uint64_t pcid_hits;               // switches that kept the cached translations
+  uint64_t pcid_misses;             // switches that had to assign a new pcid
+  uint64_t pcid_rollovers;          // pcid generation changes
+};
+
+void tlb_batch_init(tlb_batch_t *batch, address_space_t *space);
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t start, size_t size, size_t pg_size);
+void tlb_batch_flush(tlb_batch_t *batch);
+void tlb_flush_range(address_space_t *space, uintptr_t start, size_t size, size_t pg_size);
+
+void tlb_switch_space(address_space_t *prev, address_space_t *next);
+void tlb_space_activate(address_space_t *space);
+void tlb_space_deactivate(address_space_t *space);
+void tlb_shootdown_handler();
+
+void tlb_get_stats(struct tlb_stats *stats);
+void tlb_dump_stats();
+
+#endif
@@ -12,6 +12,13 @@
 
 struct vnode;
 
+// transparent huge page counters
+struct vm_thp_stats {
+  uint64_t allocs;      // 2MB pages allocated for promoted mappings
+  uint64_t fallbacks;   // 2MB allocations that failed and fell back to 4K pages
+  uint64_t splits;      // promoted mappings split back into 4K pages
+};
+
 void switch_address_space(address_space_t *new_space) __used;
 
 void init_address_space();
@@ -21,6 +28,7 @@ uintptr_t get_default_ap_pml4();
 address_space_t *vm_new_space(uintptr_t min_addr, uintptr_t max_addr, uintptr_t page_table);
 address_space_t *vm_fork_space(address_space_t *space, bool deepcopy_user);
 address_space_t *vm_new_uspace();
+void vm_free_space(address_space_t **spacep);
 
 //     vmap api
 //
@@ -41,6 +49,8 @@ __ref page_t *vm_getpage(uintptr_t vaddr);
 __ref page_t *vm_getpage_cow(uintptr_t vaddr);
 uintptr_t vm_virt_to_phys(uintptr_t vaddr);
 #define virt_to_phys(virt_addr) vm_virt_to_phys((uintptr_t)(virt_addr))
+void vm_get_fault_stats(address_space_t *space, struct vm_fault_stats *stats);
+void vm_get_thp_stats(struct vm_thp_stats *stats);
 
 //     vmap_other api
 //
@@ -10,6 +10,7 @@
 #include <kernel/str.h>
 #include <kernel/ref.h>
 #include <kernel/mutex.h>
+#include <kernel/cpu/cpu.h>
 
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 0x1000
@@ -54,7 +55,7 @@ typedef struct page {
   } head;
   union {
     struct frame_allocator *fa; // owning frame allocator (if PG_OWNING)
-    struct page *source;        // source page ref (if PG_COW)
+    struct page *source;        // source page ref (if PG_COW or PG_SUBPAGE)
   };
   struct pte *entries;          // s-list of pte structs (l)
   struct page *next;            // next page ref (l)
@@ -67,6 +68,7 @@ typedef struct page {
 #define PG_OWNING     (1 << 2)
 #define PG_HEAD       (1 << 3)
 #define PG_COW        (1 << 4)
+#define PG_SUBPAGE    (1 << 5)
 
 #define PG_SIZE_MASK  (PG_BIGPAGE | PG_HUGEPAGE)
 
@@ -94,6 +96,19 @@ struct pte {
   SLIST_ENTRY(struct pte) next;
 };
 
+// page fault counters of an address space
+struct vm_fault_stats {
+  uint64_t major;                   // faults that had to fill in a missing page
+  uint64_t minor;                   // faults on pages that were already resident
+  uint64_t around;                  // pages mapped ahead of time by fault-around
+};
+
+// the pcid assigned to an address space on a cpu
+struct tlb_pcid {
+  uint16_t pcid;
+  uint32_t gen;                     // valid if equal to the generation of the cpu
+};
+
 /*
  * A virtual address space.
  *
@@ -113,6 +128,9 @@ typedef struct address_space {
 
   uintptr_t page_table;
   LIST_HEAD(struct page) table_pages;
+  volatile uint64_t active_cpus;    // cpus that may have the space cached
+  struct tlb_pcid pcids[MAX_CPUS];
+  struct vm_fault_stats fault_stats; // updated with the lock held
 } address_space_t;
 
 #define space_lock(space) __type_checked(struct address_space *, space, mtx_lock(&(space)->lock))
@@ -155,6 +173,10 @@ typedef struct vm_mapping {
     struct vm_file *vm_file;// VM_TYPE_FILE
   };
 
+  uint16_t fault_around;    // fault-around window in pages (VM_TYPE_FILE)
+  size_t fault_off;         // offset of the last fault (VM_TYPE_FILE)
+  size_t fault_end;         // end of the last fault-around window (VM_TYPE_FILE)
+
   LIST_ENTRY(struct vm_mapping) vm_list; // entry in list of vm mappings
 } vm_mapping_t;
 
@@ -187,6 +209,7 @@ typedef struct vm_mapping {
 #define VM_MAPPED     (1 << 17) // mapping is currently active
 #define VM_LINKED     (1 << 18) // mapping was split and is linked to the following mapping
 #define VM_SPLIT      (1 << 19) // mapping was split and is the second half of the split
+#define VM_THP        (1 << 20) // mapping was transparently promoted to 2M pages
 
 #define VM_PROT_MASK  0x7    // mask of protection flags
 #define VM_MODE_MASK  0x18   // mask of mode flags
@@ -225,10 +248,10 @@ typedef struct vm_desc {
 #define KERNEL_SPACE_END    0xFFFFFFFFFFFFFFFFULL
 
 #define FRAMEBUFFER_VA      0xFFFFBFFF00000000ULL
-#define KERNEL_HEAP_VA      0xFFFFFF8000400000ULL
 #define KERNEL_RESERVED_VA  0xFFFFFF8000C00000ULL
+#define KERNEL_SLAB_VA      0xFFFFFFC000000000ULL
 
-#define KERNEL_HEAP_SIZE   (6 * SIZE_1MB)
+#define KERNEL_SLAB_SIZE   SIZE_1GB
 #define KERNEL_STACK_SIZE  SIZE_16KB
 
 #endif
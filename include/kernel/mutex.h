@@ -16,6 +16,11 @@
  *
  * A mutex is a synchronization primitive that can be used to protect
  * shared data from being simultaneously accessed by multiple threads.
+ *
+ * Contended wait mutexes spin for as long as the owner is running on another
+ * cpu and only block on a lockqueue once the owner is off-cpu. Blocked threads
+ * lend their priority to the owner (and transitively to whatever the owner is
+ * blocked on) until the mutex is released.
  */
 typedef struct mtx {
   struct lock_object lo;         // common lock state
@@ -27,6 +32,7 @@ typedef struct mtx {
 #define MTX_DEBUG     0x2  // enable debugging for this lock
 #define MTX_RECURSIVE 0x4  // allow recursive locking
 #define MTX_NOCLAIMS  0x8  // don't track lock claims
+#define MTX_NOBLOCK   0x10 // spin instead of blocking when contended (non-spin)
 
 // assert options
 #define MA_UNLOCKED     LA_UNLOCKED
@@ -67,6 +73,7 @@ void _mtx_wait_unlock(mtx_t *mtx, const char *file, int line);
 #define mtx_spin_unlock(m) _mtx_spin_unlock(m, __FILE__, __LINE__)
 
 void _thread_lock(struct thread *td, const char *file, int line);
+int _thread_trylock(struct thread *td, const char *file, int line);
 void _thread_unlock(struct thread *td, const char *file, int line);
 
 #endif
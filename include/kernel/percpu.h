@@ -15,6 +15,7 @@ struct proc;
 struct sched;
 struct address_space;
 struct lock_claim_list;
+struct pcp_pages;
 
 struct percpu {
   uint32_t id;
@@ -34,6 +35,7 @@ struct percpu {
   uint64_t rflags;
   void *gdt;
   void *tss;
+  struct pcp_pages *pcp_pages;
 } __attribute__((aligned(128)));
 _Static_assert(sizeof(struct percpu) <= 0x1000, "percpu too big");
 _Static_assert(offsetof(struct percpu, id) == 0x00, "percpu id offset");
@@ -66,6 +68,7 @@ _Static_assert(offsetof(struct percpu, scratch_rax) == 0x60, "percpu scratch_rax
 #define curcpu_area ((struct percpu *) __percpu_get_u64(self))
 #define curcpu_info ((struct cpu_info *) __percpu_get_u64(info))
 #define curcpu_spin_claims ((struct lock_claim_list *) __percpu_get_u64(spin_claims))
+#define curcpu_pcp_pages ((struct pcp_pages *) __percpu_get_u64(pcp_pages))
 
 #define curspace ((struct address_space *) __percpu_get_u64(space))
 #define curthread ((struct thread *) __percpu_get_u64(thread))
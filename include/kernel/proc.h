@@ -154,6 +154,8 @@ struct pstrings {
 /*
  * Thread
  */
+#define TD_MAX_BRLOCKS 4 // max big-reader rwlock read holds per thread
+
 typedef struct thread {
   pid_t tid;                            // thread id
   uint32_t flags;                       // thread flags
@@ -192,8 +194,11 @@ typedef struct thread {
   struct rlimit limit;                  // resource limit
   uint64_t runtime;                     // total run time
   uint64_t blocktime;                   // total block time
+  uint64_t slice;                       // remaining timeslice (ns)
 
   int lock_count;                       // number of normal mutexes held
+  int rlock_count;                      // number of rwlock read locks held
+  struct rwlock *brlocks[TD_MAX_BRLOCKS];// big-reader rwlocks read held
   int spin_count;                       // number of spin mutexes held
   int crit_level;                       // critical section level
 
@@ -203,7 +208,9 @@ typedef struct thread {
 
   struct runqueue *runq;                // runqueue (if ready)
   struct lock_object *lockobj;          // contested lock (if blocked)
+  struct lockqueue *lockq;              // lockqueue (if blocked)
   int lockq_num;                        // lockq queue number (LQ_EXCL or LQ_SHRD)
+  LIST_HEAD(struct lockqueue) contested;// lockqueues of owned locks with waiters
   const void *wchan;                    // wait channel (if in waitqueue)
   const char *wdmsg;                    // wait debug message
 
@@ -232,6 +239,10 @@ static_assert(offsetof(thread_t, kstack_size) == 0x40);
 #define   TDF2_HAS_AFFINITY(td) ((td)->flags2 & TDF2_AFFINITY)
 #define TDF2_INTRP      0x00000008  // thread was interrupted
 #define   TDF2_WAS_INTRP(td) ((td)->flags2 & TDF2_INTRP)
+#define TDF2_WAITSIG    0x00000010  // thread is in an interruptible wait
+#define   TDF2_IS_WAITSIG(td) ((td)->flags2 & TDF2_WAITSIG)
+#define TDF2_TIMEDOUT   0x00000020  // thread wait has timed out
+#define   TDF2_HAS_TIMEDOUT(td) ((td)->flags2 & TDF2_TIMEDOUT)
 
 #define TDS_IS_EMPTY(td) ((td)->state == TDS_EMPTY)
 #define TDS_IS_READY(td) ((td)->state == TDS_READY)
@@ -247,6 +258,7 @@ static_assert(offsetof(thread_t, kstack_size) == 0x40);
 
 #define td_lock_assert(td, what) __type_checked(thread_t*, td, mtx_assert(&(td)->lock, what))
 #define td_lock(td) _thread_lock(td, __FILE__, __LINE__)
+#define td_trylock(td) _thread_trylock(td, __FILE__, __LINE__)
 #define td_unlock(td) _thread_unlock(td, __FILE__, __LINE__)
 
 // realtime threads: 48-79
@@ -17,17 +17,31 @@
  * A read-write lock allows multiple readers or a single writer to
  * access a resource. It is used to protect data structures that are
  * read often but modified infrequently.
+ *
+ * Readers take the lock with a single atomic add as long as there is no
+ * writer. Once a writer has blocked on the lock new readers queue up behind
+ * it so writers can not be starved. Threads that already hold a read lock
+ * are let through to avoid deadlocking on read recursion.
+ *
+ * In big-reader mode (RW_BIGREADER) readers only touch a per-cpu counter so
+ * reads scale with the number of cpus, at the cost of writers having to wait
+ * for every cpu's readers to drain. Each thread records the big-reader locks
+ * it has read locked so that read recursion gets past a draining writer.
  */
+struct rw_pcpu;
+
 typedef struct rwlock {
   struct lock_object lo;          // common lock state
-  volatile uintptr_t mtx_lock;    // mutex lock
-  volatile uint32_t readers;      // number of readers
+  volatile uintptr_t rw_lock;     // reader count | lock state
+  struct thread *volatile owner;  // write owner
+  struct rw_pcpu *pcpu;           // per-cpu reader counts (big-reader mode)
 } rwlock_t;
 
 // rwlock options
 #define RW_DEBUG     0x1  // enable debugging for this lock
 #define RW_RECURSE   0x2  // allow recursive locking
 #define RW_NOCLAIM   0x4  // don't track lock claims
+#define RW_BIGREADER 0x8  // per-cpu readers (cheap reads, expensive writes)
 #define RW_OPT_MASK  0xF
 
 // assert options
@@ -39,9 +53,11 @@ typedef struct rwlock {
 #define RWA_OWNED    100 // lock is owned
 #define RWA_NOTOWNED 101 // lock is not owned
 
-/* common mutex api */
+/* common rwlock api */
 void _rw_init(rwlock_t *rw, uint32_t opts, const char *name);
 void _rw_destroy(rwlock_t *rw);
+bool _rw_locked(rwlock_t *rw);
+bool _rw_owned(rwlock_t *rw);
 void _rw_assert(rwlock_t *rw, int what, const char *file, int line);
 
 int _rw_try_rlock(rwlock_t *rw, const char *file, int line);
@@ -48,6 +48,11 @@ static inline void sbuf_reset(sbuf_t *sbuf) {
   sbuf && (sbuf->ptr = sbuf->data);
 }
 
+static inline void sbuf_truncate(sbuf_t *sbuf, size_t len) {
+  if (sbuf && len < sbuf_len(sbuf))
+    sbuf->ptr = sbuf->data + len;
+}
+
 static inline size_t sbuf_seek(sbuf_t *sbuf, ssize_t offset) {
   if (sbuf == NULL)
     return 0;
@@ -18,11 +18,28 @@ typedef enum sched_reason {
   SCHED_EXITED,
 } sched_reason_t;
 
+struct sched_stats {
+  uint64_t idle_steals;           // threads stolen while the cpu had nothing to run
+  uint64_t balance_pulls;         // threads pulled by the periodic balancer
+  uint64_t balance_runs;          // times the periodic balancer ran
+  uint64_t migrations;            // threads taken from this cpu by other cpus
+  uint64_t idle_sleeps;           // times the cpu went to sleep while idle
+  uint64_t idle_ns;               // time spent asleep while idle (ns)
+  uint64_t wakeup_ipis;           // ipis sent to wake the cpu from idle
+  uint64_t slice_expired;         // threads preempted at the end of their timeslice
+};
+
 void sched_init();
 void sched_submit_new_thread(thread_t *td);
 void sched_remove_ready_thread(thread_t *td);
+void sched_wakeup_thread(thread_t *td);
+void sched_set_priority(thread_t *td, uint8_t priority);
 
 void sched_again(sched_reason_t reason);
 void sched_cpu(int cpu, sched_reason_t reason);
+void sched_preempt_check();
+
+void sched_get_stats(int cpu, struct sched_stats *stats);
+void sched_dump_stats();
 
 #endif
@@ -42,6 +42,48 @@ typedef struct timer_device {
 
 typedef void (*timer_cb_t)(void *);
 
+/*
+ * A high resolution timer.
+ *
+ * Hrtimers expire at an exact deadline and are kept in a per-cpu queue ordered
+ * by deadline. The one-shot alarm of each cpu is always programmed for the
+ * earliest hrtimer or timeout, so there is no periodic tick involved.
+ */
+struct hrtimer {
+  uint64_t expires;                 // deadline (ns since boot)
+  timer_cb_t fn;
+  void *arg;
+  volatile int cpu;                 // cpu the timer is queued on (-1 if not pending)
+  uint32_t index;                   // position in the queue
+};
+
+/*
+ * A coarse timeout.
+ *
+ * Timeouts are kept in a per-cpu hierarchical timer wheel where starting and
+ * cancelling a timeout is O(1). The wheel ticks every millisecond and timeouts
+ * further out are bucketed with a granularity that grows with the distance so
+ * they may fire up to ~12% late. They are meant for things like poll or i/o
+ * timeouts which are usually cancelled long before they expire.
+ */
+struct timeout {
+  uint64_t expires;                 // deadline (wheel ticks)
+  timer_cb_t fn;
+  void *arg;
+  volatile int cpu;                 // cpu the timeout is queued on (-1 if not pending)
+  uint16_t slot;                    // wheel slot
+  LIST_ENTRY(struct timeout) list;
+};
+
+struct timer_stats {
+  uint64_t alarm_irqs;              // alarm interrupts taken
+  uint64_t reprograms;              // times the alarm was reprogrammed
+  uint64_t batches;                 // batches of expired callbacks
+  uint64_t hrtimers_expired;
+  uint64_t timeouts_expired;
+  uint64_t max_batch;               // largest batch run by a single interrupt
+};
+
 
 void register_timer_device(timer_device_t *device);
 
@@ -52,8 +94,23 @@ int timer_enable(uint16_t type);
 int timer_disable(uint16_t type);
 int timer_setval(uint16_t type, clock_t value);
 
+void timer_init();
+
+void hrtimer_init(struct hrtimer *timer, timer_cb_t fn, void *arg);
+int hrtimer_start(struct hrtimer *timer, uint64_t expires);
+bool hrtimer_cancel(struct hrtimer *timer);
+
+void timeout_init(struct timeout *timeout, timer_cb_t fn, void *arg);
+void timeout_start(struct timeout *timeout, uint64_t expires);
+bool timeout_cancel(struct timeout *timeout);
+
+static inline bool hrtimer_is_pending(struct hrtimer *timer) { return timer->cpu >= 0; }
+static inline bool timeout_is_pending(struct timeout *timeout) { return timeout->cpu >= 0; }
+
+void timer_sleep_ns(uint64_t ns);
 void timer_udelay(uint64_t us);
 
+void timer_get_stats(int cpu, struct timer_stats *stats);
 void timer_dump_pending_alarms();
 
 #endif
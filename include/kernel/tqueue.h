@@ -33,6 +33,10 @@ void runq_remove(struct runqueue *runq, struct thread *td, bool *empty);
 /// returns a non-null thread, the thread lock will be held and it will be in the
 /// running state.
 struct thread *runq_next_thread(struct runqueue *runq, bool *empty);
+/// Removes and returns the first thread on the runqueue that is allowed to run on
+/// the given cpu. Threads that are locked are skipped. If this function returns a
+/// non-null thread, the thread lock will be held.
+struct thread *runq_steal_thread(struct runqueue *runq, int cpu, bool *empty);
 
 // =================================
 //            lockqueue
@@ -48,14 +52,21 @@ struct thread *runq_next_thread(struct runqueue *runq, bool *empty);
  *
  * Lockqueues are used by short-term locks (non-spin mtx, rwlock) to mediate
  * access to the inner lock. It is equivalent to the turnstile in FreeBSD.
+ *
+ * Every blocked thread lends its priority to the owner of the lock and if the
+ * owner is itself blocked the priority is passed along to the next owner. The
+ * queues are kept ordered by priority so the first waiter is always the most
+ * urgent one. Lock order is chain lock -> lockqueue lock -> thread lock.
  */
 struct lockqueue {
   mtx_t lock;                               // lockqueue spin mutex
-  tdqueue_t queues[2];                      // exclusive and shared queues
+  tdqueue_t queues[2];                      // exclusive and shared queues (by priority)
+  volatile uint8_t pri;                     // priority of the most urgent waiter
 
   struct thread *owner;                     // owning thread
   struct lock_object *lock_obj;             // the lock object
   LIST_ENTRY(struct lockqueue) chain_list;  // chain list entry
+  LIST_ENTRY(struct lockqueue) owner_list;  // owner contested list entry
 };
 
 struct lockqueue *lockq_alloc();
@@ -71,14 +82,22 @@ void lockq_chain_unlock(struct lock_object *lock_obj);
 /// Blocks the current thread on the lockqueue. This function will context switch
 /// and not return until it has been woken back up. This should be called with the
 /// chain lock asscoiated with the lockqueue held, and will return with it unlocked.
+/// The owner may be NULL if the lock is shared and has no single owner.
 void lockq_wait(struct lockqueue *lockq, struct thread *owner, int queue);
-/// Removes the given thread from the lockqueue.
+/// Removes the given thread from the lockqueue without waking it up. This should
+/// be called with the chain lock and the thread lock held.
 void lockq_remove(struct lockqueue *lockq, struct thread *td, int queue);
 
 
-/// Signals the first thread on the lockqueue and unblocks it.
+/// Releases the current threads ownership of the lockqueue and drops any priority
+/// it was lent through it. This should be called with the chain lock held before
+/// the lock itself is released.
+void lockq_disown(struct lockqueue *lockq);
+/// Signals the first thread on the lockqueue and unblocks it. This should be called
+/// with the chain lock held.
 void lockq_signal(struct lockqueue *lockq, int queue);
-/// Signals all threads on the lockqueue and unblocks them.
+/// Signals all threads on the lockqueue and unblocks them. This should be called
+/// with the chain lock held.
 void lockq_broadcast(struct lockqueue *lockq, int queue);
 
 
@@ -94,6 +113,11 @@ void lockq_broadcast(struct lockqueue *lockq, int queue);
 /*
  * A waitqueue is a queue for threads waiting on a condition.
  *
+ * Threads wait on an arbitrary address (the wait channel) and are woken up in
+ * the order they started waiting. Like lockqueues, every thread owns a waitqueue
+ * which it gives up while it is waiting so there is no allocation involved. The
+ * chain lock protects the queue and lock order is chain lock -> thread lock.
+ *
  * Equivalent to FreeBSD sleepqueues.
  */
 struct waitqueue {
@@ -117,7 +141,25 @@ void waitq_chain_unlock(const void *wchan);
 /// and not return until it has been woken back up. This should be called with the
 /// chain lock asscoiated with the waitqueue held, and will return with it unlocked.
 void waitq_wait(struct waitqueue *waitq, const char *wdmsg);
-/// Removes the given thread from the waitqueue.
+/// Same as waitq_wait but the wait can be cut short by waitq_interrupt. Returns 0
+/// if the thread was woken up normally or -EINTR if it was interrupted.
+int waitq_wait_sig(struct waitqueue *waitq, const char *wdmsg);
+/// Same as waitq_wait but the thread is woken up after at least timeout ns if no
+/// one else woke it first. Returns 0 if the thread was woken up or -ETIMEDOUT.
+int waitq_wait_timeout(struct waitqueue *waitq, const char *wdmsg, uint64_t timeout);
+/// Removes the given thread from the waitqueue without waking it up. This should
+/// be called with the chain lock and the thread lock held.
 void waitq_remove(struct waitqueue *waitq, struct thread *td);
 
+/// Wakes up the first thread on the waitqueue. This should be called with the
+/// chain lock held.
+void waitq_signal(struct waitqueue *waitq);
+/// Wakes up all threads on the waitqueue. This should be called with the chain
+/// lock held.
+void waitq_broadcast(struct waitqueue *waitq);
+/// Interrupts the given thread. If it is in an interruptible wait it is woken up
+/// right away, otherwise its next interruptible wait returns immediately. Returns
+/// true if the thread was woken up.
+bool waitq_interrupt(struct thread *td);
+
 #endif
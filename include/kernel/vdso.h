@@ -0,0 +1,17 @@
+#ifndef KERNEL_VDSO_H
+#define KERNEL_VDSO_H
+
+#include <kernel/base.h>
+#include <kernel/mm_types.h>
+
+#include <abi/vdso.h>
+
+#define VDSO_VVAR_SIZE PAGE_SIZE // the vvar page is mapped right below the image
+
+vm_desc_t *vdso_alloc_descs(uintptr_t base);
+
+void vdso_update_clock(uint32_t mode, uint64_t mult, uint32_t shift, uint64_t base_count, uint64_t base_ns);
+void vdso_set_boot_time(uint64_t epoch);
+void vdso_disable_clock();
+
+#endif
@@ -23,6 +23,7 @@ typedef struct file {
   refcount_t refcount;  // reference count
   off_t offset;         // current file offset
   bool closed;          // file closed
+  struct file_ra ra;    // readahead state
 } file_t;
 
 __move file_t *f_alloc(int fd, int flags, vnode_t *vnode, cstr_t real_path);
@@ -10,14 +10,37 @@
 
 typedef struct vcache vcache_t;
 
+enum vcache_result {
+  VCACHE_MISS,                // nothing is known about the path
+  VCACHE_HIT,                 // the path is cached
+  VCACHE_NEGATIVE,            // the path is known not to exist
+};
+
+struct vcache_stats {
+  size_t entries;             // cached paths
+  size_t negative;            // cached paths that do not exist
+  size_t retired;             // removed entries not yet freed
+  uint64_t reclaimed;         // retired entries that have been freed
+  uint64_t evicted;           // entries evicted to make room
+  uint64_t hits;              // lookups that found the path
+  uint64_t misses;            // lookups that found nothing
+  uint64_t neg_hits;          // lookups that found a negative entry
+  uint64_t lockless_hits;     // hits served without the lock
+  uint64_t lockless_retries;  // lookups that raced a writer and took the lock
+};
+
 // vcache api
 vcache_t *vcache_alloc(__ref ventry_t *root);
 void vcache_free(vcache_t *vcache);
 ventry_t *vcache_get_root(vcache_t *vcache) __ref;
+enum vcache_result vcache_lookup(vcache_t *vcache, cstr_t path, __move ventry_t **result);
 ventry_t *vcache_get(vcache_t *vcache, cstr_t path) __move;
 int vcache_put(vcache_t *vcache, cstr_t path, ventry_t *ve);
+int vcache_put_negative(vcache_t *vcache, cstr_t path, ventry_t *dve);
 int vcache_invalidate(vcache_t *vcache, cstr_t path);
 int vcache_invalidate_all(vcache_t *vcache);
+size_t vcache_shrink(vcache_t *vcache, size_t count);
+void vcache_get_stats(vcache_t *vcache, struct vcache_stats *stats);
 void vcache_dump(vcache_t *vcache);
 
 #endif
@@ -35,6 +35,8 @@ __ref vnode_t *ve_unshadow_mount(ventry_t *mount_ve); // mount_ve = l
 void ve_replace_root(ventry_t *root_ve, ventry_t *newroot_ve); // root_ve = l, newroot_ve = l
 /// Adds a child ventry to a parent ventry.
 void ve_add_child(ventry_t *parent, ventry_t *child); // parent = l, child = _
+/// Adds a child ventry for a newly created name to a parent ventry.
+void ve_add_new_child(ventry_t *parent, ventry_t *child); // parent = l, child = _
 /// Removes a child ventry from a parent ventry.
 void ve_remove_child(ventry_t *parent, ventry_t *child); // parent = l, child = l
 /// Synchronizes a ventry with its vnode. If the vnode is dead
@@ -11,6 +11,14 @@
 
 #define VN_OPS(vn) __type_checked(struct vnode *, vn, (vn)->ops)
 
+struct vn_pgcache_stats {
+  uint64_t hits;        // pages found in the page cache
+  uint64_t misses;      // pages fetched with v_getpage
+  uint64_t ra_windows;  // readahead windows submitted
+  uint64_t ra_pages;    // pages fetched by readahead
+  uint64_t ra_random;   // reads that shrunk the window
+};
+
 // ===== vnode operations =====
 //
 // locking reference:
@@ -32,8 +40,10 @@ void vn_cleanup(__move vnode_t **vnref); // vnref = _
 int vn_open(vnode_t *vn, int flags); // vn = _
 int vn_close(vnode_t *vn); // vn = _
 ssize_t vn_read(vnode_t *vn, off_t off, kio_t *kio); // vn = r
+void vn_readahead(vnode_t *vn, struct file_ra *ra, off_t off, size_t len); // vn = r
 ssize_t vn_write(vnode_t *vn, off_t off, kio_t *kio); // vn = w
 int vn_getpage(vnode_t *vn, off_t off, bool pgcache, __move page_t **result); // vn = _
+void vn_get_pgcache_stats(struct vn_pgcache_stats *stats);
 
 int vn_load(vnode_t *vn); // vn = l
 int vn_save(vnode_t *vn); // vn = l
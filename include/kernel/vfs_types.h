@@ -197,6 +197,22 @@ typedef struct vnode {
 #define VN_OPEN   0x10 /// vnode is open (has open file descriptors)
 #define   VN_ISOPEN(vn) __type_checked(struct vnode *, vn, ((vn)->flags & VN_OPEN))
 
+/*
+ * Per-file readahead state.
+ *
+ * The window is the range of pages last submitted for readahead. Once a read
+ * reaches the async marker (async_size pages before the end of the window) the
+ * next window is started in the background so it is ready by the time the
+ * reader gets there. The window doubles on every sequential window and is
+ * halved on random access.
+ */
+struct file_ra {
+  size_t start;       // first page of the current window
+  size_t size;        // number of pages in the window
+  size_t async_size;  // pages from the end of the window to the async marker
+  size_t next;        // page expected by the next sequential read
+};
+
 
 struct vattr {
   enum vtype type;
@@ -211,6 +227,7 @@ struct vnode_ops {
   ssize_t (*v_read)(struct vnode *vn, off_t off, struct kio *kio);
   ssize_t (*v_write)(struct vnode *vn, off_t off, struct kio *kio);
   int (*v_getpage)(struct vnode *vn, off_t off, __move struct page **result);
+  int (*v_putpage)(struct vnode *vn, off_t off, __move struct page *page);
   int (*v_falloc)(struct vnode *vn, size_t len);
 
   // node operations
@@ -268,6 +285,7 @@ typedef struct ventry {
   struct ventry_ops *ops;             // ventry operations @
 
   size_t chld_count;                  // child count (V_DIR)
+  uint32_t chld_gen;                  // bumped when a name is created (V_DIR)
   union {
     struct ventry *mount;            // mounted root ventry reference (VE_MOUNT)
     LIST_HEAD(struct ventry) children;// child ventry references (V_DIR)
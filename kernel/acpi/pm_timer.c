@@ -56,6 +56,7 @@ void register_acpi_pm_timer() {
   cs->name = "acpi_pm";
   cs->data = NULL;
   cs->scale_ns = period_ns;
+  cs->freq = pm_timer_frequency;
   cs->last_count = 0;
   cs->value_mask = UINT32_MAX;
 
@@ -4,10 +4,14 @@
 
 #include <kernel/chan.h>
 #include <kernel/mm.h>
+#include <kernel/proc.h>
+#include <kernel/sched.h>
+#include <kernel/clock.h>
 
 #include <kernel/printf.h>
 #include <kernel/panic.h>
 #include <kernel/string.h>
+#include <kernel/str.h>
 #include <kernel/atomic.h>
 
 static id_t chan_id = 0;
@@ -52,9 +56,9 @@ chan_t *chan_alloc(uint16_t size, uint32_t flags) {
   chan->buffer = kmalloc(size * sizeof(uint64_t));
 
   mtx_init(&chan->reader, MTX_RECURSIVE, "chan_reader_mtx");
-  // cond_init(&chan->data_read, 0);
+  cond_init(&chan->data_read, "chan_data_read");
   mtx_init(&chan->writer, MTX_RECURSIVE, "chan_writer_mtx");
-  // cond_init(&chan->data_written, 0);
+  cond_init(&chan->data_written, "chan_data_written");
   return chan;
 }
 
@@ -74,6 +78,8 @@ int chan_free(chan_t *chan) {
     cleanup_data(chan, data);
   }
 
+  cond_destroy(&chan->data_read);
+  cond_destroy(&chan->data_written);
   kfree(chan->buffer);
   kfree(chan);
   return 0;
@@ -94,7 +100,6 @@ int chan_send(chan_t *chan, uint64_t data) {
 
   mtx_lock(&chan->writer);
   mtx_lock(&chan->lock);
-  // cond_clear_signal(&chan->data_written);
 
   // we can write the data into the buffer normally
   chan->buffer[chan->write_idx] = data;
@@ -128,7 +133,7 @@ int chan_send(chan_t *chan, uint64_t data) {
     chan->write_idx = get_next_index(chan, chan->write_idx);
   }
 
-  // cond_signal(&chan->data_written);
+  cond_signal(&chan->data_written);
   mtx_unlock(&chan->lock);
   mtx_unlock(&chan->writer);
   return 0;
@@ -148,7 +153,12 @@ int chan_sendb(chan_t *chan, uint64_t data) {
     return -1;
   }
 
-  // cond_wait(&chan->data_read);
+  // wait for the data to be read
+  mtx_lock(&chan->lock);
+  while (chan->read_idx != chan->write_idx && !(chan->flags & CHAN_CLOSED)) {
+    cond_wait(&chan->data_read, &chan->lock.lo);
+  }
+  mtx_unlock(&chan->lock);
   mtx_unlock(&chan->writer);
   return 0;
 }
@@ -161,19 +171,17 @@ int chan_recv(chan_t *chan, uint64_t *result) {
 
   mtx_lock(&chan->reader);
   mtx_lock(&chan->lock);
-  // cond_clear_signal(&chan->data_read);
 
-  if (chan->read_idx == chan->write_idx) {
-    mtx_unlock(&chan->lock);
-    // wait for new data to be written
-    // cond_wait(&chan->data_written);
+  while (chan->read_idx == chan->write_idx) {
+    // the channel may have been closed before we took the lock
     if (chan->flags & CHAN_CLOSED) {
       kprintf("error: closed while waiting in `chan_recv()` on channel[%u]\n", chan->id);
+      mtx_unlock(&chan->lock);
       mtx_unlock(&chan->reader);
       return -1;
     }
-    //
-    mtx_lock(&chan->lock);
+    // wait for new data to be written
+    cond_wait(&chan->data_written, &chan->lock.lo);
   }
   kassert(chan->read_idx != chan->write_idx);
 
@@ -182,7 +190,7 @@ int chan_recv(chan_t *chan, uint64_t *result) {
   chan->buffer[chan->read_idx] = 0;
   chan->read_idx = get_next_index(chan, chan->read_idx);
 
-  // cond_signal(&chan->data_read);
+  cond_signal(&chan->data_read);
   mtx_unlock(&chan->lock);
 
   if (result != NULL) {
@@ -204,7 +212,6 @@ int chan_recv_noblock(chan_t *chan, uint64_t *result) {
 
   mtx_lock(&chan->reader);
   mtx_lock(&chan->lock);
-  // cond_clear_signal(&chan->data_read);
 
   if (chan->read_idx == chan->write_idx) {
     mtx_unlock(&chan->lock);
@@ -218,7 +225,7 @@ int chan_recv_noblock(chan_t *chan, uint64_t *result) {
   chan->buffer[chan->read_idx] = 0;
   chan->read_idx = get_next_index(chan, chan->read_idx);
 
-  // cond_signal(&chan->data_read);
+  cond_signal(&chan->data_read);
   mtx_unlock(&chan->lock);
 
   if (result != NULL) {
@@ -264,18 +271,17 @@ int chan_wait(chan_t *chan) {
 
   mtx_lock(&chan->reader);
   mtx_lock(&chan->lock);
-  // cond_clear_signal(&chan->data_read);
 
-  if (chan->read_idx == chan->write_idx) {
-    // wait until there is data to read
-    mtx_unlock(&chan->lock);
-    // cond_wait(&chan->data_written);
+  while (chan->read_idx == chan->write_idx) {
+    // the channel may have been closed before we took the lock
     if (chan->flags & CHAN_CLOSED) {
       kprintf("error: closed while waiting in `chan_wait()` on channel[%u]\n", chan->id);
+      mtx_unlock(&chan->lock);
       mtx_unlock(&chan->reader);
       return -1;
     }
-    return 0;
+    // wait until there is data to read
+    cond_wait(&chan->data_written, &chan->lock.lo);
   }
 
   mtx_unlock(&chan->lock);
@@ -304,6 +310,9 @@ int chan_close(chan_t *chan) {
     cleanup_data(chan, data);
   }
 
+  // wake up anyone blocked on the channel
+  cond_broadcast(&chan->data_written);
+  cond_broadcast(&chan->data_read);
   mtx_unlock(&chan->lock);
   mtx_unlock(&chan->writer);
   return 0;
@@ -315,3 +324,82 @@ void chan_free_cb_kfree(void *data) {
   kfree(data);
 }
 
+//
+
+// #define CHAN_BENCHMARK
+#ifdef CHAN_BENCHMARK
+#define BENCH_ROUND_TRIPS 20000
+
+static chan_t *bench_ping;
+static chan_t *bench_pong;
+static volatile int bench_exited;
+
+static void chan_bench_pinger() {
+  for (uint64_t i = 1; i <= BENCH_ROUND_TRIPS; i++) {
+    uint64_t value;
+    chan_send(bench_ping, i);
+    if (chan_recv(bench_pong, &value) < 0 || value != i) {
+      panic("chan: ping-pong got %llu, expected %llu", value, i);
+    }
+  }
+  atomic_fetch_add(&bench_exited, 1);
+  thread_stop(curthread);
+  unreachable;
+}
+
+static void chan_bench_ponger() {
+  for (uint64_t i = 1; i <= BENCH_ROUND_TRIPS; i++) {
+    uint64_t value;
+    if (chan_recv(bench_ping, &value) < 0) {
+      panic("chan: ping-pong channel closed");
+    }
+    chan_send(bench_pong, value);
+  }
+  atomic_fetch_add(&bench_exited, 1);
+  thread_stop(curthread);
+  unreachable;
+}
+
+static void chan_bench_spawn(void (*entry)(), const char *name, int cpu) {
+  thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+  thread_setup_entry(td, (uintptr_t) entry);
+  td->name = str_fmt("%s", name);
+  cpuset_set(td->cpuset, cpu);
+  td->flags2 |= TDF2_AFFINITY;
+  proc_add_thread(curproc, td);
+  thread_finish_setup_and_submit(td);
+}
+
+// bounces a value back and forth between two threads so every message has to
+// wake up the other side. returns the average round trip time in ns
+static uint64_t chan_bench_run(int ping_cpu, int pong_cpu) {
+  bench_ping = chan_alloc(2, 0);
+  bench_pong = chan_alloc(2, 0);
+  bench_exited = 0;
+
+  uint64_t start = clock_get_nanos();
+  chan_bench_spawn(chan_bench_ponger, "chan bench pong", pong_cpu);
+  chan_bench_spawn(chan_bench_pinger, "chan bench ping", ping_cpu);
+  while (bench_exited < 2) {
+    sched_again(SCHED_YIELDED);
+  }
+  uint64_t elapsed = clock_get_nanos() - start;
+
+  chan_close(bench_ping);
+  chan_close(bench_pong);
+  chan_free(bench_ping);
+  chan_free(bench_pong);
+  return elapsed / BENCH_ROUND_TRIPS;
+}
+
+static void chan_benchmark() {
+  kprintf("chan: ping-pong benchmark (%d round trips)\n", BENCH_ROUND_TRIPS);
+  uint64_t same_ns = chan_bench_run(0, 0);
+  kprintf("  same cpu:  %llu ns per round trip\n", same_ns);
+  if (system_num_cpus > 1) {
+    uint64_t cross_ns = chan_bench_run(0, 1);
+    kprintf("  cross cpu: %llu ns per round trip\n", cross_ns);
+  }
+}
+MODULE_INIT(chan_benchmark);
+#endif
@@ -4,7 +4,9 @@
 
 #include <kernel/clock.h>
 #include <kernel/time.h>
+#include <kernel/timer.h>
 #include <kernel/proc.h>
+#include <kernel/vdso.h>
 
 #include <kernel/string.h>
 #include <kernel/printf.h>
@@ -15,8 +17,10 @@
 
 #define ASSERT(x) kassert(x)
 
-volatile uint64_t tick_count;     // system tick count
-volatile uint64_t uptime_seconds; // system uptime in seconds
+#define CLOCK_CALIBRATE_NS  MS_TO_NS(50)  // initial calibration window
+#define CLOCK_REFINE_NS     NS_PER_SEC    // delay before recalibrating over a longer window
+#define CLOCK_MULT_SHIFT    32
+
 static struct tm boot_time_tm;    // time at boot as struct tm
 static uint64_t boot_time_epoch;  // boot time in seconds since epoch
 
@@ -25,6 +29,31 @@ static LIST_HEAD(clock_source_t) clock_sources;
 static clock_source_t *current_clock_source;
 volatile uint64_t current_clock_count;
 
+/*
+ * Lockless clock parameters.
+ *
+ * When a lockless clock source is available, time is computed directly from its
+ * counter as `base_ns + ((count - base_count) * mult) >> shift`. The parameters
+ * are published under a sequence count so readers never take a lock and only
+ * retry if they race with a recalibration (which happens once shortly after boot).
+ */
+static struct clock_params {
+  volatile uint32_t seq;
+  uint32_t shift;
+  uint64_t mult;
+  uint64_t base_count;
+  uint64_t base_ns;
+} clock_params;
+
+static clock_source_t *lockless_clock_source;
+static bool clock_use_lockless;
+static bool clock_needs_refine;
+
+// first calibration sample used by the refinement
+static uint64_t calibrate_count;
+static uint64_t calibrate_ref_count;
+static struct hrtimer clock_refine_timer;
+
 // MARK: alarm and clock sources
 
 void register_alarm_source(alarm_source_t *as) {
@@ -49,7 +78,12 @@ void register_clock_source(clock_source_t *cs) {
   LIST_ENTRY_INIT(&cs->list);
   LIST_ADD(&clock_sources, cs, list);
 
-  if (!current_clock_source || cs->scale_ns < current_clock_source->scale_ns) {
+  if (cs->flags & CLOCK_SOURCE_LOCKLESS) {
+    // calibrated against the reference clock in clock_init
+    if (!lockless_clock_source) {
+      lockless_clock_source = cs;
+    }
+  } else if (!current_clock_source || cs->scale_ns < current_clock_source->scale_ns) {
     current_clock_source = cs;
   }
 
@@ -78,7 +112,8 @@ static inline alarm_source_t *alarm_source_find(const char *name) {
   return NULL;
 }
 
-static inline alarm_source_t *alarm_source_find_by_cap(uint32_t cap) {
+// returns the finest grained alarm source with the given capabilities
+alarm_source_t *alarm_source_find_by_cap(uint32_t cap) {
   alarm_source_t *best = NULL;
   LIST_FOR_IN(as, &alarm_sources, list) {
     if ((as->cap_flags & cap) == cap) {
@@ -87,20 +122,12 @@ static inline alarm_source_t *alarm_source_find_by_cap(uint32_t cap) {
       }
     }
   }
-  return NULL;
+  return best;
 }
 
 ////////////////////////////
 // MARK: system time/clock
 
-// handler is called HZ times per second by a periodic alarm source
-static void clocktick_irq_handler(struct trapframe *frame) {
-  atomic_fetch_add(&tick_count, 1);
-  if (tick_count % HZ == 0) {
-    atomic_fetch_add(&uptime_seconds, 1);
-  }
-}
-
 static inline void clock_do_read_sync(clock_source_t *source) {
   uint64_t delta;
   uint64_t count = source->read(source);
@@ -114,6 +141,125 @@ static inline void clock_do_read_sync(clock_source_t *source) {
   atomic_fetch_add(&current_clock_count, delta);
 }
 
+// MARK: lockless clock
+
+static inline uint64_t clock_lockless_nanos() {
+  struct clock_params *p = &clock_params;
+  clock_source_t *source = lockless_clock_source;
+  uint32_t seq;
+  uint64_t ns;
+  do {
+    while ((seq = atomic_load(&p->seq)) & 1) {
+      cpu_pause();
+    }
+    int64_t delta = (int64_t)(source->read(source) - p->base_count);
+    if (delta < 0) {
+      // another cpu's counter may be slightly ahead of ours when it publishes
+      delta = 0;
+    }
+    ns = p->base_ns + (uint64_t)(((__uint128_t) delta * p->mult) >> p->shift);
+  } while (atomic_load(&p->seq) != seq);
+  return ns;
+}
+
+// returns the elapsed nanoseconds represented by a number of reference counts
+static uint64_t clock_ref_counts_to_nanos(uint64_t counts) {
+  clock_source_t *ref = current_clock_source;
+  if (ref->freq != 0) {
+    return (uint64_t)(((__uint128_t) counts * NS_PER_SEC) / ref->freq);
+  }
+  return counts * ref->scale_ns;
+}
+
+// samples the lockless source and the reference clock as close together as possible
+static uint64_t clock_sample_ref(uint64_t *count) {
+  clock_source_t *ref = current_clock_source;
+  clock_source_t *source = lockless_clock_source;
+  mtx_spin_lock(&ref->lock);
+  clock_do_read_sync(ref);
+  *count = source->read(source);
+  uint64_t ref_count = current_clock_count;
+  mtx_spin_unlock(&ref->lock);
+  return ref_count;
+}
+
+// updates the lockless clock parameters so that `count` corresponds to `ns`
+static void clock_publish_params(uint64_t freq, uint64_t count, uint64_t ns) {
+  struct clock_params *p = &clock_params;
+  atomic_fetch_add(&p->seq, 1);
+  p->shift = CLOCK_MULT_SHIFT;
+  p->mult = (uint64_t)(((__uint128_t) NS_PER_SEC << CLOCK_MULT_SHIFT) / freq);
+  p->base_count = count;
+  p->base_ns = ns;
+  atomic_fetch_add(&p->seq, 1);
+
+  clock_source_t *source = lockless_clock_source;
+  uint32_t mode = (source->flags & CLOCK_SOURCE_VDSO) ? VDSO_CLOCK_TSC : VDSO_CLOCK_NONE;
+  vdso_update_clock(mode, p->mult, p->shift, count, ns);
+}
+
+static uint64_t clock_calibrate(uint64_t count0, uint64_t ref0, uint64_t *count1, uint64_t *ref1) {
+  *ref1 = clock_sample_ref(count1);
+  uint64_t elapsed_ns = clock_ref_counts_to_nanos(*ref1 - ref0);
+  if (elapsed_ns == 0) {
+    return 0;
+  }
+  return (uint64_t)(((__uint128_t)(*count1 - count0) * NS_PER_SEC) / elapsed_ns);
+}
+
+static void clock_refine_cb(void *arg) {
+  // the longer window averages out the error of the initial calibration
+  uint64_t count, ref_count;
+  uint64_t freq = clock_calibrate(calibrate_count, calibrate_ref_count, &count, &ref_count);
+  if (freq == 0) {
+    return;
+  }
+
+  // re-anchor at the current time so the clock stays continuous
+  critical_enter();
+  count = lockless_clock_source->read(lockless_clock_source);
+  uint64_t ns = clock_lockless_nanos();
+  clock_publish_params(freq, count, ns);
+  critical_exit();
+
+  lockless_clock_source->freq = freq;
+  kprintf("clock: %s frequency refined to %llu Hz\n", lockless_clock_source->name, freq);
+}
+
+static void clock_lockless_init() {
+  clock_source_t *source = lockless_clock_source;
+  source->enable(source);
+  if (source->freq != 0) {
+    uint64_t count;
+    uint64_t ref = clock_sample_ref(&count);
+    clock_publish_params(source->freq, count, ref * current_clock_source->scale_ns);
+    clock_use_lockless = true;
+    return;
+  }
+
+  // busy wait against the reference clock for the initial estimate
+  uint64_t count0, count1, ref1;
+  uint64_t ref0 = clock_sample_ref(&count0);
+  while (clock_ref_counts_to_nanos(current_clock_count - ref0) < CLOCK_CALIBRATE_NS) {
+    clock_read_sync_nanos();
+    cpu_pause();
+  }
+
+  uint64_t freq = clock_calibrate(count0, ref0, &count1, &ref1);
+  if (freq == 0) {
+    kprintf("clock: failed to calibrate %s\n", source->name);
+    return;
+  }
+
+  calibrate_count = count0;
+  calibrate_ref_count = ref0;
+  source->freq = freq;
+  clock_publish_params(freq, count1, ref1 * current_clock_source->scale_ns);
+  clock_use_lockless = true;
+  clock_needs_refine = true;
+  kprintf("clock: calibrated %s at %llu Hz\n", source->name, freq);
+}
+
 //
 
 void clock_init() {
@@ -124,6 +270,12 @@ void clock_init() {
   kprintf("using %s as clock source\n", current_clock_source->name);
   current_clock_source->enable(current_clock_source);
   current_clock_source->last_count = current_clock_source->read(current_clock_source);
+  if (lockless_clock_source != NULL) {
+    clock_lockless_init();
+    if (clock_use_lockless) {
+      kprintf("using %s for lockless clock reads\n", lockless_clock_source->name);
+    }
+  }
 
   // read boot time from rtc
   struct rtc_time rtc_boot_time;
@@ -137,27 +289,31 @@ void clock_init() {
   boot_time_tm.tm_wday = rtc_boot_time.weekday;
 
   boot_time_epoch = tm2posix(&boot_time_tm);
+  vdso_set_boot_time(boot_time_epoch);
 
-  // setup the interrupt that provides us our clock tick
-  alarm_source_t *tick_as = alarm_source_find("pit");
-  if (tick_as == NULL) {
-    panic("no alarm source found");
-  }
+  // there is no periodic clock tick. the tick count and uptime are derived from
+  // the clock and timed work runs off the per-cpu one-shot alarms, so an idle
+  // cpu is only interrupted when something is actually due
+}
 
-  int res;
-  if ((res = tick_as->init(tick_as, ALARM_PERIODIC, clocktick_irq_handler)) < 0) {
-    panic("failed to enable clock alarm source: %s", tick_as->name);
-  }
-  // tick HZ times per second
-  uint64_t val = ((NS_PER_SEC / HZ) * tick_as->scale_ns) & tick_as->value_mask;
-  if ((res = tick_as->setval(tick_as, val)) < 0) {
-    panic("failed to set clock alarm source value: %s [val=%ull]", tick_as->name, val);
+//
+
+static void clock_refine_init() {
+  if (!clock_needs_refine) {
+    return;
   }
+  hrtimer_init(&clock_refine_timer, clock_refine_cb, NULL);
+  hrtimer_start(&clock_refine_timer, clock_get_nanos() + CLOCK_REFINE_NS);
 }
+STATIC_INIT(clock_refine_init);
 
 //
 
 uint64_t clock_read_sync_nanos() {
+  if (clock_use_lockless) {
+    return clock_lockless_nanos();
+  }
+
   clock_source_t *source = current_clock_source;
   mtx_spin_lock(&source->lock);
   clock_do_read_sync(source);
@@ -166,7 +322,14 @@ uint64_t clock_read_sync_nanos() {
 }
 
 uint64_t clock_wait_sync_nanos() {
+  if (clock_use_lockless) {
+    return clock_lockless_nanos();
+  }
+
   clock_source_t *source = current_clock_source;
+  if (__expect_false(source == NULL)) {
+    return 0; // not initialized yet
+  }
 
   // use critical enter/exit so we stay in critical section even if lock is contended
   critical_enter();
@@ -190,27 +353,28 @@ uint64_t clock_wait_sync_nanos() {
 }
 
 uint64_t clock_try_sync_nanos() {
+  if (clock_use_lockless) {
+    return clock_lockless_nanos();
+  }
+
   clock_source_t *source = current_clock_source;
   if (mtx_spin_trylock(&source->lock)) {
     clock_do_read_sync(source);
     mtx_spin_unlock(&source->lock);
     return current_clock_count * source->scale_ns;
   } else {
-    // time is being read and updated by another cpu. first check to see if
-    // the current_clock_count is more recent than the kernel clock time, otherwise
-    // settle for the millisecond level precision
-    uint64_t curr_ns = SCALE_TICKS(tick_count, MS_PER_SEC);
-    uint64_t clock_ns = current_clock_count * source->scale_ns;
-    return max(clock_ns, curr_ns);
+    // time is being read and updated by another cpu so settle for the count it
+    // last published
+    return current_clock_count * source->scale_ns;
   }
 }
 
 uint64_t clock_get_ticks() {
-  return tick_count;
+  return clock_get_nanos() / (NS_PER_SEC / HZ);
 }
 
 uint64_t clock_get_uptime() {
-  return uptime_seconds;
+  return clock_get_nanos() / NS_PER_SEC;
 }
 
 uint64_t clock_get_starttime() {
@@ -218,7 +382,7 @@ uint64_t clock_get_starttime() {
 }
 
 uint64_t clock_get_millis() {
-  return SCALE_TICKS(tick_count, MS_PER_SEC);
+  return clock_get_nanos() / (NS_PER_SEC / MS_PER_SEC);
 }
 
 uint64_t clock_get_micros() {
@@ -229,3 +393,86 @@ uint64_t clock_get_nanos() {
   // return clock_read_sync_nanos();
   return clock_wait_sync_nanos();
 }
+
+// MARK: syscalls
+
+DEFINE_SYSCALL(clock_gettime, int, clockid_t clock, struct timespec *tp) {
+  uint64_t ns;
+  switch (clock) {
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+      ns = boot_time_epoch * NS_PER_SEC + clock_get_nanos();
+      break;
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_BOOTTIME:
+      ns = clock_get_nanos();
+      break;
+    default:
+      return -EINVAL;
+  }
+
+  tp->tv_sec = (time_t)(ns / NS_PER_SEC);
+  tp->tv_nsec = (long)(ns % NS_PER_SEC);
+  return 0;
+}
+
+DEFINE_SYSCALL(gettimeofday, int, struct timeval *tv, struct timezone *tz) {
+  if (tv) {
+    uint64_t ns = boot_time_epoch * NS_PER_SEC + clock_get_nanos();
+    tv->tv_sec = (time_t)(ns / NS_PER_SEC);
+    tv->tv_usec = (suseconds_t)((ns % NS_PER_SEC) / NS_PER_USEC);
+  }
+  if (tz) {
+    tz->tz_minuteswest = 0;
+    tz->tz_dsttime = 0;
+  }
+  return 0;
+}
+
+// MARK: benchmark
+
+// #define CLOCK_READ_BENCHMARK
+#ifdef CLOCK_READ_BENCHMARK
+#define CLOCK_BENCH_READS 100000
+
+static uint64_t clock_bench_locked_read() {
+  clock_source_t *source = current_clock_source;
+  mtx_spin_lock(&source->lock);
+  clock_do_read_sync(source);
+  mtx_spin_unlock(&source->lock);
+  return current_clock_count * source->scale_ns;
+}
+
+static void clock_bench_report(const char *name, uint64_t start_ns) {
+  uint64_t elapsed = clock_get_nanos() - start_ns;
+  kprintf("clock: %-16s %llu ns/read\n", name, elapsed / CLOCK_BENCH_READS);
+}
+
+static void clock_read_benchmark() {
+  kprintf("clock: benchmarking %d reads per source\n", CLOCK_BENCH_READS);
+  uint64_t start;
+
+  LIST_FOR_IN(cs, &clock_sources, list) {
+    start = clock_get_nanos();
+    for (int i = 0; i < CLOCK_BENCH_READS; i++) {
+      cs->read(cs);
+    }
+    clock_bench_report(cs->name, start);
+  }
+
+  start = clock_get_nanos();
+  for (int i = 0; i < CLOCK_BENCH_READS; i++) {
+    clock_bench_locked_read();
+  }
+  clock_bench_report("locked", start);
+
+  start = clock_get_nanos();
+  for (int i = 0; i < CLOCK_BENCH_READS; i++) {
+    clock_get_nanos();
+  }
+  clock_bench_report("clock_get_nanos", start);
+}
+MODULE_INIT(clock_read_benchmark);
+#endif
@@ -3,33 +3,146 @@
 //
 
 #include <kernel/cond.h>
+#include <kernel/mutex.h>
+#include <kernel/rwlock.h>
+#include <kernel/tqueue.h>
+#include <kernel/proc.h>
+#include <kernel/atomic.h>
+#include <kernel/panic.h>
 
+#define ASSERT(x, fmt, ...) kassertf(x, fmt, ##__VA_ARGS__)
+
+#define COND_LOCK_SHARED 0x1 // lock was held shared
+
+// releases the interlock and returns how it was held
+static uintptr_t cond_lock_release(struct lock_object *lock) {
+  switch (LO_LOCK_CLASS(lock)) {
+    case SPINLOCK_LOCKCLASS:
+      mtx_spin_unlock((mtx_t *) lock);
+      return 0;
+    case MUTEX_LOCKCLASS:
+      mtx_assert((mtx_t *) lock, MA_NOTRECURSED);
+      mtx_unlock((mtx_t *) lock);
+      return 0;
+    case RWLOCK_LOCKCLASS:
+      if (rw_owned((rwlock_t *) lock)) {
+        rw_wunlock((rwlock_t *) lock);
+        return 0;
+      }
+      rw_runlock((rwlock_t *) lock);
+      return COND_LOCK_SHARED;
+    default:
+      panic("cond: unsupported lock class %s", lock_class_kind_str(LO_LOCK_CLASS(lock)));
+  }
+}
+
+static void cond_lock_acquire(struct lock_object *lock, uintptr_t how) {
+  switch (LO_LOCK_CLASS(lock)) {
+    case SPINLOCK_LOCKCLASS:
+      mtx_spin_lock((mtx_t *) lock);
+      break;
+    case MUTEX_LOCKCLASS:
+      mtx_lock((mtx_t *) lock);
+      break;
+    case RWLOCK_LOCKCLASS:
+      if (how & COND_LOCK_SHARED) {
+        rw_rlock((rwlock_t *) lock);
+      } else {
+        rw_wlock((rwlock_t *) lock);
+      }
+      break;
+    default:
+      unreachable;
+  }
+}
+
+// registers the current thread as a waiter and releases the interlock. returns
+// with the chain lock held and the waitq to block on in waitqp.
+static uintptr_t cond_wait_prepare(cond_t *cond, struct lock_object *lock, struct waitqueue **waitqp) {
+  ASSERT(curthread != NULL, "cond_wait() outside of a thread");
+  waitq_chain_lock(cond);
+  struct waitqueue *waitq = waitq_lookup(cond);
+  if (waitq == NULL) {
+    waitq = curthread->own_waitq; // donate our waitq
+    waitq->wchan = cond;
+  }
+
+  // the count goes up before the interlock is dropped so a signal sent after the
+  // condition was changed under the interlock will always see us
+  atomic_fetch_add(&cond->waiters, 1);
+  uintptr_t how = cond_lock_release(lock);
+  *waitqp = waitq;
+  return how;
+}
+
+static void cond_wait_finish(cond_t *cond, struct lock_object *lock, uintptr_t how) {
+  atomic_fetch_sub(&cond->waiters, 1);
+  cond_lock_acquire(lock, how);
+}
+
+//
 
 void cond_init(cond_t *cond, const char *desc) {
-  // todo();
+  cond->description = desc;
+  cond->waiters = 0;
 }
 
 void cond_destroy(cond_t *cond) {
-  todo();
+  ASSERT(atomic_load(&cond->waiters) == 0, "cond_destroy() on cond with waiters");
+  cond->description = NULL;
 }
 
 void cond_wait(cond_t *cond, struct lock_object *lock) {
-  todo();
+  struct waitqueue *waitq;
+  uintptr_t how = cond_wait_prepare(cond, lock, &waitq);
+  waitq_wait(waitq, cond->description);
+  cond_wait_finish(cond, lock, how);
 }
 
 int cond_wait_sig(cond_t *cond, struct lock_object *lock) {
-  todo();
+  struct waitqueue *waitq;
+  uintptr_t how = cond_wait_prepare(cond, lock, &waitq);
+  int res = waitq_wait_sig(waitq, cond->description);
+  cond_wait_finish(cond, lock, how);
+  return res;
 }
 
-// int cond_timedwait(cond_t *cond, struct lock_object *lock, uint64_t timeout) {
-//   todo();
-// }
-// int cond_timedwait_sig(cond_t *cond, )
+int cond_timedwait(cond_t *cond, struct lock_object *lock, uint64_t timeout) {
+  struct waitqueue *waitq;
+  uintptr_t how = cond_wait_prepare(cond, lock, &waitq);
+  int res;
+  if (timeout == 0) {
+    waitq_wait(waitq, cond->description);
+    res = 0;
+  } else {
+    res = waitq_wait_timeout(waitq, cond->description, timeout);
+  }
+  cond_wait_finish(cond, lock, how);
+  return res;
+}
 
 void cond_signal(cond_t *cond) {
-  todo();
+  if (atomic_load(&cond->waiters) == 0) {
+    return;
+  }
+
+  waitq_chain_lock(cond);
+  struct waitqueue *waitq = waitq_lookup(cond);
+  if (waitq != NULL) {
+    waitq_signal(waitq);
+  }
+  waitq_chain_unlock(cond);
 }
 
 void cond_broadcast(cond_t *cond) {
-  todo();
+  if (atomic_load(&cond->waiters) == 0) {
+    return;
+  }
+
+  waitq_chain_lock(cond);
+  struct waitqueue *waitq = waitq_lookup(cond);
+  if (waitq != NULL) {
+    waitq_broadcast(waitq);
+  }
+  waitq_chain_unlock(cond);
 }
@@ -180,6 +180,11 @@ __write_cr4:
   mov cr4, rdi
   ret
 
+global __clts
+__clts:
+  clts
+  ret
+
 global __xgetbv
 __xgetbv:
   mov ecx, edi
@@ -194,8 +199,7 @@ __xsetbv:
   mov ecx, edi
   mov rax, rsi
   mov rdx, rsi
-  mov cl, 32
-  shr rdx, cl
+  shr rdx, 32
   xsetbv
   ret
 
@@ -209,6 +213,47 @@ __fxrstor:
   fxrstor [rdi]
   ret
 
+; the xsave family takes the requested feature mask in edx:eax
+global __xsave
+__xsave:
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xsave64 [rdi]
+  ret
+
+global __xsaveopt
+__xsaveopt:
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xsaveopt64 [rdi]
+  ret
+
+global __xsaves
+__xsaves:
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xsaves64 [rdi]
+  ret
+
+global __xrstor
+__xrstor:
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xrstor64 [rdi]
+  ret
+
+global __xrstors
+__xrstors:
+  mov rax, rsi
+  mov rdx, rsi
+  shr rdx, 32
+  xrstors64 [rdi]
+  ret
+
 ; Paging/TLB
 
 global cpu_flush_tlb
@@ -217,6 +262,18 @@ cpu_flush_tlb:
   mov cr3, rax
   ret
 
+global cpu_flush_tlb_global
+cpu_flush_tlb_global:
+  ; toggling cr4.pge also flushes global entries
+  mov rax, cr4
+  mov rdx, rax
+  and rdx, ~(1 << 7)
+  mov cr4, rdx
+  mov cr4, rax
+  mov rax, cr3
+  mov cr3, rax
+  ret
+
 ; Syscalls
 
 global syscall
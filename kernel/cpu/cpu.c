@@ -33,12 +33,7 @@
 #define CPU_CR4_OSFXSR     (1 << 9)
 #define CPU_CR4_OSXMMEXCPT (1 << 10)
 #define CPU_CR4_UMIP       (1 << 11)
-#define CPU_CR4_OSXSAVE    (1 << 18)
-
-#define CPU_XCR0_X87       (1 << 0)
-#define CPU_XCR0_SSE       (1 << 1)
-#define CPU_XCR0_AVX       (1 << 2)
-#define CPU_XCR0_OPMASK    (1 << 5) // AVX-512
+#define CPU_CR4_PCIDE      (1 << 17)
 
 #define CPU_EFER_SCE       (1 << 0)
 #define CPU_EFER_NXE       (1 << 11)
@@ -144,8 +139,9 @@ void cpu_early_init() {
     panic("unsupported hybrid CPU topology detected");
   }
 
-  // clear CR0.EM bit
-  __write_cr0(__read_cr0() & ~CPU_CR0_EM);
+  // clear CR0.EM bit and set CR0.WP so that kernel writes to read-only
+  // (copy-on-write) user pages fault as well
+  __write_cr0((__read_cr0() & ~CPU_CR0_EM) | CPU_CR0_WP);
   uint64_t cr4 = __read_cr4();
   cr4 |= CPU_CR4_OSFXSR | CPU_CR4_OSXMMEXCPT;
 
@@ -154,33 +150,23 @@ void cpu_early_init() {
     bsp_log_message("PGE enabled\n");
     cr4 |= CPU_CR4_PGE;
   }
+  // process-context identifiers
+  if (cpuid_query_bit(CPUID_BIT_PCID) && (__read_cr3() & 0xFFF) == 0) {
+    bsp_log_message("PCID enabled\n");
+    cr4 |= CPU_CR4_PCIDE;
+  } else {
+    cpuid_clear_bit(CPUID_BIT_PCID);
+    cpuid_clear_bit(CPUID_BIT_INVPCID);
+  }
   // user mode instruction prevention
   if (cpuid_query_bit(CPUID_BIT_UMIP)) {
     bsp_log_message("UMIP enabled\n");
     cr4 |= CPU_CR4_UMIP;
   }
-  // os enabled xsave
-  if (cpuid_query_bit(CPUID_BIT_XSAVE) && cpuid_query_bit(CPUID_BIT_OSXSAVE)) {
-    cr4 |= CPU_CR4_OSXSAVE;
-  } else {
-    bsp_log_message("XSAVE disabled\n");
-    cpuid_clear_bit(CPUID_BIT_XSAVE);
-  }
   __write_cr4(cr4);
 
-  // enable XSAVE/XRSTOR Support
-  if (cpuid_query_bit(CPUID_BIT_XSAVE)) {
-    bsp_log_message("XSAVE support 'x87 registers'\n");
-    bsp_log_message("XSAVE support 'SSE registers'\n");
-    uint64_t xcr = __xgetbv(0x1);
-    xcr |= CPU_XCR0_X87 | CPU_XCR0_SSE; // x87 state and SSE state
-    // Enable AVX if available
-    if (cpuid_query_bit(CPUID_BIT_AVX)) {
-      bsp_log_message("XSAVE support 'AVX registers'\n");
-      xcr |= CPU_XCR0_AVX; // AVX state
-    }
-    __xsetbv(0x1, xcr);
-  }
+  // enable the fpu and the xsave state components
+  fpu_init();
 
   // enable NX and Fast FXSR
   uint64_t efer = cpu_read_msr(IA32_EFER_MSR);
@@ -405,21 +391,6 @@ void cpu_enable_write_protection() {
   __write_cr0(cr0 | CPU_CR0_WP);
 }
 
-//
-// MARK: FPU
-//
-
-struct fpu_area *fpu_state_alloc() {
-  return kmallocz(sizeof(struct fpu_area));
-}
-
-void fpu_state_free(struct fpu_area **fp) {
-  if (fp != NULL) {
-    kfree(*fp);
-    *fp = NULL;
-  }
-}
-
 //
 // MARK: Syscalls
 //
@@ -444,3 +415,13 @@ DEFINE_SYSCALL(arch_prctl, int, int code, unsigned long arg) {
   }
   return 0;
 }
+
+DEFINE_SYSCALL(getcpu, int, unsigned *cpup, unsigned *nodep, void *unused) {
+  if (cpup) {
+    *cpup = curcpu_id;
+  }
+  if (nodep) {
+    *nodep = 0;
+  }
+  return 0;
+}
@@ -0,0 +1,243 @@
+#include <kernel/cpu/fpu.h>
+#include <kernel/cpu/cpu.h>
+#include <kernel/cpu/tcb.h>
+
+#include <kernel/mm.h>
+#include <kernel/proc.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/panic.h>
+
+#define ASSERT(x) kassert(x)
+
+#define CPU_CR0_MP       (1 << 1)
+#define CPU_CR0_EM       (1 << 2)
+#define CPU_CR0_TS       (1 << 3)
+#define CPU_CR0_NE       (1 << 5)
+#define CPU_CR4_OSXSAVE  (1 << 18)
+
+#define CPUID_XSAVE_LEAF 0xD
+#define XSAVE_OPT        (1 << 0) // cpuid 0xD.1 eax
+#define XSAVE_S          (1 << 3) // cpuid 0xD.1 eax
+#define XCOMP_BV_COMPACT (1ULL << 63)
+
+#define FPU_DEFAULT_FCW   0x037F
+#define FPU_DEFAULT_MXCSR 0x1F80
+
+enum fpu_method {
+  FPU_FXSAVE,
+  FPU_XSAVE,
+  FPU_XSAVEOPT,
+  FPU_XSAVES,
+};
+
+static const char *fpu_method_names[] = {
+  [FPU_FXSAVE] = "fxsave",
+  [FPU_XSAVE] = "xsave",
+  [FPU_XSAVEOPT] = "xsaveopt",
+  [FPU_XSAVES] = "xsaves",
+};
+
+/*
+ * Per-cpu fpu state.
+ *
+ * The owner is the thread whose state was last loaded into the registers of
+ * this cpu. It stays set after the thread is switched out so the state does not
+ * have to be reloaded if the thread is the next to use the fpu here. When live
+ * is false CR0.TS is set and the next fpu instruction traps.
+ */
+struct fpu_cpu {
+  thread_t *owner;
+  bool live;
+  struct fpu_stats stats;           // only updated by the owning cpu
+};
+
+static struct fpu_cpu fpu_cpus[MAX_CPUS];
+static enum fpu_method fpu_method;
+size_t fpu_area_size = sizeof(struct fpu_area);
+uint64_t fpu_xfeatures = XFEATURE_X87 | XFEATURE_SSE;
+
+static inline void cpuid_count(uint32_t leaf, uint32_t subleaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
+  __asm volatile("cpuid" : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d) : "a" (leaf), "c" (subleaf));
+}
+
+static void fpu_save(struct fpu_area *fpa) {
+  switch (fpu_method) {
+    case FPU_FXSAVE: __fxsave(fpa); break;
+    case FPU_XSAVE: __xsave(fpa, fpu_xfeatures); break;
+    case FPU_XSAVEOPT: __xsaveopt(fpa, fpu_xfeatures); break;
+    case FPU_XSAVES: __xsaves(fpa, fpu_xfeatures); break;
+  }
+}
+
+static void fpu_restore(struct fpu_area *fpa) {
+  switch (fpu_method) {
+    case FPU_FXSAVE: __fxrstor(fpa); break;
+    case FPU_XSAVE:
+    case FPU_XSAVEOPT: __xrstor(fpa, fpu_xfeatures); break;
+    case FPU_XSAVES: __xrstors(fpa, fpu_xfeatures); break;
+  }
+}
+
+static void fpu_detect_xsave() {
+  uint32_t eax, ebx, ecx, edx;
+  cpuid_count(CPUID_XSAVE_LEAF, 0, &eax, &ebx, &ecx, &edx);
+  uint64_t supported = ((uint64_t) edx << 32) | eax;
+
+  uint64_t xfeatures = XFEATURE_X87 | XFEATURE_SSE;
+  if (cpuid_query_bit(CPUID_BIT_AVX) && (supported & XFEATURE_AVX)) {
+    xfeatures |= XFEATURE_AVX;
+    if (cpuid_query_bit(CPUID_BIT_AVX512_F) && (supported & XFEATURE_AVX512) == XFEATURE_AVX512) {
+      xfeatures |= XFEATURE_AVX512;
+    }
+  }
+  fpu_xfeatures = xfeatures;
+  __xsetbv(0, xfeatures);
+
+  // the size reported in ebx depends on the features enabled in XCR0
+  cpuid_count(CPUID_XSAVE_LEAF, 0, &eax, &ebx, &ecx, &edx);
+  fpu_area_size = ebx;
+  fpu_method = FPU_XSAVE;
+
+  cpuid_count(CPUID_XSAVE_LEAF, 1, &eax, &ebx, &ecx, &edx);
+  if (eax & XSAVE_S) {
+    // supervisor state components are not used
+    cpu_write_msr(IA32_XSS_MSR, 0);
+    cpuid_count(CPUID_XSAVE_LEAF, 1, &eax, &ebx, &ecx, &edx);
+    fpu_area_size = ebx; // compacted size
+    fpu_method = FPU_XSAVES;
+  } else if (eax & XSAVE_OPT) {
+    fpu_method = FPU_XSAVEOPT;
+  }
+}
+
+//
+
+/**
+ * Sets up the fpu of the current cpu. On the boot cpu this also picks the save
+ * method and the size of the save areas. The registers start out live so early
+ * kernel code can use floating point before the #NM handler is installed.
+ */
+void fpu_init() {
+  uint64_t cr0 = __read_cr0();
+  cr0 &= ~(CPU_CR0_EM | CPU_CR0_TS);
+  cr0 |= CPU_CR0_MP | CPU_CR0_NE;
+  __write_cr0(cr0);
+
+  if (cpuid_query_bit(CPUID_BIT_XSAVE)) {
+    __write_cr4(__read_cr4() | CPU_CR4_OSXSAVE);
+    if (curcpu_is_boot) {
+      fpu_detect_xsave();
+    } else {
+      __xsetbv(0, fpu_xfeatures);
+      if (fpu_method == FPU_XSAVES) {
+        cpu_write_msr(IA32_XSS_MSR, 0);
+      }
+    }
+  }
+
+  if (curcpu_is_boot) {
+    kprintf("fpu: using %s with a %zu byte save area (xfeatures %#llx)\n",
+            fpu_method_names[fpu_method], fpu_area_size, fpu_xfeatures);
+  }
+
+  struct fpu_cpu *cpu = &fpu_cpus[curcpu_id];
+  memset(cpu, 0, sizeof(struct fpu_cpu));
+  cpu->live = true;
+}
+
+struct fpu_area *fpu_area_alloc() {
+  struct fpu_area *fpa = kmalloca(fpu_area_size, 64);
+  memset(fpa, 0, fpu_area_size);
+  fpa->fcw = FPU_DEFAULT_FCW;
+  fpa->mxcsr = FPU_DEFAULT_MXCSR;
+  if (fpu_method != FPU_FXSAVE) {
+    struct xsave_header *hdr = (void *) ((uintptr_t) fpa + sizeof(struct fpu_area));
+    // the x87 and sse state above is loaded instead of the init state
+    hdr->xstate_bv = XFEATURE_X87 | XFEATURE_SSE;
+    if (fpu_method == FPU_XSAVES) {
+      hdr->xcomp_bv = XCOMP_BV_COMPACT | fpu_xfeatures;
+    }
+  }
+  return fpa;
+}
+
+void fpu_area_free(struct fpu_area **pfpa) {
+  if (*pfpa != NULL) {
+    kfree(*pfpa);
+    *pfpa = NULL;
+  }
+}
+
+/**
+ * Called with the thread lock held just before the thread is switched out. If
+ * the thread used the fpu during its timeslice its state is saved and the cpu
+ * is left with CR0.TS set.
+ */
+void fpu_switch_out(thread_t *td) {
+  struct fpu_cpu *cpu = &fpu_cpus[curcpu_id];
+  if (!cpu->live) {
+    return; // the fpu was not used
+  }
+
+  if (cpu->owner == td) {
+    if (TDS_IS_EXITED(td)) {
+      cpu->owner = NULL;
+    } else {
+      fpu_save(td->tcb->fpu);
+      cpu->stats.saves++;
+    }
+  }
+
+  __write_cr0(__read_cr0() | CPU_CR0_TS);
+  cpu->live = false;
+}
+
+/**
+ * Handles the #NM exception raised by the first fpu instruction after a switch
+ * and loads the state of the current thread unless it is still in the registers.
+ */
+void fpu_nm_handler(struct trapframe *frame) {
+  uint64_t flags;
+  temp_irq_save(flags);
+  __clts();
+
+  struct fpu_cpu *cpu = &fpu_cpus[curcpu_id];
+  ASSERT(!cpu->live);
+  cpu->live = true;
+  cpu->stats.traps++;
+
+  thread_t *td = curthread;
+  if (td == NULL || td->tcb->fpu == NULL) {
+    // kernel threads have no state of their own and just clobber the registers
+    cpu->owner = NULL;
+  } else if (cpu->owner == td && td->tcb->fpu_cpu == curcpu_id) {
+    cpu->stats.reloads++;
+  } else {
+    fpu_restore(td->tcb->fpu);
+    cpu->owner = td;
+    td->tcb->fpu_cpu = curcpu_id;
+    cpu->stats.restores++;
+  }
+  temp_irq_restore(flags);
+}
+
+//
+
+void fpu_get_stats(struct fpu_stats *stats) {
+  memset(stats, 0, sizeof(struct fpu_stats));
+  for (int i = 0; i < MAX_CPUS; i++) {
+    struct fpu_stats *s = &fpu_cpus[i].stats;
+    stats->traps += s->traps;
+    stats->restores += s->restores;
+    stats->reloads += s->reloads;
+    stats->saves += s->saves;
+  }
+}
+
+void fpu_dump_stats() {
+  struct fpu_stats stats;
+  fpu_get_stats(&stats);
+  kprintf("fpu: %llu traps, %llu restores, %llu reloads, %llu saves (%s)\n",
+          stats.traps, stats.restores, stats.reloads, stats.saves, fpu_method_names[fpu_method]);
+}
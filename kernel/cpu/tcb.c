@@ -8,21 +8,6 @@
 #include <kernel/mm.h>
 #include <kernel/panic.h>
 
-
-struct fpu_area *fpu_area_alloc() {
-  struct fpu_area *fpa = kmallocz(sizeof(struct fpu_area));
-  return fpa;
-}
-
-void fpu_area_free(struct fpu_area **pfpa) {
-  if (*pfpa == NULL) {
-    kfree(*pfpa);
-    *pfpa = NULL;
-  }
-}
-
-//
-
 struct tcb *tcb_alloc(int flags) {
   struct tcb *tcb = kmallocz(sizeof(struct tcb));
   if (flags & TCB_FPU) {
@@ -5,6 +5,7 @@
 #include <kernel/exec.h>
 #include <kernel/loadelf.h>
 #include <kernel/proc.h>
+#include <kernel/vdso.h>
 #include <kernel/mm.h>
 #include <kernel/fs.h>
 
@@ -17,7 +18,7 @@
 #define ASSERT(x) kassert(x)
 #define DPRINTF(fmt, ...) kprintf("exec: " fmt, ##__VA_ARGS__)
 
-#define AUXV_COUNT 12
+#define AUXV_COUNT 13
 #define AUX(type, val) ((Elf64_auxv_t) { .a_type = (type), .a_un.a_val = (val) })
 
 static inline int exec_type_to_et(enum exec_type type) {
@@ -105,7 +106,8 @@ int exec_image_setup_stack(
   // The env and arg pages contain the actual strings that are pointed to by
   // the envp and argv pointers. These pages are cow copies of the pstrings pages.
   // None of the stack pages are mapped into the current address space, rather we
-  // create vm descriptors and map them later on.
+  // create vm descriptors and map them later on. The vdso and its vvar page are
+  // mapped alongside the stack and the image is passed in AT_SYSINFO_EHDR.
   //
   // ^^ higher addresses ^^
   //        ------- cow stack pages end -------
@@ -181,6 +183,10 @@ int exec_image_setup_stack(
   }
   env_ptrs[env->count] = 0; // null pointer
 
+  // add descriptors for the vvar page and the vdso image
+  vm_desc_t *vdso_descs = vdso_alloc_descs(VDSO_BASE_ADDR);
+  SLIST_ADD_SLIST(&descs, vdso_descs, SLIST_GET_LAST(vdso_descs, next), next);
+
   // auxv entries
   uintptr_t aux_base = image->base;
   if (image->interp) {
@@ -197,6 +203,7 @@ int exec_image_setup_stack(
     AUX(AT_EUID, creds->euid),
     AUX(AT_GID, creds->gid),
     AUX(AT_EGID, creds->egid),
+    AUX(AT_SYSINFO_EHDR, VDSO_BASE_ADDR + VDSO_VVAR_SIZE),
     AUX(AT_NULL, 0),
     AUX(AT_NULL, 0),
   };
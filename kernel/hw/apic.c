@@ -8,6 +8,8 @@
 #include <kernel/cpu/cpu.h>
 #include <kernel/mm.h>
 #include <kernel/init.h>
+#include <kernel/irq.h>
+#include <kernel/clock.h>
 
 #include <kernel/panic.h>
 #include <kernel/printf.h>
@@ -67,6 +69,8 @@ static LIST_HEAD(struct apic_device) apics;
 uintptr_t apic_base = APIC_BASE_PA;
 static uint64_t cpu_clock;  // ticks per second
 static uint32_t apic_clock; // ticks per second
+static uint32_t apic_timer_freq; // alarm source ticks per second (divided)
+static int apic_timer_irqnum = -1;
 
 static inline uint32_t apic_read(apic_reg_t reg) {
   uintptr_t addr = apic_base + reg;
@@ -394,3 +398,109 @@ int apic_write_icr(uint32_t low, uint8_t dest_id) {
   cpu_restore_interrupts(rflags);
   return 0;
 }
+
+//////////////////////////////
+// MARK: APIC timer alarm source
+
+// the timer counts down at the bus clock divided by 16 which keeps the
+// resolution well under a microsecond while still allowing multi-second alarms
+#define APIC_TIMER_DIVIDE APIC_DIVIDE_16
+
+static uint32_t apic_timer_calibrate() {
+  apic_reg_lvt_timer_t timer = apic_read_timer();
+  timer.mask = APIC_MASK;
+  timer.timer_mode = APIC_ONE_SHOT;
+  apic_write_timer(timer);
+
+  apic_reg_div_config_t div = apic_reg_div_config(APIC_TIMER_DIVIDE);
+  apic_write(APIC_DIVIDE_CONFIG, div.raw);
+
+  uint64_t ms = 5;
+  uint32_t min = UINT32_MAX;
+  for (int i = 0; i < 3; i++) {
+    apic_write(APIC_INITIAL_COUNT, UINT32_MAX);
+    pit_mdelay(ms);
+    uint32_t diff = UINT32_MAX - apic_read(APIC_CURRENT_COUNT);
+    if (diff < min) {
+      min = diff;
+    }
+  }
+
+  apic_write(APIC_INITIAL_COUNT, 0);
+  return min * (MS_PER_SEC / ms);
+}
+
+// called on every cpu since each one has its own timer
+static int apic_alarm_source_init(alarm_source_t *as, uint32_t mode, irq_handler_t handler) {
+  if (mode != ALARM_ONE_SHOT) {
+    kprintf("[apic] timer only supports one-shot mode\n");
+    return -EINVAL;
+  }
+
+  as->mode = mode;
+  if (apic_timer_irqnum < 0) {
+    // all cpus share the same vector and handler
+    if ((apic_timer_irqnum = irq_alloc_software_irqnum()) < 0) {
+      kprintf("[apic] failed to allocate timer irq\n");
+      return -ENOSPC;
+    }
+    as->irq_num = apic_timer_irqnum;
+    irq_register_handler(as->irq_num, handler, as);
+  }
+
+  apic_reg_div_config_t div = apic_reg_div_config(APIC_TIMER_DIVIDE);
+  apic_write(APIC_DIVIDE_CONFIG, div.raw);
+  apic_write(APIC_INITIAL_COUNT, 0);
+
+  apic_reg_lvt_timer_t timer = apic_reg_lvt_timer(
+    (uint8_t) irq_get_vector(as->irq_num), APIC_IDLE, APIC_MASK, APIC_ONE_SHOT
+  );
+  apic_write_timer(timer);
+  return 0;
+}
+
+static int apic_alarm_source_enable(alarm_source_t *as) {
+  irq_enable_interrupt(as->irq_num);
+  apic_reg_lvt_timer_t timer = apic_read_timer();
+  timer.mask = APIC_UNMASK;
+  apic_write_timer(timer);
+  return 0;
+}
+
+static int apic_alarm_source_disable(alarm_source_t *as) {
+  apic_reg_lvt_timer_t timer = apic_read_timer();
+  timer.mask = APIC_MASK;
+  apic_write_timer(timer);
+  apic_write(APIC_INITIAL_COUNT, 0);
+  return 0;
+}
+
+// arms the timer of the current cpu. a value of zero stops it
+static int apic_alarm_source_setval(alarm_source_t *as, uint64_t value) {
+  apic_write(APIC_INITIAL_COUNT, (uint32_t) value);
+  return 0;
+}
+
+
+static alarm_source_t apic_alarm_source = {
+  .name = "apic",
+  .cap_flags = ALARM_PER_CPU|ALARM_ONE_SHOT,
+  .value_mask = UINT32_MAX,
+  .init = apic_alarm_source_init,
+  .enable = apic_alarm_source_enable,
+  .disable = apic_alarm_source_disable,
+  .setval = apic_alarm_source_setval,
+};
+
+static void apic_timer_early_init() {
+  apic_timer_freq = apic_timer_calibrate();
+  if (apic_timer_freq == 0) {
+    kprintf("[apic] timer is not running\n");
+    return;
+  }
+
+  apic_alarm_source.scale_ns = max(NS_PER_SEC / apic_timer_freq, 1);
+  kprintf("[apic] timer running at %u Hz\n", apic_timer_freq);
+  register_alarm_source(&apic_alarm_source);
+}
+EARLY_INIT(apic_timer_early_init);
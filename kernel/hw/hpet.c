@@ -410,6 +410,7 @@ void register_hpet(uint8_t id, uintptr_t address, uint16_t min_period) {
     hpet_clock_source->name = "hpet";
     hpet_clock_source->data = hpet;
     hpet_clock_source->scale_ns = hpet->clock_period_ns;
+    hpet_clock_source->freq = FS_PER_SEC / HPET_ID_CLOCK_PERIOD(id_reg);
     hpet_clock_source->last_count = hpet_read64(hpet->address, HPET_COUNT);
     hpet_clock_source->value_mask = hpet->clock_count_mask;
 
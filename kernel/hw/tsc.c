@@ -0,0 +1,177 @@
+// Time Stamp Counter (TSC) clock source
+#include <kernel/hw/tsc.h>
+#include <kernel/cpu/cpu.h>
+
+#include <kernel/clock.h>
+#include <kernel/vdso.h>
+#include <kernel/init.h>
+#include <kernel/atomic.h>
+#include <kernel/printf.h>
+#include <kernel/panic.h>
+
+#define ASSERT(x) kassert(x)
+#define DPRINTF(x, ...) kprintf("tsc: " x, ##__VA_ARGS__)
+
+#define TSC_SYNC_SAMPLES  16
+#define TSC_SYNC_SPINS    100000000 // iterations before giving up on the other cpu
+
+/*
+ * The invariant tsc runs at a constant rate in all power states which makes it
+ * the cheapest clock source to read. Its frequency is calibrated by the clock
+ * code against another source when it is selected.
+ *
+ * The tsc of each cpu is started when the cpu is reset so they are usually not
+ * in sync with each other. Each AP measures its offset from the boot cpu as it
+ * comes up and if any cpu is off by more than the measurement error the offsets
+ * are applied on every read. The cpu is identified through IA32_TSC_AUX so that
+ * the counter and the offset are always from the same cpu.
+ */
+static int64_t tsc_offsets[MAX_CPUS];
+static bool tsc_use_offsets;
+static bool tsc_has_rdtscp;
+static bool tsc_present;
+
+static struct {
+  volatile int cpu;                 // cpu currently being synced (-1 if none)
+  volatile uint32_t req;            // incremented by the target for each sample
+  volatile uint32_t ack;            // set to req by the source once it has sampled
+  volatile uint64_t source_tsc;     // tsc of the source at the last sample
+  volatile bool done;
+} tsc_sync = { .cpu = -1 };
+
+
+static int tsc_clock_enable(clock_source_t *cs) {
+  return 0;
+}
+
+static int tsc_clock_disable(clock_source_t *cs) {
+  return 0;
+}
+
+static uint64_t tsc_clock_read(clock_source_t *cs) {
+  if (!tsc_use_offsets) {
+    return cpu_rdtsc_ordered();
+  }
+
+  uint32_t cpu;
+  uint64_t tsc;
+  if (tsc_has_rdtscp) {
+    tsc = cpu_rdtscp(&cpu);
+  } else {
+    uint64_t flags = cpu_save_clear_interrupts();
+    cpu = curcpu_id;
+    tsc = cpu_rdtsc_ordered();
+    cpu_restore_interrupts(flags);
+  }
+  return tsc + tsc_offsets[cpu];
+}
+
+static clock_source_t tsc_clock_source = {
+  .name = "tsc",
+  .flags = CLOCK_SOURCE_LOCKLESS | CLOCK_SOURCE_VDSO,
+  .value_mask = UINT64_MAX,
+  .enable = tsc_clock_enable,
+  .disable = tsc_clock_disable,
+  .read = tsc_clock_read,
+};
+
+static void tsc_early_init() {
+  if (!cpuid_query_bit(CPUID_BIT_TSC) || !cpuid_query_bit(CPUID_BIT_INVARIANT_TSC)) {
+    DPRINTF("invariant tsc not supported\n");
+    return;
+  }
+
+  tsc_present = true;
+  tsc_has_rdtscp = cpuid_query_bit(CPUID_BIT_RDTSCP);
+  register_clock_source(&tsc_clock_source);
+}
+EARLY_INIT(tsc_early_init);
+
+static void tsc_percpu_init() {
+  if (cpuid_query_bit(CPUID_BIT_RDTSCP)) {
+    cpu_write_msr(IA32_TSC_AUX_MSR, curcpu_id);
+  }
+}
+PERCPU_EARLY_INIT(tsc_percpu_init);
+
+//
+
+/**
+ * Serves tsc samples to the given cpu until it has measured its offset. This is
+ * called on the boot cpu right after starting an AP.
+ */
+void tsc_sync_source(int cpu) {
+  if (!tsc_present) {
+    return;
+  }
+
+  uint64_t flags = cpu_save_clear_interrupts();
+  tsc_sync.done = false;
+  tsc_sync.req = tsc_sync.ack = 0;
+  atomic_store(&tsc_sync.cpu, cpu);
+
+  uint64_t spins = 0;
+  while (!atomic_load(&tsc_sync.done)) {
+    uint32_t req = atomic_load(&tsc_sync.req);
+    if (req != tsc_sync.ack) {
+      tsc_sync.source_tsc = cpu_rdtsc_ordered();
+      atomic_store(&tsc_sync.ack, req);
+      spins = 0;
+    } else if (++spins == TSC_SYNC_SPINS) {
+      DPRINTF("CPU#%d did not sync its tsc\n", cpu);
+      break;
+    }
+    cpu_pause();
+  }
+
+  atomic_store(&tsc_sync.cpu, -1);
+  cpu_restore_interrupts(flags);
+}
+
+/**
+ * Measures the offset of the current cpu's tsc from the boot cpu. Each sample
+ * is bracketed by two local reads and the one with the shortest round trip is
+ * used, assuming the source sampled halfway through.
+ */
+void tsc_sync_target() {
+  uint8_t cpu = curcpu_id;
+  uint64_t spins = 0;
+  while (atomic_load(&tsc_sync.cpu) != cpu) {
+    if (++spins == TSC_SYNC_SPINS) {
+      DPRINTF("CPU#%d gave up waiting for tsc sync\n", cpu);
+      return;
+    }
+    cpu_pause();
+  }
+
+  uint64_t flags = cpu_save_clear_interrupts();
+  uint64_t best_rtt = UINT64_MAX;
+  int64_t offset = 0;
+  for (int i = 0; i < TSC_SYNC_SAMPLES; i++) {
+    uint64_t t0 = cpu_rdtsc_ordered();
+    uint32_t req = atomic_fetch_add(&tsc_sync.req, 1) + 1;
+    while (atomic_load(&tsc_sync.ack) != req) {
+      cpu_pause();
+    }
+    uint64_t source = tsc_sync.source_tsc;
+    uint64_t t1 = cpu_rdtsc_ordered();
+
+    uint64_t rtt = t1 - t0;
+    if (rtt < best_rtt) {
+      best_rtt = rtt;
+      offset = (int64_t)(source - (t0 + rtt / 2));
+    }
+  }
+  atomic_store(&tsc_sync.done, true);
+  cpu_restore_interrupts(flags);
+
+  // anything within the round trip time can not be told apart from noise
+  if ((uint64_t) abs(offset) > best_rtt) {
+    tsc_offsets[cpu] = offset;
+    tsc_use_offsets = true;
+    // userspace reads the counter without the offsets
+    tsc_clock_source.flags &= ~CLOCK_SOURCE_VDSO;
+    vdso_disable_clock();
+    DPRINTF("CPU#%d tsc is off by %lld cycles\n", cpu, offset);
+  }
+}
@@ -11,49 +11,117 @@
 #include <kernel/panic.h>
 #include <kernel/printf.h>
 
+#include <kernel/cpu/cpu.h>
 #include <kernel/hw/apic.h>
 
+#define IPI_QUEUE_SIZE 16
+
+struct ipi_msg {
+  ipi_type_t type;
+  uint64_t data;
+  volatile uint32_t *ack;           // incremented when the message is received
+};
+
+/*
+ * A per-cpu queue of pending ipi messages.
+ *
+ * Senders add their message to the queue of each target before raising the
+ * interrupt and the handler drains every queued message. Identical messages
+ * that are still pending are coalesced.
+ */
+struct ipi_queue {
+  mtx_t lock;
+  uint16_t head;
+  uint16_t count;
+  struct ipi_msg msgs[IPI_QUEUE_SIZE];
+};
+
 uint8_t ipi_irqnum;
 uint8_t ipi_vectornum;
-static mtx_t ipi_lock;
-static volatile uint8_t ipi_type;
-static volatile uint64_t ipi_data;
-static volatile uint8_t ipi_ack;
+static struct ipi_queue ipi_queues[MAX_CPUS];
+
+static bool ipi_dequeue(struct ipi_queue *queue, struct ipi_msg *msg) {
+  mtx_spin_lock(&queue->lock);
+  if (queue->count == 0) {
+    mtx_spin_unlock(&queue->lock);
+    return false;
+  }
+
+  *msg = queue->msgs[queue->head];
+  queue->head = (queue->head + 1) % IPI_QUEUE_SIZE;
+  queue->count--;
+  mtx_spin_unlock(&queue->lock);
+  return true;
+}
+
+static int ipi_enqueue(uint8_t cpu_id, ipi_type_t type, uint64_t data, volatile uint32_t *ack) {
+  struct ipi_queue *queue = &ipi_queues[cpu_id];
+  mtx_spin_lock(&queue->lock);
+  for (int i = 0; i < queue->count; i++) {
+    struct ipi_msg *msg = &queue->msgs[(queue->head + i) % IPI_QUEUE_SIZE];
+    if (msg->type == type && msg->data == data && msg->ack == NULL && ack == NULL) {
+      mtx_spin_unlock(&queue->lock);
+      return 0;
+    }
+  }
+
+  if (queue->count == IPI_QUEUE_SIZE) {
+    mtx_spin_unlock(&queue->lock);
+    return -1;
+  }
+
+  struct ipi_msg *msg = &queue->msgs[(queue->head + queue->count) % IPI_QUEUE_SIZE];
+  msg->type = type;
+  msg->data = data;
+  msg->ack = ack;
+  queue->count++;
+  mtx_spin_unlock(&queue->lock);
+  return 0;
+}
 
 __used void ipi_handler(struct trapframe *frame) {
-  uint8_t type = ipi_type;
-  uint64_t data = ipi_data;
-  kassert(type < NUM_IPIS);
-  atomic_fetch_add(&ipi_ack, 1);
-
-  // kprintf("[CPU#%d] ipi %d\n", curcpu_id, type);
-  switch (type) {
-    case IPI_PANIC:
-      if (data != 0) {
-        if (!is_kernel_code_ptr(data)) {
-          kprintf("CPU#%d IPI panic - bad handler!\n", curcpu_id);
-        } else {
-          ((irq_handler_t)((void *) data))(frame);
+  struct ipi_queue *queue = &ipi_queues[curcpu_id];
+  struct ipi_msg msg;
+  while (ipi_dequeue(queue, &msg)) {
+    ipi_type_t type = msg.type;
+    uint64_t data = msg.data;
+    kassert(type < NUM_IPIS);
+    if (msg.ack != NULL) {
+      atomic_fetch_add(msg.ack, 1);
+    }
+
+    // kprintf("[CPU#%d] ipi %d\n", curcpu_id, type);
+    switch (type) {
+      case IPI_PANIC:
+        if (data != 0) {
+          if (!is_kernel_code_ptr(data)) {
+            kprintf("CPU#%d IPI panic - bad handler!\n", curcpu_id);
+          } else {
+            ((irq_handler_t)((void *) data))(frame);
+          }
         }
-      }
-      WHILE_TRUE;
-      unreachable;
-    case IPI_INVLPG:
-      todo("IPI_INVLPG");
-      break;
-    case IPI_SCHEDULE:
-      sched_again((sched_reason_t)data);
-      break;
-    case IPI_NOOP:
-      break;
-    default: unreachable;
+        WHILE_TRUE;
+        unreachable;
+      case IPI_INVLPG:
+        tlb_shootdown_handler();
+        break;
+      case IPI_SCHEDULE:
+        sched_again((sched_reason_t)data);
+        break;
+      case IPI_NOOP:
+        break;
+      default: unreachable;
+    }
   }
 }
 
 static void ipi_static_init() {
-  mtx_init(&ipi_lock, MTX_SPIN, "ipi_lock");
+  for (int i = 0; i < MAX_CPUS; i++) {
+    mtx_init(&ipi_queues[i].lock, MTX_SPIN, "ipi_queue_lock");
+  }
+
   ipi_irqnum = irq_must_reserve_irqnum(MAX_IRQ-1);
-  ipi_vectornum = (uint8_t) irq_get_vector(ipi_vectornum);
+  ipi_vectornum = (uint8_t) irq_get_vector(ipi_irqnum);
 
   if (irq_register_handler(ipi_irqnum, ipi_handler, NULL) < 0) {
     panic("failed to register ipi handler");
@@ -65,30 +133,15 @@ STATIC_INIT(ipi_static_init);
 
 int ipi_deliver_cpu_id(ipi_type_t type, uint8_t cpu_id, uint64_t data) {
   kassert(type < NUM_IPIS);
-  if (cpu_id > system_num_cpus) {
+  if (cpu_id >= system_num_cpus) {
     return -1;
   }
 
   // kprintf("[CPU#%d] delivering ipi to CPU#%d\n", PERCPU_ID, cpu_id);
-
-  // we cant use spin_lock here because it disables interrupts which might be coming
-  // from another cpu holding the lock
-  while (!mtx_spin_trylock(&ipi_lock)) {
-    cpu_pause();
+  if (ipi_enqueue(cpu_id, type, data, NULL) < 0) {
+    return -1;
   }
-  ipi_type = type;
-  ipi_data = data;
-  ipi_ack = 0;
-
   apic_write_icr(APIC_DM_FIXED | APIC_LVL_ASSERT | ipi_vectornum, cpu_id);
-
-  // cpu_enable_interrupts();
-  // while (*((volatile uint8_t *)(&ipi_ack)) != 1) {
-  //   cpu_pause();
-  // }
-  // cpu_disable_interrupts();
-
-  mtx_spin_unlock(&ipi_lock);
   return 0;
 }
 
@@ -97,32 +150,44 @@ int ipi_deliver_mode(ipi_type_t type, ipi_mode_t mode, uint64_t data) {
   kprintf("[CPU#%d] delivering ipi using mode %d\n", PERCPU_ID, mode);
 
   uint32_t apic_flags;
-  uint32_t num_acks;
   switch (mode) {
     case IPI_SELF:
       apic_flags = APIC_DS_SELF;
-      num_acks = 1;
       break;
     case IPI_ALL_INCL:
       apic_flags = APIC_DS_ALLINC;
-      num_acks = system_num_cpus;
       break;
     case IPI_ALL_EXCL:
       apic_flags = APIC_DS_ALLBUT;
-      num_acks = system_num_cpus - 1;
       break;
     default:
       panic("invalid ipi mode");
   }
 
-  mtx_spin_lock(&ipi_lock);
-  ipi_type = type;
-  ipi_data = data;
-  ipi_ack = 0;
+  volatile uint32_t acks = 0;
+  uint32_t num_acks = 0;
+  uint8_t self = curcpu_id;
+  int res = 0;
+  for (uint8_t cpu = 0; cpu < system_num_cpus; cpu++) {
+    if ((mode == IPI_SELF && cpu != self) || (mode == IPI_ALL_EXCL && cpu == self)) {
+      continue;
+    }
+    if (ipi_enqueue(cpu, type, data, &acks) < 0) {
+      // the cpus queued so far hold a pointer to acks so they still have to be
+      // interrupted and waited on before we can return
+      res = -1;
+      break;
+    }
+    num_acks++;
+  }
+
+  if (num_acks == 0) {
+    return res;
+  }
+
   apic_write_icr(APIC_DM_FIXED | APIC_LVL_ASSERT | apic_flags | ipi_vectornum, 0);
-  while (ipi_ack != num_acks) {
+  while (acks != num_acks) {
     cpu_pause();
   }
-  mtx_spin_unlock(&ipi_lock);
-  return 0;
+  return res;
 }
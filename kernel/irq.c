@@ -4,6 +4,7 @@
 
 #include <kernel/irq.h>
 #include <kernel/mutex.h>
+#include <kernel/sched.h>
 #include <kernel/printf.h>
 #include <kernel/panic.h>
 
@@ -64,6 +65,7 @@ static struct isa_irq_override irq_isa_overrides[NUM_ISA_IRQS];
 
 
 void page_fault_handler(struct trapframe *frame);
+void fpu_nm_handler(struct trapframe *frame);
 
 __used noreturn void double_fault_handler() {
   kprintf_kputs("!!! DOUBLE FAULT !!!\n");
@@ -80,6 +82,10 @@ __used void interrupt_handler(struct trapframe *frame) {
 
 LABEL(handled_interrupt);
   apic_send_eoi();
+  // a handler may have asked for the current thread to be preempted. the switch
+  // only happens after the eoi so the vector is not left in service while the
+  // next thread runs
+  sched_preempt_check();
 }
 
 noreturn void default_exception_handler(struct trapframe *frame) {
@@ -172,6 +178,8 @@ void irq_init() {
   for (int i = 0; i < NUM_EXCEPTS; i++) {
     if (i == CPU_EXCEPTION_PF) {
       handlers[i].handler = page_fault_handler;
+    } else if (i == CPU_EXCEPTION_NM) {
+      handlers[i].handler = fpu_nm_handler;
     } else {
       handlers[i].handler = default_exception_handler;
     }
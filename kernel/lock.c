@@ -5,12 +5,21 @@
 #include <kernel/lock.h>
 #include <kernel/proc.h>
 #include <kernel/tqueue.h>
+#include <kernel/atomic.h>
+#include <kernel/printf.h>
 #include <kernel/panic.h>
 
+#include <sort.h>
+
 #define ASSERT(x) kassert(x)
 
 #define MAX_CLAIMS 8
 
+#define LOCK_STATS_SIZE 512 // must be power of 2
+#define LOCK_STATS_HASH(lock) ((((uintptr_t)(lock) >> 4) * 0x9E3779B97F4A7C15ULL) >> 55)
+#define LOCK_STATS_DUMP_MAX 32
+#define LOCK_STATS_DEAD ((struct lock_object *) 1) // entry of a destroyed lock
+
 /*
  * A lock claim is a record of a lock held by an owner.
  */
@@ -88,6 +97,139 @@ void lock_claim_list_remove(struct lock_claim_list *list, struct lock_object *lo
   panic("lock_claim_list_remove() on unowned lock");
 }
 
+// MARK: lock stats
+
+static struct lock_stats lock_stats_table[LOCK_STATS_SIZE];
+static struct lock_stats *lock_stats_sorted[LOCK_STATS_SIZE];
+static uint64_t lock_stats_dropped; // contentions not recorded because the table was full
+
+static struct lock_stats *lock_stats_claim(struct lock_stats *stats, struct lock_object *old, struct lock_object *lock) {
+  if (atomic_cmpxchg(&stats->lock, old, lock)) {
+    stats->name = lock->name;
+    return stats;
+  } else if (atomic_load(&stats->lock) == lock) {
+    return stats; // claimed by another cpu contending on the same lock
+  }
+  return NULL;
+}
+
+static struct lock_stats *lock_stats_lookup(struct lock_object *lock, bool create) {
+  struct lock_stats *dead = NULL;
+  struct lock_stats *stats = NULL;
+  uint32_t i = LOCK_STATS_HASH(lock) & (LOCK_STATS_SIZE - 1);
+  for (int n = 0; n < LOCK_STATS_SIZE; n++, i = (i + 1) & (LOCK_STATS_SIZE - 1)) {
+    struct lock_stats *entry = &lock_stats_table[i];
+    struct lock_object *entry_lock = atomic_load(&entry->lock);
+    if (entry_lock == lock) {
+      return entry;
+    } else if (entry_lock == LOCK_STATS_DEAD) {
+      // freed entries keep the probe chain intact and are reused first
+      if (dead == NULL) {
+        dead = entry;
+      }
+      continue;
+    } else if (entry_lock != NULL) {
+      continue;
+    }
+
+    if (!create) {
+      return NULL;
+    } else if (dead != NULL) {
+      break;
+    }
+    if ((stats = lock_stats_claim(entry, NULL, lock)) != NULL) {
+      return stats;
+    }
+    // the entry was taken by another lock so keep probing
+  }
+
+  if (create && dead != NULL) {
+    return lock_stats_claim(dead, LOCK_STATS_DEAD, lock);
+  }
+  return NULL;
+}
+
+void lock_stats_record_acquire(struct lock_object *lock) {
+  struct lock_stats *stats = lock_stats_lookup(lock, false);
+  if (stats != NULL) {
+    atomic_fetch_add(&stats->acquisitions, 1);
+  }
+}
+
+void lock_stats_record_contention(struct lock_object *lock, uint64_t spin_ns, uint64_t sleep_ns) {
+  struct lock_stats *stats = lock_stats_lookup(lock, true);
+  if (stats == NULL) {
+    atomic_fetch_add(&lock_stats_dropped, 1);
+    return;
+  }
+
+  if (!(lock->flags & LO_CONTENDED)) {
+    atomic_fetch_or(&lock->flags, LO_CONTENDED);
+  }
+  atomic_fetch_add(&stats->acquisitions, 1);
+  atomic_fetch_add(&stats->contended, 1);
+  atomic_fetch_add(&stats->spin_ns, spin_ns);
+  atomic_fetch_add(&stats->sleep_ns, sleep_ns);
+}
+
+/**
+ * Releases the stats entry of a lock that is being destroyed so that the entry
+ * can be reused and a new lock at the same address does not inherit its stats.
+ */
+void lock_stats_remove(struct lock_object *lock) {
+  if (!(lock->flags & LO_CONTENDED)) {
+    return; // the lock never had an entry
+  }
+
+  struct lock_stats *stats = lock_stats_lookup(lock, false);
+  if (stats == NULL) {
+    return;
+  }
+  stats->name = NULL;
+  stats->acquisitions = 0;
+  stats->contended = 0;
+  stats->spin_ns = 0;
+  stats->sleep_ns = 0;
+  atomic_store(&stats->lock, LOCK_STATS_DEAD);
+}
+
+int lock_stats_get(struct lock_object *lock, struct lock_stats *stats) {
+  struct lock_stats *entry = lock_stats_lookup(lock, false);
+  if (entry == NULL) {
+    return -1;
+  }
+  *stats = *entry;
+  return 0;
+}
+
+static int lock_stats_cmp(const void *a, const void *b) {
+  const struct lock_stats *sa = *(struct lock_stats *const *) a;
+  const struct lock_stats *sb = *(struct lock_stats *const *) b;
+  uint64_t wa = sa->spin_ns + sa->sleep_ns;
+  uint64_t wb = sb->spin_ns + sb->sleep_ns;
+  return wa < wb ? 1 : (wa > wb ? -1 : 0);
+}
+
+void lock_stats_dump() {
+  size_t count = 0;
+  for (int i = 0; i < LOCK_STATS_SIZE; i++) {
+    struct lock_object *lock = lock_stats_table[i].lock;
+    if (lock != NULL && lock != LOCK_STATS_DEAD) {
+      lock_stats_sorted[count++] = &lock_stats_table[i];
+    }
+  }
+
+  // most time spent waiting first
+  qsort(lock_stats_sorted, count, sizeof(struct lock_stats *), lock_stats_cmp);
+  kprintf("lock stats: %zu contended locks (%llu dropped)\n", count, lock_stats_dropped);
+  for (size_t i = 0; i < count && i < LOCK_STATS_DUMP_MAX; i++) {
+    struct lock_stats *stats = lock_stats_sorted[i];
+    kprintf("  %-24s %p: acquisitions = %llu, contended = %llu, spin = %llu us, sleep = %llu us\n",
+            stats->name, stats->lock, stats->acquisitions, stats->contended,
+            stats->spin_ns / NS_PER_USEC, stats->sleep_ns / NS_PER_USEC);
+  }
+}
+
 // MARK: spin delay
 
 int spin_delay_wait(struct spin_delay *delay) {
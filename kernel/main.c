@@ -6,6 +6,7 @@
 #include <kernel/irq.h>
 #include <kernel/init.h>
 #include <kernel/clock.h>
+#include <kernel/timer.h>
 #include <kernel/mm.h>
 #include <kernel/fs.h>
 #include <kernel/exec.h>
@@ -16,6 +17,7 @@
 
 #include <kernel/acpi/acpi.h>
 #include <kernel/cpu/cpu.h>
+#include <kernel/hw/tsc.h>
 #include <kernel/debug/debug.h>
 
 #include <kernel/printf.h>
@@ -58,9 +60,11 @@ __used void kmain() {
   debug_init();
   cpu_late_init();
 
-  // initialize the irq layer and timekeeping so the static initializers can use them.
+  // initialize the irq layer, timekeeping and the timer queue of the boot cpu so the
+  // static initializers can use them.
   irq_init();
   clock_init();
+  timer_init();
   // then run the static initializers.
   do_static_initializers();
 
@@ -105,8 +109,10 @@ __used void ap_main() {
   cpu_early_init();
   do_percpu_initializers();
   kprintf("[CPU#%d] initializing\n", curcpu_id);
+  tsc_sync_target();
 
   init_ap_address_space();
+  timer_init();
 
   kprintf("[CPU#%d] done!\n", curcpu_id);
 
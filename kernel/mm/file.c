@@ -12,14 +12,19 @@
 
 
 static __ref page_t *anon_getpage_missing(vm_file_t *file, size_t off) {
+  if (file->pg_size != PAGE_SIZE) {
+    // let the caller fall back to smaller pages
+    return try_alloc_pages_size(1, file->pg_size);
+  }
   return alloc_pages_size(1, file->pg_size);
 }
 
 static __ref page_t *vnode_getpage_missing(vm_file_t *file, size_t off) {
   int res;
-  page_t *page;
+  page_t *page = NULL;
   vnode_t *vn = file->vnode;
-  if ((res = vn_getpage(vn, (off_t) off, /*pgcache=*/false, &page)) < 0) {
+  // the page is inserted into the shared vnode cache under the vnode lock
+  if ((res = vn_getpage(vn, (off_t) off, /*pgcache=*/true, &page)) < 0) {
     return NULL;
   }
   return page;
@@ -87,7 +92,7 @@ __ref page_t *vm_file_getpage(vm_file_t *file, size_t off) {
   page_t *page = pgcache_lookup(file->pgcache, off);
   if (page == NULL) {
     page = file->missing_page(file, off);
-    if (page != NULL) {
+    if (page != NULL && file->vnode == NULL) {
       pgcache_insert(file->pgcache, off, getref(page), NULL);
     }
   }
@@ -3,303 +3,155 @@
 //
 
 #include <kernel/mm/heap.h>
-#include <kernel/mm/init.h>
-#include <kernel/mm/pgtable.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/pmalloc.h>
+#include <kernel/mm/vmalloc.h>
 
+#include <kernel/percpu.h>
+#include <kernel/atomic.h>
 #include <kernel/printf.h>
 #include <kernel/string.h>
 #include <kernel/panic.h>
-#include <kernel/mutex.h>
-
-
-#define END_ADDR(heap) ((heap)->virt_addr + (heap)->size)
 
+#define ASSERT(x) kassert(x)
+
+/*
+ * The kernel heap.
+ *
+ * Small allocations are served from a set of size class caches which are
+ * backed by the slab allocator so the common path is a per-cpu magazine hit
+ * that does not take any locks. Classes are spaced at quarter steps between
+ * powers of two above 64 bytes which keeps internal fragmentation under 25%.
+ * The power of two classes are naturally aligned which is what kmalloca relies
+ * on. Allocations larger than the biggest class are mapped directly into kernel
+ * space.
+ */
 mm_heap_t kheap;
-mtx_t kheap_lock;
 
-static const char *hist_labels[9] = {
-  "0-8", "9-16", "17-32", "33-64", "65-128", "129-512", "513-1024", "larger"
+static const uint16_t kmalloc_sizes[KMALLOC_NUM_CLASSES] = {
+  8, 16, 24, 32, 48, 64,
+  80, 96, 112, 128,
+  160, 192, 224, 256,
+  320, 384, 448, 512,
+  640, 768, 896, 1024,
+  1280, 1536, 1792, 2048,
+  2560, 3072, 3584, 4096,
+  5120, 6144, 7168, 8192,
 };
 
+static char kmalloc_names[KMALLOC_NUM_CLASSES][16];
 
-static inline int get_hist_bucket(size_t size) {
-  switch (size) {
-    case 1 ... 8: return 0;
-    case 9 ... 16: return 1;
-    case 17 ... 32: return 2;
-    case 33 ... 64: return 3;
-    case 65 ... 128: return 4;
-    case 129 ... 512: return 5;
-    case 513 ... 1024: return 6;
-    default: return 7;
-  }
-}
-
-static inline mm_chunk_t *get_prev_chunk(mm_chunk_t *chunk) {
-  if (chunk->prev_offset == 0) {
-    return NULL;
+static inline int size_to_class(size_t size) {
+  ASSERT(size > 0 && size <= KMALLOC_MAX_SIZE);
+  if (size <= 32) {
+    return (int)((size - 1) >> 3);
+  } else if (size <= 64) {
+    return size <= 48 ? 4 : 5;
   }
 
-  mm_chunk_t *prev = offset_ptr(chunk, -chunk->prev_offset);
-  if (prev->magic != CHUNK_MAGIC) {
-    panic("[get_prev_chunk] chunk magic is invalid");
-  }
-  return prev;
+  // sizes in (2^shift, 2^(shift+1)] are split into four classes
+  int shift = 63 - __builtin_clzll(size - 1);
+  int step = (int)((size - 1 - (1ULL << shift)) >> (shift - 2));
+  return 6 + (shift - 6) * 4 + step;
 }
 
-static inline mm_chunk_t *get_next_chunk(mm_heap_t *heap, mm_chunk_t *chunk) {
-  if (chunk == heap->last_chunk) {
-    return NULL;
-  }
-
-  uintptr_t next_addr = offset_addr(chunk, sizeof(mm_chunk_t) + chunk->size);
-  if (next_addr < END_ADDR(heap) && ((uint16_t *) next_addr)[0] == HOLE_MAGIC) {
-    uint16_t hole_size = ((uint16_t *) next_addr)[1];
-    next_addr += hole_size;
-  }
-
-  if (next_addr >= END_ADDR(heap)) {
-    return NULL;
+static void *kmalloc_large(size_t size) {
+  if (__expect_false(curspace == NULL)) {
+    panic("[kmalloc] large allocation before the address space is initialized (%zu)\n", size);
   }
 
-  mm_chunk_t *next = (void *) next_addr;
-  if (next->magic != CHUNK_MAGIC) {
-    panic("[get_next_chunk] chunk magic is invalid");
+  // unlike vmalloc the pages are allocated up front so heap memory never faults
+  size = page_align(size);
+  page_t *pages = alloc_pages(SIZE_TO_PAGES(size));
+  if (pages == NULL) {
+    panic("[kmalloc] error - out of memory (%zu)\n", size);
   }
-  return next;
-}
 
-static inline void aquire_heap(mm_heap_t *heap) {
-  // curthread will only be null for the earliest of allocations
-  if (__expect_false(curthread == NULL)) {
-    mtx_spin_lock(&kheap_lock);
-  } else {
-    mtx_lock(&heap->lock);
+  uintptr_t vaddr = vmap_pages(moveref(pages), 0, size, VM_RDWR|VM_MALLOC, "kmalloc");
+  if (vaddr == 0) {
+    panic("[kmalloc] error - failed to map large allocation (%zu)\n", size);
   }
-}
 
-static inline void release_heap(mm_heap_t *heap) {
-  if (__expect_false(curthread == NULL)) {
-    mtx_spin_unlock(&kheap_lock);
-  } else {
-    mtx_unlock(&heap->lock);
-  }
+  atomic_fetch_add(&kheap.stats.large_alloc_count, 1);
+  return (void *) vaddr;
 }
 
 // ----- heap creation -----
 
 void mm_init_kheap() {
-  size_t page_count = SIZE_TO_PAGES(KERNEL_HEAP_SIZE);
-  uintptr_t phys_addr = mm_early_alloc_pages(page_count);
-  uintptr_t virt_addr = KERNEL_HEAP_VA;
-  if (KERNEL_HEAP_SIZE >= BIGPAGE_SIZE && is_aligned(phys_addr, BIGPAGE_SIZE)) {
-    uintptr_t num_bigpages = KERNEL_HEAP_SIZE / BIGPAGE_SIZE;
-    page_count = PAGES_TO_SIZE(page_count) % BIGPAGE_SIZE;
-    early_map_entries(virt_addr, phys_addr, num_bigpages, VM_RDWR|VM_HUGE_2MB);
-    phys_addr += num_bigpages * BIGPAGE_SIZE;
-    virt_addr += num_bigpages * BIGPAGE_SIZE;
-  }
+  memset(&kheap, 0, sizeof(mm_heap_t));
+  for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+    size_t size = kmalloc_sizes[i];
+    size_t alignment = is_pow2(size) ? min(size, PAGE_SIZE) : KMALLOC_MIN_SIZE;
+    ASSERT(size_to_class(size) == i);
 
-  if (page_count > 0) {
-    early_map_entries(virt_addr, phys_addr, page_count, VM_RDWR);
+    ksnprintf(kmalloc_names[i], sizeof(kmalloc_names[i]), "kmalloc-%zu", size);
+    kheap.classes[i] = kmem_cache_create(kmalloc_names[i], size, alignment, 0);
+    kheap.stats.classes[i].size = size;
   }
 
-  memset(&kheap, 0, sizeof(mm_heap_t));
-  kheap.phys_addr = phys_addr;
-  kheap.virt_addr = KERNEL_HEAP_VA;
-  kheap.size = KERNEL_HEAP_SIZE;
-  kheap.used = 0;
-  kheap.last_chunk = NULL;
-  LIST_INIT(&kheap.chunks);
-  mtx_init(&kheap_lock, MTX_SPIN|MTX_RECURSIVE, "kheap_lock");
-  mtx_init(&kheap.lock, MTX_RECURSIVE, "kheap_mutex");
-
   kprintf("initialized kernel heap\n");
 }
 
-uintptr_t kheap_phys_addr() {
-  return kheap.phys_addr;
-}
-
 // ----- kmalloc -----
 
-void *__kmalloc(mm_heap_t *heap, size_t size, size_t alignment) {
-  kassert(heap != NULL);
-  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
-    panic("[kmalloc] invalid alignment given: %zu\n", alignment);
-  }
-
+void *kmalloc(size_t size) {
   if (size == 0) {
     return NULL;
-  } else if (size > CHUNK_MAX_SIZE) {
-    panic("[kmalloc] error - request too large (%zu)\n", size);
+  } else if (size > KMALLOC_MAX_SIZE) {
+    return kmalloc_large(size);
   }
+  return kmem_cache_alloc(kheap.classes[size_to_class(size)]);
+}
 
-  aquire_heap(heap);
-  heap->stats.alloc_count++;
-  heap->stats.alloc_sizes[get_hist_bucket(size)]++;
-  size = align(max(size, CHUNK_MIN_SIZE), CHUNK_SIZE_ALIGN);
-
-  // search for the best fitting chunk. If one is not found,
-  // we will create a new chunk in the unmanaged heap memory.
-  if (LIST_FIRST(&heap->chunks)) {
-    // kprintf("[kmalloc] searching used chunks\n");
-    mm_chunk_t *chunk = NULL;
-    mm_chunk_t *curr = NULL;
-    LIST_FOREACH(curr, &heap->chunks, list) {
-      // check if chunk is properly aligned
-      if (offset_addr(curr, sizeof(mm_chunk_t)) % alignment != 0) {
-        continue;
-      }
-
-      if (curr->size >= size) {
-        if (chunk == NULL || (curr->size < chunk->size)) {
-          chunk = curr;
-        }
-      } else if (curr->size == size) {
-        // if current chunk is exact match use it right away
-        chunk = curr;
-        break;
-      }
-    }
-
-    if (chunk != NULL) {
-      // kprintf("[kmalloc] used chunk found (size %d)\n", chunk->size);
-      // if a chunk was found remove it from the list
-      LIST_REMOVE(&heap->chunks, chunk, list);
-      chunk->free = false;
-
-      heap->used += size + sizeof(mm_chunk_t);
-      release_heap(heap);
-      return offset_ptr(chunk, sizeof(mm_chunk_t));
-    }
-  }
-
-  // kprintf("[kmalloc] creating new chunk\n");
-  // if we get this far it means that no existing chunk could
-  // fit the requested size therefore a new chunk must be made.
-
-  // create new chunk
-  uintptr_t chunk_addr;
-  if (heap->last_chunk == NULL) {
-    chunk_addr = heap->virt_addr;
-  } else {
-    chunk_addr = offset_addr(heap->last_chunk, sizeof(mm_chunk_t) + heap->last_chunk->size);
+void *kmallocz(size_t size) {
+  void *p = kmalloc(size);
+  if (p) {
+    memset(p, 0, size);
   }
+  return p;
+}
 
-  // fix alignment
-  uintptr_t aligned_mem = align(chunk_addr + sizeof(mm_chunk_t), alignment);
-  uintptr_t aligned_chunk = aligned_mem - sizeof(mm_chunk_t);
-
-  if (aligned_chunk != chunk_addr) {
-    size_t hole_size = aligned_chunk - chunk_addr;
-    if (hole_size < sizeof(mm_chunk_t) + CHUNK_MIN_SIZE) {
-      // we can't create a new chunk here, so we need to create a hole
-      ((uint16_t *) chunk_addr)[0] = HOLE_MAGIC;
-      ((uint16_t *) chunk_addr)[1] = hole_size;
-      heap->used += hole_size;
-    } else {
-      // create a new free chunk
-      mm_chunk_t *free_chunk = (void *) chunk_addr;
-      free_chunk->magic = CHUNK_MAGIC;
-      free_chunk->size = hole_size - sizeof(mm_chunk_t);
-      free_chunk->free = true;
-      LIST_ADD_FRONT(&heap->chunks, free_chunk, list);
-    }
+void *kmalloca(size_t size, size_t alignment) {
+  if (alignment == 0 || !is_pow2(alignment)) {
+    panic("[kmalloca] invalid alignment given: %zu\n", alignment);
+  } else if (alignment > PAGE_SIZE) {
+    panic("[kmalloca] unsupported alignment: %zu\n", alignment);
   }
 
-  if (aligned_mem + size > END_ADDR(heap)) {
-    kprintf("heap: allocation overflows end of heap: %p (size=%zu, align=%zu)\n", aligned_mem, size, alignment);
-    kprintf("heap: heap out of memory\n");
-    kprintf("      virt_addr = %p\n", heap->virt_addr);
-    kprintf("      size = %zu\n", heap->size);
-    kprintf("      used = %zu\n", heap->used);
-    kprintf("      alloc count = %zu\n", heap->stats.alloc_count);
-    kprintf("      free count = %zu\n", heap->stats.free_count);
-
-    kprintf("      request_sizes:\n");
-    for (int i = 0; i < ARRAY_SIZE(hist_labels); i++) {
-      kprintf("        %s - %zu\n", hist_labels[i], heap->stats.alloc_sizes[i]);
-    }
-
-    panic("[kmalloc] error - out of memory");
+  if (size == 0) {
+    return NULL;
+  } else if (alignment <= KMALLOC_MIN_SIZE || size > KMALLOC_MAX_SIZE) {
+    // every class is 8 byte aligned and large allocations are page aligned
+    return kmalloc(size);
   }
 
-  mm_chunk_t *chunk = (void *) aligned_chunk;
-  chunk->magic = CHUNK_MAGIC;
-  chunk->size = size;
-  chunk->free = false;
-  chunk->list.next = NULL;
-  chunk->list.prev = NULL;
-  if (heap->last_chunk != NULL) {
-    // chunk->prev_size = heap->last_chunk->size;
-    // chunk->prev_free = heap->last_chunk->free;
-    chunk->prev_offset = aligned_chunk - (uintptr_t) heap->last_chunk;
-  } else {
-    // chunk->prev_size = 0;
-    // chunk->prev_free = false;
-    chunk->prev_offset = 0;
+  // the power of two classes are naturally aligned
+  size = max(size, alignment);
+  if (!is_pow2(size)) {
+    size = 1ULL << (64 - __builtin_clzll(size - 1));
   }
-
-  heap->last_chunk = chunk;
-  heap->used += size + sizeof(mm_chunk_t);
-
-  release_heap(heap);
-  return offset_ptr(chunk, sizeof(mm_chunk_t));
-}
-
-void *kmalloc(size_t size) {
-  return __kmalloc(&kheap, size, CHUNK_MIN_ALIGN);
-}
-
-void *kmallocz(size_t size) {
-  void *p = __kmalloc(&kheap, size, CHUNK_MIN_ALIGN);
-  memset(p, 0, size);
-  return p;
-}
-
-void *kmalloca(size_t size, size_t alignment) {
-  return __kmalloc(&kheap, size, alignment);
+  return kmalloc(size);
 }
 
 // ----- kfree -----
 
-void __kfree(mm_heap_t *heap, void *ptr) {
-  kassert(heap != NULL);
+void kfree(void *ptr) {
   if (ptr == NULL) {
     return;
   }
 
-  heap->stats.free_count++;
-
-  mm_chunk_t *chunk = offset_ptr(ptr, -sizeof(mm_chunk_t));
-  if (chunk->magic != CHUNK_MAGIC) {
-    kprintf("[kfree] invalid pointer\n");
+  kmem_cache_t *cache = kmem_ptr_to_cache(ptr);
+  if (cache != NULL) {
+    kmem_cache_free(cache, ptr);
     return;
-  } else if (chunk->free) {
-    kprintf("[kfree] freeing already freed chunk\n");
+  } else if (kmem_is_slab_ptr(ptr)) {
+    kprintf("[kfree] invalid pointer %p\n", ptr);
     return;
   }
 
-  aquire_heap(heap);
-  if (!(LIST_NEXT(chunk, list) == NULL && LIST_PREV(chunk, list) == NULL)) {
-    panic("[kfree] error - chunk linked to other chunks");
-  }
-
-  // kprintf("[kfree] freeing pointer %p\n", ptr);
-  chunk->free = true;
-  mm_chunk_t *next_chunk = get_next_chunk(heap, chunk);
-  if (next_chunk != NULL) {
-    // next_chunk->prev_free = true;
-  }
-
-  LIST_ADD_FRONT(&heap->chunks, chunk, list);
-  heap->used -= chunk->size + sizeof(mm_chunk_t);
-  release_heap(heap);
-}
-
-void kfree(void *ptr) {
-  __kfree(&kheap, ptr);
+  atomic_fetch_add(&kheap.stats.large_free_count, 1);
+  vfree(ptr);
 }
 
 // ----- kcalloc -----
@@ -309,8 +161,8 @@ void *kcalloc(size_t nmemb, size_t size) {
     return NULL;
   }
 
-  size_t total = nmemb * size;
-  if (total > CHUNK_MAX_SIZE) {
+  size_t total;
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
     panic("[kcalloc] error - request too large (%zu, %zu)\n", nmemb, size);
   }
 
@@ -324,38 +176,73 @@ void *kcalloc(size_t nmemb, size_t size) {
 // --------------------
 
 int kheap_is_valid_ptr(void *ptr) {
-  uintptr_t chunk_addr = offset_addr(ptr, -sizeof(mm_chunk_t));
-  if (chunk_addr < kheap.virt_addr || chunk_addr > END_ADDR(&kheap)) {
-    return false;
-  }
+  if (kmem_is_slab_ptr(ptr)) {
+    kmem_cache_t *cache = kmem_ptr_to_cache(ptr);
+    if (cache == NULL) {
+      return false;
+    }
 
-  mm_chunk_t *chunk = (void *) chunk_addr;
-  if (chunk->magic != CHUNK_MAGIC) {
+    for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+      if (kheap.classes[i] == cache) {
+        return true;
+      }
+    }
     return false;
   }
-  return true;
+
+  // large allocations are page aligned and mapped
+  return is_aligned((uintptr_t) ptr, PAGE_SIZE) && vm_virt_to_phys((uintptr_t) ptr) != 0;
 }
 
 uintptr_t kheap_ptr_to_phys(void *ptr) {
-  if ((uintptr_t) ptr == KERNEL_HEAP_VA) {
-    return kheap.phys_addr;
-  }
-
   kassert(kheap_is_valid_ptr(ptr));
-  size_t offset = ((uintptr_t) ptr) - kheap.virt_addr;
-  return kheap.phys_addr + offset;
+  if (kmem_is_slab_ptr(ptr)) {
+    return kmem_ptr_to_phys(ptr);
+  }
+  // large allocations are only physically contiguous within a page
+  return vm_virt_to_phys((uintptr_t) ptr);
 }
 
 //
 
+static void kheap_update_stats() {
+  kheap.size = 0;
+  kheap.used = 0;
+  kheap.stats.alloc_count = kheap.stats.large_alloc_count;
+  kheap.stats.free_count = kheap.stats.large_free_count;
+  for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+    if (kheap.classes[i] == NULL) {
+      continue; // not initialized yet
+    }
+
+    struct kmem_cache_stats stats;
+    kmem_cache_get_stats(kheap.classes[i], &stats);
+
+    kheap.stats.classes[i].active = stats.active - stats.cached;
+    kheap.stats.classes[i].cached = stats.cached;
+    kheap.stats.classes[i].alloc_count = stats.allocs;
+    kheap.stats.classes[i].free_count = stats.frees;
+    kheap.stats.alloc_count += stats.allocs;
+    kheap.stats.free_count += stats.frees;
+    kheap.size += stats.num_slabs * stats.slab_size;
+    kheap.used += (stats.active - stats.cached) * stats.obj_size;
+  }
+}
+
 void kheap_dump_stats() {
+  kheap_update_stats();
   kprintf("  size = %zu\n", kheap.size);
   kprintf("  used = %zu\n", kheap.used);
   kprintf("  alloc count = %zu\n", kheap.stats.alloc_count);
   kprintf("  free count = %zu\n", kheap.stats.free_count);
-
-  kprintf("  request_sizes:\n");
-  for (int i = 0; i < 8; i++) {
-    kprintf("    %s - %zu\n", hist_labels[i], kheap.stats.alloc_sizes[i]);
+  kprintf("  large alloc count = %zu\n", kheap.stats.large_alloc_count);
+  kprintf("  large free count = %zu\n", kheap.stats.large_free_count);
+  for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+    if (kheap.stats.classes[i].alloc_count == 0) {
+      continue;
+    }
+    kprintf("  class %-5zu: active = %zu, cached = %zu, allocs = %zu, frees = %zu\n",
+            kheap.stats.classes[i].size, kheap.stats.classes[i].active, kheap.stats.classes[i].cached,
+            kheap.stats.classes[i].alloc_count, kheap.stats.classes[i].free_count);
   }
 }
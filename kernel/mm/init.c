@@ -4,6 +4,7 @@
 
 #include <kernel/mm/init.h>
 #include <kernel/mm/heap.h>
+#include <kernel/mm/slab.h>
 #include <kernel/mm/pgtable.h>
 
 #include <kernel/cpu/cpu.h>
@@ -115,6 +116,7 @@ void mm_early_init() {
             initrd_phys >= kernel_reserved_end);
   }
 
+  mm_init_kmem();
   mm_init_kheap();
 }
 
@@ -148,6 +150,6 @@ void *mm_early_map_pages_reserved(uintptr_t phys_addr, size_t count, uint32_t vm
   } else if (vm_flags & VM_HUGE_1GB) {
     size = SIZE_1GB;
   }
-  kernel_reserved_va_ptr += size;
+  kernel_reserved_va_ptr += count * size;
   return early_map_entries(va_ptr, phys_addr, count, vm_flags);
 }
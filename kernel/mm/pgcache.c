@@ -3,21 +3,71 @@
 //
 
 #include <kernel/mm/pgcache.h>
+#include <kernel/mm/reclaim.h>
 #include <kernel/mm.h>
 
+#include <kernel/atomic.h>
 #include <kernel/panic.h>
 #include <math.h>
 
 #define log2(x) (63 - __builtin_clzll(x))
 
+#define PGCACHE_SCAN_BATCH 32 // pages evicted per hold of the cache lock
+#define PGCACHE_SCAN_RATIO 4  // pages looked at for every page asked for
+
 struct pgcache_node {
   void *slots[PGCACHE_FANOUT];
   struct {
     uint16_t count;
     uint16_t dirty[PGCACHE_FANOUT / (8 * sizeof(uint16_t))];
+    uint16_t referenced;                  // slots looked up since the hand last passed
+    uint16_t active;                      // slots in the active set
     LIST_ENTRY(struct pgcache_node) list; // leaf nodes
   } leaf;
 };
+_Static_assert(PGCACHE_FANOUT <= 8 * sizeof(uint16_t));
+
+#define SLOT_BIT(i) ((uint16_t)(1 << (i)))
+#define SLOT_DIRTY(node, i) ((node)->leaf.dirty[(i) / 16] & (1 << ((i) % 16)))
+
+// caches taking part in reclaim
+static LIST_HEAD(struct pgcache) reclaim_caches;
+static mtx_t reclaim_caches_lock;
+static struct pgcache_stats pgcache_stats;
+
+// updates the global counters of a reclaimable cache
+#define RECLAIM_STAT_ADD(cache, field, n) \
+  do { if ((cache)->flags & PGCACHE_RECLAIM) atomic_fetch_add(&pgcache_stats.field, n); } while (0)
+#define RECLAIM_STAT_SUB(cache, field, n) \
+  do { if ((cache)->flags & PGCACHE_RECLAIM) atomic_fetch_sub(&pgcache_stats.field, n); } while (0)
+
+// the cache lock must be held
+static void leaf_slot_filled(struct pgcache *cache, struct pgcache_node *node) {
+  if (node->leaf.count++ == 0 && node != cache->root) {
+    cache->empty_leaves--;
+    RECLAIM_STAT_SUB(cache, empty_leaves, 1);
+  }
+  cache->count++;
+  RECLAIM_STAT_ADD(cache, cached, 1);
+}
+
+// the cache lock must be held
+static void leaf_slot_emptied(struct pgcache *cache, struct pgcache_node *node, size_t idx) {
+  uint16_t bit = SLOT_BIT(idx);
+  if (node->leaf.active & bit) {
+    cache->active--;
+    RECLAIM_STAT_SUB(cache, active, 1);
+  }
+  node->leaf.referenced &= ~bit;
+  node->leaf.active &= ~bit;
+
+  if (--node->leaf.count == 0 && node != cache->root) {
+    cache->empty_leaves++;
+    RECLAIM_STAT_ADD(cache, empty_leaves, 1);
+  }
+  cache->count--;
+  RECLAIM_STAT_SUB(cache, cached, 1);
+}
 
 //
 
@@ -27,6 +77,7 @@ struct visit_stack_entry {
   struct pgcache_node *node;
   int slot_index;
   uint16_t level;
+  size_t key;             // page index bits taken by the levels above
 };
 
 static void internal_visit_pages_iter(
@@ -62,7 +113,8 @@ static void internal_visit_pages_iter(
   stack[top++] = (struct visit_stack_entry){
     .node = root,
     .slot_index = 0,
-    .level = level
+    .level = level,
+    .key = 0,
   };
 
   while (top > 0) {
@@ -79,21 +131,24 @@ static void internal_visit_pages_iter(
     }
 
     current->slot_index++;
-    size_t slot_start = (i << (cache->bits_per_lvl * (cache->order - current->level)));
-    size_t slot_end = slot_start + (1ULL << (cache->bits_per_lvl * (cache->order - current->level)));
-    if (slot_end <= start_off || slot_start >= end_off) {
+    if (node->slots[i] == NULL) {
       continue;
     }
 
-    if (node->slots[i]) {
-      if (current->level < cache->order) {
-        stack[top++] = (struct visit_stack_entry){
-          .node = (struct pgcache_node *) node->slots[i],
-          .slot_index = 0,
-          .level = current->level + 1
-        };
-      } else {
-        fn((page_t **)&node->slots[i], slot_start, data);
+    // the root indexes the least significant bits of the page index (see
+    // internal_lookup_leaf) so a subtree does not cover a contiguous range
+    size_t key = current->key | ((size_t) i << (cache->bits_per_lvl * current->level));
+    if (current->level < cache->order) {
+      stack[top++] = (struct visit_stack_entry){
+        .node = (struct pgcache_node *) node->slots[i],
+        .slot_index = 0,
+        .level = current->level + 1,
+        .key = key,
+      };
+    } else {
+      size_t off = key << log2(cache->pg_size);
+      if (off >= start_off && off < end_off) {
+        fn((page_t **)&node->slots[i], off, data);
       }
     }
   }
@@ -121,6 +176,8 @@ static struct pgcache_node *internal_lookup_leaf(struct pgcache *tree, size_t of
       node->slots[idx] = child;
       if (i == order - 1) { // this is a leaf node
         LIST_ADD(&tree->leaf_nodes, child, leaf.list);
+        tree->empty_leaves++;
+        RECLAIM_STAT_ADD(tree, empty_leaves, 1);
       }
     }
     off >>= bits_per_lvl;
@@ -133,6 +190,101 @@ static struct pgcache_node *internal_lookup_leaf(struct pgcache *tree, size_t of
   return node;
 }
 
+// evicts the inactive pages of up to max leaves starting at the hand. the
+// evicted pages are moved to victims and must be dropped by the caller once
+// the cache lock is released. the cache lock must be held.
+static size_t internal_clock_scan(struct pgcache *cache, page_t **victims, size_t max, size_t *budget) {
+  struct pgcache_node *leaf = cache->hand;
+  if (leaf == NULL) {
+    leaf = LIST_FIRST(&cache->leaf_nodes);
+  }
+
+  size_t count = 0;
+  size_t scanned = 0;
+  struct pgcache_node *start = leaf;
+  while (leaf != NULL && count < max && *budget > 0) {
+    for (int i = 0; i < PGCACHE_FANOUT && leaf->leaf.count > 0; i++) {
+      page_t *page = leaf->slots[i];
+      if (page == NULL) {
+        continue;
+      }
+
+      uint16_t bit = SLOT_BIT(i);
+      scanned++;
+      if (leaf->leaf.referenced & bit) {
+        // used since the last sweep, give it another round
+        leaf->leaf.referenced &= ~bit;
+        if (!(leaf->leaf.active & bit)) {
+          leaf->leaf.active |= bit;
+          cache->active++;
+          RECLAIM_STAT_ADD(cache, active, 1);
+        }
+      } else if (leaf->leaf.active & bit) {
+        leaf->leaf.active &= ~bit;
+        cache->active--;
+        RECLAIM_STAT_SUB(cache, active, 1);
+      } else if (count < max && !SLOT_DIRTY(leaf, i) && read_refcount(page) == 1 && page->entries == NULL) {
+        // only the cache holds the page
+        victims[count++] = moveref(leaf->slots[i]);
+        leaf_slot_emptied(cache, leaf, i);
+      }
+    }
+    *budget -= min(*budget, PGCACHE_FANOUT);
+
+    leaf = LIST_NEXT(leaf, leaf.list);
+    if (leaf == NULL) {
+      leaf = LIST_FIRST(&cache->leaf_nodes);
+    }
+    if (leaf == start) {
+      break; // went all the way around
+    }
+  }
+
+  if (leaf == NULL) {
+    *budget -= min(*budget, 1); // the cache is empty
+  }
+  cache->hand = leaf;
+  RECLAIM_STAT_ADD(cache, scanned, scanned);
+  RECLAIM_STAT_ADD(cache, reclaimed, count);
+  return count;
+}
+
+// unlinks the empty nodes below node and pushes them onto the freelist. returns
+// true if node no longer has any children. the cache lock must be held.
+static bool internal_prune_nodes(struct pgcache *cache, struct pgcache_node *node, uint16_t level, struct pgcache_node **freelist, size_t *nr) {
+  if (level == cache->order) {
+    return node->leaf.count == 0;
+  }
+
+  bool empty = true;
+  for (int i = 0; i < PGCACHE_FANOUT; i++) {
+    struct pgcache_node *child = node->slots[i];
+    if (child == NULL) {
+      continue;
+    }
+
+    if (*nr == 0 || !internal_prune_nodes(cache, child, level + 1, freelist, nr)) {
+      empty = false;
+      continue;
+    }
+
+    if (level + 1 == cache->order) {
+      LIST_REMOVE(&cache->leaf_nodes, child, leaf.list);
+      if (cache->hand == child) {
+        cache->hand = NULL;
+      }
+      cache->empty_leaves--;
+      RECLAIM_STAT_SUB(cache, empty_leaves, 1);
+      (*nr)--;
+    }
+
+    node->slots[i] = NULL;
+    child->slots[0] = *freelist;
+    *freelist = child;
+  }
+  return empty;
+}
+
 //
 // MARK: pgcache api
 //
@@ -144,6 +296,7 @@ struct pgcache *pgcache_alloc(uint16_t order, uint32_t pg_size) {
   tree->pg_size = pg_size;
   tree->max_capacity = (1ULL << ((order + 1) * tree->bits_per_lvl)) * pg_size;
   tree->root = kmallocz(sizeof(struct pgcache_node));
+  mtx_init(&tree->lock, MTX_SPIN, "pgcache_lock");
   ref_init(&tree->refcount);
 
   if (order == 0) {
@@ -155,6 +308,16 @@ struct pgcache *pgcache_alloc(uint16_t order, uint32_t pg_size) {
 void pgcache_free(struct pgcache **cacheptr) {
   struct pgcache *cache = moveref(*cacheptr);
   if (cache && ref_put(&cache->refcount)) {
+    if (cache->flags & PGCACHE_RECLAIM) {
+      mtx_spin_lock(&reclaim_caches_lock);
+      LIST_REMOVE(&reclaim_caches, cache, list);
+      mtx_spin_unlock(&reclaim_caches_lock);
+
+      atomic_fetch_sub(&pgcache_stats.cached, cache->count);
+      atomic_fetch_sub(&pgcache_stats.active, cache->active);
+      atomic_fetch_sub(&pgcache_stats.empty_leaves, cache->empty_leaves);
+    }
+
     internal_visit_pages_iter(cache, &cache->root, 0, cache->max_capacity, /*free=*/true, 0, (void *) drop_pages, NULL);
     kfree(cache);
   }
@@ -170,11 +333,15 @@ __ref page_t *pgcache_lookup(struct pgcache *cache, size_t off) {
   }
 
   size_t idx;
+  page_t *page = NULL;
+  mtx_spin_lock(&cache->lock);
   struct pgcache_node *node = internal_lookup_leaf(cache, off, /*insert=*/false, &idx);
-  if (node == NULL) {
-    return NULL;
+  if (node != NULL && node->slots[idx] != NULL) {
+    node->leaf.referenced |= SLOT_BIT(idx);
+    page = getref((page_t *) node->slots[idx]);
   }
-  return getref((page_t *) node->slots[idx]);
+  mtx_spin_unlock(&cache->lock);
+  return page;
 }
 
 void pgcache_insert(struct pgcache *cache, size_t off, __ref page_t *page, __move page_t **out_old) {
@@ -184,12 +351,17 @@ void pgcache_insert(struct pgcache *cache, size_t off, __ref page_t *page, __mov
   }
 
   size_t idx;
+  mtx_spin_lock(&cache->lock);
   struct pgcache_node *node = internal_lookup_leaf(cache, off, /*insert=*/true, &idx);
   kassert(node != NULL);
 
   page_t *old = moveref(node->slots[idx]);
+  if (old != NULL) {
+    leaf_slot_emptied(cache, node, idx);
+  }
   node->slots[idx] = moveref(page);
-  node->leaf.count++;
+  leaf_slot_filled(cache, node);
+  mtx_spin_unlock(&cache->lock);
 
   if (out_old) {
     *out_old = moveref(old);
@@ -204,21 +376,166 @@ void pgcache_remove(struct pgcache *cache, size_t off, __move page_t **out_page)
   }
 
   size_t idx;
+  mtx_spin_lock(&cache->lock);
   struct pgcache_node *node = internal_lookup_leaf(cache, off, /*insert=*/false, &idx);
   if (node == NULL || node->slots[idx] == NULL) {
+    mtx_spin_unlock(&cache->lock);
     return;
   }
 
-  node->leaf.count--;
-  // TODO: free leaf nodes if they are empty?
+  // empty leaf nodes are freed by the pgcache_nodes shrinker
+  page_t *page = moveref(node->slots[idx]);
+  leaf_slot_emptied(cache, node, idx);
+  mtx_spin_unlock(&cache->lock);
 
   if (out_page) {
-    *out_page = moveref(node->slots[idx]);
+    *out_page = moveref(page);
   } else {
-    drop_pages((page_t **) &node->slots[idx]);
+    drop_pages(&page);
   }
 }
 
+/**
+ * Calls fn for every page in [start_off, end_off). The pages of a reclaimable
+ * cache are visited with the cache lock held so fn must not block or call back
+ * into the same cache.
+ */
 void pgcache_visit_pages(struct pgcache *cache, size_t start_off, size_t end_off, pgcache_visit_t fn, void *data) {
+  bool locked = cache->flags & PGCACHE_RECLAIM;
+  if (locked) {
+    mtx_spin_lock(&cache->lock);
+  }
   internal_visit_pages_iter(cache, &cache->root, start_off, end_off, /*free=*/false, 0, fn, data);
+  if (locked) {
+    mtx_spin_unlock(&cache->lock);
+  }
+}
+
+/**
+ * Adds the cache to the set of caches whose clean pages may be evicted when
+ * memory runs low. Pages of the cache must be possible to fetch again, so this
+ * is meant for caches of file data.
+ */
+void pgcache_set_reclaimable(struct pgcache *cache) {
+  mtx_spin_lock(&reclaim_caches_lock);
+  mtx_spin_lock(&cache->lock);
+  if (!(cache->flags & PGCACHE_RECLAIM)) {
+    cache->flags |= PGCACHE_RECLAIM;
+    atomic_fetch_add(&pgcache_stats.cached, cache->count);
+    atomic_fetch_add(&pgcache_stats.active, cache->active);
+    atomic_fetch_add(&pgcache_stats.empty_leaves, cache->empty_leaves);
+    LIST_ADD(&reclaim_caches, cache, list);
+  }
+  mtx_spin_unlock(&cache->lock);
+  mtx_spin_unlock(&reclaim_caches_lock);
+}
+
+void pgcache_get_stats(struct pgcache_stats *stats) {
+  stats->cached = atomic_load(&pgcache_stats.cached);
+  stats->active = atomic_load(&pgcache_stats.active);
+  stats->inactive = stats->cached - min(stats->active, stats->cached);
+  stats->empty_leaves = atomic_load(&pgcache_stats.empty_leaves);
+  stats->scanned = atomic_load(&pgcache_stats.scanned);
+  stats->reclaimed = atomic_load(&pgcache_stats.reclaimed);
+  stats->nodes_freed = atomic_load(&pgcache_stats.nodes_freed);
+}
+
+//
+// MARK: shrinkers
+//
+
+static size_t pgcache_pages_count(struct shrinker *shrinker) {
+  size_t cached = atomic_load(&pgcache_stats.cached);
+  size_t active = atomic_load(&pgcache_stats.active);
+  return cached - min(active, cached);
+}
+
+static size_t pgcache_pages_scan(struct shrinker *shrinker, size_t nr) {
+  page_t *victims[PGCACHE_SCAN_BATCH];
+  size_t budget = nr * PGCACHE_SCAN_RATIO;
+  size_t freed = 0;
+  while (freed < nr && budget > 0) {
+    size_t count = 0;
+    mtx_spin_lock(&reclaim_caches_lock);
+    struct pgcache *cache = LIST_FIRST(&reclaim_caches);
+    if (cache == NULL) {
+      mtx_spin_unlock(&reclaim_caches_lock);
+      break;
+    }
+
+    // rotate the list so that the next batch starts with the next cache
+    LIST_REMOVE(&reclaim_caches, cache, list);
+    LIST_ADD(&reclaim_caches, cache, list);
+    if (mtx_spin_trylock(&cache->lock)) {
+      count = internal_clock_scan(cache, victims, min(nr - freed, PGCACHE_SCAN_BATCH), &budget);
+      mtx_spin_unlock(&cache->lock);
+    } else {
+      budget -= min(budget, PGCACHE_FANOUT);
+    }
+    mtx_spin_unlock(&reclaim_caches_lock);
+
+    for (size_t i = 0; i < count; i++) {
+      drop_pages(&victims[i]);
+    }
+    freed += count;
+  }
+  return freed;
+}
+
+static size_t pgcache_nodes_count(struct shrinker *shrinker) {
+  return atomic_load(&pgcache_stats.empty_leaves);
+}
+
+static size_t pgcache_nodes_scan(struct shrinker *shrinker, size_t nr) {
+  struct pgcache_node *freelist = NULL;
+  size_t remaining = nr;
+
+  mtx_spin_lock(&reclaim_caches_lock);
+  struct pgcache *cache;
+  LIST_FOREACH(cache, &reclaim_caches, list) {
+    if (remaining == 0) {
+      break;
+    }
+    if (cache->empty_leaves == 0 || cache->order == 0 || !mtx_spin_trylock(&cache->lock)) {
+      continue;
+    }
+    internal_prune_nodes(cache, cache->root, 0, &freelist, &remaining);
+    mtx_spin_unlock(&cache->lock);
+  }
+  mtx_spin_unlock(&reclaim_caches_lock);
+
+  // free the nodes outside of the locks
+  size_t count = 0;
+  while (freelist != NULL) {
+    struct pgcache_node *node = freelist;
+    freelist = node->slots[0];
+    kfree(node);
+    count++;
+  }
+  atomic_fetch_add(&pgcache_stats.nodes_freed, count);
+  return nr - remaining;
+}
+
+static struct shrinker pgcache_pages_shrinker = {
+  .name = "pgcache",
+  .count = pgcache_pages_count,
+  .scan = pgcache_pages_scan,
+};
+
+static struct shrinker pgcache_nodes_shrinker = {
+  .name = "pgcache_nodes",
+  .count = pgcache_nodes_count,
+  .scan = pgcache_nodes_scan,
+};
+
+static void pgcache_static_init() {
+  LIST_INIT(&reclaim_caches);
+  mtx_init(&reclaim_caches_lock, MTX_SPIN, "reclaim_caches_lock");
+}
+STATIC_INIT(pgcache_static_init);
+
+static void pgcache_module_init() {
+  register_shrinker(&pgcache_pages_shrinker);
+  register_shrinker(&pgcache_nodes_shrinker);
 }
+MODULE_INIT(pgcache_module_init);
@@ -36,8 +36,15 @@
 
 #define PML4_PTR    ((uint64_t *) get_virt_addr(R_ENTRY, R_ENTRY, R_ENTRY, R_ENTRY))
 #define TEMP_PDPT   ((uint64_t *) get_virt_addr(R_ENTRY, R_ENTRY, R_ENTRY, T_ENTRY))
-#define TEMP_PDPTE  (&TEMP_PDPT[curcpu_id])
-#define TEMP_PTR    ((uint64_t *) get_virt_addr(R_ENTRY, R_ENTRY, T_ENTRY, curcpu_id))
+#define TEMP_PD     ((uint64_t *) get_virt_addr(R_ENTRY, R_ENTRY, T_ENTRY, 0))
+
+#define KMAP_CPU_ENTRIES  4 // temp pd entries owned by each cpu
+#define KMAP_SLOTS        NUM_ENTRIES // 4k slots per cpu
+#define KMAP_HUGE_SLOTS   (KMAP_CPU_ENTRIES - 1) // 2mb slots per cpu
+#define KMAP_STACK_MAX    16
+
+#define KMAP_PT(cpu)      ((uint64_t *) get_virt_addr(R_ENTRY, T_ENTRY, 0, (cpu) * KMAP_CPU_ENTRIES))
+#define KMAP_BASE(cpu)    get_virt_addr(T_ENTRY, 0, (cpu) * KMAP_CPU_ENTRIES, 0)
 
 // page entry flags
 #define PE_PRESENT        (1ULL << 0)
@@ -69,6 +76,38 @@ void _print_pgtable_address(uint16_t l4, uint16_t l3, uint16_t l2, uint16_t l1);
 uint64_t *startup_kernel_pml4;
 // pdpe page for the temp entry
 page_t *temp_pdpt_page;
+// pde page for the kmap windows
+page_t *temp_pd_page;
+
+/*
+ * Per-cpu temporary mappings.
+ *
+ * Each cpu owns a window of 4k slots and a few 2mb slots in the temp region which
+ * are used to access pages that are not otherwise mapped. Mappings are local to the
+ * cpu and only valid within the critical section held between kmap_local and the
+ * matching kunmap_local, so they must be released in the reverse order.
+ *
+ * The 4k slots are handed out round-robin and never reused until the window wraps
+ * around at which point all of them are flushed at once. Since a slot is only written
+ * once between flushes there can be no stale translations for it and the common case
+ * does not need an invlpg. The slot entries are global so they are shared by every
+ * pcid. Without global pages each slot is invalidated as it is mapped.
+ */
+struct kmap_entry {
+  uint16_t slot;                    // first 4k slot or huge slot index
+  uint16_t count;                   // number of 4k slots (0 for huge slots)
+};
+
+struct kmap_cpu {
+  page_t *table;                    // page table backing the 4k slots
+  uint16_t next;                    // next unused slot since the last flush
+  uint16_t depth;                   // number of live mappings
+  uint16_t huge_depth;              // number of live huge mappings
+  struct kmap_entry stack[KMAP_STACK_MAX];
+};
+
+static struct kmap_cpu kmap_cpus[MAX_CPUS];
+static bool kmap_lazy_flush;
 
 
 static inline uint64_t *get_child_pgtable_address(const uint64_t *parent, pg_level_t level, uint16_t index) {
@@ -209,6 +248,19 @@ void *early_map_entries(uintptr_t vaddr, uintptr_t paddr, size_t count, uint32_t
   return addr;
 }
 
+static void kmap_init_cpu() {
+  uint8_t id = curcpu_id;
+  struct kmap_cpu *km = &kmap_cpus[id];
+  if (km->table != NULL) {
+    return;
+  }
+
+  memset(km, 0, sizeof(struct kmap_cpu));
+  km->table = alloc_pages(1);
+  TEMP_PD[id * KMAP_CPU_ENTRIES] = km->table->address | PE_WRITE | PE_PRESENT;
+  cpu_invlpg((uintptr_t) KMAP_PT(id));
+  memset(KMAP_PT(id), 0, PAGE_SIZE);
+}
 
 void init_recursive_pgtable() {
   uintptr_t pgtable = get_current_pgtable();
@@ -220,10 +272,18 @@ void init_recursive_pgtable() {
   table_virt[R_ENTRY] = (uint64_t) pgtable | PE_WRITE | PE_PRESENT;
 
   // we also setup a fixed page directory pointer table to enable the temporary mapping
-  // of pages. each cpu has its own entry in this table which can be accessed with TEMP_PDPTE
+  // of pages. the first page directory is split between the cpus which each get their
+  // own kmap window (see kmap_local)
+  static_assert(MAX_CPUS * KMAP_CPU_ENTRIES <= NUM_ENTRIES);
   temp_pdpt_page = alloc_pages(1);
+  temp_pd_page = alloc_pages(1);
   table_virt[T_ENTRY] = temp_pdpt_page->address | PE_WRITE | PE_PRESENT;
   memset(TEMP_PDPT, 0, PAGE_SIZE);
+  TEMP_PDPT[0] = temp_pd_page->address | PE_WRITE | PE_PRESENT;
+  cpu_invlpg(TEMP_PD);
+  memset(TEMP_PD, 0, PAGE_SIZE);
+
+  kmap_init_cpu();
 }
 
 uintptr_t get_current_pgtable() {
@@ -242,6 +302,16 @@ void pgtable_update_entry_flags(uintptr_t vaddr, uint64_t *pte, uint32_t vm_flag
   cpu_invlpg(vaddr);
 }
 
+// fills in an entry of an existing table only if it is not present. since the
+// entry was not present there is nothing to invalidate
+bool pgtable_map_empty_entry(uint64_t *pte, uintptr_t paddr, uint32_t vm_flags) {
+  if (*pte & PE_PRESENT) {
+    return false;
+  }
+  *pte = paddr | vm_flags_to_pe_flags(vm_flags);
+  return true;
+}
+
 bool pgtable_get_entry_dirty(const uint64_t *pte) {
   return *pte & PE_DIRTY;
 }
@@ -384,27 +454,168 @@ uint64_t recursive_duplicate_pgtable(
 
 //
 
-void fill_unmapped_page(page_t *page, uint8_t v, size_t off, size_t len) {
-  ASSERT(off + len <= PAGE_SIZE);
+static void kmap_percpu_init() {
+  if (curcpu_is_boot) {
+    kmap_lazy_flush = cpuid_query_bit(CPUID_BIT_PGE);
+  }
+
+  kmap_init_cpu();
+  // slots mapped so far may have been invalidated eagerly so make sure
+  // the window is flushed before it is used lazily
+  kmap_cpus[curcpu_id].next = KMAP_SLOTS;
+}
+PERCPU_EARLY_INIT(kmap_percpu_init);
+
+static uint16_t kmap_alloc_slots(struct kmap_cpu *km, uint16_t count) {
+  bool wrapped = false;
+  for (;;) {
+    if (km->next + count > KMAP_SLOTS) {
+      if (wrapped) {
+        panic("kmap: no free slots for %d pages", count);
+      }
+
+      // every slot has been used since the last flush
+      if (kmap_lazy_flush) {
+        cpu_flush_tlb_global();
+      }
+      km->next = 0;
+      wrapped = true;
+    }
+
+    // skip over slots that are still held by outer mappings
+    uint16_t slot = km->next;
+    km->next += count;
+    for (int i = 0; i < km->depth; i++) {
+      struct kmap_entry *l = &km->stack[i];
+      if (l->count > 0 && slot < l->slot + l->count && l->slot < slot + count) {
+        km->next = l->slot + l->count;
+        slot = UINT16_MAX;
+        break;
+      }
+    }
+
+    if (slot != UINT16_MAX) {
+      return slot;
+    }
+  }
+}
+
+// maps count frames from the page list, or contiguous frames starting at frame if
+// pages is null, into consecutive 4k slots. called from within a critical section
+static void *kmap_push_slots(page_t *pages, uintptr_t frame, size_t count) {
+  ASSERT(count > 0 && count <= KMAP_BATCH_MAX);
+  uint8_t id = curcpu_id;
+  struct kmap_cpu *km = &kmap_cpus[id];
+  ASSERT(km->depth < KMAP_STACK_MAX);
+
+  uint16_t slot = kmap_alloc_slots(km, count);
+  uint64_t *pt = KMAP_PT(id);
+  uintptr_t vaddr = KMAP_BASE(id) + PAGES_TO_SIZE(slot);
+  page_t *page = pages;
+  for (size_t i = 0; i < count; i++) {
+    uintptr_t paddr = frame + PAGES_TO_SIZE(i);
+    if (pages != NULL) {
+      ASSERT(page != NULL);
+      ASSERT(pg_flags_to_size(page->flags) == PAGE_SIZE);
+      paddr = page->address;
+      page = page->next;
+    }
+
+    pt[slot + i] = paddr | PE_GLOBAL | PE_WRITE | PE_PRESENT;
+    if (!kmap_lazy_flush) {
+      cpu_invlpg(vaddr + PAGES_TO_SIZE(i));
+    }
+  }
+
+  km->stack[km->depth++] = (struct kmap_entry){ .slot = slot, .count = count };
+  return (void *) vaddr;
+}
+
+// maps a 2mb frame into one of the huge slots. called from within a critical section
+static void *kmap_push_huge(uintptr_t frame) {
+  ASSERT(is_aligned(frame, SIZE_2MB));
+  uint8_t id = curcpu_id;
+  struct kmap_cpu *km = &kmap_cpus[id];
+  ASSERT(km->depth < KMAP_STACK_MAX);
+  if (km->huge_depth == KMAP_HUGE_SLOTS) {
+    panic("kmap: no free huge slots");
+  }
+
+  uint16_t slot = km->huge_depth++;
+  uintptr_t vaddr = KMAP_BASE(id) + (slot + 1) * SIZE_2MB;
+  TEMP_PD[id * KMAP_CPU_ENTRIES + 1 + slot] = frame | PE_SIZE | PE_GLOBAL | PE_WRITE | PE_PRESENT;
+  cpu_invlpg(vaddr);
+
+  km->stack[km->depth++] = (struct kmap_entry){ .slot = slot, .count = 0 };
+  return (void *) vaddr;
+}
+
+static inline uint64_t *kmap_local_table(uintptr_t table) {
+  critical_enter();
+  return kmap_push_slots(NULL, table, 1);
+}
+
+/**
+ * Temporarily maps a page into the kernel address space of the current cpu. The
+ * mapping must be released with kunmap_local and it holds a critical section until
+ * then. Both 4k and 2mb pages are supported.
+ */
+void *kmap_local(page_t *page) {
+  critical_enter();
+  size_t pgsize = pg_flags_to_size(page->flags);
+  if (pgsize == SIZE_2MB) {
+    return kmap_push_huge(page->address);
+  }
+
+  ASSERT(pgsize == PAGE_SIZE);
+  return kmap_push_slots(NULL, page->address, 1);
+}
+
+/**
+ * Temporarily maps the first count pages of a list of 4k pages into a single
+ * virtually contiguous window. At most KMAP_BATCH_MAX pages can be mapped at once.
+ */
+void *kmap_local_pages(page_t *pages, size_t count) {
   critical_enter();
-  // ---------------------
-  *TEMP_PDPTE = page->address | PE_WRITE | PE_PRESENT;
-  cpu_invlpg(TEMP_PTR);
-  memset(((void *)TEMP_PTR) + off, v, len);
-  *TEMP_PDPTE = 0;
-  // ---------------------
+  return kmap_push_slots(pages, 0, count);
+}
+
+void kunmap_local(void *ptr) {
+  uint8_t id = curcpu_id;
+  struct kmap_cpu *km = &kmap_cpus[id];
+  ASSERT(km->depth > 0);
+
+  // mappings must be released in reverse order
+  struct kmap_entry *l = &km->stack[--km->depth];
+  if (l->count == 0) {
+    ASSERT(l->slot == km->huge_depth - 1);
+    ASSERT((uintptr_t) ptr == KMAP_BASE(id) + (l->slot + 1) * SIZE_2MB);
+    TEMP_PD[id * KMAP_CPU_ENTRIES + 1 + l->slot] = 0;
+    km->huge_depth--;
+  } else {
+    ASSERT((uintptr_t) ptr == KMAP_BASE(id) + PAGES_TO_SIZE(l->slot));
+    // the translations stay cached until the slots are reused
+    memset(&KMAP_PT(id)[l->slot], 0, l->count * sizeof(uint64_t));
+  }
   critical_exit();
 }
 
+//
+
+void fill_unmapped_page(page_t *page, uint8_t v, size_t off, size_t len) {
+  ASSERT(off + len <= pg_flags_to_size(page->flags));
+  void *ptr = kmap_local(page);
+  memset(ptr + off, v, len);
+  kunmap_local(ptr);
+}
+
 void fill_unmapped_pages(page_t *pages, uint8_t v, size_t off, size_t len) {
   size_t pgsize = pg_flags_to_size(pages->flags);
-  ASSERT(pgsize == PAGE_SIZE);
   if (pages->flags & PG_HEAD) {
     // the offset and length can span the whole page list
-    size_t list_size = PAGES_TO_SIZE(pages->head.count);
+    size_t list_size = pages->head.count * pgsize;
     ASSERT(off + len <= list_size);
 
-    bool contiguous = pages->head.contiguous;
     page_t *page = pages;
     while (page && off >= pgsize) {
       // get to the page for the offset
@@ -422,42 +633,43 @@ void fill_unmapped_pages(page_t *pages, uint8_t v, size_t off, size_t len) {
     }
   } else {
     // we are dealing with only a single page
-    ASSERT(off + len <= PAGE_SIZE);
     fill_unmapped_page(pages, v, off, len);
   }
 }
 
+void copy_unmapped_page(page_t *page, const void *src) {
+  void *ptr = kmap_local(page);
+  memcpy(ptr, src, pg_flags_to_size(page->flags));
+  kunmap_local(ptr);
+}
+
+static size_t rw_kio_window(void *ptr, size_t len, kio_t *kio) {
+  if (kio->dir == KIO_WRITE) {
+    return kio_write_in(kio, ptr, len, 0);
+  } else if (kio->dir == KIO_READ) {
+    return kio_read_out(ptr, len, 0, kio);
+  }
+  return 0;
+}
+
 size_t rw_unmapped_page(page_t *page, size_t off, kio_t *kio) {
-  void *tmp_ptr = TEMP_PTR;
   size_t pgsize = pg_flags_to_size(page->flags);
-  ASSERT(pgsize == PAGE_SIZE); // TODO: support big pages
   ASSERT(off < pgsize);
 
   size_t len = min(pgsize - off, kio_remaining(kio));
-  size_t n = 0;
-  critical_enter();
-  // ---------------------
-  *TEMP_PDPTE = page->address | PE_WRITE | PE_PRESENT;
-  cpu_invlpg(TEMP_PTR);
-  if (kio->dir == KIO_WRITE) {
-    n = kio_write_in(kio, offset_ptr(TEMP_PTR, off), len, 0);
-  } else if (kio->dir == KIO_READ) {
-    n = kio_read_out(offset_ptr(TEMP_PTR, off), len, 0, kio);
-  }
-  *TEMP_PDPTE = 0;
-  // ---------------------
-  critical_exit();
+  void *ptr = kmap_local(page);
+  size_t n = rw_kio_window(offset_ptr(ptr, off), len, kio);
+  kunmap_local(ptr);
   return n;
 }
 
 size_t rw_unmapped_pages(page_t *pages, size_t off, kio_t *kio) {
   size_t pgsize = pg_flags_to_size(pages->flags);
-  ASSERT(pgsize == PAGE_SIZE);
   ASSERT(pages->flags & PG_HEAD);
 
   // get start page for offset
   page_t *page = pages;
-  while (page && off >= PAGE_SIZE) {
+  while (page && off >= pgsize) {
     off -= pgsize;
     page = page->next;
   }
@@ -469,24 +681,33 @@ size_t rw_unmapped_pages(page_t *pages, size_t off, kio_t *kio) {
       break;
     }
 
-    n += rw_unmapped_page(page, off, kio);
+    if (pgsize != PAGE_SIZE) {
+      n += rw_unmapped_page(page, off, kio);
+      off = 0;
+      page = page->next;
+      continue;
+    }
+
+    // map as many of the pages as are needed into one window and do a single copy
+    size_t count = 0;
+    page_t *last = page;
+    while (last && count < KMAP_BATCH_MAX && PAGES_TO_SIZE(count) < off + remain) {
+      last = last->next;
+      count++;
+    }
+
+    size_t len = min(PAGES_TO_SIZE(count) - off, remain);
+    void *ptr = kmap_local_pages(page, count);
+    n += rw_kio_window(offset_ptr(ptr, off), len, kio);
+    kunmap_local(ptr);
     off = 0;
-    page = page->next;
+    page = last;
   }
   return n;
 }
 
 //
 
-static inline uint64_t *temp_map_user_pgtable(uintptr_t pgtable) {
-  // // only invalidate TEMP_PTR if we're replacing an existing mapping
-  // bool invlpg = (*TEMP_PDPTE & PE_FRAME_MASK) != 0;
-  *TEMP_PDPTE = pgtable | PE_USER | PE_WRITE | PE_PRESENT;
-
-  cpu_invlpg(TEMP_PTR);
-  return TEMP_PTR;
-}
-
 void nonrecursive_map_frames(uintptr_t pml4, uintptr_t vaddr, uintptr_t paddr, size_t count, uint32_t vm_flags, __move page_t **out_pages) {
   ASSERT(vaddr < USER_SPACE_END);
   ASSERT(is_aligned(vaddr, PAGE_SIZE));
@@ -496,10 +717,8 @@ void nonrecursive_map_frames(uintptr_t pml4, uintptr_t vaddr, uintptr_t paddr, s
   uint16_t pe_flags = vm_flags_to_pe_flags(vm_flags);
   LIST_HEAD(page_t) table_pages = {0};
   while (count > 0) {
-    critical_enter();
-
     // walk down the hierarchy by mapping in one level at a time
-    volatile uint64_t *table = temp_map_user_pgtable(pml4);
+    volatile uint64_t *table = kmap_local_table(pml4);
     for (pg_level_t level = PG_LEVEL_PML4; level > map_level; level--) {
       int index = index_for_pg_level(vaddr, level);
       uintptr_t next_table = table[index] & PE_FRAME_MASK;
@@ -508,13 +727,15 @@ void nonrecursive_map_frames(uintptr_t pml4, uintptr_t vaddr, uintptr_t paddr, s
         SLIST_ADD(&table_pages, table_page, next);
         table[index] = table_page->address | PE_USER | PE_WRITE | PE_PRESENT;
 
-        table = temp_map_user_pgtable(table_page->address);
-        memset(table, 0, PAGE_SIZE);
-      } else if (!(table[index] & PE_PRESENT)) {
-        table[index] = next_table | PE_USER | PE_WRITE | PE_PRESENT;
-        table = temp_map_user_pgtable(next_table);
+        kunmap_local((void *) table);
+        table = kmap_local_table(table_page->address);
+        memset((void *) table, 0, PAGE_SIZE);
       } else {
-        table = temp_map_user_pgtable(next_table);
+        if (!(table[index] & PE_PRESENT)) {
+          table[index] = next_table | PE_USER | PE_WRITE | PE_PRESENT;
+        }
+        kunmap_local((void *) table);
+        table = kmap_local_table(next_table);
       }
     }
 
@@ -527,9 +748,9 @@ void nonrecursive_map_frames(uintptr_t pml4, uintptr_t vaddr, uintptr_t paddr, s
       count--;
     }
 
-    // if mapping across multiple tables exit critical in-between to allow other
-    // threads to preempt if necessary
-    critical_exit();
+    // if mapping across multiple tables release the window in-between to allow
+    // other threads to preempt if necessary
+    kunmap_local((void *) table);
   }
 
   *out_pages = LIST_FIRST(&table_pages);
@@ -572,9 +793,12 @@ uintptr_t create_new_ap_page_tables(__move page_t **out_pages) {
   page_t *new_pml4 = alloc_pages(1);
   SLIST_ADD(&table_pages, new_pml4, next);
 
-  critical_enter();
-  *TEMP_PDPTE = new_pml4->address | PE_WRITE | PE_PRESENT;
-  uint64_t *table_virt = TEMP_PTR;
+  page_t *new_low_pdpt = alloc_pages(1);
+  page_t *new_low_pde = alloc_pages(1);
+  SLIST_ADD(&table_pages, new_low_pdpt, next);
+  SLIST_ADD(&table_pages, new_low_pde, next);
+
+  uint64_t *table_virt = kmap_local(new_pml4);
   memset(table_virt, 0, PAGE_SIZE);
 
   // shallow copy kernel entries
@@ -587,28 +811,18 @@ uintptr_t create_new_ap_page_tables(__move page_t **out_pages) {
   }
 
   // identity map bottom of memory
-  page_t *new_low_pdpt = alloc_pages(1);
-  SLIST_ADD(&table_pages, new_low_pdpt, next);
   table_virt[0] = new_low_pdpt->address | PE_WRITE | PE_PRESENT; // pml4 -> pdpe
+  kunmap_local(table_virt);
 
-  *TEMP_PDPTE = new_low_pdpt->address | PE_WRITE | PE_PRESENT;
-  cpu_invlpg(TEMP_PTR);
-  uint64_t *low_pdpt = TEMP_PTR;
+  uint64_t *low_pdpt = kmap_local(new_low_pdpt);
   memset(low_pdpt, 0, PAGE_SIZE);
-
-  page_t *new_low_pde = alloc_pages(1);
-  SLIST_ADD(&table_pages, new_low_pde, next);
   low_pdpt[0] = new_low_pde->address | PE_WRITE | PE_PRESENT; // pdpe -> pde
+  kunmap_local(low_pdpt);
 
-  *TEMP_PDPTE = new_low_pde->address | PE_WRITE | PE_PRESENT;
-  cpu_invlpg(TEMP_PTR);
-  uint64_t *low_pde = TEMP_PTR;
+  uint64_t *low_pde = kmap_local(new_low_pde);
   memset(low_pde, 0, PAGE_SIZE);
   low_pde[0] = 0 | PE_SIZE | PE_WRITE | PE_PRESENT; // pde -> 2mb identity mapping
-
-  *TEMP_PDPTE = 0;
-  cpu_invlpg(TEMP_PTR);
-  critical_exit();
+  kunmap_local(low_pde);
 
   if (out_pages != NULL) {
     *out_pages = LIST_FIRST(&table_pages);
@@ -621,9 +835,7 @@ uintptr_t fork_page_tables(page_t **out_pages, bool deepcopy_user) {
   page_t *new_pml4 = alloc_pages(1);
   SLIST_ADD(&table_pages, new_pml4, next);
 
-  critical_enter();
-  *TEMP_PDPTE = new_pml4->address | PE_WRITE | PE_PRESENT;
-  uint64_t *table_virt = TEMP_PTR;
+  uint64_t *table_virt = kmap_local(new_pml4);
   memset(table_virt, 0, PAGE_SIZE);
 
   // shallow copy kernel entries
@@ -640,17 +852,15 @@ uintptr_t fork_page_tables(page_t **out_pages, bool deepcopy_user) {
     for (int i = PML4_INDEX(USER_SPACE_START); i <= PML4_INDEX(USER_SPACE_END); i++) {
       page_t *page_ptr = NULL;
       uint64_t *src_table = (void *) get_virt_addr(R_ENTRY, R_ENTRY, R_ENTRY, i);
-      uint64_t *dest_table = TEMP_PTR;
-      ((uint64_t *)TEMP_PTR)[i] = recursive_duplicate_pgtable(PG_LEVEL_PDP, src_table, dest_table, i, &page_ptr);
+      uint64_t *dest_table = table_virt;
+      table_virt[i] = recursive_duplicate_pgtable(PG_LEVEL_PDP, src_table, dest_table, i, &page_ptr);
       if (page_ptr != NULL) {
         SLIST_ADD_SLIST(&table_pages, page_ptr, SLIST_GET_LAST(page_ptr, next), next);
       }
     }
   }
 
-  *TEMP_PDPTE = 0;
-  cpu_invlpg(TEMP_PTR);
-  critical_exit();
+  kunmap_local(table_virt);
 
   if (out_pages != NULL) {
     *out_pages = LIST_FIRST(&table_pages);
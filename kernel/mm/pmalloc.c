@@ -4,22 +4,30 @@
 
 #include <kernel/mm/pmalloc.h>
 #include <kernel/mm/pgtable.h>
+#include <kernel/mm/slab.h>
 #include <kernel/mm/init.h>
+#include <kernel/mm/reclaim.h>
 
+#include <kernel/cpu/cpu.h>
 #include <kernel/mutex.h>
 #include <kernel/string.h>
 #include <kernel/printf.h>
 #include <kernel/panic.h>
 #include <bitmap.h>
+#include <buddy.h>
 
 #define ASSERT(x) kassert(x)
+// #define PMALLOC_BENCHMARK
 
 #define ZONE_ALLOC_DEFAULT ZONE_TYPE_HIGH
 
 static LIST_HEAD(frame_allocator_t) mem_zones[MAX_ZONE_TYPE];
 static size_t zone_page_count[MAX_ZONE_TYPE];
+static size_t pg_watermarks[MAX_PG_WMARK];
 static size_t reserved_pages = 128;
 static page_t *initrd_pages = NULL;
+static kmem_cache_t *page_cache;
+static kmem_cache_t *pte_cache;
 
 static const size_t zone_limits[MAX_ZONE_TYPE] = {
   [ZONE_TYPE_LOW] = ZONE_LOW_MAX,
@@ -65,6 +73,13 @@ static frame_allocator_t *locate_owning_allocator(uintptr_t addr) {
   return NULL;
 }
 
+// wakes the reclaim thread if the free pages have dropped below the low watermark
+static inline void check_watermark() {
+  if (pmalloc_free_pages() < pg_watermarks[PG_WMARK_LOW]) {
+    reclaim_wakeup();
+  }
+}
+
 __ref static page_t *alloc_page_structs(frame_allocator_t *fa, uintptr_t frame, size_t count, size_t pg_size) {
   ASSERT(count > 0);
   uint32_t pg_flags = PG_OWNING;
@@ -79,7 +94,7 @@ __ref static page_t *alloc_page_structs(frame_allocator_t *fa, uintptr_t frame,
   page_t *first = NULL;
   page_t *last = NULL;
   while (remaining > 0) {
-    page_t *page = kmallocz(sizeof(page_t));
+    page_t *page = kmem_cache_allocz(page_cache);
     page->address = address;
     page->flags = pg_flags;
     page->fa = fa;
@@ -118,7 +133,7 @@ __ref static page_t *alloc_nonowned_structs(uintptr_t frame, size_t count, size_
   page_t *first = NULL;
   page_t *last = NULL;
   while (remaining > 0) {
-    page_t *page = kmallocz(sizeof(page_t));
+    page_t *page = kmem_cache_allocz(page_cache);
     page->address = address;
     page->flags = pg_flags;
     mtx_init(&page->pg_lock, MTX_SPIN, "pg_lock");
@@ -148,10 +163,12 @@ __ref static page_t *alloc_cow_structs(page_t *pages) {
   page_t *last = NULL;
   page_t *curr = pages;
   while (curr) {
-    page_t *page = kmallocz(sizeof(page_t));
+    page_t *page = kmem_cache_allocz(page_cache);
     page->address = curr->address;
     page->flags = (curr->flags & PG_SIZE_MASK) | PG_COW;
-    page->source = getref(curr);
+    // always reference the original page so that its refcount is the number of
+    // cow pages sharing it no matter how many times it has been forked
+    page->source = getref((curr->flags & PG_COW) ? curr->source : curr);
     mtx_init(&page->pg_lock, MTX_SPIN, "pg_lock");
     initref(page);
     if (first == NULL) {
@@ -195,6 +212,8 @@ __ref static page_t *alloc_shared_structs(page_t *pages) {
 // MARK: bitmap frame allocator
 //
 
+// the bitmap allocator is only kept around as a baseline for the benchmark
+#ifdef PMALLOC_BENCHMARK
 static void *bitmap_fa_init(frame_allocator_t *fa) {
   size_t num_frames = align(fa->size, PAGE_SIZE) / PAGE_SIZE;
 
@@ -307,13 +326,375 @@ static void bitmap_fa_free(frame_allocator_t *fa, uintptr_t frame, size_t count,
   mtx_spin_unlock(&fa->lock);
 }
 
+static size_t bitmap_fa_alloc_bulk(frame_allocator_t *fa, uintptr_t *frames, size_t n) {
+  bitmap_t *bmp = fa->data;
+  size_t count = 0;
+  mtx_spin_lock(&fa->lock);
+  while (count < n) {
+    index_t frame_index = bitmap_get_set_free(bmp);
+    if (frame_index < 0) {
+      break;
+    }
+    frames[count++] = fa->base + PAGES_TO_SIZE(frame_index);
+  }
+  fa->free -= PAGES_TO_SIZE(count);
+  mtx_spin_unlock(&fa->lock);
+  return count;
+}
+
+static void bitmap_fa_free_bulk(frame_allocator_t *fa, const uintptr_t *frames, size_t n) {
+  bitmap_t *bmp = fa->data;
+  mtx_spin_lock(&fa->lock);
+  for (size_t i = 0; i < n; i++) {
+    bitmap_clear(bmp, SIZE_TO_PAGES(frames[i] - fa->base));
+  }
+  fa->free += PAGES_TO_SIZE(n);
+  mtx_spin_unlock(&fa->lock);
+}
+
 static struct frame_allocator_impl bitmap_allocator = {
   .fa_init = bitmap_fa_init,
   .fa_alloc = bitmap_fa_alloc,
   .fa_reserve = bitmap_fa_reserve,
   .fa_free = bitmap_fa_free,
+  .fa_alloc_bulk = bitmap_fa_alloc_bulk,
+  .fa_free_bulk = bitmap_fa_free_bulk,
+};
+#endif
+
+//
+// MARK: buddy frame allocator
+//
+
+#define BUDDY_MAX_ORDER 18 // 1GB block of 4KB frames
+
+struct buddy_fa {
+  buddy_t buddy;
+  uintptr_t tree_base; // naturally aligned base of the tree span
 };
 
+// returns the order of the smallest naturally aligned span which covers the region
+static uint8_t buddy_fa_depth(uintptr_t base, size_t size) {
+  uint8_t depth = 0;
+  while (align_down(base, PAGES_TO_SIZE(1ULL << depth)) + PAGES_TO_SIZE(1ULL << depth) < base + size) {
+    depth++;
+  }
+  return depth;
+}
+
+static size_t buddy_fa_meta_pages(uintptr_t base, size_t size) {
+  size_t nbytes = buddy_tree_size(buddy_fa_depth(base, size));
+  if (nbytes > PAGES_TO_SIZE(2)) {
+    return SIZE_TO_PAGES(nbytes);
+  }
+  return 0;
+}
+
+static void *buddy_fa_init(frame_allocator_t *fa) {
+  uint8_t depth = buddy_fa_depth(fa->base, fa->size);
+  uintptr_t tree_base = align_down(fa->base, PAGES_TO_SIZE(1ULL << depth));
+
+  void *tree;
+  size_t nbytes = buddy_tree_size(depth);
+  if (nbytes > PAGES_TO_SIZE(2)) {
+    // too large for kmalloc
+    size_t num_tree_pages = SIZE_TO_PAGES(nbytes);
+    if (num_tree_pages > reserved_pages) {
+      panic("no more reserved pages (%d)", num_tree_pages);
+    }
+
+    uintptr_t buffer_phys = mm_early_alloc_pages(num_tree_pages);
+    tree = mm_early_map_pages_reserved(buffer_phys, num_tree_pages, VM_WRITE);
+    reserved_pages -= num_tree_pages;
+  } else {
+    tree = kmalloc(nbytes);
+  }
+
+  struct buddy_fa *bfa = kmallocz(sizeof(struct buddy_fa));
+  bfa->tree_base = tree_base;
+  buddy_init(&bfa->buddy, tree, depth, BUDDY_MAX_ORDER);
+  // everything outside of the region stays marked as used
+  buddy_mark_free(&bfa->buddy, SIZE_TO_PAGES(fa->base - tree_base), fa->size / PAGE_SIZE);
+  return bfa;
+}
+
+static intptr_t buddy_fa_alloc(frame_allocator_t *fa, size_t count, size_t pagesize) {
+  struct buddy_fa *bfa = fa->data;
+  size_t num_4k_pages = (count * pagesize) / PAGE_SIZE;
+  uint8_t order = num_4k_pages == 1 ? 0 : 64 - __builtin_clzll(num_4k_pages - 1);
+
+  mtx_spin_lock(&fa->lock);
+  index_t frame_index = buddy_alloc(&bfa->buddy, order);
+  if (frame_index >= 0) {
+    // give back the tail of the block if the count is not a power of two
+    buddy_mark_free(&bfa->buddy, frame_index + num_4k_pages, (1ULL << order) - num_4k_pages);
+    fa->free -= count * pagesize;
+  }
+  mtx_spin_unlock(&fa->lock);
+  if (frame_index < 0) {
+    return -1;
+  }
+
+  return (intptr_t) bfa->tree_base + PAGES_TO_SIZE(frame_index);
+}
+
+static int buddy_fa_reserve(frame_allocator_t *fa, uintptr_t frame, size_t count, size_t pagesize) {
+  struct buddy_fa *bfa = fa->data;
+  size_t num_4k_pages = (count * pagesize) / PAGE_SIZE;
+  index_t frame_index = SIZE_TO_PAGES(frame - bfa->tree_base);
+
+  mtx_spin_lock(&fa->lock);
+  bool is_free = buddy_is_free(&bfa->buddy, frame_index, num_4k_pages);
+  if (is_free) {
+    buddy_mark_used(&bfa->buddy, frame_index, num_4k_pages);
+    fa->free -= count * pagesize;
+  }
+  mtx_spin_unlock(&fa->lock);
+  if (!is_free) {
+    // some or all of the requested pages are allocated
+    return -1;
+  }
+
+  return 0;
+}
+
+static void buddy_fa_free(frame_allocator_t *fa, uintptr_t frame, size_t count, size_t pagesize) {
+  struct buddy_fa *bfa = fa->data;
+  size_t num_4k_pages = (count * pagesize) / PAGE_SIZE;
+  index_t frame_index = SIZE_TO_PAGES(frame - bfa->tree_base);
+
+  mtx_spin_lock(&fa->lock);
+  kassertf(buddy_is_used(&bfa->buddy, frame_index, num_4k_pages), "double free of frame %p", frame);
+  buddy_mark_free(&bfa->buddy, frame_index, num_4k_pages);
+  fa->free += count * pagesize;
+  mtx_spin_unlock(&fa->lock);
+}
+
+static size_t buddy_fa_alloc_bulk(frame_allocator_t *fa, uintptr_t *frames, size_t n) {
+  struct buddy_fa *bfa = fa->data;
+  size_t count = 0;
+  mtx_spin_lock(&fa->lock);
+  while (count < n) {
+    index_t frame_index = buddy_alloc(&bfa->buddy, 0);
+    if (frame_index < 0) {
+      break;
+    }
+    frames[count++] = bfa->tree_base + PAGES_TO_SIZE(frame_index);
+  }
+  fa->free -= PAGES_TO_SIZE(count);
+  mtx_spin_unlock(&fa->lock);
+  return count;
+}
+
+static void buddy_fa_free_bulk(frame_allocator_t *fa, const uintptr_t *frames, size_t n) {
+  struct buddy_fa *bfa = fa->data;
+  mtx_spin_lock(&fa->lock);
+  for (size_t i = 0; i < n; i++) {
+    index_t frame_index = SIZE_TO_PAGES(frames[i] - bfa->tree_base);
+    kassertf(buddy_is_used(&bfa->buddy, frame_index, 1), "double free of frame %p", frames[i]);
+    buddy_mark_free(&bfa->buddy, frame_index, 1);
+  }
+  fa->free += PAGES_TO_SIZE(n);
+  mtx_spin_unlock(&fa->lock);
+}
+
+static struct frame_allocator_impl buddy_allocator = {
+  .fa_init = buddy_fa_init,
+  .fa_alloc = buddy_fa_alloc,
+  .fa_reserve = buddy_fa_reserve,
+  .fa_free = buddy_fa_free,
+  .fa_alloc_bulk = buddy_fa_alloc_bulk,
+  .fa_free_bulk = buddy_fa_free_bulk,
+};
+
+//
+// MARK: per-cpu page cache
+//
+
+#define PCP_BATCH 16
+#define PCP_HIGH  64
+#define PCP_MAX   (PCP_HIGH + PCP_BATCH)
+
+/*
+ * A per-cpu magazine of free 4k frames.
+ *
+ * Single page allocations and frees go through the cache of the current cpu so
+ * that the zone allocator locks are only taken once per batch. The cache lock is
+ * only ever contended when another cpu drains it under memory pressure.
+ */
+struct pcp_pages {
+  mtx_t lock;
+  uint16_t count;   // number of cached frames
+  uint16_t low;     // refill a batch when count drops to this
+  uint16_t high;    // drain a batch when count goes above this
+  uint16_t batch;   // number of frames moved per refill/drain
+  struct pcp_stats stats;
+  struct {
+    uintptr_t frame;
+    frame_allocator_t *fa;
+  } frames[PCP_MAX];
+};
+
+static struct pcp_pages *cpu_pcp_pages[MAX_CPUS];
+
+static inline bool pcp_is_cacheable(uintptr_t frame) {
+  // keep the low and dma zones out of the caches
+  return get_mem_zone_type(frame) >= ZONE_TYPE_NORMAL;
+}
+
+static void pcp_refill(struct pcp_pages *pcp) {
+  uintptr_t frames[PCP_BATCH];
+  size_t want = min(pcp->batch, PCP_MAX - pcp->count);
+  for (zone_type_t zone_type = ZONE_ALLOC_DEFAULT; zone_type >= ZONE_TYPE_NORMAL && want > 0; zone_type--) {
+    frame_allocator_t *fa = LIST_FIRST(&mem_zones[zone_type]);
+    while (fa && want > 0) {
+      if (fa->free >= PAGE_SIZE) {
+        size_t n = fa->impl->fa_alloc_bulk(fa, frames, want);
+        for (size_t i = 0; i < n; i++) {
+          pcp->frames[pcp->count].frame = frames[i];
+          pcp->frames[pcp->count].fa = fa;
+          pcp->count++;
+        }
+        want -= n;
+      }
+      fa = LIST_NEXT(fa, list);
+    }
+  }
+  pcp->stats.refills++;
+}
+
+// returns the n oldest frames in the cache to their allocators
+static void pcp_drain(struct pcp_pages *pcp, size_t n) {
+  uintptr_t frames[PCP_BATCH];
+  n = min(n, pcp->count);
+
+  size_t i = 0;
+  while (i < n) {
+    // free runs of frames owned by the same allocator together
+    frame_allocator_t *fa = pcp->frames[i].fa;
+    size_t run = 0;
+    while (i < n && run < PCP_BATCH && pcp->frames[i].fa == fa) {
+      frames[run++] = pcp->frames[i++].frame;
+    }
+    fa->impl->fa_free_bulk(fa, frames, run);
+  }
+
+  pcp->count -= n;
+  memmove(&pcp->frames[0], &pcp->frames[n], pcp->count * sizeof(pcp->frames[0]));
+  pcp->stats.drains++;
+}
+
+__ref static page_t *pcp_alloc_page() {
+  struct pcp_pages *pcp = curcpu_pcp_pages;
+  if (__expect_false(pcp == NULL)) {
+    return NULL;
+  }
+
+  bool refilled = false;
+  mtx_spin_lock(&pcp->lock);
+  if (pcp->count <= pcp->low) {
+    pcp->stats.alloc_misses++;
+    pcp_refill(pcp);
+    if (pcp->count == 0) {
+      mtx_spin_unlock(&pcp->lock);
+      return NULL;
+    }
+    refilled = true;
+  } else {
+    pcp->stats.alloc_hits++;
+  }
+
+  pcp->count--;
+  uintptr_t frame = pcp->frames[pcp->count].frame;
+  frame_allocator_t *fa = pcp->frames[pcp->count].fa;
+  mtx_spin_unlock(&pcp->lock);
+
+  // only the refills touch the zones so only they can cross the watermark
+  if (refilled) {
+    check_watermark();
+  }
+  return alloc_page_structs(fa, frame, 1, PAGE_SIZE);
+}
+
+static bool pcp_free_frame(frame_allocator_t *fa, uintptr_t frame) {
+  struct pcp_pages *pcp = curcpu_pcp_pages;
+  if (__expect_false(pcp == NULL) || !pcp_is_cacheable(frame)) {
+    return false;
+  }
+
+  mtx_spin_lock(&pcp->lock);
+  pcp->frames[pcp->count].frame = frame;
+  pcp->frames[pcp->count].fa = fa;
+  pcp->count++;
+  pcp->stats.free_hits++;
+  if (pcp->count > pcp->high) {
+    pcp_drain(pcp, pcp->batch);
+  }
+  mtx_spin_unlock(&pcp->lock);
+  return true;
+}
+
+static void pcp_percpu_init() {
+  struct pcp_pages *pcp = kmallocz(sizeof(struct pcp_pages));
+  mtx_init(&pcp->lock, MTX_SPIN, "pcp_pages_lock");
+  pcp->low = 0;
+  pcp->high = PCP_HIGH;
+  pcp->batch = PCP_BATCH;
+  cpu_pcp_pages[curcpu_id] = pcp;
+  PERCPU_AREA->pcp_pages = pcp;
+}
+PERCPU_EARLY_INIT(pcp_percpu_init);
+
+/**
+ * Returns all frames cached by the given cpu to the zone allocators.
+ * This may be called from any cpu.
+ */
+void pcp_drain_cpu(int cpu) {
+  ASSERT(cpu >= 0 && cpu < MAX_CPUS);
+  struct pcp_pages *pcp = cpu_pcp_pages[cpu];
+  if (pcp == NULL) {
+    return;
+  }
+
+  mtx_spin_lock(&pcp->lock);
+  while (pcp->count > 0) {
+    pcp_drain(pcp, pcp->batch);
+  }
+  mtx_spin_unlock(&pcp->lock);
+}
+
+void pcp_drain_all() {
+  for (int i = 0; i < system_num_cpus; i++) {
+    pcp_drain_cpu(i);
+  }
+}
+
+void pcp_get_stats(int cpu, struct pcp_stats *stats) {
+  ASSERT(cpu >= 0 && cpu < MAX_CPUS);
+  struct pcp_pages *pcp = cpu_pcp_pages[cpu];
+  if (pcp == NULL) {
+    memset(stats, 0, sizeof(struct pcp_stats));
+    return;
+  }
+
+  mtx_spin_lock(&pcp->lock);
+  *stats = pcp->stats;
+  mtx_spin_unlock(&pcp->lock);
+}
+
+void pcp_dump_stats() {
+  kprintf("pcp pages:\n");
+  for (int i = 0; i < system_num_cpus; i++) {
+    struct pcp_stats stats;
+    pcp_get_stats(i, &stats);
+
+    uint64_t total = stats.alloc_hits + stats.alloc_misses;
+    uint64_t rate = total ? (stats.alloc_hits * 100) / total : 0;
+    kprintf("  CPU#%d: hits=%llu misses=%llu (%llu%%) frees=%llu refills=%llu drains=%llu\n",
+            i, stats.alloc_hits, stats.alloc_misses, rate, stats.free_hits, stats.refills, stats.drains);
+  }
+}
+
 //
 // MARK: frame allocator api
 //
@@ -342,8 +723,8 @@ __move page_t *fa_alloc_pages(frame_allocator_t *fa, size_t count, size_t pg_siz
   }
 
   // alloc the backing frames
-  uintptr_t frame = fa->impl->fa_alloc(fa, count, pg_size);
-  if (frame == 0) {
+  intptr_t frame = fa->impl->fa_alloc(fa, count, pg_size);
+  if (frame < 0) {
     return NULL;
   }
 
@@ -363,27 +744,52 @@ int fa_reserve_pages(frame_allocator_t *fa, uintptr_t frame, size_t count, size_
 }
 
 void fa_free_page(page_t *page) {
-  if (page->flags & PG_COW) {
+  if (page->flags & (PG_COW | PG_SUBPAGE)) {
     // drop ref to the source page
     putref(&page->source, fa_free_page);
   } else if (page->flags & PG_OWNING) {
     frame_allocator_t *fa = page->fa;
-    fa->impl->fa_free(fa, page->address, 1, pg_flags_to_size(page->flags));
+    size_t pg_size = pg_flags_to_size(page->flags);
+    if (pg_size != PAGE_SIZE || !pcp_free_frame(fa, page->address)) {
+      fa->impl->fa_free(fa, page->address, 1, pg_size);
+    }
   }
 
   putref(&page->next, fa_free_page);
-  kfree(page);
+  kmem_cache_free(page_cache, page);
 }
 
 //
 //
 
 void init_mem_zones() {
+  memory_map_t *memory_map = &boot_info_v2->mem_map;
+  size_t num_entries = memory_map->size / sizeof(memory_map_entry_t);
+
+  page_cache = kmem_cache_create("page", sizeof(page_t), 0, 0);
+  pte_cache = kmem_cache_create("pte", sizeof(struct pte), 0, 0);
+
+  // account for the buddy trees that wont fit in the kernel heap
+  for (size_t i = 0; i < num_entries; i++) {
+    memory_map_entry_t *entry = &memory_map->map[i];
+    if (entry->type != MEMORY_USABLE) {
+      continue;
+    }
+
+    uintptr_t base = entry->base;
+    size_t size = entry->size;
+    zone_type_t type = get_mem_zone_type(base);
+    if (type != get_mem_zone_type(base + size - 1)) {
+      uintptr_t end_base = zone_limits[type];
+      reserved_pages += buddy_fa_meta_pages(end_base, base + size - end_base);
+      size = end_base - base;
+    }
+    reserved_pages += buddy_fa_meta_pages(base, size);
+  }
+
   // reserve pages in zone entry
   mm_early_reserve_pages(reserved_pages);
 
-  memory_map_t *memory_map = &boot_info_v2->mem_map;
-  size_t num_entries = memory_map->size / sizeof(memory_map_entry_t);
   for (size_t i = 0; i < num_entries; i++) {
     memory_map_entry_t *entry = &memory_map->map[i];
     if (entry->type != MEMORY_USABLE) {
@@ -402,7 +808,7 @@ void init_mem_zones() {
       size_t end_size = base + size - end_base;
 
       // create allocator in the zone which this entry spills into
-      frame_allocator_t *fa = new_frame_allocator(end_base, end_size, &bitmap_allocator);
+      frame_allocator_t *fa = new_frame_allocator(end_base, end_size, &buddy_allocator);
       LIST_ADD(&mem_zones[end_type], fa, list);
       zone_page_count[end_type] += SIZE_TO_PAGES(end_size);
 
@@ -410,7 +816,7 @@ void init_mem_zones() {
       size = fa->base - base;
     }
 
-    frame_allocator_t *fa = new_frame_allocator(base, size, &bitmap_allocator);
+    frame_allocator_t *fa = new_frame_allocator(base, size, &buddy_allocator);
     ASSERT(fa != NULL);
     LIST_ADD(&mem_zones[type], fa, list);
     zone_page_count[end_type] += SIZE_TO_PAGES(size);
@@ -424,6 +830,14 @@ void init_mem_zones() {
     }
   }
 
+  // size the watermarks from the total amount of memory
+  size_t total_pages = 0;
+  for (size_t i = 0; i < MAX_ZONE_TYPE; i++) {
+    total_pages += zone_page_count[i];
+  }
+  pg_watermarks[PG_WMARK_LOW] = max(total_pages / 64, 256);
+  pg_watermarks[PG_WMARK_HIGH] = pg_watermarks[PG_WMARK_LOW] * 2;
+
   kprintf("memory zones:\n");
   for (size_t i = 0; i < MAX_ZONE_TYPE; i++) {
     uintptr_t zone_start = i == 0 ? 0 : zone_limits[i - 1];
@@ -473,6 +887,23 @@ int reserve_pages(enum pg_rsrv_kind kind, uintptr_t address, size_t count, size_
   return fa_reserve_pages(fa, address, count, pagesize);
 }
 
+size_t pmalloc_free_pages() {
+  size_t free = 0;
+  for (size_t i = 0; i < MAX_ZONE_TYPE; i++) {
+    frame_allocator_t *fa = LIST_FIRST(&mem_zones[i]);
+    while (fa) {
+      free += fa->free;
+      fa = LIST_NEXT(fa, list);
+    }
+  }
+  return free / PAGE_SIZE;
+}
+
+size_t pmalloc_watermark(enum pg_wmark wmark) {
+  ASSERT(wmark < MAX_PG_WMARK);
+  return pg_watermarks[wmark];
+}
+
 // MARK: page allocation api
 //
 
@@ -503,11 +934,31 @@ __ref page_t *alloc_pages_zone(zone_type_t zone_type, size_t count, size_t pages
 __ref page_t *alloc_pages_size(size_t count, size_t pagesize) {
   ASSERT(pagesize == PAGE_SIZE || pagesize == PAGE_SIZE_2MB || pagesize == PAGE_SIZE_1GB);
   zone_type_t zone_type = ZONE_ALLOC_DEFAULT;
+  if (count == 1 && pagesize == PAGE_SIZE) {
+    page_t *page = pcp_alloc_page();
+    if (page != NULL) {
+      return page;
+    }
+  }
 
+  bool drained = false;
+  bool reclaimed = false;
   page_t *pages = NULL;
   while (pages == NULL) {
     if (zone_type == MAX_ZONE_TYPE) {
-      panic("out of memory");
+      if (!drained) {
+        // give back the frames held in the per-cpu caches and try again
+        pcp_drain_all();
+        drained = true;
+      } else if (!reclaimed) {
+        // shrink the caches ourselves rather than wait for the reclaim thread
+        reclaim_direct(SIZE_TO_PAGES(count * pagesize));
+        pcp_drain_all();
+        reclaimed = true;
+      } else {
+        panic("out of memory");
+      }
+      zone_type = ZONE_ALLOC_DEFAULT;
     }
 
     // try all of the zones
@@ -516,6 +967,28 @@ __ref page_t *alloc_pages_size(size_t count, size_t pagesize) {
       zone_type = zone_alloc_order[zone_type];
   }
 
+  check_watermark();
+  return pages;
+}
+
+// like alloc_pages_size but returns NULL instead of panicking when no frames are
+// available. this is meant for allocations that can fall back to smaller pages
+__ref page_t *try_alloc_pages_size(size_t count, size_t pagesize) {
+  ASSERT(pagesize == PAGE_SIZE || pagesize == PAGE_SIZE_2MB || pagesize == PAGE_SIZE_1GB);
+  if (count == 1 && pagesize == PAGE_SIZE) {
+    page_t *page = pcp_alloc_page();
+    if (page != NULL) {
+      return page;
+    }
+  }
+
+  zone_type_t zone_type = ZONE_ALLOC_DEFAULT;
+  page_t *pages = NULL;
+  while (pages == NULL && zone_type != MAX_ZONE_TYPE) {
+    pages = alloc_pages_zone(zone_type, count, pagesize);
+    zone_type = zone_alloc_order[zone_type];
+  }
+  check_watermark();
   return pages;
 }
 
@@ -554,6 +1027,24 @@ __ref page_t *alloc_shared_pages(page_t *pages) {
   return alloc_shared_structs(pages);
 }
 
+/**
+ * Returns a new 4K page struct for the frame at the given offset within a big
+ * page. Like a cow page the struct keeps the big page alive, so the frame can
+ * be handed out to code that only deals with 4K pages.
+ */
+__ref page_t *alloc_subpage(page_t *page, size_t off) {
+  ASSERT(is_aligned(off, PAGE_SIZE) && off < pg_flags_to_size(page->flags));
+  page_t *subpage = kmem_cache_allocz(page_cache);
+  subpage->address = page->address + off;
+  subpage->flags = PG_HEAD | PG_COW;
+  subpage->head.count = 1;
+  subpage->head.contiguous = true;
+  subpage->source = getref((page->flags & PG_COW) ? page->source : page);
+  mtx_init(&subpage->pg_lock, MTX_SPIN, "pg_lock");
+  initref(subpage);
+  return subpage;
+}
+
 void drop_pages(__move page_t **pagesref) {
   if (__expect_false(pagesref == NULL || *pagesref == NULL)) {
     return;
@@ -563,11 +1054,63 @@ void drop_pages(__move page_t **pagesref) {
   putref(&pages, fa_free_page);
 }
 
+/**
+ * Releases a list of pages one page at a time. Unlike drop_pages the pages are
+ * unlinked first so that pages which are still referenced elsewhere (such as
+ * cow sources) do not keep the rest of the list alive or referenced.
+ */
+void drop_pages_unlinked(__move page_t **pagesref) {
+  page_t *page = moveref(*pagesref);
+  while (page != NULL) {
+    page_t *next = moveref(page->next);
+    putref(&page, fa_free_page);
+    page = next;
+  }
+}
+
+// MARK: raw frame api
+//
+
+/**
+ * Allocates count contiguous frames of the given size without any page structs.
+ * This is meant for the allocators that back the page structs themselves. The
+ * physical address of the first frame is returned or -1 if no frames are free.
+ */
+intptr_t alloc_frames(size_t count, size_t pagesize) {
+  ASSERT(pagesize == PAGE_SIZE || pagesize == PAGE_SIZE_2MB || pagesize == PAGE_SIZE_1GB);
+  if (count == 0) {
+    return -1;
+  }
+
+  size_t total_size = count * pagesize;
+  zone_type_t zone_type = ZONE_ALLOC_DEFAULT;
+  while (zone_type != MAX_ZONE_TYPE) {
+    frame_allocator_t *fa = LIST_FIRST(&mem_zones[zone_type]);
+    while (fa) {
+      if (fa->free >= total_size) {
+        intptr_t frame = fa->impl->fa_alloc(fa, count, pagesize);
+        if (frame >= 0) {
+          return frame;
+        }
+      }
+      fa = LIST_NEXT(fa, list);
+    }
+    zone_type = zone_alloc_order[zone_type];
+  }
+  return -1;
+}
+
+void free_frames(uintptr_t frame, size_t count, size_t pagesize) {
+  frame_allocator_t *fa = locate_owning_allocator(frame);
+  ASSERT(fa != NULL);
+  fa->impl->fa_free(fa, frame, count, pagesize);
+}
+
 // MARK: page struct api
 //
 
 struct pte *pte_struct_alloc(page_t *page, uint64_t *entry, vm_mapping_t *vm) {
-  struct pte *pte = kmallocz(sizeof(struct pte));
+  struct pte *pte = kmem_cache_allocz(pte_cache);
   pte->page = getref(page);
   pte->entry = entry;
   pte->address = vm->address;
@@ -577,7 +1120,7 @@ struct pte *pte_struct_alloc(page_t *page, uint64_t *entry, vm_mapping_t *vm) {
 void pte_struct_free(struct pte **pteptr) {
   struct pte *pte = moveref(*pteptr);
   drop_pages(&pte->page);
-  kfree(pte);
+  kmem_cache_free(pte_cache, pte);
 }
 
 void page_add_mapping(page_t *page, struct pte *pte) {
@@ -641,6 +1184,62 @@ void page_update_flags(page_t *page, uint32_t flags) {
 //
 //
 
+/**
+ * Splits an owning page into a list of smaller owning pages covering the same
+ * frames. The original page gives up ownership of its frames so only the struct
+ * is released once it is dropped. The page must not be shared.
+ */
+__ref page_t *page_split_frames(page_t *page, size_t pg_size) {
+  size_t size = pg_flags_to_size(page->flags);
+  ASSERT(page->flags & PG_OWNING);
+  ASSERT(pg_size < size);
+
+  mtx_spin_lock(&page->pg_lock);
+  page->flags &= ~PG_OWNING;
+  mtx_spin_unlock(&page->pg_lock);
+  return alloc_page_structs(page->fa, page->address, size / pg_size, pg_size);
+}
+
+/**
+ * Splits a page that may still be shared into a list of smaller pages covering
+ * the same frames. Each new page keeps the original alive so nothing is copied
+ * and any subpages handed out before stay valid. The pieces of a cow page are
+ * cow pages of its source while the pieces of any other page can be written in
+ * place.
+ */
+__ref page_t *page_split_shared(page_t *page, size_t pg_size) {
+  size_t size = pg_flags_to_size(page->flags);
+  ASSERT(pg_size < size);
+  uint32_t pg_flags = (page->flags & PG_COW) ? PG_COW : PG_SUBPAGE;
+  if (pg_size == BIGPAGE_SIZE) {
+    pg_flags |= PG_BIGPAGE;
+  }
+  page_t *source = (page->flags & PG_COW) ? page->source : page;
+
+  page_t *first = NULL;
+  page_t *last = NULL;
+  for (size_t off = 0; off < size; off += pg_size) {
+    page_t *piece = kmem_cache_allocz(page_cache);
+    piece->address = page->address + off;
+    piece->flags = pg_flags;
+    piece->source = getref(source);
+    mtx_init(&piece->pg_lock, MTX_SPIN, "pg_lock");
+    initref(piece);
+    if (first == NULL) {
+      first = moveref(piece);
+      last = first;
+    } else {
+      last->next = moveref(piece);
+      last = last->next;
+    }
+  }
+
+  first->flags |= PG_HEAD;
+  first->head.count = size / pg_size;
+  first->head.contiguous = true;
+  return moveref(first);
+}
+
 // Joins two page lists together and returns a moved reference to the new head.
 __ref page_t *page_list_join(__ref page_t *head, __ref page_t *tail) {
   if (head == NULL) {
@@ -702,3 +1301,127 @@ __ref page_t *page_list_split(__ref page_t *head, size_t count, __out page_t **t
   *tailref = moveref(newhead);
   return head;
 }
+
+//
+// MARK: allocator benchmark
+//
+
+#ifdef PMALLOC_BENCHMARK
+#define BENCH_BASE  SIZE_16GB // synthetic region, frames are never touched
+#define BENCH_SIZE  SIZE_16MB
+#define BENCH_OPS   20000
+
+static uint64_t bench_rand(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static uint64_t bench_alloc_free(frame_allocator_t *fa, intptr_t *held, size_t nframes, int mix) {
+  struct frame_allocator_impl *impl = fa->impl;
+  uint64_t seed = 0x2545F4914F6CDD1DULL;
+  size_t count = 0;
+  size_t ops = 0;
+
+  uint64_t t0 = cpu_read_tsc();
+  switch (mix) {
+    case 0: // fill with 4k pages then drain in random order
+      while (count < nframes && (held[count] = impl->fa_alloc(fa, 1, PAGE_SIZE)) >= 0)
+        count++;
+      ops += count;
+      while (count > 0) {
+        size_t i = bench_rand(&seed) % count;
+        impl->fa_free(fa, held[i], 1, PAGE_SIZE);
+        held[i] = held[--count];
+        ops++;
+      }
+      break;
+    case 1: // random 4k alloc/free mix
+      for (; ops < BENCH_OPS; ops++) {
+        if (count < nframes && (count == 0 || bench_rand(&seed) % 5 < 3)) {
+          intptr_t frame = impl->fa_alloc(fa, 1, PAGE_SIZE);
+          if (frame >= 0)
+            held[count++] = frame;
+        } else {
+          size_t i = bench_rand(&seed) % count;
+          impl->fa_free(fa, held[i], 1, PAGE_SIZE);
+          held[i] = held[--count];
+        }
+      }
+      break;
+    case 2: // 2mb pages on top of a fragmented zone
+      for (size_t i = 0; i < nframes / 4; i++) {
+        intptr_t frame = impl->fa_alloc(fa, 1, PAGE_SIZE);
+        if (frame >= 0)
+          held[count++] = frame;
+      }
+      for (size_t i = 0; i < count; i += 2) {
+        impl->fa_free(fa, held[i], 1, PAGE_SIZE);
+      }
+      for (; ops < BENCH_OPS / 10; ops++) {
+        intptr_t frame = impl->fa_alloc(fa, 1, PAGE_SIZE_2MB);
+        if (frame >= 0)
+          impl->fa_free(fa, frame, 1, PAGE_SIZE_2MB);
+      }
+      for (size_t i = 1; i < count; i += 2) {
+        impl->fa_free(fa, held[i], 1, PAGE_SIZE);
+      }
+      count = 0;
+      break;
+    default: // random multi-page alloc/free mix
+      for (; ops < BENCH_OPS; ops++) {
+        if (count < nframes && (count == 0 || bench_rand(&seed) % 5 < 3)) {
+          size_t n = 2 + bench_rand(&seed) % 31;
+          intptr_t frame = impl->fa_alloc(fa, n, PAGE_SIZE);
+          if (frame >= 0) {
+            held[count++] = frame;
+            held[count++] = (intptr_t) n;
+          }
+        } else {
+          size_t i = (bench_rand(&seed) % (count / 2)) * 2;
+          impl->fa_free(fa, held[i], held[i + 1], PAGE_SIZE);
+          held[i + 1] = held[--count];
+          held[i] = held[--count];
+        }
+      }
+      break;
+  }
+  uint64_t t1 = cpu_read_tsc();
+
+  while (count > 0) {
+    if (mix == 3) {
+      count -= 2;
+      impl->fa_free(fa, held[count], held[count + 1], PAGE_SIZE);
+    } else {
+      impl->fa_free(fa, held[--count], 1, PAGE_SIZE);
+    }
+  }
+  return (t1 - t0) / max(ops, 1);
+}
+
+static void pmalloc_benchmark() {
+  static const char *mix_names[] = { "4k fill/drain", "4k random", "2mb fragmented", "multi-page" };
+  size_t nframes = BENCH_SIZE / PAGE_SIZE;
+  intptr_t *held = kmalloc(nframes * sizeof(intptr_t));
+
+  frame_allocator_t *bitmap_fa = new_frame_allocator(BENCH_BASE, BENCH_SIZE, &bitmap_allocator);
+  frame_allocator_t *buddy_fa = new_frame_allocator(BENCH_BASE, BENCH_SIZE, &buddy_allocator);
+  kprintf("pmalloc: benchmark (%zu frames, cycles/op)\n", nframes);
+  for (int mix = 0; mix < ARRAY_SIZE(mix_names); mix++) {
+    uint64_t bitmap_cycles = bench_alloc_free(bitmap_fa, held, nframes, mix);
+    uint64_t buddy_cycles = bench_alloc_free(buddy_fa, held, nframes, mix);
+    kprintf("  %-16s bitmap %8llu  buddy %8llu\n", mix_names[mix], bitmap_cycles, buddy_cycles);
+  }
+
+  bitmap_free(bitmap_fa->data);
+  kfree(bitmap_fa->data);
+  kfree(bitmap_fa);
+  kfree(((struct buddy_fa *) buddy_fa->data)->buddy.tree);
+  kfree(buddy_fa->data);
+  kfree(buddy_fa);
+  kfree(held);
+}
+STATIC_INIT(pmalloc_benchmark);
+#endif
@@ -0,0 +1,196 @@
+#include <kernel/mm/reclaim.h>
+#include <kernel/mm/pmalloc.h>
+#include <kernel/mm/pgcache.h>
+
+#include <kernel/atomic.h>
+#include <kernel/cond.h>
+#include <kernel/mutex.h>
+#include <kernel/proc.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/str.h>
+#include <kernel/panic.h>
+
+#define ASSERT(x) kassert(x)
+// #define DPRINTF(fmt, ...) kprintf("reclaim: " fmt, ##__VA_ARGS__)
+#define DPRINTF(fmt, ...)
+
+#define RECLAIM_BATCH     64                // minimum objects asked of a shrinker per pass
+#define RECLAIM_MAX_PASSES 8                // passes before the reclaim thread gives up
+#define RECLAIM_INTERVAL  MS_TO_NS(1000)    // period of the watermark check
+
+static LIST_HEAD(struct shrinker) shrinkers;
+static mtx_t shrinkers_lock;
+static mtx_t reclaim_lock;
+static cond_t reclaim_cond;
+static volatile int reclaim_pending;
+static struct reclaim_stats reclaim_stats;
+
+static bool reclaim_can_block() {
+  thread_t *td = curthread;
+  return td != NULL && td->crit_level == 0 && !TDF_IS_IDLE(td);
+}
+
+// asks every shrinker to free about nr objects. the shrinkers lock must be held
+static size_t reclaim_pass(size_t nr) {
+  size_t freed = 0;
+  struct shrinker *shrinker;
+  LIST_FOREACH(shrinker, &shrinkers, list) {
+    size_t count = shrinker->count(shrinker);
+    if (count == 0) {
+      continue;
+    }
+
+    size_t n = shrinker->scan(shrinker, min(count, max(nr, RECLAIM_BATCH)));
+    DPRINTF("%s: freed %zu of %zu\n", shrinker->name, n, count);
+    shrinker->freed += n;
+    freed += n;
+  }
+
+  atomic_fetch_add(&reclaim_stats.passes, 1);
+  atomic_fetch_add(&reclaim_stats.freed, freed);
+  return freed;
+}
+
+// shrinks the caches until the free pages are back above the high watermark and
+// returns false if they could not get there
+static bool reclaim_balance() {
+  size_t high = pmalloc_watermark(PG_WMARK_HIGH);
+  bool balanced = false;
+  mtx_lock(&shrinkers_lock);
+  for (int i = 0; i < RECLAIM_MAX_PASSES; i++) {
+    size_t free = pmalloc_free_pages();
+    if (free >= high) {
+      balanced = true;
+      break;
+    }
+
+    if (reclaim_pass(high - free) == 0) {
+      break; // nothing left to give back
+    }
+    // the freed frames may be sitting in the per-cpu caches
+    pcp_drain_all();
+  }
+  mtx_unlock(&shrinkers_lock);
+  return balanced;
+}
+
+static noreturn void reclaim_worker() {
+  bool backoff = false;
+  mtx_lock(&reclaim_lock);
+  for (;;) {
+    if (backoff || atomic_load(&reclaim_pending) == 0) {
+      // the timeout covers a wakeup sent just before we started waiting
+      cond_timedwait(&reclaim_cond, &reclaim_lock.lo, RECLAIM_INTERVAL);
+    }
+    atomic_store(&reclaim_pending, 0);
+
+    mtx_unlock(&reclaim_lock);
+    backoff = false;
+    if (pmalloc_free_pages() < pmalloc_watermark(PG_WMARK_LOW)) {
+      backoff = !reclaim_balance();
+    }
+    mtx_lock(&reclaim_lock);
+
+    if (backoff) {
+      // the caches had nothing more to give so leave the wakeup pending until
+      // the next interval. otherwise every allocation below the low watermark
+      // would wake us for another pass that frees nothing
+      atomic_store(&reclaim_pending, 1);
+    }
+  }
+}
+
+static void reclaim_static_init() {
+  LIST_INIT(&shrinkers);
+  mtx_init(&shrinkers_lock, 0, "shrinkers_lock");
+  mtx_init(&reclaim_lock, 0, "reclaim_lock");
+  cond_init(&reclaim_cond, "reclaim_cond");
+}
+STATIC_INIT(reclaim_static_init);
+
+static void reclaim_module_init() {
+  thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+  thread_setup_entry(td, (uintptr_t) reclaim_worker);
+  td->name = str_fmt("reclaimd");
+  proc_add_thread(curproc, td);
+  thread_finish_setup_and_submit(td);
+}
+MODULE_INIT(reclaim_module_init);
+
+//
+// MARK: Public API
+//
+
+void register_shrinker(struct shrinker *shrinker) {
+  ASSERT(shrinker->count != NULL && shrinker->scan != NULL);
+  shrinker->freed = 0;
+  mtx_lock(&shrinkers_lock);
+  LIST_ADD(&shrinkers, shrinker, list);
+  mtx_unlock(&shrinkers_lock);
+}
+
+void unregister_shrinker(struct shrinker *shrinker) {
+  mtx_lock(&shrinkers_lock);
+  LIST_REMOVE(&shrinkers, shrinker, list);
+  mtx_unlock(&shrinkers_lock);
+}
+
+/**
+ * Wakes the reclaim thread. This is called by the page allocator whenever it
+ * notices the free pages have dropped below the low watermark so it only takes
+ * a single atomic op if the thread was already woken or is backing off after a
+ * pass that could not reach the high watermark.
+ */
+void reclaim_wakeup() {
+  if (atomic_cmpxchg(&reclaim_pending, 0, 1)) {
+    atomic_fetch_add(&reclaim_stats.wakeups, 1);
+    cond_signal(&reclaim_cond);
+  }
+}
+
+/**
+ * Runs a single pass over the shrinkers from the calling thread and returns the
+ * number of objects freed. This is the last resort of an allocation that found
+ * no free frames, so it does nothing if the caller cannot block or is already
+ * running the shrinkers.
+ */
+size_t reclaim_direct(size_t nr_pages) {
+  if (!reclaim_can_block() || mtx_owner(&shrinkers_lock) == curthread) {
+    return 0;
+  }
+
+  atomic_fetch_add(&reclaim_stats.direct, 1);
+  mtx_lock(&shrinkers_lock);
+  size_t freed = reclaim_pass(nr_pages);
+  mtx_unlock(&shrinkers_lock);
+  return freed;
+}
+
+void reclaim_get_stats(struct reclaim_stats *stats) {
+  stats->wakeups = atomic_load(&reclaim_stats.wakeups);
+  stats->direct = atomic_load(&reclaim_stats.direct);
+  stats->passes = atomic_load(&reclaim_stats.passes);
+  stats->freed = atomic_load(&reclaim_stats.freed);
+}
+
+void reclaim_dump_stats() {
+  struct reclaim_stats stats;
+  reclaim_get_stats(&stats);
+  kprintf("reclaim: %zu free pages (low=%zu high=%zu)\n", pmalloc_free_pages(),
+          pmalloc_watermark(PG_WMARK_LOW), pmalloc_watermark(PG_WMARK_HIGH));
+  kprintf("  wakeups=%llu direct=%llu passes=%llu freed=%llu\n",
+          stats.wakeups, stats.direct, stats.passes, stats.freed);
+
+  struct pgcache_stats pgstats;
+  pgcache_get_stats(&pgstats);
+  kprintf("  pgcache: cached=%zu active=%zu inactive=%zu reclaimed=%llu scanned=%llu nodes_freed=%llu\n",
+          pgstats.cached, pgstats.active, pgstats.inactive, pgstats.reclaimed, pgstats.scanned, pgstats.nodes_freed);
+
+  mtx_lock(&shrinkers_lock);
+  struct shrinker *shrinker;
+  LIST_FOREACH(shrinker, &shrinkers, list) {
+    kprintf("  %-16s count=%zu freed=%llu\n", shrinker->name, shrinker->count(shrinker), shrinker->freed);
+  }
+  mtx_unlock(&shrinkers_lock);
+}
@@ -0,0 +1,727 @@
+#include <kernel/mm/slab.h>
+#include <kernel/mm/pmalloc.h>
+#include <kernel/mm/pgtable.h>
+#include <kernel/mm/init.h>
+#include <kernel/mm/reclaim.h>
+#include <kernel/mm/tlb.h>
+
+#include <kernel/cpu/cpu.h>
+#include <kernel/mutex.h>
+#include <kernel/proc.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/panic.h>
+
+#define ASSERT(x) kassert(x)
+// #define DPRINTF(fmt, ...) kprintf("slab: %s: " fmt, __func__, ##__VA_ARGS__)
+#define DPRINTF(fmt, ...)
+
+#define KMEM_MAX_ORDER    3   // largest slab is 2^3 pages
+#define KMEM_MIN_OBJS     8   // preferred minimum number of objects per slab
+#define KMEM_MIN_ALIGN    8
+#define KMEM_MAX_EMPTY    2   // empty slabs kept by a cache before returning them
+#define KMEM_MAG_MAX      32  // max rounds in a magazine
+
+#define KMEM_CHUNK_SIZE   SIZE_2MB
+#define KMEM_REGION_SIZE  (KERNEL_SLAB_SIZE / (KMEM_MAX_ORDER + 1))
+#define KMEM_CHUNK_PAGES  SIZE_TO_PAGES(KMEM_CHUNK_SIZE)
+
+struct kmem_slab {
+  kmem_cache_t *cache;
+  void *freelist;                   // list of free objects
+  uint16_t inuse;                   // number of allocated objects
+  LIST_ENTRY(struct kmem_slab) list;
+};
+
+/*
+ * A per-cpu magazine of free objects.
+ *
+ * Each cpu has its own magazine for every cache which is only ever touched by
+ * that cpu from within a critical section, so the common alloc and free paths
+ * do not take any locks. Objects move between the magazine and the slabs in
+ * batches under the cache lock.
+ */
+struct kmem_magazine {
+  uint16_t count;
+  uint16_t size;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t frees;
+  void *rounds[KMEM_MAG_MAX];
+};
+
+struct kmem_cache {
+  const char *name;
+  size_t size;                      // requested object size
+  size_t obj_size;                  // object size including padding
+  size_t align;                     // object alignment
+  uint32_t flags;
+  uint16_t slab_order;              // log2 of the slab size in pages
+  uint16_t slab_objs;               // objects per slab
+  uint16_t obj_offset;              // offset of the first object in a slab
+  uint16_t mag_size;                // rounds per magazine
+  uint16_t batch;                   // objects moved per magazine refill/flush
+
+  mtx_t lock;
+  LIST_HEAD(struct kmem_slab) partial;
+  LIST_HEAD(struct kmem_slab) full;
+  LIST_HEAD(struct kmem_slab) empty;
+  size_t num_slabs;
+  size_t num_empty;
+  size_t active;                    // objects allocated out of the slabs
+  uint64_t allocs;                  // slab layer allocations (no magazine)
+  uint64_t frees;                   // slab layer frees (no magazine)
+
+  struct kmem_magazine *mags[MAX_CPUS];
+  LIST_ENTRY(struct kmem_cache) list;
+};
+
+struct kmem_free_run {
+  void *cache;                      // overlaps kmem_slab.cache and is always NULL
+  struct kmem_free_run *next;
+};
+
+/*
+ * A part of the slab arena that holds slabs of a single order.
+ */
+struct kmem_region {
+  uintptr_t base;                   // start of the region
+  uintptr_t early_end;              // end of the early window
+  uintptr_t ptr;                    // next unused address
+  uintptr_t end;                    // end of the mapped part
+  struct kmem_free_run *free;       // released slabs
+  size_t num_free;
+};
+
+/*
+ * The slab arena.
+ *
+ * Slabs are carved out of a dedicated region of kernel space which is split
+ * evenly between the slab orders. Since every slab in a region has the same
+ * size, the slab that owns any address in the arena can be found from the
+ * address alone. Because the page structs and vm mappings live in caches
+ * themselves, growing the arena cannot allocate either of them. Instead raw
+ * 2MB frames are taken from the zone allocators and mapped into a page
+ * directory that is created during early boot along with a small window at
+ * the start of each region for the allocations made before the zones are
+ * initialized. The physical address of every chunk is recorded so that
+ * objects can be translated without walking the page tables. The number of
+ * free pages in every chunk is tracked as well so that chunks which no longer
+ * hold any slabs can be given back to the page allocator by the shrinker.
+ */
+static struct {
+  mtx_t lock;
+  struct kmem_region regions[KMEM_MAX_ORDER + 1];
+  uintptr_t chunk_phys[KERNEL_SLAB_SIZE / KMEM_CHUNK_SIZE];
+  uint16_t chunk_free[KERNEL_SLAB_SIZE / KMEM_CHUNK_SIZE];
+  size_t chunks;
+} kmem_arena;
+
+// pages mapped at the start of each region before the zones are up
+static const size_t kmem_early_pages[KMEM_MAX_ORDER + 1] = { 256, 128, 128, 256 };
+
+static LIST_HEAD(struct kmem_cache) kmem_caches;
+static mtx_t kmem_caches_lock;
+
+static struct kmem_cache kmem_cache_cache;
+static struct kmem_cache kmem_mag_cache;
+
+static inline size_t slab_size(kmem_cache_t *cache) {
+  return PAGES_TO_SIZE((size_t)1 << cache->slab_order);
+}
+
+static inline struct kmem_slab *obj_to_slab(kmem_cache_t *cache, void *obj) {
+  return (void *) align_down((uintptr_t) obj, slab_size(cache));
+}
+
+//
+// MARK: arena
+//
+
+static inline size_t chunk_index(uintptr_t addr) {
+  return (addr - KERNEL_SLAB_VA) / KMEM_CHUNK_SIZE;
+}
+
+static bool kmem_arena_grow(struct kmem_region *region) {
+  // the mapped part always ends on a slab boundary
+  ASSERT(region->ptr == region->end);
+  // chunks given back by the shrinker leave holes so take the lowest free one
+  uintptr_t vaddr = region->base;
+  while (kmem_arena.chunk_phys[chunk_index(vaddr)] != 0) {
+    vaddr += KMEM_CHUNK_SIZE;
+    if (vaddr + KMEM_CHUNK_SIZE > region->base + KMEM_REGION_SIZE) {
+      return false;
+    }
+  }
+
+  intptr_t frame = alloc_frames(1, PAGE_SIZE_2MB);
+  if (frame < 0) {
+    // the per-cpu page caches may be holding on to the frames we need
+    pcp_drain_all();
+    if ((frame = alloc_frames(1, PAGE_SIZE_2MB)) < 0) {
+      return false;
+    }
+  }
+
+  // the page directory for the arena was created during early boot and is
+  // shared by all address spaces so no new tables are needed here
+  page_t *table_pages = NULL;
+  recursive_map_entry(vaddr, frame, VM_RDWR|VM_HUGE_2MB, &table_pages);
+  ASSERT(table_pages == NULL);
+
+  kmem_arena.chunk_phys[chunk_index(vaddr)] = frame;
+  kmem_arena.chunks++;
+  region->ptr = vaddr;
+  region->end = vaddr + KMEM_CHUNK_SIZE;
+  return true;
+}
+
+static uintptr_t kmem_arena_alloc(uint16_t order) {
+  ASSERT(order <= KMEM_MAX_ORDER);
+  struct kmem_region *region = &kmem_arena.regions[order];
+
+  mtx_spin_lock(&kmem_arena.lock);
+  struct kmem_free_run *run = region->free;
+  if (run != NULL) {
+    region->free = run->next;
+    region->num_free--;
+    kmem_arena.chunk_free[chunk_index((uintptr_t) run)] -= 1 << order;
+    mtx_spin_unlock(&kmem_arena.lock);
+    return (uintptr_t) run;
+  }
+
+  if (region->ptr == region->end && !kmem_arena_grow(region)) {
+    mtx_spin_unlock(&kmem_arena.lock);
+    return 0;
+  }
+
+  uintptr_t addr = region->ptr;
+  region->ptr += PAGES_TO_SIZE((size_t)1 << order);
+  mtx_spin_unlock(&kmem_arena.lock);
+  return addr;
+}
+
+static void kmem_arena_free(uintptr_t addr, uint16_t order) {
+  ASSERT(order <= KMEM_MAX_ORDER);
+  struct kmem_region *region = &kmem_arena.regions[order];
+
+  mtx_spin_lock(&kmem_arena.lock);
+  struct kmem_free_run *run = (void *) addr;
+  run->cache = NULL;
+  run->next = region->free;
+  region->free = run;
+  region->num_free++;
+  kmem_arena.chunk_free[chunk_index(addr)] += 1 << order;
+  mtx_spin_unlock(&kmem_arena.lock);
+}
+
+// takes the free runs of a chunk that no longer holds any slabs off the free
+// list of the region and returns its address, or 0 if there is no such chunk.
+// the arena lock must be held.
+static uintptr_t kmem_arena_take_chunk(struct kmem_region *region) {
+  uintptr_t chunk = 0;
+  struct kmem_free_run *run;
+  for (run = region->free; run != NULL; run = run->next) {
+    if (kmem_arena.chunk_free[chunk_index((uintptr_t) run)] == KMEM_CHUNK_PAGES) {
+      chunk = align_down((uintptr_t) run, KMEM_CHUNK_SIZE);
+      break;
+    }
+  }
+  if (chunk == 0) {
+    return 0;
+  }
+
+  struct kmem_free_run **prev = &region->free;
+  while (*prev != NULL) {
+    if (align_down((uintptr_t) *prev, KMEM_CHUNK_SIZE) == chunk) {
+      *prev = (*prev)->next;
+      region->num_free--;
+    } else {
+      prev = &(*prev)->next;
+    }
+  }
+  return chunk;
+}
+
+// gives the chunks that no longer hold any slabs back to the page allocator and
+// returns the number of pages freed
+static size_t kmem_arena_release() {
+  size_t freed = 0;
+  for (int order = 0; order <= KMEM_MAX_ORDER; order++) {
+    struct kmem_region *region = &kmem_arena.regions[order];
+    for (;;) {
+      mtx_spin_lock(&kmem_arena.lock);
+      uintptr_t vaddr = kmem_arena_take_chunk(region);
+      mtx_spin_unlock(&kmem_arena.lock);
+      if (vaddr == 0) {
+        break;
+      }
+
+      // the chunk keeps its physical address until the frame is gone from every
+      // tlb so that the region can not grow into it before then
+      size_t index = chunk_index(vaddr);
+      recursive_unmap_entry(vaddr, VM_HUGE_2MB);
+      tlb_flush_range(NULL, vaddr, KMEM_CHUNK_SIZE, PAGE_SIZE_2MB);
+      free_frames(kmem_arena.chunk_phys[index], 1, PAGE_SIZE_2MB);
+
+      mtx_spin_lock(&kmem_arena.lock);
+      kmem_arena.chunk_phys[index] = 0;
+      kmem_arena.chunk_free[index] = 0;
+      kmem_arena.chunks--;
+      mtx_spin_unlock(&kmem_arena.lock);
+      freed += KMEM_CHUNK_PAGES;
+    }
+  }
+  return freed;
+}
+
+//
+// MARK: slab layer
+//
+
+static struct kmem_slab *kmem_slab_create(kmem_cache_t *cache) {
+  uintptr_t addr = kmem_arena_alloc(cache->slab_order);
+  if (addr == 0) {
+    return NULL;
+  }
+
+  struct kmem_slab *slab = (void *) addr;
+  slab->cache = cache;
+  slab->inuse = 0;
+  slab->freelist = NULL;
+  LIST_ENTRY_INIT(&slab->list);
+
+  // thread the objects onto the freelist in address order
+  uintptr_t obj = addr + cache->obj_offset + (cache->slab_objs - 1) * cache->obj_size;
+  for (int i = 0; i < cache->slab_objs; i++) {
+    *((void **) obj) = slab->freelist;
+    slab->freelist = (void *) obj;
+    obj -= cache->obj_size;
+  }
+
+  cache->num_slabs++;
+  return slab;
+}
+
+static void kmem_slab_destroy(kmem_cache_t *cache, struct kmem_slab *slab) {
+  ASSERT(slab->inuse == 0);
+  cache->num_slabs--;
+  kmem_arena_free((uintptr_t) slab, cache->slab_order);
+}
+
+// the cache lock must be held
+static void *kmem_slab_alloc_obj(kmem_cache_t *cache) {
+  struct kmem_slab *slab = LIST_FIRST(&cache->partial);
+  if (slab == NULL) {
+    slab = LIST_REMOVE_FIRST(&cache->empty, list);
+    if (slab != NULL) {
+      cache->num_empty--;
+    } else if ((slab = kmem_slab_create(cache)) == NULL) {
+      return NULL;
+    }
+    LIST_ADD_FRONT(&cache->partial, slab, list);
+  }
+
+  void *obj = slab->freelist;
+  slab->freelist = *((void **) obj);
+  slab->inuse++;
+  if (slab->inuse == cache->slab_objs) {
+    LIST_REMOVE(&cache->partial, slab, list);
+    LIST_ADD(&cache->full, slab, list);
+  }
+
+  cache->active++;
+  return obj;
+}
+
+// the cache lock must be held
+static void kmem_slab_free_obj(kmem_cache_t *cache, void *obj) {
+  struct kmem_slab *slab = obj_to_slab(cache, obj);
+  if (slab->cache != cache) {
+    panic("kmem_cache_free: object %p does not belong to cache %s", obj, cache->name);
+  }
+
+  ASSERT(slab->inuse > 0);
+  if (slab->inuse == cache->slab_objs) {
+    LIST_REMOVE(&cache->full, slab, list);
+    LIST_ADD_FRONT(&cache->partial, slab, list);
+  }
+
+  *((void **) obj) = slab->freelist;
+  slab->freelist = obj;
+  slab->inuse--;
+  cache->active--;
+  if (slab->inuse == 0) {
+    LIST_REMOVE(&cache->partial, slab, list);
+    if (cache->num_empty < KMEM_MAX_EMPTY) {
+      LIST_ADD(&cache->empty, slab, list);
+      cache->num_empty++;
+    } else {
+      kmem_slab_destroy(cache, slab);
+    }
+  }
+}
+
+//
+// MARK: magazine layer
+//
+
+// called from within a critical section
+static void kmem_magazine_refill(kmem_cache_t *cache, struct kmem_magazine *mag) {
+  mtx_spin_lock(&cache->lock);
+  while (mag->count < cache->batch) {
+    void *obj = kmem_slab_alloc_obj(cache);
+    if (obj == NULL) {
+      break;
+    }
+    mag->rounds[mag->count++] = obj;
+  }
+  mtx_spin_unlock(&cache->lock);
+}
+
+// called from within a critical section
+static void kmem_magazine_flush(kmem_cache_t *cache, struct kmem_magazine *mag, size_t n) {
+  n = min(n, mag->count);
+  mtx_spin_lock(&cache->lock);
+  for (size_t i = 0; i < n; i++) {
+    kmem_slab_free_obj(cache, mag->rounds[i]);
+  }
+  mtx_spin_unlock(&cache->lock);
+
+  // the oldest objects are flushed first
+  mag->count -= n;
+  memmove(&mag->rounds[0], &mag->rounds[n], mag->count * sizeof(void *));
+}
+
+static void kmem_magazine_alloc(kmem_cache_t *cache) {
+  struct kmem_magazine *mag = kmem_cache_allocz(&kmem_mag_cache);
+  mag->size = cache->mag_size;
+
+  critical_enter();
+  int id = curcpu_id;
+  if (cache->mags[id] == NULL) {
+    cache->mags[id] = mag;
+    mag = NULL;
+  }
+  critical_exit();
+
+  if (mag != NULL) {
+    // the thread was migrated and the magazine was already there
+    kmem_cache_free(&kmem_mag_cache, mag);
+  }
+}
+
+// enters a critical section and returns the magazine for the current cpu
+static inline struct kmem_magazine *kmem_magazine_enter(kmem_cache_t *cache) {
+  critical_enter();
+  struct kmem_magazine *mag = cache->mags[curcpu_id];
+  while (__expect_false(mag == NULL)) {
+    critical_exit();
+    kmem_magazine_alloc(cache);
+    critical_enter();
+    mag = cache->mags[curcpu_id];
+  }
+  return mag;
+}
+
+//
+// MARK: caches
+//
+
+static void kmem_cache_setup(kmem_cache_t *cache, const char *name, size_t size, size_t alignment, uint32_t flags) {
+  ASSERT(size > 0);
+  if (alignment == 0) {
+    alignment = KMEM_MIN_ALIGN;
+  }
+  ASSERT(is_pow2(alignment) && alignment <= PAGE_SIZE);
+
+  memset(cache, 0, sizeof(struct kmem_cache));
+  cache->name = name;
+  cache->size = size;
+  cache->align = alignment;
+  cache->flags = flags;
+  cache->obj_size = align(max(size, sizeof(void *)), alignment);
+  cache->obj_offset = align(sizeof(struct kmem_slab), alignment);
+
+  // use the smallest slab that fits a reasonable number of objects
+  uint16_t order = 0;
+  while (order < KMEM_MAX_ORDER &&
+         (PAGES_TO_SIZE((size_t)1 << order) - cache->obj_offset) / cache->obj_size < KMEM_MIN_OBJS) {
+    order++;
+  }
+  cache->slab_order = order;
+  cache->slab_objs = (PAGES_TO_SIZE((size_t)1 << order) - cache->obj_offset) / cache->obj_size;
+  if (cache->slab_objs == 0) {
+    panic("kmem_cache_create: object too large [cache=%s, size=%zu]", name, size);
+  }
+
+  // larger objects get smaller magazines
+  if (cache->obj_size <= 256) {
+    cache->mag_size = KMEM_MAG_MAX;
+  } else if (cache->obj_size <= 1024) {
+    cache->mag_size = KMEM_MAG_MAX / 2;
+  } else {
+    cache->mag_size = KMEM_MAG_MAX / 4;
+  }
+  cache->batch = cache->mag_size / 2;
+
+  mtx_init(&cache->lock, MTX_SPIN, "kmem_cache_lock");
+  LIST_INIT(&cache->partial);
+  LIST_INIT(&cache->full);
+  LIST_INIT(&cache->empty);
+
+  mtx_spin_lock(&kmem_caches_lock);
+  LIST_ADD(&kmem_caches, cache, list);
+  mtx_spin_unlock(&kmem_caches_lock);
+}
+
+void mm_init_kmem() {
+  memset(&kmem_arena, 0, sizeof(kmem_arena));
+  mtx_init(&kmem_arena.lock, MTX_SPIN, "kmem_arena_lock");
+
+  // map the early window of each region. this also creates the page directory
+  // that later chunks are mapped into.
+  for (int order = 0; order <= KMEM_MAX_ORDER; order++) {
+    struct kmem_region *region = &kmem_arena.regions[order];
+    size_t count = kmem_early_pages[order];
+    ASSERT(count % (1 << order) == 0 && PAGES_TO_SIZE(count) <= KMEM_CHUNK_SIZE);
+
+    uintptr_t phys_addr = mm_early_alloc_pages(count);
+    region->base = KERNEL_SLAB_VA + order * KMEM_REGION_SIZE;
+    early_map_entries(region->base, phys_addr, count, VM_RDWR);
+    kmem_arena.chunk_phys[chunk_index(region->base)] = phys_addr;
+
+    region->early_end = region->base + PAGES_TO_SIZE(count);
+    region->ptr = region->base;
+    region->end = region->early_end;
+  }
+
+  LIST_INIT(&kmem_caches);
+  mtx_init(&kmem_caches_lock, MTX_SPIN, "kmem_caches_lock");
+
+  // the caches backing the cache and magazine structs cannot use magazines themselves
+  kmem_cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(struct kmem_cache), 0, KMEM_NOMAG);
+  kmem_cache_setup(&kmem_mag_cache, "kmem_magazine", sizeof(struct kmem_magazine), 0, KMEM_NOMAG);
+
+  kprintf("initialized kernel object caches\n");
+}
+
+/**
+ * Creates a new cache of objects with the given size and alignment. If the
+ * alignment is 0 objects are aligned to 8 bytes.
+ */
+kmem_cache_t *kmem_cache_create(const char *name, size_t size, size_t alignment, uint32_t flags) {
+  kmem_cache_t *cache = kmem_cache_alloc(&kmem_cache_cache);
+  kmem_cache_setup(cache, name, size, alignment, flags);
+  DPRINTF("created cache %s [obj_size=%zu, slab_objs=%d]\n", name, cache->obj_size, cache->slab_objs);
+  return cache;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache) {
+  void *obj;
+  if (cache->flags & KMEM_NOMAG) {
+    mtx_spin_lock(&cache->lock);
+    obj = kmem_slab_alloc_obj(cache);
+    cache->allocs++;
+    mtx_spin_unlock(&cache->lock);
+    if (obj == NULL) {
+      panic("kmem_cache_alloc: out of memory [cache=%s]", cache->name);
+    }
+    return obj;
+  }
+
+  struct kmem_magazine *mag = kmem_magazine_enter(cache);
+  if (__expect_false(mag->count == 0)) {
+    mag->misses++;
+    kmem_magazine_refill(cache, mag);
+    if (mag->count == 0) {
+      critical_exit();
+      panic("kmem_cache_alloc: out of memory [cache=%s]", cache->name);
+    }
+  } else {
+    mag->hits++;
+  }
+
+  obj = mag->rounds[--mag->count];
+  critical_exit();
+  return obj;
+}
+
+void *kmem_cache_allocz(kmem_cache_t *cache) {
+  void *obj = kmem_cache_alloc(cache);
+  memset(obj, 0, cache->size);
+  return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj) {
+  if (obj == NULL) {
+    return;
+  }
+
+  if (cache->flags & KMEM_NOMAG) {
+    mtx_spin_lock(&cache->lock);
+    kmem_slab_free_obj(cache, obj);
+    cache->frees++;
+    mtx_spin_unlock(&cache->lock);
+    return;
+  }
+
+  struct kmem_magazine *mag = kmem_magazine_enter(cache);
+  if (__expect_false(mag->count == mag->size)) {
+    kmem_magazine_flush(cache, mag, cache->batch);
+  }
+
+  mag->rounds[mag->count++] = obj;
+  mag->frees++;
+  critical_exit();
+}
+
+/**
+ * Returns the cache that owns the object at ptr, or NULL if ptr does not point
+ * to the start of an object in an allocated slab.
+ */
+kmem_cache_t *kmem_ptr_to_cache(void *ptr) {
+  uintptr_t addr = (uintptr_t) ptr;
+  if (!kmem_is_slab_ptr(ptr)) {
+    return NULL;
+  }
+
+  uint16_t order = (addr - KERNEL_SLAB_VA) / KMEM_REGION_SIZE;
+  struct kmem_region *region = &kmem_arena.regions[order];
+  size_t index = chunk_index(addr);
+  if (kmem_arena.chunk_phys[index] == 0 || kmem_arena.chunk_free[index] == KMEM_CHUNK_PAGES ||
+      (addr >= region->ptr && addr < region->end) ||
+      (addr >= region->early_end && addr < region->base + KMEM_CHUNK_SIZE)) {
+    return NULL; // not mapped or being given back
+  }
+
+  struct kmem_slab *slab = (void *) align_down(addr, PAGES_TO_SIZE((size_t)1 << order));
+  kmem_cache_t *cache = slab->cache;
+  if (cache == NULL || cache->slab_order != order) {
+    return NULL;
+  }
+
+  size_t off = addr - (uintptr_t) slab;
+  if (off < cache->obj_offset || (off - cache->obj_offset) % cache->obj_size != 0) {
+    return NULL;
+  }
+  return cache;
+}
+
+/**
+ * Returns the physical address of a pointer into the slab arena. Objects never
+ * cross a chunk boundary so they are always physically contiguous.
+ */
+uintptr_t kmem_ptr_to_phys(void *ptr) {
+  ASSERT(kmem_is_slab_ptr(ptr));
+  uintptr_t addr = (uintptr_t) ptr;
+  uintptr_t phys = kmem_arena.chunk_phys[chunk_index(addr)];
+  ASSERT(phys != 0);
+  return phys + (addr % KMEM_CHUNK_SIZE);
+}
+
+//
+
+/**
+ * Collects the usage statistics of a cache. The magazine counters are read
+ * without synchronization so the result is only approximate.
+ */
+void kmem_cache_get_stats(kmem_cache_t *cache, struct kmem_cache_stats *stats) {
+  memset(stats, 0, sizeof(struct kmem_cache_stats));
+  stats->obj_size = cache->obj_size;
+  stats->slab_size = slab_size(cache);
+  stats->num_slabs = cache->num_slabs;
+  stats->num_objs = cache->num_slabs * cache->slab_objs;
+  stats->active = cache->active;
+  stats->allocs = cache->allocs;
+  stats->frees = cache->frees;
+
+  for (int i = 0; i < MAX_CPUS; i++) {
+    struct kmem_magazine *mag = cache->mags[i];
+    if (mag == NULL) {
+      continue;
+    }
+
+    stats->cached += mag->count;
+    stats->allocs += mag->hits + mag->misses;
+    stats->frees += mag->frees;
+    stats->mag_hits += mag->hits;
+    stats->mag_misses += mag->misses;
+  }
+}
+
+// this does not take any locks so it is safe to call while panicking
+void kmem_dump_stats() {
+  size_t free_pages = 0;
+  for (int order = 0; order <= KMEM_MAX_ORDER; order++) {
+    free_pages += kmem_arena.regions[order].num_free << order;
+  }
+
+  kprintf("kmem: %zu chunks, %zu free pages\n", kmem_arena.chunks, free_pages);
+  kprintf("  %-16s %8s %8s %8s %8s %8s %10s %10s\n",
+          "cache", "objsize", "slabs", "objs", "active", "cached", "allocs", "hit%");
+
+  kmem_cache_t *cache;
+  LIST_FOREACH(cache, &kmem_caches, list) {
+    struct kmem_cache_stats stats;
+    kmem_cache_get_stats(cache, &stats);
+
+    uint64_t lookups = stats.mag_hits + stats.mag_misses;
+    uint64_t rate = lookups ? (stats.mag_hits * 100) / lookups : 0;
+    kprintf("  %-16s %8zu %8zu %8zu %8zu %8zu %10llu %9llu%%\n",
+            cache->name, stats.obj_size, stats.num_slabs, stats.num_objs,
+            stats.active - stats.cached, stats.cached, stats.allocs, rate);
+  }
+}
+
+//
+// MARK: shrinker
+//
+
+static size_t kmem_shrinker_count(struct shrinker *shrinker) {
+  size_t count = 0;
+  mtx_spin_lock(&kmem_caches_lock);
+  kmem_cache_t *cache;
+  LIST_FOREACH(cache, &kmem_caches, list) {
+    count += cache->num_empty;
+  }
+  mtx_spin_unlock(&kmem_caches_lock);
+  return count;
+}
+
+// releases the empty slabs kept by the caches back to the arena and then gives
+// the chunks left without any slabs back to the page allocator. only the pages
+// of those chunks count as freed since the slabs that stay in the arena do not
+// make any more memory available to the rest of the system.
+static size_t kmem_shrinker_scan(struct shrinker *shrinker, size_t nr) {
+  size_t released = 0;
+  mtx_spin_lock(&kmem_caches_lock);
+  kmem_cache_t *cache;
+  LIST_FOREACH(cache, &kmem_caches, list) {
+    if (released == nr) {
+      break;
+    }
+
+    mtx_spin_lock(&cache->lock);
+    struct kmem_slab *slab;
+    while (released < nr && (slab = LIST_REMOVE_FIRST(&cache->empty, list)) != NULL) {
+      cache->num_empty--;
+      kmem_slab_destroy(cache, slab);
+      released++;
+    }
+    mtx_spin_unlock(&cache->lock);
+  }
+  mtx_spin_unlock(&kmem_caches_lock);
+  return kmem_arena_release();
+}
+
+static struct shrinker kmem_shrinker = {
+  .name = "slab",
+  .count = kmem_shrinker_count,
+  .scan = kmem_shrinker_scan,
+};
+
+static void kmem_shrinker_init() {
+  register_shrinker(&kmem_shrinker);
+}
+MODULE_INIT(kmem_shrinker_init);
@@ -0,0 +1,368 @@
+#include <kernel/mm/tlb.h>
+#include <kernel/mm/pgtable.h>
+
+#include <kernel/cpu/cpu.h>
+#include <kernel/atomic.h>
+#include <kernel/mutex.h>
+#include <kernel/proc.h>
+#include <kernel/ipi.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/panic.h>
+
+#define ASSERT(x) kassert(x)
+
+#define TLB_QUEUE_SIZE 16
+#define TLB_NUM_PCIDS  4096
+#define CR3_NOFLUSH    (1ULL << 63)
+
+/*
+ * A shootdown request.
+ *
+ * Requests live on the stack of the sending cpu which waits until every target
+ * has processed it before returning, so the batch does not need to be copied.
+ */
+struct tlb_request {
+  const tlb_batch_t *batch;
+  volatile uint32_t pending;        // number of cpus yet to process the request
+};
+
+/*
+ * Per-cpu tlb state.
+ *
+ * Each cpu has a queue of pending shootdown requests. A single IPI_INVLPG is
+ * sent when a request is added to an empty queue and the target handles all
+ * queued requests by the time the ipi arrives. Cpus waiting on their own requests
+ * keep draining their queue so two cpus shooting each other down with interrupts
+ * disabled can not deadlock.
+ *
+ * When PCIDs are supported each cpu also hands out its own PCIDs to the address
+ * spaces it runs. An assignment is only valid for the generation it was made in
+ * and once the PCIDs run out the generation is bumped which implicitly revokes
+ * every assignment. A PCID is always loaded with a flush the first time it is
+ * used in a generation so nothing stale from a previous owner survives.
+ */
+struct tlb_cpu {
+  mtx_t lock;
+  uint16_t count;
+  struct tlb_request *reqs[TLB_QUEUE_SIZE];
+
+  uint16_t next_pcid;
+  uint32_t pcid_gen;
+  struct tlb_stats stats;           // only updated by the owning cpu
+};
+
+static struct tlb_cpu tlb_cpus[MAX_CPUS];
+static volatile uint64_t tlb_online_cpus;
+static bool tlb_use_pcid;
+static bool tlb_use_invpcid;
+
+// revokes all pcid assignments of the current cpu
+static void tlb_pcid_new_generation(struct tlb_cpu *cpu) {
+  cpu->pcid_gen++;
+  cpu->next_pcid = 1;
+  cpu->stats.pcid_rollovers++;
+}
+
+static void tlb_invalidate_local(const tlb_batch_t *batch, struct tlb_cpu *cpu) {
+  struct tlb_stats *stats = &cpu->stats;
+  address_space_t *space = batch->space;
+  uint8_t id = curcpu_id;
+
+  // translations of a space that is not loaded can only be cached under its pcid
+  if (!batch->global && space != curspace) {
+    struct tlb_pcid *p = &space->pcids[id];
+    if (!tlb_use_pcid || p->gen != cpu->pcid_gen) {
+      return; // nothing cached
+    }
+
+    if (!tlb_use_invpcid) {
+      // drop the assignment so the pcid is flushed before it is used again
+      p->gen = 0;
+      return;
+    }
+
+    if (batch->full) {
+      cpu_invpcid(INVPCID_CONTEXT, p->pcid, 0);
+      stats->full_flushes++;
+      return;
+    }
+
+    for (int i = 0; i < batch->count; i++) {
+      const struct tlb_range *range = &batch->ranges[i];
+      for (uintptr_t addr = range->start; addr < range->end; addr += range->pg_size) {
+        cpu_invpcid(INVPCID_ADDR, p->pcid, addr);
+        stats->pages_flushed++;
+      }
+    }
+    return;
+  }
+
+  if (batch->full) {
+    if (batch->global) {
+      // this also flushes every pcid
+      cpu_flush_tlb_global();
+    } else {
+      cpu_flush_tlb();
+    }
+    stats->full_flushes++;
+    return;
+  }
+
+  for (int i = 0; i < batch->count; i++) {
+    const struct tlb_range *range = &batch->ranges[i];
+    for (uintptr_t addr = range->start; addr < range->end; addr += range->pg_size) {
+      cpu_invlpg(addr);
+      stats->pages_flushed++;
+    }
+  }
+
+  if (batch->global && tlb_use_pcid) {
+    // invlpg only reaches non-global entries of the current pcid but kernel
+    // translations may be cached under any of them
+    tlb_pcid_new_generation(cpu);
+  }
+}
+
+// called from within a critical section
+static void tlb_process_queue(struct tlb_cpu *cpu) {
+  struct tlb_request *reqs[TLB_QUEUE_SIZE];
+  mtx_spin_lock(&cpu->lock);
+  uint16_t count = cpu->count;
+  memcpy(reqs, cpu->reqs, count * sizeof(struct tlb_request *));
+  cpu->count = 0;
+  mtx_spin_unlock(&cpu->lock);
+
+  for (int i = 0; i < count; i++) {
+    tlb_invalidate_local(reqs[i]->batch, cpu);
+    // the request may be gone as soon as it is released
+    atomic_fetch_sub(&reqs[i]->pending, 1);
+  }
+}
+
+static void tlb_percpu_init() {
+  if (curcpu_is_boot) {
+    // the feature bits are cleared by cpu_early_init if PCIDs can not be used
+    tlb_use_pcid = cpuid_query_bit(CPUID_BIT_PCID);
+    tlb_use_invpcid = tlb_use_pcid && cpuid_query_bit(CPUID_BIT_INVPCID);
+  }
+
+  struct tlb_cpu *cpu = &tlb_cpus[curcpu_id];
+  memset(cpu, 0, sizeof(struct tlb_cpu));
+  mtx_init(&cpu->lock, MTX_SPIN, "tlb_cpu_lock");
+  // generation 0 is never valid so zeroed spaces start without a pcid
+  cpu->pcid_gen = 1;
+  cpu->next_pcid = 1;
+  atomic_fetch_or(&tlb_online_cpus, 1ULL << curcpu_id);
+}
+PERCPU_EARLY_INIT(tlb_percpu_init);
+
+//
+
+void tlb_batch_init(tlb_batch_t *batch, address_space_t *space) {
+  batch->space = space;
+  batch->count = 0;
+  batch->full = false;
+  batch->global = false;
+  batch->pages = 0;
+}
+
+/**
+ * Adds a range of stale translations to the batch. Adjacent ranges are merged
+ * and the batch falls back to a full flush once it has too many ranges or pages.
+ */
+void tlb_batch_add(tlb_batch_t *batch, uintptr_t start, size_t size, size_t pg_size) {
+  ASSERT(is_aligned(start, pg_size) && is_aligned(size, pg_size));
+  if (size == 0) {
+    return;
+  }
+
+  if (start >= KERNEL_SPACE_START) {
+    batch->global = true;
+  }
+  if (batch->full) {
+    return;
+  }
+
+  batch->pages += size / pg_size;
+  if (batch->pages > TLB_FLUSH_MAX) {
+    batch->full = true;
+    return;
+  }
+
+  if (batch->count > 0) {
+    struct tlb_range *last = &batch->ranges[batch->count - 1];
+    if (last->end == start && last->pg_size == pg_size) {
+      last->end += size;
+      return;
+    }
+  }
+
+  if (batch->count == TLB_BATCH_MAX) {
+    batch->full = true;
+    return;
+  }
+
+  batch->ranges[batch->count++] = (struct tlb_range){ start, start + size, pg_size };
+}
+
+/**
+ * Invalidates the batch on the current cpu and every other cpu that may have
+ * the translations cached and waits for them to finish. Kernel addresses are
+ * shot down on all online cpus while user addresses only go to the cpus that
+ * have the address space active. The batch is empty afterwards.
+ */
+void tlb_batch_flush(tlb_batch_t *batch) {
+  if (batch->count == 0 && !batch->full) {
+    return;
+  }
+
+  critical_enter();
+  uint8_t id = curcpu_id;
+  struct tlb_cpu *self = &tlb_cpus[id];
+  tlb_invalidate_local(batch, self);
+
+  uint64_t targets = atomic_load(&tlb_online_cpus) & ~(1ULL << id);
+  if (!batch->global) {
+    ASSERT(batch->space != NULL);
+    targets &= atomic_load(&batch->space->active_cpus);
+  }
+
+  if (targets != 0) {
+    struct tlb_request req = { .batch = batch, .pending = __builtin_popcountll(targets) };
+    self->stats.shootdowns++;
+
+    while (targets != 0) {
+      int cpu = __builtin_ctzll(targets);
+      targets &= targets - 1;
+
+      struct tlb_cpu *target = &tlb_cpus[cpu];
+      mtx_spin_lock(&target->lock);
+      while (target->count == TLB_QUEUE_SIZE) {
+        // the target is backed up so make progress on our own queue meanwhile
+        mtx_spin_unlock(&target->lock);
+        tlb_process_queue(self);
+        cpu_pause();
+        mtx_spin_lock(&target->lock);
+      }
+
+      bool notify = target->count == 0;
+      target->reqs[target->count++] = &req;
+      mtx_spin_unlock(&target->lock);
+
+      if (notify) {
+        // the request is already queued and points into our stack so the
+        // target has to be told about it. if its ipi queue is full keep
+        // serving our own requests until it has drained some of it
+        while (ipi_deliver_cpu_id(IPI_INVLPG, (uint8_t) cpu, 0) < 0) {
+          tlb_process_queue(self);
+          cpu_pause();
+        }
+        self->stats.ipis_sent++;
+      }
+    }
+
+    while (atomic_load(&req.pending) > 0) {
+      tlb_process_queue(self);
+      cpu_pause();
+    }
+  }
+  critical_exit();
+
+  tlb_batch_init(batch, batch->space);
+}
+
+void tlb_flush_range(address_space_t *space, uintptr_t start, size_t size, size_t pg_size) {
+  tlb_batch_t batch;
+  tlb_batch_init(&batch, space);
+  tlb_batch_add(&batch, start, size, pg_size);
+  tlb_batch_flush(&batch);
+}
+
+//
+
+// called before the space is loaded on the current cpu
+void tlb_space_activate(address_space_t *space) {
+  atomic_fetch_or(&space->active_cpus, 1ULL << curcpu_id);
+}
+
+// called after the space has been unloaded from the current cpu
+void tlb_space_deactivate(address_space_t *space) {
+  if (tlb_use_pcid) {
+    // shootdowns skip this cpu from now on so whatever is still cached under
+    // the old pcid can not be trusted. revoking it makes the next load flush.
+    space->pcids[curcpu_id].gen = 0;
+  }
+  atomic_fetch_and(&space->active_cpus, ~(1ULL << curcpu_id));
+}
+
+/**
+ * Loads the page tables of the given address space on the current cpu. If PCIDs
+ * are supported the new space is loaded under its pcid without a flush when the
+ * assignment is still valid. The previous space stops receiving shootdowns from
+ * this cpu once it is switched out so its pcid here is revoked at the same time.
+ * This must be called from within a critical section after curspace has been
+ * updated.
+ */
+void tlb_switch_space(address_space_t *prev, address_space_t *next) {
+  tlb_space_activate(next);
+  if (!tlb_use_pcid) {
+    set_current_pgtable(next->page_table);
+    if (prev != NULL) {
+      tlb_space_deactivate(prev);
+    }
+    return;
+  }
+
+  struct tlb_cpu *cpu = &tlb_cpus[curcpu_id];
+  struct tlb_pcid *p = &next->pcids[curcpu_id];
+  uint64_t cr3 = next->page_table;
+  if (p->gen == cpu->pcid_gen) {
+    cr3 |= p->pcid | CR3_NOFLUSH;
+    cpu->stats.pcid_hits++;
+  } else {
+    if (cpu->next_pcid == TLB_NUM_PCIDS) {
+      tlb_pcid_new_generation(cpu);
+    }
+    p->pcid = cpu->next_pcid++;
+    p->gen = cpu->pcid_gen;
+    cr3 |= p->pcid;
+    cpu->stats.pcid_misses++;
+  }
+  __write_cr3(cr3);
+  if (prev != NULL) {
+    tlb_space_deactivate(prev);
+  }
+}
+
+// called from the ipi handler
+void tlb_shootdown_handler() {
+  tlb_process_queue(&tlb_cpus[curcpu_id]);
+}
+
+//
+
+void tlb_get_stats(struct tlb_stats *stats) {
+  memset(stats, 0, sizeof(struct tlb_stats));
+  for (int i = 0; i < MAX_CPUS; i++) {
+    struct tlb_stats *s = &tlb_cpus[i].stats;
+    stats->shootdowns += s->shootdowns;
+    stats->ipis_sent += s->ipis_sent;
+    stats->pages_flushed += s->pages_flushed;
+    stats->full_flushes += s->full_flushes;
+    stats->pcid_hits += s->pcid_hits;
+    stats->pcid_misses += s->pcid_misses;
+    stats->pcid_rollovers += s->pcid_rollovers;
+  }
+}
+
+void tlb_dump_stats() {
+  struct tlb_stats stats;
+  tlb_get_stats(&stats);
+  kprintf("tlb: %llu shootdowns, %llu ipis sent, %llu pages flushed, %llu full flushes\n",
+          stats.shootdowns, stats.ipis_sent, stats.pages_flushed, stats.full_flushes);
+  if (tlb_use_pcid) {
+    kprintf("tlb: pcid %llu hits, %llu misses, %llu rollovers%s\n",
+            stats.pcid_hits, stats.pcid_misses, stats.pcid_rollovers, tlb_use_invpcid ? " (invpcid)" : "");
+  }
+}
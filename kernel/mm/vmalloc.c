@@ -7,6 +7,8 @@
 #include <kernel/mm/pgtable.h>
 #include <kernel/mm/file.h>
 #include <kernel/mm/heap.h>
+#include <kernel/mm/slab.h>
+#include <kernel/mm/tlb.h>
 #include <kernel/mm/init.h>
 
 #include <kernel/cpu/cpu.h>
@@ -41,9 +43,23 @@
 #define HINT_KERNEL_MALLOC  0xFFFFC01000000000ULL // for VM_MALLOC
 #define HINT_KERNEL_STACK   0xFFFFFF8040000000ULL // for VM_STACK
 
+// fault-around window for file mappings (in pages)
+#define FAULT_AROUND_MIN    4
+#define FAULT_AROUND_MAX    64
+#define FAULT_AROUND_INIT   16
+
 extern uintptr_t entry_initial_stack_top;
 address_space_t *default_user_space;
 address_space_t *kernel_space;
+static kmem_cache_t *vm_mapping_cache;
+
+static struct {
+  uint64_t faults;    // write faults on shared cow pages
+  uint64_t copies;    // pages copied on write
+  uint64_t reuses;    // pages made writable in place
+} vm_cow_stats;
+
+static struct vm_thp_stats vm_thp_stats;
 
 // called from switch.asm
 __used void switch_address_space(address_space_t *new_space) {
@@ -51,8 +67,12 @@ __used void switch_address_space(address_space_t *new_space) {
   if (current != NULL && current->page_table == new_space->page_table) {
     return;
   }
+
+  // curspace and cr3 must change together for shootdowns to see a consistent view
+  critical_enter();
   set_curspace(new_space);
-  set_current_pgtable(new_space->page_table);
+  tlb_switch_space(current, new_space);
+  critical_exit();
 }
 
 static always_inline bool space_contains_addr(address_space_t *space, uintptr_t addr) {
@@ -113,6 +133,27 @@ static always_inline size_t vm_empty_space(vm_mapping_t *vm) {
   return size;
 }
 
+// shared copy-on-write pages are mapped read-only until they are written to
+static always_inline uint32_t vm_page_map_flags(vm_mapping_t *vm, page_t *page) {
+  if ((page->flags & PG_COW) && !(vm->flags & VM_SHARED) && read_refcount(page->source) > 1) {
+    return vm->flags & ~VM_WRITE;
+  }
+  return vm->flags;
+}
+
+// anonymous mappings that can be covered entirely by 2MB pages are transparently
+// promoted to them
+static always_inline uint32_t vm_thp_flags(uintptr_t hint, size_t size, size_t vm_size, uint32_t vm_flags) {
+  if (vm_flags & (VM_HUGE_2MB | VM_HUGE_1GB | VM_STACK | VM_SHARED)) {
+    return vm_flags;
+  } else if (size == 0 || !is_aligned(size, PAGE_SIZE_2MB) || !is_aligned(vm_size, PAGE_SIZE_2MB)) {
+    return vm_flags;
+  } else if ((vm_flags & VM_FIXED) && !is_aligned(hint, PAGE_SIZE_2MB)) {
+    return vm_flags;
+  }
+  return vm_flags | VM_HUGE_2MB | VM_THP;
+}
+
 static inline bool vm_are_siblings(vm_mapping_t *a, vm_mapping_t *b) {
   if (a->address > b->address) {
     vm_mapping_t *tmp = a;
@@ -224,14 +265,15 @@ static void page_type_map_internal(vm_mapping_t *vm, page_t *pages, size_t size,
       break;
     }
 
+    uint32_t vm_flags = vm_page_map_flags(vm, curr);
     struct pte *pte = page_get_mapping(curr, vm);
     if (pte != NULL) {
       // update existing mapping
-      pgtable_update_entry_flags(ptr, pte->entry, vm->flags);
+      pgtable_update_entry_flags(ptr, pte->entry, vm_flags);
     } else {
       // create new mapping
       page_t *table_pages = NULL;
-      uint64_t *entry = recursive_map_entry(ptr, curr->address, vm->flags, &table_pages);
+      uint64_t *entry = recursive_map_entry(ptr, curr->address, vm_flags, &table_pages);
       if (table_pages != NULL) {
         page_t *last_page = SLIST_GET_LAST(table_pages, next);
         SLIST_ADD_SLIST(&vm->space->table_pages, table_pages, last_page, next);
@@ -292,10 +334,61 @@ static __ref page_t *page_type_getpage_internal(vm_mapping_t *vm, size_t off) {
       break;
     }
     curr = curr->next;
+    off -= size;
   }
   return getref(curr);
 }
 
+static __ref page_t *page_type_fork_internal(vm_mapping_t *vm, tlb_batch_t *batch) {
+  if (vm->flags & VM_SHARED) {
+    // the new mapping gets its own page structs for the same frames
+    return alloc_cow_pages(vm->vm_pages);
+  }
+
+  bool originals = false;
+  for (page_t *curr = vm->vm_pages; curr != NULL; curr = curr->next) {
+    if (!(curr->flags & PG_COW)) {
+      originals = true;
+      break;
+    }
+  }
+
+  if (originals) {
+    // the first time a mapping is forked it is switched over to cow pages as well
+    // so that the refcount of each frame is the number of mappings sharing it
+    page_t *old = moveref(vm->vm_pages);
+    vm->vm_pages = alloc_cow_pages(old);
+    for (page_t *curr = old; curr != NULL; curr = curr->next) {
+      struct pte *pte = page_remove_mapping(curr, vm);
+      if (pte != NULL) {
+        pte_struct_free(&pte);
+      }
+    }
+    drop_pages_unlinked(&old);
+  }
+
+  __ref page_t *pages = alloc_cow_pages(vm->vm_pages);
+  if ((vm->flags & VM_MAPPED) && (vm->flags & VM_WRITE)) {
+    // write protect the now shared pages
+    size_t stride = vm_flags_to_size(vm->flags);
+    if (originals) {
+      // the old pages may not have been tracked so remap everything
+      page_type_map_internal(vm, vm->vm_pages, vm->size, 0);
+    } else {
+      uintptr_t ptr = vm->address;
+      for (page_t *curr = vm->vm_pages; curr != NULL; curr = curr->next) {
+        struct pte *pte = page_get_mapping(curr, vm);
+        if (pte != NULL) {
+          pgtable_update_entry_flags(ptr, pte->entry, vm_page_map_flags(vm, curr));
+        }
+        ptr += stride;
+      }
+    }
+    tlb_batch_add(batch, vm->address, vm->size, stride);
+  }
+  return pages;
+}
+
 static __ref page_t *page_type_split_internal(__ref page_t *pages, size_t off, __out page_t **tailref) {
   size_t pg_size = pg_flags_to_size(pages->flags);
   ASSERT(pages->flags & PG_HEAD);
@@ -316,13 +409,8 @@ static void page_type_join_internal(__inout page_t **pagesref, __ref page_t *oth
 
 // file type
 
-static vm_file_t *vm_file_fork_internal(vm_file_t *anon, bool shared) {
-  todo();
-}
-
 struct file_cb_data {
   vm_mapping_t *vm;
-  size_t off;
   bool unmap;
 };
 
@@ -330,52 +418,99 @@ static void file_map_update_cb(page_t **pageref, size_t off, void *data) {
   page_t *page = *pageref;
   struct file_cb_data *cb = data;
   vm_mapping_t *vm = cb->vm;
+  uintptr_t vaddr = vm->address + (off - vm->vm_file->off);
 
   if (cb->unmap) {
     struct pte *pte = page_remove_mapping(page, vm);
     if (pte != NULL) {
-      pgtable_update_entry_flags(vm->address + cb->off, pte->entry, 0);
+      recursive_unmap_entry(vaddr, vm->flags);
       pte_struct_free(&pte);
     }
   } else {
+    uint32_t vm_flags = vm_page_map_flags(vm, page);
     struct pte *pte = page_get_mapping(page, vm);
     if (pte == NULL) {
       page_t *table_pages = NULL;
-      uint64_t *entry = recursive_map_entry(vm->address + cb->off, page->address, vm->flags, &table_pages);
+      uint64_t *entry = recursive_map_entry(vaddr, page->address, vm_flags, &table_pages);
       if (table_pages != NULL) {
         page_t *last_page = SLIST_GET_LAST(table_pages, next);
         SLIST_ADD_SLIST(&vm->space->table_pages, table_pages, last_page, next);
       }
       page_add_mapping(page, pte_struct_alloc(page, entry, vm));
     } else {
-      pgtable_update_entry_flags(vm->address + cb->off, pte->entry, vm->flags);
+      pgtable_update_entry_flags(vaddr, pte->entry, vm_flags);
     }
   }
-
-  cb->off += pg_flags_to_size(page->flags);
 }
 
 static void file_type_map_internal(vm_mapping_t *vm, size_t size, size_t off) {
-  struct file_cb_data data = {vm, off, /*unmap=*/false};
-  vm_file_visit_pages(vm->vm_file, off, vm->size, file_map_update_cb, &data);
+  struct file_cb_data data = {vm, /*unmap=*/false};
+  off += vm->vm_file->off;
+  vm_file_visit_pages(vm->vm_file, off, off + size, file_map_update_cb, &data);
 }
 
 static void file_type_unmap_internal(vm_mapping_t *vm, size_t size, size_t off) {
-  struct file_cb_data data = {vm, off, /*unmap=*/true};
-  vm_file_visit_pages(vm->vm_file, off, vm->size, file_map_update_cb, &data);
+  struct file_cb_data data = {vm, /*unmap=*/true};
+  off += vm->vm_file->off;
+  vm_file_visit_pages(vm->vm_file, off, off + size, file_map_update_cb, &data);
 }
 
-static void file_type_mappage_internal(vm_mapping_t *vm, vm_file_t *file, size_t off, __ref page_t *page) {
-  ASSERT((page->flags & PG_HEAD) && (page->head.count == 1));
-  ASSERT(pg_flags_to_size(page->flags) == file->pg_size);
-  page_t *table_pages = NULL;
-  uint64_t *entry = recursive_map_entry(vm->address + off, page->address, vm->flags, &table_pages);
-  if (table_pages != NULL) {
-    page_t *last_page = SLIST_GET_LAST(table_pages, next);
-    SLIST_ADD_SLIST(&vm->space->table_pages, table_pages, last_page, next);
+struct file_fork_data {
+  vm_mapping_t *vm;
+  struct pgcache *pgcache;
+  tlb_batch_t *batch;
+};
+
+static void file_fork_cow_cb(page_t **pageref, size_t off, void *data) {
+  struct file_fork_data *fd = data;
+  vm_mapping_t *vm = fd->vm;
+  page_t *page = *pageref;
+  if (!(page->flags & PG_COW)) {
+    // replace the page with a cow page so that the refcount of the frame is
+    // the number of mappings sharing it
+    page_t *cow = alloc_cow_pages(page);
+    struct pte *pte = page_remove_mapping(page, vm);
+    if (pte != NULL) {
+      page_add_mapping(cow, pte_struct_alloc(cow, pte->entry, vm));
+      pte_struct_free(&pte);
+    }
+    drop_pages(pageref);
+    *pageref = cow;
+    page = cow;
   }
-  page_add_mapping(page, pte_struct_alloc(page, entry, vm));
-  drop_pages(&page);
+
+  pgcache_insert(fd->pgcache, off, alloc_cow_pages(page), NULL);
+
+  // write protect the now shared page
+  struct pte *pte = page_get_mapping(page, vm);
+  if (pte != NULL && (vm->flags & VM_WRITE)) {
+    size_t pg_size = vm->vm_file->pg_size;
+    uintptr_t vaddr = vm->address + (off - vm->vm_file->off);
+    pgtable_update_entry_flags(vaddr, pte->entry, vm_page_map_flags(vm, page));
+    tlb_batch_add(fd->batch, vaddr, pg_size, pg_size);
+  }
+}
+
+static vm_file_t *file_type_fork_internal(vm_mapping_t *vm, vm_file_t *sibling, tlb_batch_t *batch) {
+  vm_file_t *file = vm->vm_file;
+  vm_file_t *new_file = vm_file_fork(file);
+  if ((vm->flags & VM_SHARED) || file->vnode != NULL) {
+    // shared and vnode backed mappings keep using the same page cache
+    return new_file;
+  }
+
+  // private anonymous memory gets its own page cache with cow copies of the
+  // resident pages. siblings of a split mapping keep sharing one cache
+  pgcache_free(&new_file->pgcache);
+  if (sibling != NULL) {
+    new_file->pgcache = getref(sibling->pgcache);
+  } else {
+    new_file->pgcache = pgcache_alloc(file->pgcache->order, file->pg_size);
+  }
+
+  struct file_fork_data data = {vm, new_file->pgcache, batch};
+  vm_file_visit_pages(file, file->off, file->off + file->size, file_fork_cow_cb, &data);
+  return new_file;
 }
 
 static vm_file_t *file_type_split_internal(vm_mapping_t *vm, size_t off) {
@@ -390,28 +525,187 @@ static void file_type_join_internal(vm_mapping_t *vm, vm_file_t **otherref) {
 // MARK: Internal mapping functions
 //
 
-static void vm_fork_internal(vm_mapping_t *vm, vm_mapping_t *new_vm) {
-  bool shared = new_vm->flags & VM_SHARED;
+/*
+ * Forks a mapping into a new address space.
+ *
+ * Private memory is shared copy-on-write. The resident pages of both mappings
+ * are replaced with cow pages that reference the original frames and the parent
+ * mapping is write protected, while the new mapping is left unmapped and filled
+ * in lazily by the page fault handler. The first write to a shared page copies
+ * it, unless all other mappings have since let go of the frame, in which case
+ * it is reused in place.
+ *
+ * When the page tables were copied along with the space the new mapping is
+ * already mapped to the same frames, so it just gets its own page structs.
+ */
+static void vm_fork_internal(vm_mapping_t *vm, vm_mapping_t *new_vm, vm_mapping_t *sibling, bool copied,
+                             tlb_batch_t *batch) {
+  space_lock_assert(vm->space, MA_OWNED);
   switch (vm->type) {
     case VM_TYPE_RSVD:
       break;
     case VM_TYPE_PHYS:
       new_vm->vm_phys = vm->vm_phys;
+      if (!copied && (vm->flags & VM_MAPPED)) {
+        // physical mappings can not fault so they are mapped up front
+        size_t stride = vm_flags_to_size(vm->flags);
+        page_t *table_pages = NULL;
+        nonrecursive_map_frames(new_vm->space->page_table, new_vm->address, vm->vm_phys, vm->size / stride,
+                                vm->flags, &table_pages);
+        if (table_pages != NULL) {
+          page_t *last_page = SLIST_GET_LAST(table_pages, next);
+          SLIST_ADD_SLIST(&new_vm->space->table_pages, table_pages, last_page, next);
+        }
+      }
       break;
     case VM_TYPE_PAGE:
-      new_vm->vm_pages = alloc_cow_pages(vm->vm_pages);
+      if (copied) {
+        new_vm->vm_pages = alloc_cow_pages(vm->vm_pages);
+      } else {
+        new_vm->vm_pages = page_type_fork_internal(vm, batch);
+      }
       break;
     case VM_TYPE_FILE:
-      new_vm->vm_file = vm_file_fork(vm->vm_file);
+      if (copied) {
+        new_vm->vm_file = vm_file_fork(vm->vm_file);
+      } else {
+        new_vm->vm_file = file_type_fork_internal(vm, sibling ? sibling->vm_file : NULL, batch);
+      }
       break;
     default:
       panic("vm_fork_internal: invalid mapping type");
   }
 }
 
+// maps a single page of the mapping at the given offset
+static uint64_t *vm_map_page_internal(vm_mapping_t *vm, size_t off, page_t *page) {
+  ASSERT(pg_flags_to_size(page->flags) == vm_flags_to_size(vm->flags));
+  page_t *table_pages = NULL;
+  uint64_t *entry = recursive_map_entry(vm->address + off, page->address, vm_page_map_flags(vm, page), &table_pages);
+  if (table_pages != NULL) {
+    page_t *last_page = SLIST_GET_LAST(table_pages, next);
+    SLIST_ADD_SLIST(&vm->space->table_pages, table_pages, last_page, next);
+  }
+  if (page_get_mapping(page, vm) == NULL) {
+    page_add_mapping(page, pte_struct_alloc(page, entry, vm));
+  }
+  return entry;
+}
+
+// resolves a write to a mapped copy-on-write page. this fails only if a promoted
+// mapping has no free 2MB frame for the copy in which case it should be split
+static int vm_cow_page_internal(vm_mapping_t *vm, size_t off, page_t *page) {
+  uintptr_t vaddr = vm->address + off;
+  size_t pg_size = pg_flags_to_size(page->flags);
+  if (!(page->flags & PG_COW) || (vm->flags & VM_SHARED)) {
+    // spurious fault from a stale tlb entry
+    vm_map_page_internal(vm, off, page);
+    return 0;
+  }
+
+  atomic_fetch_add(&vm_cow_stats.faults, 1);
+  if (read_refcount(page->source) == 1) {
+    // nobody else is left sharing the frame so it can just be made writable. the
+    // refcount can not go back up since only a fork of this space can share it
+    atomic_fetch_add(&vm_cow_stats.reuses, 1);
+    vm_map_page_internal(vm, off, page);
+    return 0;
+  }
+
+  // the frame is still shared so give the page its own copy. the cow page is
+  // private to this mapping which lets us swap the frame without touching the
+  // page list or the ptes
+  page_t *copy;
+  if (vm->flags & VM_THP) {
+    copy = try_alloc_pages_size(1, pg_size);
+    if (copy == NULL) {
+      return -ENOMEM;
+    }
+  } else {
+    copy = alloc_pages_size(1, pg_size);
+  }
+  copy_unmapped_page(copy, (void *) vaddr);
+
+  mtx_spin_lock(&page->pg_lock);
+  page_t *old = moveref(page->source);
+  page->source = moveref(copy);
+  page->address = page->source->address;
+  mtx_spin_unlock(&page->pg_lock);
+  drop_pages(&old);
+
+  if (vm->type == VM_TYPE_PAGE) {
+    vm->vm_pages->head.contiguous = false;
+  }
+
+  atomic_fetch_add(&vm_cow_stats.copies, 1);
+  vm_map_page_internal(vm, off, page);
+  // other threads may still be reading the old frame
+  tlb_flush_range(vm->space, vaddr, pg_size, pg_size);
+  return 0;
+}
+
+static void thp_split_cb(page_t **pageref, size_t off, void *data) {
+  struct pgcache *pgcache = data;
+  page_t *page = *pageref;
+
+  page_t *pages;
+  if (!(page->flags & PG_COW) && read_refcount(page) == 1) {
+    // only the cache holds the page so its frames can be handed over
+    pages = page_split_frames(page, PAGE_SIZE);
+  } else if ((page->flags & PG_COW) && read_refcount(page) == 1 && read_refcount(page->source) == 1) {
+    // same for a cow page that is the last one sharing its frames
+    pages = page_split_frames(page->source, PAGE_SIZE);
+  } else {
+    // the frames are shared with a fork or with subpages that were handed out
+    // so the new pages keep referencing them instead of taking them over
+    pages = page_split_shared(page, PAGE_SIZE);
+  }
+
+  while (pages != NULL) {
+    page_t *piece = page_list_split(moveref(pages), 1, &pages);
+    pgcache_insert(pgcache, off, moveref(piece), NULL);
+    off += PAGE_SIZE;
+  }
+}
+
+/*
+ * Splits a mapping that was promoted to 2MB pages back into 4K pages.
+ *
+ * Pages that are not shared hand their frames over to new 4K page structs while
+ * shared ones are split into 4K pages that reference them. Either way the data
+ * stays where it is. The new pages replace the 2MB ones in the page cache and
+ * are mapped in their place.
+ */
+static void vm_thp_split(vm_mapping_t *vm) {
+  space_lock_assert(vm->space, MA_OWNED);
+  ASSERT(vm->type == VM_TYPE_FILE && (vm->flags & VM_THP));
+  vm_file_t *file = vm->vm_file;
+  ASSERT(read_refcount(file->pgcache) == 1);
+
+  // remove the 2MB entries first so that the mappings do not hold on to the pages
+  bool mapped = vm->flags & VM_MAPPED;
+  if (mapped) {
+    file_type_unmap_internal(vm, vm->size, 0);
+    tlb_flush_range(vm->space, vm->address, vm->size, PAGE_SIZE_2MB);
+  }
+
+  struct pgcache *pgcache = pgcache_alloc(pgcache_size_to_order(file->size, PAGE_SIZE), PAGE_SIZE);
+  vm_file_visit_pages(file, file->off, file->off + file->size, thp_split_cb, pgcache);
+
+  pgcache_free(&file->pgcache);
+  file->pgcache = pgcache;
+  file->pg_size = PAGE_SIZE;
+  vm->flags &= ~(VM_HUGE_2MB | VM_THP);
+  if (mapped) {
+    file_type_map_internal(vm, vm->size, 0);
+  }
+  atomic_fetch_add(&vm_thp_stats.splits, 1);
+}
+
 static void vm_update_internal(vm_mapping_t *vm, uint32_t prot) {
   space_lock_assert(vm->space, MA_OWNED);
   prot &= VM_PROT_MASK;
+  bool was_mapped = vm->flags & VM_MAPPED;
 
   vm->flags &= ~VM_PROT_MASK;
   vm->flags |= prot;
@@ -446,6 +740,11 @@ static void vm_update_internal(vm_mapping_t *vm, uint32_t prot) {
         panic("vm_update_internal: invalid mapping type");
     }
   }
+
+  if (was_mapped) {
+    // existing entries were removed or had their permissions changed
+    tlb_flush_range(vm->space, vm->address, vm->size, vm_flags_to_size(vm->flags));
+  }
 }
 
 static void vm_split_internal(vm_mapping_t *vm, size_t off, vm_mapping_t *sibling) {
@@ -480,19 +779,35 @@ static void vm_join_internal(vm_mapping_t *vm, vm_mapping_t *other) {
   }
 }
 
-static void vm_free_internal(vm_mapping_t *vm) {
+static void vm_unmap_internal(vm_mapping_t *vm, tlb_batch_t *batch) {
   space_lock_assert(vm->space, MA_OWNED);
   switch (vm->type) {
     case VM_TYPE_PHYS:
       phys_type_unmap_internal(vm, vm->size, 0);
-      vm->vm_phys = 0;
       break;
     case VM_TYPE_PAGE:
       page_type_unmap_internal(vm, vm->size, 0);
-      drop_pages(&vm->vm_pages);
       break;
     case VM_TYPE_FILE:
       file_type_unmap_internal(vm, vm->size, 0);
+      break;
+    default:
+      panic("vm_unmap_internal: invalid mapping type");
+  }
+  tlb_batch_add(batch, vm->address, vm->size, vm_flags_to_size(vm->flags));
+}
+
+// the mapping must be unmapped and the stale translations flushed first
+static void vm_free_internal(vm_mapping_t *vm) {
+  space_lock_assert(vm->space, MA_OWNED);
+  switch (vm->type) {
+    case VM_TYPE_PHYS:
+      vm->vm_phys = 0;
+      break;
+    case VM_TYPE_PAGE:
+      drop_pages(&vm->vm_pages);
+      break;
+    case VM_TYPE_FILE:
       vm_file_free(&vm->vm_file);
       break;
     default:
@@ -505,12 +820,13 @@ static void vm_free_internal(vm_mapping_t *vm) {
 //
 
 static vm_mapping_t *vm_struct_alloc(enum vm_type type, uint32_t vm_flags, uintptr_t vaddr, size_t size, size_t virt_size) {
-  vm_mapping_t *vm = kmallocz(sizeof(vm_mapping_t));
+  vm_mapping_t *vm = kmem_cache_allocz(vm_mapping_cache);
   vm->type = type;
   vm->flags = vm_flags;
   vm->address = vaddr;
   vm->size = size;
   vm->virt_size = virt_size;
+  vm->fault_around = FAULT_AROUND_INIT;
   return vm;
 }
 
@@ -630,13 +946,14 @@ static vm_mapping_t *split_mapping(vm_mapping_t *vm, size_t off) {
   interval_t intvl = vm_virt_interval(vm);
 
   // create new mapping
-  vm_mapping_t *new_vm = kmallocz(sizeof(vm_mapping_t));
+  vm_mapping_t *new_vm = kmem_cache_allocz(vm_mapping_cache);
   new_vm->type = vm->type;
   new_vm->flags = vm->flags | VM_SPLIT;
   new_vm->address = vm->address + off;
   new_vm->size = vm->size - off;
   new_vm->space = space;
   new_vm->name = str_from_cstr(cstr_from_str(vm->name));
+  new_vm->fault_around = FAULT_AROUND_INIT;
 
   vm_split_internal(vm, off, new_vm);
   vm->flags |= VM_LINKED;
@@ -692,7 +1009,7 @@ static vm_mapping_t *join_mappings(vm_mapping_t *vm_a, vm_mapping_t *vm_b) {
   vm_a->virt_size = vm_a->virt_size + vm_b->virt_size;
 
   str_free(&vm_b->name);
-  kfree(vm_b);
+  kmem_cache_free(vm_mapping_cache, vm_b);
   return vm_a;
 }
 
@@ -735,7 +1052,8 @@ static bool move_mapping(vm_mapping_t *vm, size_t newsize) {
   return true;
 }
 
-static void free_mapping(vm_mapping_t **vmp) {
+// if unmapped is true the caller has already unmapped the mapping and flushed it
+static void free_mapping(vm_mapping_t **vmp, bool unmapped) {
   vm_mapping_t *vm = *vmp;
   address_space_t *space = vm->space;
   space_lock_assert(space, MA_OWNED);
@@ -745,10 +1063,16 @@ static void free_mapping(vm_mapping_t **vmp) {
   space->num_mappings--;
 
   if (vm->flags & VM_MAPPED) {
+    if (!unmapped) {
+      tlb_batch_t batch;
+      tlb_batch_init(&batch, space);
+      vm_unmap_internal(vm, &batch);
+      tlb_batch_flush(&batch);
+    }
     vm_free_internal(vm);
   }
   str_free(&vm->name);
-  kfree(vm);
+  kmem_cache_free(vm_mapping_cache, vm);
   *vmp = NULL;
 }
 
@@ -973,16 +1297,79 @@ LABEL(ret);
 // MARK: Public API
 //
 
+struct fault_around_data {
+  vm_mapping_t *vm;
+  uint64_t *entry;          // entry of the faulting page
+  size_t off;               // file offset of the faulting page
+  size_t count;             // number of pages mapped
+};
+
+static void fault_around_cb(page_t **pageref, size_t off, void *data) {
+  struct fault_around_data *fa = data;
+  vm_mapping_t *vm = fa->vm;
+  page_t *page = *pageref;
+  if (off == fa->off || page_get_mapping(page, vm) != NULL) {
+    return;
+  }
+
+  // the window never crosses the table of the faulting page
+  ssize_t index = ((ssize_t) off - (ssize_t) fa->off) / (ssize_t) vm->vm_file->pg_size;
+  uint64_t *entry = fa->entry + index;
+  if (pgtable_map_empty_entry(entry, page->address, vm_page_map_flags(vm, page))) {
+    page_add_mapping(page, pte_struct_alloc(page, entry, vm));
+    fa->count++;
+  }
+}
+
+/*
+ * Maps the resident neighbours of a faulting file page.
+ *
+ * The window grows while the faults move forward through the mapping and
+ * shrinks when they jump around. Sequential faults map the pages following the
+ * fault while random ones map the pages around it. Only pages already in the
+ * page cache are mapped and the window is clamped to the page table of the
+ * faulting page so that all entries are installed with the single walk done
+ * to map the faulting page.
+ */
+static void vm_fault_around(vm_mapping_t *vm, size_t off, uint64_t *entry) {
+  vm_file_t *file = vm->vm_file;
+  size_t pg_size = file->pg_size;
+  size_t n = vm->fault_around;
+  size_t start;
+  if (off > vm->fault_off && off <= vm->fault_end) {
+    n = min(n * 2, FAULT_AROUND_MAX);
+    start = off;
+  } else {
+    n = max(n / 2, FAULT_AROUND_MIN);
+    start = off - min(off, (n / 2) * pg_size);
+  }
+  vm->fault_around = n;
+  vm->fault_off = off;
+
+  size_t table_span = pg_size * PGTABLE_NUM_ENTRIES;
+  uintptr_t table_start = align_down(vm->address + off, table_span);
+  uintptr_t lo = max(vm->address + start, table_start);
+  uintptr_t hi = min(vm->address + min(start + n * pg_size, vm->size), table_start + table_span);
+  vm->fault_end = hi - vm->address;
+
+  struct fault_around_data data = {vm, entry, file->off + off, 0};
+  vm_file_visit_pages(file, file->off + (lo - vm->address), file->off + (hi - vm->address), fault_around_cb, &data);
+  vm->space->fault_stats.around += data.count;
+}
+
 static always_inline bool can_handle_fault(vm_mapping_t *vm, uintptr_t fault_addr, uint32_t error_code) {
-  if (vm->type != VM_TYPE_FILE || !(vm->flags & VM_MAPPED)) {
+  if ((vm->type != VM_TYPE_FILE && vm->type != VM_TYPE_PAGE) || !(vm->flags & VM_MAPPED)) {
     return false;
+  } else if (fault_addr < vm->address || fault_addr >= vm->address + vm->size) {
+    return false; // guard page or empty space
   }
 
   uint32_t prot = vm->flags & VM_PROT_MASK;
   if (error_code & CPU_PF_W) {
     return prot != 0 && vm->flags & VM_WRITE;
   }
-  return prot != 0;
+  // any other fault on a present page is a protection violation
+  return prot != 0 && !(error_code & CPU_PF_P);
 }
 
 __used void page_fault_handler(struct trapframe *frame) {
@@ -994,34 +1381,69 @@ __used void page_fault_handler(struct trapframe *frame) {
   address_space_t *space = select_space(curspace, fault_addr);
   space_lock(space);
 
-  vm_mapping_t *vm = NULL;
-  if (!(frame->error & CPU_PF_P)) {
-    // fault was due to a non-present page this might be recoverable
-    // check if this fault is related to a vm mapping
-    vm = space_get_mapping(space, fault_addr);
-    if (vm == NULL || !can_handle_fault(vm, fault_addr, frame->error)) {
-      // TODO: support extending stacks automatically if the fault happens
-      //       in the guard page
-      space_unlock(space);
-      goto exception;
-    }
+  // check if this fault is related to a vm mapping
+  vm_mapping_t *vm = space_get_mapping(space, fault_addr);
+  if (vm == NULL || !can_handle_fault(vm, fault_addr, frame->error)) {
+    // TODO: support extending stacks automatically if the fault happens
+    //       in the guard page
+    space_unlock(space);
+    goto exception;
+  }
 
-    // DPRINTF("non-present page fault in vm_file [vm={:str},addr=%p]\n", &vm->name, fault_addr);
-    size_t off = page_trunc(fault_addr - vm->address);
-    vm_file_t *file = vm->vm_file;
-    page_t *page = vm_file_getpage(file, off);
+  size_t off = align_down(fault_addr - vm->address, vm_flags_to_size(vm->flags));
+  page_t *page;
+  bool major = false;
+  if (vm->type == VM_TYPE_PAGE) {
+    page = page_type_getpage_internal(vm, off);
+  } else {
+    page = pgcache_lookup(vm->vm_file->pgcache, vm->vm_file->off + off);
     if (page == NULL) {
-      EPRINTF("failed to get non-present page in vm_file [vm={:str},off=%zu]\n", &vm->name, off);
-      space_unlock(space);
-      goto exception;
+      major = true;
+      page = vm_file_getpage(vm->vm_file, off);
+      if (page == NULL && (vm->flags & VM_THP)) {
+        // no 2MB frames are available so fall back to 4K pages
+        atomic_fetch_add(&vm_thp_stats.fallbacks, 1);
+        vm_thp_split(vm);
+        off = align_down(fault_addr - vm->address, PAGE_SIZE);
+        page = vm_file_getpage(vm->vm_file, off);
+      } else if (page != NULL && (vm->flags & VM_THP)) {
+        atomic_fetch_add(&vm_thp_stats.allocs, 1);
+      }
     }
-
-    file_type_mappage_internal(vm, file, off, moveref(page));
+  }
+  if (page == NULL) {
+    EPRINTF("failed to get page for fault [vm={:str},off=%zu]\n", &vm->name, off);
     space_unlock(space);
-    return; // recover
+    goto exception;
+  }
+
+  if (major) {
+    space->fault_stats.major++;
+  } else {
+    space->fault_stats.minor++;
   }
 
-  // TODO: support COW pages on CPU_PF_W
+  if (!(frame->error & CPU_PF_P)) {
+    // the page has not been mapped yet
+    uint64_t *entry = vm_map_page_internal(vm, off, page);
+    if (vm->type == VM_TYPE_FILE) {
+      vm_fault_around(vm, off, entry);
+    }
+  }
+  if ((frame->error & CPU_PF_W) && vm_cow_page_internal(vm, off, page) < 0) {
+    // no 2MB frames are available for the copy so fall back to 4K pages
+    atomic_fetch_add(&vm_thp_stats.fallbacks, 1);
+    drop_pages(&page);
+    vm_thp_split(vm);
+    off = align_down(fault_addr - vm->address, PAGE_SIZE);
+    page = pgcache_lookup(vm->vm_file->pgcache, vm->vm_file->off + off);
+    ASSERT(page != NULL);
+    vm_cow_page_internal(vm, off, page);
+  }
+
+  drop_pages(&page);
+  space_unlock(space);
+  return; // recover
 
 LABEL(exception);
   kprintf("================== !!! Exception !!! ==================\n");
@@ -1059,10 +1481,11 @@ void init_address_space() {
   //   kernel_code_start - kernel_code_end | kernel code (rw)
   //   kernel_code_end - kernel_data_end   | kernel data (rw)
   //       ...
-  //   0xFFFFFF8000400000 - +6Mi           | kernel heap (rw)
-  //       ...
   //   0xFFFFFF8000C00000 - +rsvd size     | kernel reserved (--)
+  //       ...
+  //   0xFFFFFFC000000000 - +1Gi           | kernel slab arena (rw)
   //
+  vm_mapping_cache = kmem_cache_create("vm_mapping", sizeof(vm_mapping_t), 0, 0);
   init_recursive_pgtable();
 
   uintptr_t pgtable = get_current_pgtable();
@@ -1075,6 +1498,7 @@ void init_address_space() {
   kernel_space = vm_new_space(KERNEL_SPACE_START, KERNEL_SPACE_END, 0);
   // allocate the default user space
   default_user_space = vm_new_space(USER_SPACE_START, USER_SPACE_END, pgtable);
+  tlb_space_activate(default_user_space);
   set_curspace(default_user_space);
 
   /////////////////////////////////
@@ -1085,8 +1509,9 @@ void init_address_space() {
   vmap_phys(0, kernel_virtual_offset, lowmem_size, VM_RDWR | kvm_flags, "lowmem");
   vmap_phys(kernel_address, kernel_code_start, kernel_code_size, VM_RDEXC | kvm_flags, "kernel code");
   vmap_phys(kernel_address + kernel_code_size, kernel_code_end, kernel_data_size, VM_RDWR | kvm_flags, "kernel data");
-  vmap_phys(kheap_phys_addr(), KERNEL_HEAP_VA, KERNEL_HEAP_SIZE, VM_RDWR | kvm_flags, "kernel heap");
   vmap_phys(kernel_reserved_start, KERNEL_RESERVED_VA, reserved_size, VM_RDWR | kvm_flags, "kernel reserved");
+  // the slab arena is mapped on demand outside of the vm layer
+  vmap_rsvd(KERNEL_SLAB_VA, KERNEL_SLAB_SIZE, kvm_flags, "kernel slab");
   /////////////////////////////////
 
   execute_init_address_space_callbacks();
@@ -1100,8 +1525,10 @@ void init_address_space() {
   // this leaves the original page tables (identity mappings included) for our APs
   space_lock(default_user_space);
   address_space_t *user_space = vm_fork_space(default_user_space, /*deepcopy_user=*/false);
-  set_current_pgtable(user_space->page_table);
+  critical_enter();
   set_curspace(user_space);
+  tlb_switch_space(default_user_space, user_space);
+  critical_exit();
   curproc->space = user_space;
   space_unlock(default_user_space);
 
@@ -1152,11 +1579,11 @@ address_space_t *vm_new_uspace() {
   return space;
 }
 
-// the caller must have target space locked
+// the caller must have target space locked. deepcopy_user is only meant for
+// bootstrapping spaces whose user page tables must be kept as is
 address_space_t *vm_fork_space(address_space_t *space, bool deepcopy_user) {
   space_lock_assert(space, MA_OWNED);
   address_space_t *newspace = vm_new_space(space->min_addr, space->max_addr, 0);
-  newspace->num_mappings = space->num_mappings;
   ASSERT(space->page_table == get_current_pgtable());
 
   // fork the page tables
@@ -1169,14 +1596,23 @@ address_space_t *vm_fork_space(address_space_t *space, bool deepcopy_user) {
   newspace->page_table = pgtable;
   SLIST_ADD_SLIST(&newspace->table_pages, meta_pages, SLIST_GET_LAST(meta_pages, next), next);
 
-  // clone and fork all the vm_mappings
+  // clone and fork all the vm_mappings. the write protected parent mappings
+  // are flushed together at the end
+  tlb_batch_t batch;
+  tlb_batch_init(&batch, space);
+  vm_mapping_t *prev_vm = NULL;
   vm_mapping_t *prev_newvm = NULL;
   vm_mapping_t *vm = NULL;
   LIST_FOREACH(vm, &space->mappings, vm_list) {
     vm_mapping_t *newvm = vm_struct_alloc(vm->type, vm->flags, vm->address, vm->size, vm->virt_size);
     newvm->name = str_dup(vm->name);
     newvm->space = newspace;
-    vm_fork_internal(vm, newvm);
+
+    vm_mapping_t *sibling = NULL;
+    if (prev_vm != NULL && vm_are_siblings(prev_vm, vm)) {
+      sibling = prev_newvm;
+    }
+    vm_fork_internal(vm, newvm, sibling, deepcopy_user, &batch);
 
     // insert into new space
     intvl_tree_insert(newspace->new_tree, vm_virt_interval(newvm), newvm);
@@ -1186,10 +1622,33 @@ address_space_t *vm_fork_space(address_space_t *space, bool deepcopy_user) {
       LIST_ADD(&newspace->mappings, newvm, vm_list);
     }
     newspace->num_mappings++;
+    prev_vm = vm;
+    prev_newvm = newvm;
   }
+
+  tlb_batch_flush(&batch);
   return newspace;
 }
 
+// frees a space that is no longer loaded on any cpu. its mappings have to be
+// freed beforehand while it was still current
+void vm_free_space(address_space_t **spacep) {
+  address_space_t *space = *spacep;
+  ASSERT(space != curspace);
+  ASSERT(space->num_mappings == 0);
+  ASSERT(atomic_load(&space->active_cpus) == 0);
+
+  page_t *table_pages = LIST_FIRST(&space->table_pages);
+  LIST_FIRST(&space->table_pages) = NULL;
+  LIST_LAST(&space->table_pages) = NULL;
+  drop_pages_unlinked(&table_pages);
+
+  intvl_tree_free(space->new_tree);
+  mtx_destroy(&space->lock);
+  kfree(space);
+  *spacep = NULL;
+}
+
 //
 // MARK:- vmap API
 //
@@ -1236,6 +1695,7 @@ uintptr_t vmap_file(vm_file_t *file, uintptr_t hint, size_t vm_size, uint32_t vm
 }
 
 uintptr_t vmap_anon(size_t vm_size, uintptr_t hint, size_t size, uint32_t vm_flags, const char *name) {
+  vm_flags = vm_thp_flags(hint, size, vm_size, vm_flags);
   vm_file_t *file = vm_file_alloc_anon(size, vm_flags_to_size(vm_flags));
   int res;
   uintptr_t vaddr;
@@ -1324,13 +1784,23 @@ int vmap_free(uintptr_t vaddr, size_t size) {
     }
   }
 
-  // free all the mappings
+  // unmap all the mappings first so the stale translations are shot down together
+  tlb_batch_t batch;
+  tlb_batch_init(&batch, space);
+  for (vm_mapping_t *curr = vm; curr != LIST_NEXT(vm_end, vm_list); curr = LIST_NEXT(curr, vm_list)) {
+    if (curr->flags & VM_MAPPED) {
+      vm_unmap_internal(curr, &batch);
+    }
+  }
+  tlb_batch_flush(&batch);
+
+  // then free them
   while (vm != vm_end) {
     vm_mapping_t *next = LIST_NEXT(vm, vm_list);
-    free_mapping(&vm);
+    free_mapping(&vm, /*unmapped=*/true);
     vm = next;
   }
-  free_mapping(&vm_end);
+  free_mapping(&vm_end, /*unmapped=*/true);
   vm_end = NULL;
 
 LABEL(ret);
@@ -1407,6 +1877,12 @@ int vmap_protect(uintptr_t vaddr, size_t len, int prot) {
   interval_t i = intvl(vaddr, vaddr+len);
   bool is_single = vm == vm_end;
   bool are_siblings = vm_are_siblings(vm, vm_end);
+  if (is_single && (vm->flags & VM_THP) && !intvl_eq(i, i_start) &&
+      contains_point(i_start, i.start) && contains_point(i_start, i.end-1)) {
+    // only part of a promoted mapping is changing so it goes back to 4K pages
+    vm_thp_split(vm);
+  }
+
   if (!contains_point(i_start, i.start) || !contains_point(i_end, i.end-1)) {
     // case 1
     res = -ENOMEM;
@@ -1496,6 +1972,11 @@ int vmap_resize(uintptr_t vaddr, size_t old_size, size_t new_size, bool allow_mo
     goto ret;
   }
 
+  if ((vm->flags & VM_THP) && !is_aligned(new_size, PAGE_SIZE_2MB)) {
+    // the new size can not be covered by 2MB pages
+    vm_thp_split(vm);
+  }
+
   // first try resizing the existing mapping in place
   uintptr_t old_addr = vm->address;
   if (!resize_mapping_inplace(vm, new_size)) {
@@ -1515,9 +1996,20 @@ int vmap_resize(uintptr_t vaddr, size_t old_size, size_t new_size, bool allow_mo
     if (vm->type == VM_TYPE_PAGE) {
       page_type_unmap_internal(vm, size, off);
     } else if (vm->type == VM_TYPE_FILE) {
-      struct file_cb_data data = {vm, off, /*unmap=*/false};
-      vm_file_visit_pages(vm->vm_file, off, off + size, file_map_update_cb, &data);
+      file_type_unmap_internal(vm, size, off);
     }
+    tlb_flush_range(space, vm->address + off, size, vm_flags_to_size(vm->flags));
+  }
+
+  if (vm->type == VM_TYPE_FILE && vm->vm_file->vnode == NULL) {
+    // anonymous memory follows the size of the mapping
+    vm_file_t *file = vm->vm_file;
+    if (new_size < old_size && read_refcount(file->pgcache) == 1) {
+      for (size_t off = new_size; off < old_size; off += file->pg_size) {
+        pgcache_remove(file->pgcache, file->off + off, NULL);
+      }
+    }
+    file->size = new_size;
   }
 
 LABEL(ret);
@@ -1578,6 +2070,18 @@ __ref page_t *vm_getpage_cow(uintptr_t vaddr) {
 
 //
 
+void vm_get_fault_stats(address_space_t *space, struct vm_fault_stats *stats) {
+  space_lock(space);
+  *stats = space->fault_stats;
+  space_unlock(space);
+}
+
+void vm_get_thp_stats(struct vm_thp_stats *stats) {
+  stats->allocs = atomic_load(&vm_thp_stats.allocs);
+  stats->fallbacks = atomic_load(&vm_thp_stats.fallbacks);
+  stats->splits = atomic_load(&vm_thp_stats.splits);
+}
+
 uintptr_t vm_virt_to_phys(uintptr_t vaddr) {
   if (!is_valid_pointer(vaddr)) {
     return 0;
@@ -1720,6 +2224,7 @@ uintptr_t vmap_other_anon(address_space_t *uspace, size_t vm_size, uintptr_t vad
           vaddr, vm_size, size, vm_flags, name);
 
   int res;
+  vm_flags = vm_thp_flags(vaddr, size, vm_size, vm_flags);
   vm_file_t *file = vm_file_alloc_anon(size, vm_flags_to_size(vm_flags));
   if ((res = vmap_internal(uspace, VM_TYPE_FILE, vaddr, size, vm_size, vm_flags, name, file, NULL)) < 0) {
     ALLOC_ERROR("vmap: failed to make anonymous mapping %s {:err}\n", name, res);
@@ -1859,10 +2364,62 @@ void vfree(void *ptr) {
     DPANICF("vfree: invalid pointer: {:018p} is not the start of a vmalloc mapping\n", ptr);
   }
 
-  free_mapping(&vm);
+  free_mapping(&vm, /*unmapped=*/false);
   space_unlock(space);
 }
 
+// #define VM_FORK_BENCHMARK
+#ifdef VM_FORK_BENCHMARK
+#define BENCH_SIZE SIZE_16MB
+
+// forks a fully populated mapping and writes to a varying number of its pages from the child
+static void vm_fork_benchmark() {
+  static const size_t touch_counts[] = { 0, 16, 256, 4096 };
+  address_space_t *space = curspace;
+  uintptr_t vaddr = vmap_anon(0, 0, BENCH_SIZE, VM_USER|VM_RDWR, "fork benchmark");
+  memset((void *) vaddr, 0xAA, BENCH_SIZE);
+
+  kprintf("vmalloc: fork benchmark (%zu pages resident, cycles)\n", BENCH_SIZE / PAGE_SIZE);
+  for (int i = 0; i < ARRAY_SIZE(touch_counts); i++) {
+    size_t touched = touch_counts[i];
+    uint64_t copies = vm_cow_stats.copies;
+    uint64_t reuses = vm_cow_stats.reuses;
+
+    space_lock(space);
+    uint64_t start = cpu_read_tsc();
+    address_space_t *child = vm_fork_space(space, /*deepcopy_user=*/false);
+    uint64_t fork_cycles = cpu_read_tsc() - start;
+    space_unlock(space);
+
+    curproc->space = child;
+    switch_address_space(child);
+    start = cpu_read_tsc();
+    for (size_t j = 0; j < touched; j++) {
+      *((volatile uint64_t *)(vaddr + j * PAGE_SIZE)) = j;
+    }
+    uint64_t touch_cycles = cpu_read_tsc() - start;
+
+    // the mappings have to be freed while the child is current
+    space_lock(child);
+    vm_mapping_t *vm;
+    while ((vm = LIST_FIRST(&child->mappings)) != NULL) {
+      free_mapping(&vm, /*unmapped=*/false);
+    }
+    space_unlock(child);
+
+    switch_address_space(space);
+    curproc->space = space;
+    vm_free_space(&child);
+
+    kprintf("  touched %-5zu fork %10llu  writes %10llu  copies %5llu  reuses %5llu\n",
+            touched, fork_cycles, touch_cycles, vm_cow_stats.copies - copies, vm_cow_stats.reuses - reuses);
+  }
+
+  vmap_free(vaddr, BENCH_SIZE);
+}
+STATIC_INIT(vm_fork_benchmark);
+#endif
+
 //
 // MARK: Debug functions
 //
@@ -1886,7 +2443,14 @@ static inline const char *prot_to_debug_str(uint32_t vm_flags) {
 }
 
 void vm_print_address_space() {
+  struct vm_fault_stats stats;
+  vm_get_fault_stats(curspace, &stats);
   kprintf("vm: address space mappings\n");
+  kprintf("vm: %llu major faults, %llu minor faults, %llu pages faulted around\n",
+          stats.major, stats.minor, stats.around);
+  struct vm_thp_stats thp;
+  vm_get_thp_stats(&thp);
+  kprintf("vm: %llu thp allocations, %llu fallbacks, %llu splits\n", thp.allocs, thp.fallbacks, thp.splits);
   kprintf("{:$=^80s}\n", " user space ");
   vm_print_mappings(curspace);
   kprintf("{:$=^80s}\n", " kernel space ");
@@ -4,7 +4,9 @@
 
 #include <kernel/mutex.h>
 #include <kernel/proc.h>
+#include <kernel/sched.h>
 #include <kernel/tqueue.h>
+#include <kernel/clock.h>
 #include <kernel/panic.h>
 #include <kernel/printf.h>
 
@@ -21,7 +23,8 @@
 #define MTX_LOCKED      0x01 // mutex is locked
 #define MTX_DESTROYED   0x02 // destroyed mutex state
 #define MTX_RECURSED    0x04 // mutex is locked recursively (non-spin)
-#define MTX_STATE_MASK  0x07
+#define MTX_CONTESTED   0x08 // threads are blocked on the mutex (with MTX_LOCKED)
+#define MTX_STATE_MASK  0x0f
 
 #define MTX_DEBUGF(m, file, line, fmt, ...) \
   { if (__expect_false((m)->lo.flags & LO_DEBUG)) kprintf("mtx: " fmt " [%s:%d]\n", ##__VA_ARGS__, file, line); }
@@ -67,6 +70,7 @@ uint32_t _mtx_opts_to_lockobject_flags(uint32_t opts) {
   flags |= opts & MTX_DEBUG ? LO_DEBUG : 0;
   flags |= opts & MTX_NOCLAIMS ? LO_NOCLAIMS : 0;
   flags |= opts & MTX_RECURSIVE ? LO_RECURSABLE : 0;
+  flags |= opts & MTX_NOBLOCK ? LO_NOBLOCK : 0;
   return flags;
 }
 
@@ -82,6 +86,7 @@ void _mtx_init(mtx_t *mtx, uint32_t opts, const char *name) {
 void _mtx_destroy(mtx_t *mtx) {
   MTX_DEBUGF(mtx, __FILE__, __LINE__, "destroy {:#Lo}", mtx);
   ASSERT(mtx->mtx_lock != MTX_DESTROYED, "_mtx_destroy() on locked mutex");
+  lock_stats_remove(&mtx->lo);
   mtx->lo.flags = MTX_DESTROYED;
   mtx->lo.data = 0;
   mtx->mtx_lock = MTX_DESTROYED;
@@ -215,7 +220,7 @@ int _mtx_wait_trylock(mtx_t *mtx, const char *file, int line) {
 
   if (curthread != NULL && mtx_get_owner(mtx) == curthread) {
     ASSERT(mtx_get_lo(mtx) & LO_RECURSABLE, "_mtx_wait_trylock() on non-recursive mutex, %s:%d", file, line);
-    mtx->mtx_lock |= MTX_RECURSED;
+    atomic_fetch_or(&mtx->mtx_lock, MTX_RECURSED);
     mtx->lo.data++;
     curthread->lock_count++;
     return 1;
@@ -226,6 +231,9 @@ int _mtx_wait_trylock(mtx_t *mtx, const char *file, int line) {
     // uncontended lock
     mtx->lo.data = 1;
     curthread->lock_count++;
+    if (__expect_false(mtx->lo.flags & LO_CONTENDED)) {
+      lock_stats_record_acquire(&mtx->lo);
+    }
     return 1;
   }
 
@@ -233,6 +241,105 @@ int _mtx_wait_trylock(mtx_t *mtx, const char *file, int line) {
   return 0;
 }
 
+// the lock has an owner so spin while it is running on another cpu and block on
+// the lockqueue once it is not. the owner of a short critical section is likely
+// to release the lock well before a pair of context switches would complete.
+static void mtx_wait_lock_contested(mtx_t *mtx, const char *file, int line) {
+  struct lock_object *lock_obj = &mtx->lo;
+  thread_t *td = curthread;
+  uintptr_t mtx_lock = new_mtx_lock(td, MTX_LOCKED);
+  // threads in a critical section can not block and neither can thread locks.
+  // those can still yield the cpu as long as the scheduler will not need a lock
+  // that we hold or are waiting for
+  bool can_block = td != NULL && td->crit_level == 0 && !TDF_IS_IDLE(td) &&
+                   !(lock_obj->flags & LO_NOBLOCK);
+  bool can_yield = td != NULL && td->crit_level == 0 && !TDF_IS_IDLE(td) &&
+                   td->lock_count == 0 && mtx != &td->lock;
+
+  uint64_t start_ns = clock_get_nanos();
+  uint64_t sleep_ns = 0;
+  for (;;) {
+    uintptr_t v = atomic_load_relaxed(&mtx->mtx_lock);
+    if (v == MTX_UNOWNED) {
+      if (atomic_cmpxchg_acq(&mtx->mtx_lock, MTX_UNOWNED, mtx_lock)) {
+        break;
+      }
+      continue;
+    }
+
+    thread_t *owner = mtx_lock_owner(v);
+    if (owner == NULL || TDS_IS_RUNNING(owner)) {
+      cpu_pause();
+      continue;
+    } else if (!can_block) {
+      if (can_yield) {
+        // the owner was preempted and may be waiting for this cpu so spinning
+        // could keep it from ever releasing the lock
+        sched_again(SCHED_YIELDED);
+      } else {
+        // nothing to do but wait for another cpu to pick up the owner
+        cpu_pause();
+      }
+      continue;
+    }
+
+    lockq_chain_lock(lock_obj);
+    // the owner may have released the lock or started running again
+    v = atomic_load_relaxed(&mtx->mtx_lock);
+    owner = mtx_lock_owner(v);
+    if (v == MTX_UNOWNED || owner == NULL || TDS_IS_RUNNING(owner)) {
+      lockq_chain_unlock(lock_obj);
+      continue;
+    }
+
+    // mark the mutex contested so the owner has to go through the chain lock to
+    // release it. this can not race with the unlock once the bit is set
+    if (!(v & MTX_CONTESTED) && !atomic_cmpxchg(&mtx->mtx_lock, v, v | MTX_CONTESTED)) {
+      lockq_chain_unlock(lock_obj);
+      continue;
+    }
+
+    struct lockqueue *lockq = lockq_lookup(lock_obj);
+    if (lockq == NULL) {
+      lockq = td->own_lockq; // donate our lockq
+      lockq->lock_obj = lock_obj;
+    }
+
+    MTX_DEBUGF(mtx, file, line, "wait_lock {:#Lo} blocking on owner={:td}", mtx, owner);
+    uint64_t block_ns = clock_get_nanos();
+    lockq_wait(lockq, owner, LQ_EXCL);
+    block_ns = clock_get_nanos() - block_ns;
+    sleep_ns += block_ns;
+    td->blocktime += block_ns;
+  }
+
+  mtx->lo.data = 1;
+  td->lock_count++;
+
+  uint64_t total_ns = clock_get_nanos() - start_ns;
+  lock_stats_record_contention(lock_obj, total_ns - min(total_ns, sleep_ns), sleep_ns);
+}
+
+// the mutex is contested so wake the blocked threads and let them compete for
+// it again. the ones that lose block again and lend their priority to the new
+// owner.
+static void mtx_wait_unlock_contested(mtx_t *mtx) {
+  struct lock_object *lock_obj = &mtx->lo;
+  lockq_chain_lock(lock_obj);
+
+  struct lockqueue *lockq = lockq_lookup(lock_obj);
+  if (lockq != NULL) {
+    lockq_disown(lockq);
+    atomic_store_release(&mtx->mtx_lock, MTX_UNOWNED);
+    lockq_broadcast(lockq, LQ_EXCL);
+  } else {
+    // the waiters were removed without being woken (eg. they were stopped)
+    atomic_store_release(&mtx->mtx_lock, MTX_UNOWNED);
+  }
+
+  lockq_chain_unlock(lock_obj);
+}
+
 void _mtx_wait_lock(mtx_t *mtx, const char *file, int line) {
   MTX_DEBUGF(mtx, file, line, "wait_lock {:#Lo} lock={:#x} owner={:td} curthread={:td}", mtx, mtx->mtx_lock, mtx_lock_owner(mtx->mtx_lock), curthread);
   ASSERT(mtx->mtx_lock != MTX_DESTROYED, "_mtx_wait_lock() on destroyed mutex, %s:%d", file, line);
@@ -244,31 +351,24 @@ void _mtx_wait_lock(mtx_t *mtx, const char *file, int line) {
     MTX_DEBUGF(mtx, file, line, "wait_lock {:#Lo} recursed", mtx);
     ASSERT(mtx_get_lo(mtx) & LO_RECURSABLE, "_mtx_wait_lock() on non-recursive mutex, %s:%d", file, line);
     // recursed lock
-    mtx->mtx_lock |= MTX_RECURSED;
+    atomic_fetch_or(&mtx->mtx_lock, MTX_RECURSED);
     mtx->lo.data++;
     curthread->lock_count++;
     return;
   }
 
-  for (;;) {
-    uintptr_t mtx_lock = new_mtx_lock(curthread, MTX_LOCKED);
-    if (atomic_cmpxchg_acq(&mtx->mtx_lock, MTX_UNOWNED, mtx_lock)) {
-      // lock claimed
-      mtx->lo.data = 1;
-      curthread->lock_count++;
-      return;
-    }
-
-    struct lock_object *lock_obj = &mtx->lo;
-    lockq_chain_lock(lock_obj);
-
-    struct lockqueue *lockq = lockq_lookup(lock_obj);
-    if (lockq == NULL) {
-      lockq = curthread->own_lockq; // donate our lockq
+  uintptr_t mtx_lock = new_mtx_lock(curthread, MTX_LOCKED);
+  if (atomic_cmpxchg_acq(&mtx->mtx_lock, MTX_UNOWNED, mtx_lock)) {
+    // lock claimed
+    mtx->lo.data = 1;
+    curthread->lock_count++;
+    if (__expect_false(mtx->lo.flags & LO_CONTENDED)) {
+      lock_stats_record_acquire(&mtx->lo);
     }
-
-    lockq_wait(lockq, curthread, LQ_EXCL);
+    return;
   }
+
+  mtx_wait_lock_contested(mtx, file, line);
 }
 
 void _mtx_wait_unlock(mtx_t *mtx, const char *file, int line) {
@@ -288,14 +388,16 @@ void _mtx_wait_unlock(mtx_t *mtx, const char *file, int line) {
     MTX_DEBUGF(mtx, file, line, "wait_unlock {:#Lo} recursed", mtx);
     ASSERT(mtx_get_lo(mtx) & LO_RECURSABLE, "_mtx_wait_unlock() on non-recursive mutex");
     if (mtx->lo.data == 1) {
-      mtx->mtx_lock &= ~MTX_RECURSED;
+      atomic_fetch_and(&mtx->mtx_lock, ~MTX_RECURSED);
     }
     MTX_DEBUGF(mtx, file, line, "--> lock={:#x}", mtx->mtx_lock);
     return;
   }
 
   ASSERT(mtx->lo.data == 0, "_mtx_wait_unlock() expected 0 count, got %d", mtx->lo.data);
-  atomic_store_release(&mtx->mtx_lock, MTX_UNOWNED);
+  if (!atomic_cmpxchg_rel(&mtx->mtx_lock, new_mtx_lock(curthread, MTX_LOCKED), MTX_UNOWNED)) {
+    mtx_wait_unlock_contested(mtx);
+  }
 
   WAIT_CLAIMS_REMOVE(&mtx->lo);
 }
@@ -308,6 +410,10 @@ void _thread_lock(thread_t *td, const char *file, int line) {
   _mtx_wait_lock(&td->lock, file, line);
 }
 
+int _thread_trylock(thread_t *td, const char *file, int line) {
+  return _mtx_wait_trylock(&td->lock, file, line);
+}
+
 void _thread_unlock(thread_t *td, const char *file, int line) {
   _mtx_wait_unlock(&td->lock, file, line);
 }
@@ -67,6 +67,8 @@ noreturn void panic(const char *fmt, ...) {
   debug_unwind(frame->rip, (uintptr_t) frame->rbp);
   kprintf("==== kernel heap ====\n");
   kheap_dump_stats();
+  kprintf("==== kernel caches ====\n");
+  kmem_dump_stats();
   mtx_spin_unlock(&panic_lock);
 
   if (system_num_cpus > 1) {
@@ -17,6 +17,7 @@
 
 #include <kernel/cpu/cpu.h>
 #include <kernel/cpu/gdt.h>
+#include <kernel/cpu/fpu.h>
 #include <kernel/vfs/file.h>
 #include <kernel/vfs/ventry.h>
 
@@ -42,12 +43,15 @@ static struct pcreds *root_creds;
 static pgroup_t *pgroup0;
 static proc_t *proc0;
 static mtx_t proc0_ap_lock;
+static kmem_cache_t *thread_cache;
 
 struct percpu *percpu0;
 
 void proc0_init() {
   // runs just after the early initializers
   percpu0 = curcpu_area;
+  // the low 4 bits of a thread pointer hold the mutex state
+  thread_cache = kmem_cache_create("thread", sizeof(thread_t), 16, 0);
 
   root_creds = pcreds_alloc(0, 0);
   pgroup0 = pgrp_alloc_empty(0, NULL);
@@ -595,7 +599,7 @@ static void kernel_thread_start_wrapper(void (*func)()) {
 }
 
 static thread_t *thread_alloc_internal(uint32_t flags, uintptr_t kstack_base, size_t kstack_size) {
-  thread_t *td = kmallocz(sizeof(thread_t));
+  thread_t *td = kmem_cache_allocz(thread_cache);
   td->flags = flags;
   td->flags2 = TDF2_FIRSTTIME;
 
@@ -608,7 +612,7 @@ static thread_t *thread_alloc_internal(uint32_t flags, uintptr_t kstack_base, si
   td->cpu_id = -1;
   td->pri_base = td_flags_to_base_priority(flags);
   td->priority = td->pri_base;
-  mtx_init(&td->lock, 0, "thread_lock");
+  mtx_init(&td->lock, MTX_NOBLOCK, "thread_lock");
 
   // ASSERT(kstack_pages != NULL);
   // td->kstack_base =
@@ -630,10 +634,12 @@ static thread_t *thread_alloc_internal(uint32_t flags, uintptr_t kstack_base, si
 
   td->tcb->rsp = kstack_top;
   td->tcb->rflags = 0x3202; // IF=1, IOPL=3
+  td->tcb->fpu_cpu = -1;
   if (flags & TDF_KTHREAD) {
     td->tcb->tcb_flags |= TCB_KERNEL;
   } else {
-    td->tcb->tcb_flags |= TCB_IRETQ;
+    td->tcb->tcb_flags |= TCB_IRETQ | TCB_FPU;
+    td->tcb->fpu = fpu_area_alloc();
   }
   return td;
 }
@@ -677,9 +683,9 @@ void thread_free_exited(thread_t **tdp) {
   cpuset_free(&td->cpuset);
 
   pcreds_release(&td->creds);
-  // tcb_free(&td->tcb);
+  fpu_area_free(&td->tcb->fpu);
   todo();
-  kfree(td);
+  kmem_cache_free(thread_cache, td);
   *tdp = NULL;
 }
 
@@ -4,61 +4,689 @@
 
 #include <kernel/rwlock.h>
 #include <kernel/proc.h>
+#include <kernel/tqueue.h>
+#include <kernel/sched.h>
+#include <kernel/clock.h>
+#include <kernel/mm.h>
+#include <kernel/atomic.h>
+#include <kernel/string.h>
 #include <kernel/panic.h>
 #include <kernel/printf.h>
+#include <kernel/str.h>
 
-#define RW_ASSERT(x, fmt, ...) kassertf(x, fmt, __VA_ARGS__)
-#define RW_DEBUGF(m, fmt, ...) \
-  if (__expect_false(rw_get_opts(m) & RW_DEBUG)) kprintf("rwlock: " fmt "", __VA_ARGS__)
-
-#define rw_set_owner(m, td) (mtx->owner_opts = (uintptr_t)(td) | ((mtx)->owner_opts & MTX_OPT_MASK))
-#define rw_set_opts(m, opts) (mtx->owner_opts = (opts) | ((mtx)->owner_opts & ~MTX_OPT_MASK))
-#define rw_get_owner(m) ((thread_t *) ((mtx)->owner_opts & ~MTX_OPT_MASK))
-#define rw_get_opts(m) ((mtx)->owner_opts & MTX_OPT_MASK)
+#define RW_ASSERT(x, fmt, ...) kassertf(x, fmt, ##__VA_ARGS__)
+#define RW_DEBUGF(rw, fmt, ...) \
+  { if (__expect_false((rw)->lo.flags & LO_DEBUG)) kprintf("rwlock: " fmt "\n", ##__VA_ARGS__); }
 
 // rwlock state
-#define RW_UNOWNED   0x00 // free rwlock state
-#define RW_LOCKED    0x01 // rwlock is locked
-#define RW_READING   0x02 // rwlock is locked for reading
-#define RW_DESTROYED 0x08 // rwlock has been destroyed
+#define RW_UNOWNED        0x00 // free rwlock state
+#define RW_WRITER         0x01 // rwlock is locked for writing
+#define RW_READ_WAITERS   0x02 // readers are blocked on the lockqueue
+#define RW_WRITE_WAITERS  0x04 // writers are blocked on the lockqueue
+#define RW_DESTROYED      0x08 // rwlock has been destroyed
+#define RW_WAITERS        (RW_READ_WAITERS | RW_WRITE_WAITERS)
+#define RW_READERS_SHIFT  8
+#define RW_ONE_READER     (1ULL << RW_READERS_SHIFT)
+#define rw_readers(v)     ((v) >> RW_READERS_SHIFT)
+
+#define RW_READER_SPINS   1000 // times a writer spins on readers before blocking
+#define RW_DRAIN_SPINS    1000 // times a big-reader writer spins on readers before yielding
+
+struct rw_pcpu {
+  volatile int64_t readers; // may go negative if a reader migrated before unlocking
+} __aligned(64);
+
+static inline bool rw_can_block() {
+  thread_t *td = curthread;
+  return td != NULL && td->crit_level == 0 && !TDF_IS_IDLE(td);
+}
+
+// big-reader locks have no shared reader count so each thread keeps track of
+// the ones it has read locked
+static inline bool rw_big_held(rwlock_t *rw, thread_t *td) {
+  if (td == NULL) {
+    return false;
+  }
+  for (int i = 0; i < TD_MAX_BRLOCKS; i++) {
+    if (td->brlocks[i] == rw) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline void rw_big_hold(rwlock_t *rw, thread_t *td) {
+  for (int i = 0; i < TD_MAX_BRLOCKS; i++) {
+    if (td->brlocks[i] == NULL) {
+      td->brlocks[i] = rw;
+      return;
+    }
+  }
+  panic("rwlock: too many big-reader read locks held by thread");
+}
+
+static inline void rw_big_unhold(rwlock_t *rw, thread_t *td) {
+  for (int i = 0; i < TD_MAX_BRLOCKS; i++) {
+    if (td->brlocks[i] == rw) {
+      td->brlocks[i] = NULL;
+      return;
+    }
+  }
+  panic("rwlock: big-reader read lock not held by thread");
+}
+
+// readers are let in if there is no writer and no writer is waiting, unless
+// the thread already holds a read lock in which case it could be holding up
+// the waiting writer. a big-reader writer sets its bit before it drains the
+// readers so a thread that holds a read lock on it is let through the bit too.
+static inline bool rw_can_read(rwlock_t *rw, uintptr_t v, thread_t *td) {
+  if (v & RW_WRITER) {
+    return rw->pcpu != NULL && rw_big_held(rw, td);
+  }
+  return !(v & RW_WRITE_WAITERS) || (td != NULL && td->rlock_count > 0);
+}
+
+static int64_t rw_big_readers(rwlock_t *rw) {
+  int64_t readers = 0;
+  for (int i = 0; i < MAX_CPUS; i++) {
+    readers += atomic_load(&rw->pcpu[i].readers);
+  }
+  return readers;
+}
+
+// waits for the readers on every cpu to leave. new readers back off as soon as
+// they see the writer bit. returns the time spent waiting.
+static uint64_t rw_big_drain(rwlock_t *rw) {
+  if (rw_big_readers(rw) == 0) {
+    return 0;
+  }
+
+  uint64_t start_ns = clock_get_nanos();
+  int spins = 0;
+  while (rw_big_readers(rw) != 0) {
+    if (++spins >= RW_DRAIN_SPINS && rw_can_block()) {
+      // readers may sleep while holding the lock
+      spins = 0;
+      sched_again(SCHED_YIELDED);
+    } else {
+      cpu_pause();
+    }
+  }
+  return clock_get_nanos() - start_ns;
+}
+
+// hands the lock to the next waiters once it has been released. writers go
+// first one at a time and the readers are only let in once no writer is left.
+// called with the chain lock held.
+static void rw_wakeup_locked(rwlock_t *rw, struct lockqueue *lockq) {
+  if (lockq != NULL && !LIST_EMPTY(&lockq->queues[LQ_EXCL])) {
+    // the waiter bits stay set so new readers keep backing off
+    lockq_signal(lockq, LQ_EXCL);
+    return;
+  }
+
+  atomic_fetch_and(&rw->rw_lock, ~RW_WAITERS);
+  if (lockq != NULL) {
+    lockq_broadcast(lockq, LQ_SHRD);
+  }
+}
+
+static void rw_wakeup(rwlock_t *rw) {
+  struct lock_object *lock_obj = &rw->lo;
+  lockq_chain_lock(lock_obj);
+
+  uintptr_t v = atomic_load(&rw->rw_lock);
+  if (rw_readers(v) != 0 || (v & RW_WRITER) || !(v & RW_WAITERS)) {
+    // the lock was taken again or someone else already woke them
+    lockq_chain_unlock(lock_obj);
+    return;
+  }
+
+  rw_wakeup_locked(rw, lockq_lookup(lock_obj));
+  lockq_chain_unlock(lock_obj);
+}
+
+static inline void rw_runlock_internal(rwlock_t *rw) {
+  uintptr_t v = atomic_fetch_sub(&rw->rw_lock, RW_ONE_READER) - RW_ONE_READER;
+  if (__expect_false(rw_readers(v) == 0 && (v & RW_WAITERS) && !(v & RW_WRITER))) {
+    // we were the last reader and threads are blocked on the lock
+    rw_wakeup(rw);
+  }
+}
+
+static inline bool rw_try_enter_read(rwlock_t *rw, thread_t *td) {
+  if (rw->pcpu != NULL) {
+    struct rw_pcpu *pcpu = &rw->pcpu[curcpu_id];
+    atomic_fetch_add(&pcpu->readers, 1);
+    // the writer sets its bit before summing the counters so either it sees
+    // our count or we see its bit
+    if (rw_can_read(rw, atomic_load(&rw->rw_lock), td)) {
+      return true;
+    }
+    atomic_fetch_sub(&pcpu->readers, 1);
+    return false;
+  }
+
+  uintptr_t v = atomic_fetch_add(&rw->rw_lock, RW_ONE_READER);
+  if (rw_can_read(rw, v, td)) {
+    return true;
+  }
+
+  // back out the same way a reader releases the lock since a waiting writer
+  // may be relying on the count dropping to zero
+  rw_runlock_internal(rw);
+  return false;
+}
+
+static void rw_release_write(rwlock_t *rw) {
+  rw->lo.data = 0;
+  rw->owner = NULL;
+  for (;;) {
+    uintptr_t v = atomic_load_relaxed(&rw->rw_lock);
+    if (v & RW_WAITERS) {
+      break;
+    }
+    // readers backing out of a failed attempt may change the count under us
+    if (atomic_cmpxchg_rel(&rw->rw_lock, v, v & ~RW_WRITER)) {
+      return;
+    }
+  }
+
+  struct lock_object *lock_obj = &rw->lo;
+  lockq_chain_lock(lock_obj);
+  struct lockqueue *lockq = lockq_lookup(lock_obj);
+  if (lockq != NULL) {
+    lockq_disown(lockq);
+  }
+  atomic_fetch_and(&rw->rw_lock, ~RW_WRITER);
+  rw_wakeup_locked(rw, lockq);
+  lockq_chain_unlock(lock_obj);
+}
+
+// the lock is held by a writer or a writer is waiting. spin while the writer is
+// running on another cpu and block on the shared queue otherwise.
+static void rw_rlock_contested(rwlock_t *rw, const char *file, int line) {
+  struct lock_object *lock_obj = &rw->lo;
+  thread_t *td = curthread;
+  bool can_block = rw_can_block();
+
+  uint64_t start_ns = clock_get_nanos();
+  uint64_t sleep_ns = 0;
+  for (;;) {
+    uintptr_t v = atomic_load_relaxed(&rw->rw_lock);
+    if (rw_can_read(rw, v, td)) {
+      if (rw_try_enter_read(rw, td)) {
+        break;
+      }
+      continue;
+    }
+
+    thread_t *owner = rw->owner;
+    if (!can_block || ((v & RW_WRITER) && (owner == NULL || TDS_IS_RUNNING(owner)))) {
+      cpu_pause();
+      continue;
+    }
+
+    lockq_chain_lock(lock_obj);
+    v = atomic_load_relaxed(&rw->rw_lock);
+    owner = rw->owner;
+    if (rw_can_read(rw, v, td) || ((v & RW_WRITER) && (owner == NULL || TDS_IS_RUNNING(owner)))) {
+      lockq_chain_unlock(lock_obj);
+      continue;
+    }
+
+    // whoever releases the lock next has to go through the chain lock
+    if (!(v & RW_READ_WAITERS) && !atomic_cmpxchg(&rw->rw_lock, v, v | RW_READ_WAITERS)) {
+      lockq_chain_unlock(lock_obj);
+      continue;
+    }
+
+    struct lockqueue *lockq = lockq_lookup(lock_obj);
+    if (lockq == NULL) {
+      lockq = td->own_lockq; // donate our lockq
+      lockq->lock_obj = lock_obj;
+    }
+
+    RW_DEBUGF(rw, "rlock %s blocking [%s:%d]", lock_obj->name, file, line);
+    uint64_t block_ns = clock_get_nanos();
+    // readers only lend their priority to a writer, a waiting writer has none
+    lockq_wait(lockq, (v & RW_WRITER) ? owner : NULL, LQ_SHRD);
+    block_ns = clock_get_nanos() - block_ns;
+    sleep_ns += block_ns;
+    td->blocktime += block_ns;
+  }
+
+  uint64_t total_ns = clock_get_nanos() - start_ns;
+  lock_stats_record_contention(lock_obj, total_ns - min(total_ns, sleep_ns), sleep_ns);
+}
+
+// the lock is held by readers or another writer. spin while the writer is running,
+// or for a while on readers since there is no way to tell if they are running, and
+// then block on the exclusive queue which also stops new readers from coming in.
+static void rw_wlock_contested(rwlock_t *rw, const char *file, int line) {
+  struct lock_object *lock_obj = &rw->lo;
+  thread_t *td = curthread;
+  bool can_block = rw_can_block();
+
+  uint64_t start_ns = clock_get_nanos();
+  uint64_t sleep_ns = 0;
+  int spins = 0;
+  for (;;) {
+    uintptr_t v = atomic_load_relaxed(&rw->rw_lock);
+    if (!(v & RW_WRITER) && rw_readers(v) == 0) {
+      // any waiter bits are kept for the next release
+      if (atomic_cmpxchg_acq(&rw->rw_lock, v, v | RW_WRITER)) {
+        break;
+      }
+      continue;
+    }
+
+    thread_t *owner = rw->owner;
+    if (!can_block) {
+      cpu_pause();
+      continue;
+    } else if (v & RW_WRITER) {
+      if (owner == NULL || TDS_IS_RUNNING(owner)) {
+        cpu_pause();
+        continue;
+      }
+    } else if (spins < RW_READER_SPINS) {
+      spins++;
+      cpu_pause();
+      continue;
+    }
+
+    lockq_chain_lock(lock_obj);
+    v = atomic_load_relaxed(&rw->rw_lock);
+    owner = rw->owner;
+    if ((!(v & RW_WRITER) && rw_readers(v) == 0) ||
+        ((v & RW_WRITER) && (owner == NULL || TDS_IS_RUNNING(owner)))) {
+      lockq_chain_unlock(lock_obj);
+      continue;
+    }
+
+    if (!(v & RW_WRITE_WAITERS) && !atomic_cmpxchg(&rw->rw_lock, v, v | RW_WRITE_WAITERS)) {
+      lockq_chain_unlock(lock_obj);
+      continue;
+    }
+
+    struct lockqueue *lockq = lockq_lookup(lock_obj);
+    if (lockq == NULL) {
+      lockq = td->own_lockq; // donate our lockq
+      lockq->lock_obj = lock_obj;
+    }
+
+    RW_DEBUGF(rw, "wlock %s blocking [%s:%d]", lock_obj->name, file, line);
+    uint64_t block_ns = clock_get_nanos();
+    lockq_wait(lockq, (v & RW_WRITER) ? owner : NULL, LQ_EXCL);
+    block_ns = clock_get_nanos() - block_ns;
+    sleep_ns += block_ns;
+    td->blocktime += block_ns;
+    spins = 0;
+  }
+
+  uint64_t total_ns = clock_get_nanos() - start_ns;
+  lock_stats_record_contention(lock_obj, total_ns - min(total_ns, sleep_ns), sleep_ns);
+}
 
 // MARK: common rwlock api
 
 void _rw_init(rwlock_t *rw, uint32_t opts, const char *name) {
+  uint32_t flags = LO_INITIALIZED | RWLOCK_LOCKCLASS;
+  flags |= opts & RW_DEBUG ? LO_DEBUG : 0;
+  flags |= opts & RW_RECURSE ? LO_RECURSABLE : 0;
+  flags |= opts & RW_NOCLAIM ? LO_NOCLAIMS : 0;
+
   rw->lo.name = name;
-  rw->lo.flags = 0;
-  rw->lo.data = 0; // recurse count
-  rw->readers = 0;
+  rw->lo.flags = flags;
+  rw->lo.data = 0; // write recurse count
+  rw->rw_lock = RW_UNOWNED;
+  rw->owner = NULL;
+  rw->pcpu = NULL;
+  if (opts & RW_BIGREADER) {
+    size_t size = MAX_CPUS * sizeof(struct rw_pcpu);
+    rw->pcpu = kmalloca(size, 64);
+    memset(rw->pcpu, 0, size);
+  }
 }
 
 void _rw_destroy(rwlock_t *rw) {
+  RW_ASSERT(!_rw_locked(rw), "_rw_destroy() on locked rwlock");
+  lock_stats_remove(&rw->lo);
+  kfree(rw->pcpu);
+  rw->pcpu = NULL;
+  rw->lo.flags = 0;
+  rw->lo.data = 0;
+  rw->rw_lock = RW_DESTROYED;
+}
 
+bool _rw_locked(rwlock_t *rw) {
+  uintptr_t v = rw->rw_lock;
+  if ((v & RW_WRITER) || rw_readers(v) > 0) {
+    return true;
+  }
+  return rw->pcpu != NULL && rw_big_readers(rw) > 0;
 }
 
-void _rw_assert(rwlock_t *rw, int what, const char *file, int line) {
+bool _rw_owned(rwlock_t *rw) {
+  return (rw->rw_lock & RW_WRITER) && rw->owner == curthread;
+}
 
+void _rw_assert(rwlock_t *rw, int what, const char *file, int line) {
+  uintptr_t v = rw->rw_lock;
+  switch (what) {
+    case RWA_UNLOCKED:
+      kassertf(!_rw_locked(rw), "rwlock locked, %s:%d", file, line);
+      break;
+    case RWA_LOCKED:
+      kassertf(_rw_locked(rw), "rwlock unlocked, %s:%d", file, line);
+      break;
+    case RWA_SLOCKED:
+      kassertf(!(v & RW_WRITER) && _rw_locked(rw), "rwlock not read locked, %s:%d", file, line);
+      break;
+    case RWA_XLOCKED:
+    case RWA_OWNED:
+      kassertf(_rw_owned(rw), "rwlock not write locked by thread, %s:%d", file, line);
+      break;
+    case RWA_NOTOWNED:
+      kassertf(!_rw_owned(rw), "rwlock write locked by thread, %s:%d", file, line);
+      break;
+    case RWA_RECURSED:
+      kassertf(_rw_owned(rw) && rw->lo.data > 1, "rwlock not recursed, %s:%d", file, line);
+      break;
+    default:
+      panic("invalid rwlock assertion");
+  }
 }
 
+// MARK: read lock
+
 int _rw_try_rlock(rwlock_t *rw, const char *file, int line) {
-  todo();
-}
+  RW_ASSERT(rw->rw_lock != RW_DESTROYED, "_rw_try_rlock() on destroyed rwlock, %s:%d", file, line);
+  thread_t *td = curthread;
+  if (!rw_try_enter_read(rw, td)) {
+    return 0;
+  }
 
-int _rw_try_wlock(rwlock_t *rw, const char *file, int line) {
-  todo();
+  if (td != NULL) {
+    td->rlock_count++;
+    if (rw->pcpu != NULL) {
+      rw_big_hold(rw, td);
+    }
+  }
+  return 1;
 }
 
 void _rw_rlock(rwlock_t *rw, const char *file, int line) {
+  RW_ASSERT(rw->rw_lock != RW_DESTROYED, "_rw_rlock() on destroyed rwlock, %s:%d", file, line);
+  thread_t *td = curthread;
+  RW_ASSERT(td == NULL || rw->owner != td, "_rw_rlock() on rwlock write locked by thread, %s:%d", file, line);
+
+  if (__expect_false(!rw_try_enter_read(rw, td))) {
+    rw_rlock_contested(rw, file, line);
+  } else if (__expect_false(rw->lo.flags & LO_CONTENDED) && rw->pcpu == NULL) {
+    // big-reader locks skip this so readers never share a cache line
+    lock_stats_record_acquire(&rw->lo);
+  }
 
+  if (td != NULL) {
+    td->rlock_count++;
+    if (rw->pcpu != NULL) {
+      rw_big_hold(rw, td);
+    }
+  }
 }
 
-void _rw_wlock(rwlock_t *rw, const char *file, int line) {
+void _rw_runlock(rwlock_t *rw) {
+  thread_t *td = curthread;
+  if (rw->pcpu != NULL) {
+    atomic_fetch_sub(&rw->pcpu[curcpu_id].readers, 1);
+  } else {
+    RW_ASSERT(!(rw->rw_lock & RW_WRITER) && rw_readers(rw->rw_lock) > 0, "_rw_runlock() on rwlock not read locked");
+    rw_runlock_internal(rw);
+  }
 
+  if (td != NULL) {
+    RW_ASSERT(td->rlock_count > 0, "_rw_runlock() with no read locks held");
+    td->rlock_count--;
+    if (rw->pcpu != NULL) {
+      rw_big_unhold(rw, td);
+    }
+  }
 }
 
-void _rw_runlock(rwlock_t *rw) {
+// MARK: write lock
+
+int _rw_try_wlock(rwlock_t *rw, const char *file, int line) {
+  RW_ASSERT(rw->rw_lock != RW_DESTROYED, "_rw_try_wlock() on destroyed rwlock, %s:%d", file, line);
+  thread_t *td = curthread;
+  if (td != NULL && rw->owner == td) {
+    RW_ASSERT(rw->lo.flags & LO_RECURSABLE, "_rw_try_wlock() on non-recursive rwlock, %s:%d", file, line);
+    rw->lo.data++;
+    return 1;
+  }
+
+  uintptr_t v = atomic_load_relaxed(&rw->rw_lock);
+  if ((v & RW_WRITER) || rw_readers(v) > 0 || !atomic_cmpxchg_acq(&rw->rw_lock, v, v | RW_WRITER)) {
+    return 0;
+  }
+
+  rw->owner = td;
+  rw->lo.data = 1;
+  if (rw->pcpu != NULL && rw_big_readers(rw) != 0) {
+    rw_release_write(rw);
+    return 0;
+  }
+  return 1;
+}
+
+void _rw_wlock(rwlock_t *rw, const char *file, int line) {
+  RW_ASSERT(rw->rw_lock != RW_DESTROYED, "_rw_wlock() on destroyed rwlock, %s:%d", file, line);
+  thread_t *td = curthread;
+  if (td != NULL && rw->owner == td) {
+    RW_ASSERT(rw->lo.flags & LO_RECURSABLE, "_rw_wlock() on non-recursive rwlock, %s:%d", file, line);
+    rw->lo.data++;
+    return;
+  }
 
+  if (__expect_false(!atomic_cmpxchg_acq(&rw->rw_lock, RW_UNOWNED, RW_WRITER))) {
+    rw_wlock_contested(rw, file, line);
+  } else if (__expect_false(rw->lo.flags & LO_CONTENDED)) {
+    lock_stats_record_acquire(&rw->lo);
+  }
+
+  rw->owner = td;
+  rw->lo.data = 1;
+  if (rw->pcpu != NULL) {
+    uint64_t drain_ns = rw_big_drain(rw);
+    if (drain_ns > 0) {
+      lock_stats_record_contention(&rw->lo, drain_ns, 0);
+    }
+  }
 }
 
 void _rw_wunlock(rwlock_t *rw) {
+  thread_t *td = curthread;
+  RW_ASSERT(rw->rw_lock != RW_DESTROYED, "_rw_wunlock() on destroyed rwlock");
+  RW_ASSERT((rw->rw_lock & RW_WRITER) && rw->owner == td, "_rw_wunlock() on rwlock not write locked by thread");
+
+  if (rw->lo.data > 1) {
+    rw->lo.data--;
+    return;
+  }
+  rw_release_write(rw);
+}
+
+//
+
+// #define RWLOCK_BENCHMARK
+#ifdef RWLOCK_BENCHMARK
+#define BENCH_MAX_THREADS   8
+#define BENCH_DURATION      MS_TO_NS(250)
+#define BENCH_WRITE_EVERY   64  // one write per this many operations
+#define BENCH_DATA_WORDS    8
+
+static rwlock_t *bench_lock;
+static int bench_write_every;
+static volatile bool bench_start;
+static volatile bool bench_stop;
+static volatile int bench_next_id;
+static volatile int bench_exited;
+static volatile uint64_t bench_ops[BENCH_MAX_THREADS];
+static volatile uint64_t bench_violations;
+static volatile uint64_t bench_data[BENCH_DATA_WORDS];
+
+static void rw_bench_worker() {
+  int id = atomic_fetch_add(&bench_next_id, 1);
+  uint64_t ops = 0;
+  while (!bench_start) {
+    cpu_pause();
+  }
+
+  while (!bench_stop) {
+    if (bench_write_every > 0 && ops % bench_write_every == 0) {
+      rw_wlock(bench_lock);
+      uint64_t value = bench_data[0] + 1;
+      for (int i = 0; i < BENCH_DATA_WORDS; i++) {
+        bench_data[i] = value;
+      }
+      rw_wunlock(bench_lock);
+    } else {
+      // readers must never see a partially written update
+      rw_rlock(bench_lock);
+      uint64_t value = bench_data[0];
+      for (int i = 1; i < BENCH_DATA_WORDS; i++) {
+        if (bench_data[i] != value) {
+          atomic_fetch_add(&bench_violations, 1);
+        }
+      }
+      rw_runlock(bench_lock);
+    }
+    ops++;
+  }
+
+  bench_ops[id] = ops;
+  atomic_fetch_add(&bench_exited, 1);
+  thread_stop(curthread);
+  unreachable;
+}
+
+// runs the workers pinned one per cpu and returns the total operations per ms
+static uint64_t rw_bench_run(rwlock_t *rw, int nthreads, int write_every) {
+  bench_lock = rw;
+  bench_write_every = write_every;
+  bench_start = false;
+  bench_stop = false;
+  bench_next_id = 0;
+  bench_exited = 0;
+
+  for (int i = 0; i < nthreads; i++) {
+    thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+    thread_setup_entry(td, (uintptr_t) rw_bench_worker);
+    td->name = str_fmt("rwlock bench %d", i);
+    cpuset_set(td->cpuset, i);
+    td->flags2 |= TDF2_AFFINITY;
+    proc_add_thread(curproc, td);
+    thread_finish_setup_and_submit(td);
+  }
+
+  while (bench_next_id < nthreads) {
+    sched_again(SCHED_YIELDED);
+  }
+
+  uint64_t start = clock_get_nanos();
+  bench_start = true;
+  while (clock_get_nanos() - start < BENCH_DURATION) {
+    sched_again(SCHED_YIELDED);
+  }
+  bench_stop = true;
+  while (bench_exited < nthreads) {
+    sched_again(SCHED_YIELDED);
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i < nthreads; i++) {
+    total += bench_ops[i];
+  }
+  return total / (BENCH_DURATION / MS_TO_NS(1));
+}
+
+static volatile bool bench_writer_done;
+
+static void rw_bench_writer() {
+  rw_wlock(bench_lock);
+  rw_wunlock(bench_lock);
+  bench_writer_done = true;
+  thread_stop(curthread);
+  unreachable;
+}
+
+// a thread holding a big-reader read lock takes it again while a writer is
+// draining the readers. both the reader and the writer have to get through.
+static void rw_bench_recursive_read(rwlock_t *rw) {
+  bench_lock = rw;
+  bench_writer_done = false;
+  rw_rlock(rw);
+
+  thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+  thread_setup_entry(td, (uintptr_t) rw_bench_writer);
+  td->name = str_from("rwlock bench writer");
+  proc_add_thread(curproc, td);
+  thread_finish_setup_and_submit(td);
+
+  uint64_t start = clock_get_nanos();
+  while (!(atomic_load(&rw->rw_lock) & RW_WRITER)) {
+    if (clock_get_nanos() - start > BENCH_DURATION) {
+      panic("rwlock: writer never started draining");
+    }
+    sched_again(SCHED_YIELDED);
+  }
+
+  rw_rlock(rw);
+  rw_runlock(rw);
+  rw_runlock(rw);
+
+  start = clock_get_nanos();
+  while (!bench_writer_done) {
+    if (clock_get_nanos() - start > BENCH_DURATION) {
+      panic("rwlock: writer stuck after recursive read");
+    }
+    sched_again(SCHED_YIELDED);
+  }
+  kprintf("  recursive read with a draining writer ok\n");
+}
+
+// compares a plain rwlock against a big-reader one as the number of cpus grows,
+// both read-only and with an occasional writer
+static void rwlock_benchmark() {
+  static rwlock_t plain;
+  static rwlock_t big;
+  rw_init(&plain, 0, "rw_bench_plain");
+  rw_init(&big, RW_BIGREADER, "rw_bench_big");
+
+  int max_threads = min((int) system_num_cpus, BENCH_MAX_THREADS);
+  kprintf("rwlock: contention benchmark (%d cpus, %llu ms per run)\n",
+          max_threads, BENCH_DURATION / MS_TO_NS(1));
+  for (int writes = 0; writes < 2; writes++) {
+    int write_every = writes ? BENCH_WRITE_EVERY : 0;
+    if (writes) {
+      kprintf("  1 write per %d ops\n", BENCH_WRITE_EVERY);
+    } else {
+      kprintf("  read only\n");
+    }
+    for (int n = 1; n <= max_threads; n *= 2) {
+      uint64_t plain_ops = rw_bench_run(&plain, n, write_every);
+      uint64_t big_ops = rw_bench_run(&big, n, write_every);
+      kprintf("    %d threads: plain %8llu ops/ms, big-reader %8llu ops/ms\n", n, plain_ops, big_ops);
+    }
+  }
 
+  rw_bench_recursive_read(&big);
+  lock_stats_dump();
+  if (bench_violations > 0) {
+    panic("rwlock: %llu readers saw a partial write", bench_violations);
+  }
+  kprintf("rwlock: benchmark passed\n");
 }
+MODULE_INIT(rwlock_benchmark);
+#endif
@@ -6,30 +6,80 @@
 #include <kernel/proc.h>
 #include <kernel/clock.h>
 #include <kernel/ipi.h>
+#include <kernel/timer.h>
+#include <kernel/mm.h>
 
 #include <kernel/panic.h>
 #include <kernel/printf.h>
+#include <kernel/string.h>
+#include <kernel/str.h>
 #include <kernel/atomic.h>
 #include <kernel/bits.h>
 
 #include <kernel/cpu/cpu.h>
+#include <kernel/cpu/fpu.h>
 
 #define ASSERT(x) kassert(x)
 #define DPRINTF(x, ...) kprintf("sched: " x, ##__VA_ARGS__)
 
 #define NRUNQS 64
+#define BALANCE_INTERVAL  10000000ULL // periodic balance interval (ns)
+#define BALANCE_MIN_DIFF  2           // imbalance needed before threads are pulled
+#define IDLE_POLL_RETRIES 64          // spin delays before an idle cpu goes to sleep
+
+// timeslices
+#define SLICE_REALTIME    MS_TO_NS(5)
+#define SLICE_TS_MAX      MS_TO_NS(20)  // slice of the highest timeshare priority
+#define SLICE_TS_MIN      MS_TO_NS(5)   // slice of the lowest timeshare priority
+#define SLICE_IDLE        MS_TO_NS(50)
+#define SLICE_RETRY       US_TO_NS(500) // delay when the thread can not be preempted yet
+
+// idle states
+#define IDLE_RUNNING  0
+#define IDLE_SLEEPING 1               // asleep in hlt or mwait
+#define IDLE_WOKEN    2               // woken up but not yet running
 
 /*
  * A scheduler on a cpu.
+ *
+ * Threads are assigned to a cpu when they are submitted but may later move to
+ * another one. A cpu that runs out of ready threads steals one from the busiest
+ * cpu before falling back to its idle thread, and every BALANCE_INTERVAL each
+ * cpu pulls threads from the busiest cpu if it has significantly more ready
+ * threads. Stolen threads are always taken from the highest priority runqueue
+ * that has a thread allowed to run on the stealing cpu.
+ *
+ * When there is nothing left to run the cpu polls for a short while and then
+ * goes to sleep. There is no periodic tick and the per-cpu alarm is one-shot so
+ * a sleeping cpu is only woken by a due timer, an interrupt or new work. If
+ * MONITOR/MWAIT is supported the cpu waits on the cache line holding the
+ * readymask and idle state so that queueing a thread onto it is enough to wake
+ * it up, otherwise it halts and has to be woken with an ipi. Work queued onto busy cpus bumps sched_steal_gen and
+ * wakes one sleeping cpu so it can be stolen.
+ *
+ * Every thread other than the idle thread runs with a timeslice that depends on
+ * its priority band. A per-cpu hrtimer is armed with the remainder of the slice
+ * whenever a thread is switched in and preempts it once the slice is used up,
+ * at which point the thread gets a fresh slice and goes to the back of its
+ * runqueue. Threads that give up the cpu early keep what is left of their slice.
  */
 typedef struct sched {
   uint64_t id;                    // scheduler id
-  volatile uint64_t readymask;    // runqueues with ready threads (bitmap)
+  volatile uint64_t readymask __aligned(64); // runqueues with ready threads (bitmap)
+  volatile uint32_t idle_state;   // idle state (shares the readymask cache line)
+  uint64_t idle_gen;              // sched_steal_gen when the cpu last went idle
   struct runqueue queues[NRUNQS]; // runqueues (indexed by td->priority/4)
   thread_t *idle;                 // idle thread
-  uint64_t last_switch;           // last time a thread switch occured (ns)
+  uint64_t last_switch;           // last time the running thread was charged (ns)
+  uint64_t last_balance;          // last time the periodic balancer ran (ns)
+  struct hrtimer slice_timer;     // timeslice timer
+  bool preempt;                   // the timeslice of the current thread expired
+  struct sched_stats stats;
 } sched_t;
 static sched_t *cpu_scheds[MAX_CPUS];
+static bool sched_use_mwait;
+static volatile uint32_t sched_idle_sleepers; // number of sleeping cpus
+static volatile uint64_t sched_steal_gen;     // bumped when work is queued on a busy cpu
 
 // defined in switch.asm
 void sched_do_switch(thread_t *curr, thread_t *next);
@@ -63,6 +113,14 @@ static int select_cpu_by_lowest_rough_est_ready(int *out_est) {
   return cpu;
 }
 
+static size_t sched_ready_count(sched_t *sched) {
+  size_t tdcount = 0;
+  for (int j = 0; j < NRUNQS; j++) {
+    tdcount += atomic_load_relaxed(&sched->queues[j].count);
+  }
+  return tdcount;
+}
+
 // this function selects the cpu with the lowest thread count compared by summing
 // the counts of each runqueue. this is a more accurate heuristic for sched load
 // but it also requires more memory accesses.
@@ -74,11 +132,7 @@ static int select_cpu_by_lowest_readycnt(size_t *out_count) {
     if (sched == NULL)
       continue;
 
-    size_t tdcount = 0;
-    for (int j = 0; j < NRUNQS; j++) {
-      tdcount += atomic_load_relaxed(&sched->queues[j].count);
-    }
-
+    size_t tdcount = sched_ready_count(sched);
     if (tdcount < min) {
       min = tdcount;
       cpu = i;
@@ -125,81 +179,344 @@ int select_cpu_for_new_thread(thread_t *td) {
   return select_cpu_by_lowest_readycnt(NULL);
 }
 
+// wakes the cpu if it is asleep in its idle thread. with mwait the store to the
+// monitored idle state is enough, otherwise an ipi is needed.
+static void sched_wake_cpu(sched_t *sched) {
+  if (atomic_load(&sched->idle_state) != IDLE_SLEEPING ||
+      !atomic_cmpxchg(&sched->idle_state, IDLE_SLEEPING, IDLE_WOKEN)) {
+    return;
+  }
+
+  if (!sched_use_mwait) {
+    ipi_deliver_cpu_id(IPI_NOOP, (uint8_t) sched->id, 0);
+    atomic_fetch_add(&sched->stats.wakeup_ipis, 1);
+  }
+}
+
+// called after a thread has been queued on the given cpu
+static void sched_notify_ready(sched_t *sched, thread_t *td) {
+  if (atomic_load(&sched->idle_state) != IDLE_RUNNING) {
+    sched_wake_cpu(sched);
+    return;
+  }
+
+  // the cpu is busy so let a sleeping cpu try to steal the thread
+  atomic_fetch_add(&sched_steal_gen, 1);
+  if (atomic_load(&sched_idle_sleepers) == 0) {
+    return;
+  }
+
+  for (int i = 0; i < system_num_cpus; i++) {
+    sched_t *other = cpu_scheds[i];
+    if (other == NULL || other == sched || atomic_load(&other->idle_state) != IDLE_SLEEPING)
+      continue;
+    if (TDF2_HAS_AFFINITY(td) && !cpuset_test(td->cpuset, i))
+      continue;
+
+    sched_wake_cpu(other);
+    break;
+  }
+}
+
+// clears the readymask bit of a runqueue that was found empty. a thread may have
+// been queued (and its bit set) since then so the bit is put back if so
+static inline void sched_clear_ready(sched_t *sched, int i) {
+  atomic_fetch_and(&sched->readymask, ~(1ULL << i));
+  if (atomic_load(&sched->queues[i].count) > 0) {
+    atomic_fetch_or(&sched->readymask, 1ULL << i);
+  }
+}
+
+static inline void sched_add_ready_thread(sched_t *sched, thread_t *td) {
+  int i = td->priority / 4;
+  runq_add(&sched->queues[i], td);
+  atomic_fetch_or(&sched->readymask, 1ULL << i);
+  sched_notify_ready(sched, td);
+}
+
 static inline thread_t *sched_runq_get_next_thread(sched_t *sched, int i) {
   bool empty;
   thread_t *td = runq_next_thread(&sched->queues[i], &empty);
   if (empty) {
     // clear the readymask bit if the runqueue is empty
-    atomic_fetch_and(&sched->readymask, ~(1 << i));
+    sched_clear_ready(sched, i);
+  }
+  return td;
+}
+
+// returns the cpu other than the current one with the most ready threads
+static int select_busiest_cpu(sched_t *self, size_t *out_count) {
+  int cpu = -1;
+  size_t max = 0;
+  for (int i = 0; i < system_num_cpus; i++) {
+    sched_t *sched = cpu_scheds[i];
+    if (sched == NULL || sched == self || atomic_load_relaxed(&sched->readymask) == 0)
+      continue;
+
+    size_t tdcount = sched_ready_count(sched);
+    if (tdcount > max) {
+      max = tdcount;
+      cpu = i;
+    }
+  }
+
+  if (out_count != NULL)
+    *out_count = max;
+  return cpu;
+}
+
+// takes a ready thread from another cpu that is allowed to run on the current cpu.
+// the runqueues are searched in priority order so the highest priority thread is
+// taken first. the thread will be locked and moved to the current cpu on return.
+static thread_t *sched_steal_thread(sched_t *self, sched_t *victim) {
+  uint64_t mask = atomic_load_relaxed(&victim->readymask);
+  while (mask != 0) {
+    int i = bit_ffs64(mask);
+    mask &= mask - 1;
+
+    bool empty;
+    thread_t *td = runq_steal_thread(&victim->queues[i], (int) self->id, &empty);
+    if (empty) {
+      sched_clear_ready(victim, i);
+    }
+
+    if (td != NULL) {
+      td->cpu_id = (int) self->id;
+      atomic_fetch_add(&victim->stats.migrations, 1);
+      return td;
+    }
+  }
+  return NULL;
+}
+
+// called when the current cpu has nothing to run. the busiest cpu is tried first
+// but its threads may not be allowed to run here so every other cpu is tried too.
+static thread_t *sched_steal_idle(sched_t *sched) {
+  int busiest = select_busiest_cpu(sched, NULL);
+  if (busiest < 0) {
+    return NULL;
+  }
+
+  thread_t *td = sched_steal_thread(sched, cpu_scheds[busiest]);
+  for (int i = 1; td == NULL && i < system_num_cpus; i++) {
+    sched_t *victim = cpu_scheds[(busiest + i) % system_num_cpus];
+    if (victim == NULL || victim == sched || atomic_load_relaxed(&victim->readymask) == 0)
+      continue;
+    td = sched_steal_thread(sched, victim);
+  }
+
+  if (td != NULL) {
+    sched->stats.idle_steals++;
   }
   return td;
 }
 
+// evens out sustained imbalance by pulling half of the difference in ready threads
+// from the busiest cpu. this is called from sched_again so it only runs on cpus that
+// are switching threads anyway.
+static void sched_balance(sched_t *sched) {
+  uint64_t now = clock_get_nanos();
+  if (now - sched->last_balance < BALANCE_INTERVAL) {
+    return;
+  }
+  sched->last_balance = now;
+  sched->stats.balance_runs++;
+
+  size_t max;
+  int busiest = select_busiest_cpu(sched, &max);
+  size_t count = sched_ready_count(sched);
+  if (busiest < 0 || max < count + BALANCE_MIN_DIFF) {
+    return;
+  }
+
+  size_t n = (max - count) / 2;
+  while (n-- > 0) {
+    thread_t *td = sched_steal_thread(sched, cpu_scheds[busiest]);
+    if (td == NULL) {
+      break;
+    }
+
+    sched_add_ready_thread(sched, td);
+    td_unlock(td);
+    sched->stats.balance_pulls++;
+  }
+}
+
 // returns the next thread to run on the current cpu. the thread will be
-// locked and in the ready state on return.
-static thread_t *sched_next_thread() {
+// locked and in the ready state on return. if there is nothing to run and
+// allow_idle is false null is returned.
+static thread_t *sched_next_thread(bool allow_idle) {
   sched_t *sched = cursched;
   thread_t *td = NULL;
 
-  bool empty;
-  int i = 0;
-  if (sched->readymask != 0 && (i = bit_ffs64(sched->readymask)) != -1) {
-    td = sched_runq_get_next_thread(sched, i);
+  uint64_t mask;
+  while ((mask = atomic_load_relaxed(&sched->readymask)) != 0) {
+    td = sched_runq_get_next_thread(sched, bit_ffs64(mask));
     if (td != NULL) {
-      // clear the readymask bit
-      atomic_fetch_xor(&sched->readymask, 1 << i);
       return td;
     }
   }
 
   // do a linear scan of the runqueues
-  for (i = 0; i < NRUNQS; i++) {
+  for (int i = 0; i < NRUNQS; i++) {
     // get the runq count without acquiring the lock and then
     // optimistically try to get the next thread
     if (atomic_load_relaxed(&sched->queues[i].count) > 0) {
       td = sched_runq_get_next_thread(sched, i);
       if (td != NULL) {
-        break;
+        return td;
       }
     }
   }
 
-  if (td == NULL) {
+  // try to take work from another cpu. anything queued after this point
+  // will be noticed by the idle thread through sched_steal_gen
+  uint64_t gen = atomic_load(&sched_steal_gen);
+  if ((td = sched_steal_idle(sched)) != NULL) {
+    return td;
+  }
+
+  if (allow_idle) {
     // if no threads available, run idle thread
+    sched->idle_gen = gen;
     td = sched->idle;
     td_lock(td);
   }
   return td;
 }
 
+// returns the full timeslice for the thread. realtime threads get short slices so
+// that they round-robin quickly while higher timeshare priorities get longer ones
+static uint64_t sched_slice_for(thread_t *td) {
+  if (td->priority < PRI_NORMAL) {
+    return SLICE_REALTIME;
+  } else if (td->priority >= PRI_IDLE) {
+    return SLICE_IDLE;
+  }
+
+  uint64_t range = PRI_IDLE - 1 - PRI_NORMAL;
+  return SLICE_TS_MAX - ((td->priority - PRI_NORMAL) * (SLICE_TS_MAX - SLICE_TS_MIN)) / range;
+}
+
+// arms the timeslice timer of the current cpu. zero disarms it
+static void sched_arm_slice(sched_t *sched, uint64_t ns) {
+  if (ns == 0) {
+    hrtimer_cancel(&sched->slice_timer);
+    return;
+  }
+
+  // there is no periodic tick to fall back on so without the timer the thread
+  // would never be preempted
+  int res = hrtimer_start(&sched->slice_timer, clock_get_nanos() + ns);
+  if (res < 0) {
+    panic("sched: failed to arm the timeslice timer on CPU#%d (%d)", curcpu_id, res);
+  }
+}
+
+// charges the time since the last switch to the running thread
+static void sched_charge_thread(sched_t *sched, thread_t *td) {
+  uint64_t now = clock_get_nanos();
+  uint64_t ran = now - sched->last_switch;
+  sched->last_switch = now;
+  td->runtime += ran;
+  td->slice = ran < td->slice ? td->slice - ran : 0;
+}
+
+// returns true if a thread of the same or higher priority is ready on the cpu
+static inline bool sched_has_ready_at(sched_t *sched, int priority) {
+  uint64_t mask = atomic_load_relaxed(&sched->readymask);
+  return mask != 0 && bit_ffs64(mask) <= priority / 4;
+}
+
+// called from the timer interrupt. the switch itself happens in sched_preempt_check
+// once the interrupt has been acknowledged
+static void sched_slice_expired(void *arg) {
+  sched_t *sched = arg;
+  thread_t *td = curthread;
+  if (TDF_IS_IDLE(td)) {
+    return;
+  }
+
+  if (td->crit_level > 0 || mtx_owner(&td->lock) != NULL) {
+    // the thread is in the middle of being rescheduled or holds its own
+    // lock, so try again shortly
+    sched_arm_slice(sched, SLICE_RETRY);
+    return;
+  }
+  sched->preempt = true;
+}
+
 //
 
-noreturn void idle_thread_entry() {
-  sched_t *sched = cursched;
+static inline bool sched_idle_has_work(sched_t *sched) {
+  return atomic_load(&sched->readymask) != 0 || atomic_load(&sched_steal_gen) != sched->idle_gen;
+}
 
-idle_wait:;
-  struct spin_delay delay = new_spin_delay(SHORT_DELAY, MAX_RETRIES);
-  for (;;) {
-    if (sched->readymask != 0) {
-      // at least one of the runqueues could have a thread
-      break;
+// waits until there may be work for the current cpu
+static void sched_idle_wait(sched_t *sched) {
+  // poll for a little while first since sleeping adds wakeup latency
+  struct spin_delay delay = new_spin_delay(SHORT_DELAY, IDLE_POLL_RETRIES);
+  while (spin_delay_wait(&delay)) {
+    if (sched_idle_has_work(sched)) {
+      return;
     }
+  }
 
-    if (!spin_delay_wait(&delay)) {
-      // its been a while since there's been a ready thread, this could indicate a problem
-      DPRINTF("idle thread on CPU#%d has been waiting for a while\n", curcpu_id);
-      break;
+  cpu_disable_interrupts();
+  atomic_store(&sched->idle_state, IDLE_SLEEPING);
+  atomic_fetch_add(&sched_idle_sleepers, 1);
+  if (sched_idle_has_work(sched)) {
+    // something was queued while going to sleep
+    atomic_fetch_sub(&sched_idle_sleepers, 1);
+    atomic_store(&sched->idle_state, IDLE_RUNNING);
+    cpu_enable_interrupts();
+    return;
+  }
+
+  // the local alarm is one-shot and the clock has no periodic tick, so nothing
+  // wakes us unless a timer on this cpu is due
+  uint64_t start = clock_get_nanos();
+  if (sched_use_mwait) {
+    cpu_monitor(&sched->readymask);
+    // a wakeup may have happened before the monitor was armed
+    if (atomic_load(&sched->idle_state) == IDLE_SLEEPING && atomic_load(&sched->readymask) == 0) {
+      cpu_sti_mwait(0);
+    } else {
+      cpu_enable_interrupts();
     }
+  } else {
+    cpu_sti_hlt();
   }
 
-  sched_again(SCHED_YIELDED);
-  goto idle_wait;
+  // interrupts are enabled again at this point
+  uint64_t slept = clock_get_nanos() - start;
+  atomic_fetch_sub(&sched_idle_sleepers, 1);
+  atomic_store(&sched->idle_state, IDLE_RUNNING);
+
+  sched->stats.idle_sleeps++;
+  sched->stats.idle_ns += slept;
+}
+
+//
+
+noreturn void idle_thread_entry() {
+  sched_t *sched = cursched;
+  for (;;) {
+    sched_idle_wait(sched);
+    sched_again(SCHED_YIELDED);
+  }
 }
 
 //
 
 void sched_init() {
-  sched_t *sched = kmallocz(sizeof(sched_t));
+  if (curcpu_is_boot) {
+    sched_use_mwait = cpuid_query_bit(CPUID_BIT_MONITOR);
+  }
+
+  // the readymask is aligned to a cache line for mwait
+  sched_t *sched = kmalloca(sizeof(sched_t), 64);
+  memset(sched, 0, sizeof(sched_t));
   sched->id = curcpu_id;
   sched->idle = thread_alloc_idle();
   for (int i = 0; i < NRUNQS; i++) {
@@ -208,6 +525,9 @@ void sched_init() {
   cpu_scheds[curcpu_id] = sched;
 
   set_cursched(sched);
+  sched->last_switch = clock_get_nanos();
+  hrtimer_init(&sched->slice_timer, sched_slice_expired, sched);
+
   if (curthread == NULL) {
     // have the APs switch to their idle threads
     thread_t *td = sched->idle;
@@ -230,10 +550,20 @@ void sched_submit_new_thread(thread_t *td) {
   TD_SET_STATE(td, TDS_READY);
   td->flags2 |= TDF2_FIRSTTIME;
   td->cpu_id = cpu;
+  sched_add_ready_thread(sched, td);
+}
 
-  int i = td->priority / 4;
-  runq_add(&sched->queues[i], td);
-  atomic_fetch_or(&sched->readymask, 1 << i);
+// makes a sleeping or blocked thread runnable again on the cpu it last ran on
+void sched_wakeup_thread(thread_t *td) {
+  ASSERT(TDS_IS_WAITING(td) || TDS_IS_BLOCKED(td));
+  td_lock_assert(td, MA_OWNED);
+
+  ASSERT(td->cpu_id >= 0);
+  sched_t *sched = cpu_scheds[td->cpu_id];
+  ASSERT(sched != NULL);
+
+  TD_SET_STATE(td, TDS_READY);
+  sched_add_ready_thread(sched, td);
 }
 
 void sched_remove_ready_thread(thread_t *td) {
@@ -248,7 +578,24 @@ void sched_remove_ready_thread(thread_t *td) {
   int i = td->priority / 4;
   runq_remove(&sched->queues[i], td, &empty);
   if (empty) {
-    atomic_fetch_and(&sched->readymask, ~(1 << i));
+    sched_clear_ready(sched, i);
+  }
+}
+
+// changes the current priority of a thread and moves it to the matching runqueue
+// if it is waiting to run
+void sched_set_priority(thread_t *td, uint8_t priority) {
+  td_lock_assert(td, MA_OWNED);
+  if (td->priority == priority) {
+    return;
+  }
+
+  if (TDS_IS_READY(td) && td->runq != NULL) {
+    sched_remove_ready_thread(td);
+    td->priority = priority;
+    sched_add_ready_thread(cpu_scheds[td->cpu_id], td);
+  } else {
+    td->priority = priority;
   }
 }
 
@@ -286,7 +633,35 @@ void sched_again(sched_reason_t reason) {
       unreachable;
   }
 
-  thread_t *newtd = sched_next_thread();
+  sched_t *sched = cursched;
+  sched_charge_thread(sched, oldtd);
+  sched_balance(sched);
+
+  thread_t *newtd;
+  if (TDS_IS_READY(oldtd) && !TDF_IS_IDLE(oldtd)) {
+    if (oldtd->slice == 0) {
+      oldtd->slice = sched_slice_for(oldtd);
+    }
+
+    // the thread is still runnable so keep running it if there is nothing else.
+    // a preempted thread only gives way to threads of the same or higher priority
+    newtd = NULL;
+    if (reason != SCHED_PREEMPTED || sched_has_ready_at(sched, oldtd->priority)) {
+      newtd = sched_next_thread(false);
+    }
+
+    if (newtd == NULL) {
+      TD_SET_STATE(oldtd, TDS_RUNNING);
+      sched_arm_slice(sched, oldtd->slice);
+      td_unlock(oldtd);
+      return;
+    }
+
+    // the thread can not be stolen until it has been switched out and unlocked
+    sched_add_ready_thread(sched, oldtd);
+  } else {
+    newtd = sched_next_thread(true);
+  }
   td_lock_assert(newtd, MA_OWNED);
   TD_SET_STATE(newtd, TDS_RUNNING);
 
@@ -294,10 +669,33 @@ void sched_again(sched_reason_t reason) {
     newtd->start_time = clock_micro_time();
   }
 
+  if (TDF_IS_IDLE(newtd)) {
+    sched_arm_slice(sched, 0);
+  } else {
+    if (newtd->slice == 0) {
+      newtd->slice = sched_slice_for(newtd);
+    }
+    sched_arm_slice(sched, newtd->slice);
+  }
+
   td_unlock(newtd);
+  fpu_switch_out(oldtd);
   sched_do_switch(oldtd, newtd);
 }
 
+// called on the way out of every interrupt, after the eoi has been sent, to
+// preempt the current thread if its timeslice has expired
+void sched_preempt_check() {
+  sched_t *sched = cursched;
+  if (sched == NULL || !sched->preempt) {
+    return;
+  }
+
+  sched->preempt = false;
+  sched->stats.slice_expired++;
+  sched_again(SCHED_PREEMPTED);
+}
+
 void sched_cpu(int cpu, sched_reason_t reason) {
   ASSERT(cpu >= 0 && cpu < system_num_cpus);
   if (cpu == curcpu_id) {
@@ -308,3 +706,238 @@ void sched_cpu(int cpu, sched_reason_t reason) {
     }
   }
 }
+
+//
+
+void sched_get_stats(int cpu, struct sched_stats *stats) {
+  ASSERT(cpu >= 0 && cpu < MAX_CPUS);
+  sched_t *sched = cpu_scheds[cpu];
+  if (sched == NULL) {
+    memset(stats, 0, sizeof(struct sched_stats));
+    return;
+  }
+  memcpy(stats, &sched->stats, sizeof(struct sched_stats));
+}
+
+void sched_dump_stats() {
+  uint64_t uptime = clock_get_nanos();
+  for (int i = 0; i < system_num_cpus; i++) {
+    sched_t *sched = cpu_scheds[i];
+    if (sched == NULL)
+      continue;
+
+    struct sched_stats stats;
+    sched_get_stats(i, &stats);
+    kprintf("sched: CPU#%d %zu ready, %llu idle steals, %llu balance pulls (%llu runs), %llu migrations\n",
+            i, sched_ready_count(sched), stats.idle_steals, stats.balance_pulls, stats.balance_runs, stats.migrations);
+    kprintf("sched: CPU#%d %llu timeslices expired\n", i, stats.slice_expired);
+    kprintf("sched: CPU#%d idle %llu.%03llus (%llu%%) in %llu sleeps, %llu wakeup ipis [%s]\n",
+            i, stats.idle_ns / NS_PER_SEC, (stats.idle_ns % NS_PER_SEC) / MS_TO_NS(1),
+            uptime > 0 ? (stats.idle_ns * 100) / uptime : 0, stats.idle_sleeps, stats.wakeup_ipis,
+            sched_use_mwait ? "mwait" : "hlt");
+  }
+}
+
+// #define SCHED_BALANCE_STRESS
+#ifdef SCHED_BALANCE_STRESS
+#define STRESS_THREADS  13
+#define STRESS_CHUNK    100000
+#define STRESS_WINDOW   100000000ULL // 100ms
+#define STRESS_WINDOWS  20
+#define STRESS_MAX_IMBALANCE 20      // percent
+
+static volatile bool stress_stop;
+static volatile int stress_exited;
+static volatile uint64_t stress_work[MAX_CPUS];
+static volatile uint64_t stress_violations;
+static thread_t *stress_pinned;
+
+static void sched_stress_worker() {
+  thread_t *td = curthread;
+  while (!stress_stop) {
+    for (volatile int i = 0; i < STRESS_CHUNK; i++);
+
+    // threads only move between cpus when they reschedule
+    uint8_t cpu = curcpu_id;
+    atomic_fetch_add(&stress_work[cpu], 1);
+    if (td == stress_pinned && cpu != 0) {
+      atomic_fetch_add(&stress_violations, 1);
+    }
+    sched_again(SCHED_YIELDED);
+  }
+
+  atomic_fetch_add(&stress_exited, 1);
+  thread_stop(td);
+  unreachable;
+}
+
+// piles an uneven number of cpu bound threads onto the first two cpus and checks
+// that the work done by each cpu evens out as the threads get spread around
+static void sched_balance_stress() {
+  if (system_num_cpus < 2) {
+    kprintf("sched: balance stress test needs at least 2 cpus\n");
+    return;
+  }
+
+  for (int i = 0; i < STRESS_THREADS; i++) {
+    thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+    thread_setup_entry(td, (uintptr_t) sched_stress_worker);
+    td->name = str_fmt("sched stress %d", i);
+
+    // use the affinity to force the initial placement
+    int cpu = (i % 4 == 3) ? 1 : 0;
+    cpuset_set(td->cpuset, cpu);
+    td->flags2 |= TDF2_AFFINITY;
+    if (i == 0) {
+      // the first thread stays pinned to make sure affinity is respected
+      stress_pinned = td;
+    }
+
+    proc_add_thread(curproc, td);
+    thread_finish_setup_and_submit(td);
+    if (td != stress_pinned) {
+      td_lock(td);
+      td->flags2 &= ~TDF2_AFFINITY;
+      cpuset_reset(td->cpuset, cpu);
+      td_unlock(td);
+    }
+  }
+
+  kprintf("sched: balance stress (%d threads, %d cpus)\n", STRESS_THREADS, system_num_cpus);
+  uint64_t prev[MAX_CPUS] = {0};
+  uint64_t imbalance = 100;
+  for (int w = 0; w < STRESS_WINDOWS; w++) {
+    uint64_t end = clock_get_nanos() + STRESS_WINDOW;
+    while (clock_get_nanos() < end) {
+      sched_again(SCHED_YIELDED);
+    }
+
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    for (int i = 0; i < system_num_cpus; i++) {
+      uint64_t work = stress_work[i];
+      uint64_t delta = work - prev[i];
+      prev[i] = work;
+      min = min(min, delta);
+      max = max(max, delta);
+    }
+
+    imbalance = max > 0 ? ((max - min) * 100) / max : 0;
+    kprintf("  window %2d: min %6llu max %6llu imbalance %3llu%%\n", w, min, max, imbalance);
+  }
+
+  stress_stop = true;
+  while (stress_exited < STRESS_THREADS) {
+    sched_again(SCHED_YIELDED);
+  }
+
+  sched_dump_stats();
+  if (imbalance > STRESS_MAX_IMBALANCE || stress_violations > 0) {
+    panic("sched: balance stress failed (imbalance %llu%%, %llu affinity violations)",
+          imbalance, stress_violations);
+  }
+  kprintf("sched: balance stress passed\n");
+}
+MODULE_INIT(sched_balance_stress);
+#endif
+
+// #define SCHED_LATENCY_BENCHMARK
+#ifdef SCHED_LATENCY_BENCHMARK
+#define LATENCY_HOGS      3
+#define LATENCY_SAMPLES   200
+#define LATENCY_PERIOD    US_TO_NS(2500)
+
+#include <sort.h>
+
+static volatile bool latency_stop;
+static volatile int latency_exited;
+static volatile bool latency_done;
+static uint64_t latency_samples[LATENCY_SAMPLES];
+
+static void sched_latency_hog() {
+  // never gives up the cpu on its own
+  while (!latency_stop) {
+    cpu_pause();
+  }
+
+  atomic_fetch_add(&latency_exited, 1);
+  thread_stop(curthread);
+  unreachable;
+}
+
+// there is no sleep primitive that wakes threads on a timer yet, so a sleeping
+// thread is emulated by yielding until the wakeup deadline has passed. the time
+// between the deadline and the thread actually running again is the latency.
+static void sched_latency_wakee() {
+  for (int i = 0; i < LATENCY_SAMPLES; i++) {
+    uint64_t deadline = clock_get_nanos() + LATENCY_PERIOD;
+    uint64_t now;
+    while ((now = clock_get_nanos()) < deadline) {
+      sched_again(SCHED_YIELDED);
+    }
+    latency_samples[i] = now - deadline;
+  }
+
+  latency_done = true;
+  atomic_fetch_add(&latency_exited, 1);
+  thread_stop(curthread);
+  unreachable;
+}
+
+static int latency_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static thread_t *sched_latency_spawn(void (*entry)(), const char *name) {
+  thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+  thread_setup_entry(td, (uintptr_t) entry);
+  td->name = str_fmt("%s", name);
+
+  // keep everything on one cpu so the hogs compete with the wakee
+  cpuset_set(td->cpuset, 0);
+  td->flags2 |= TDF2_AFFINITY;
+  proc_add_thread(curproc, td);
+  thread_finish_setup_and_submit(td);
+  return td;
+}
+
+// measures the wakeup-to-run latency of a thread sharing a cpu with cpu hogs.
+// without timeslice preemption the hogs never let the wakee run again.
+static void sched_latency_benchmark() {
+  for (int i = 0; i < LATENCY_HOGS; i++) {
+    sched_latency_spawn(sched_latency_hog, "latency hog");
+  }
+  sched_latency_spawn(sched_latency_wakee, "latency wakee");
+
+  uint64_t start = clock_get_nanos();
+  while (!latency_done) {
+    sched_again(SCHED_YIELDED);
+  }
+  uint64_t elapsed = clock_get_nanos() - start;
+
+  latency_stop = true;
+  while (latency_exited < LATENCY_HOGS + 1) {
+    sched_again(SCHED_YIELDED);
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i < LATENCY_SAMPLES; i++) {
+    total += latency_samples[i];
+  }
+  qsort(latency_samples, LATENCY_SAMPLES, sizeof(uint64_t), latency_cmp);
+
+  uint64_t p50 = latency_samples[LATENCY_SAMPLES / 2];
+  uint64_t p99 = latency_samples[(LATENCY_SAMPLES * 99) / 100];
+  kprintf("sched: latency benchmark (%d hogs, %d samples, %llu ms)\n",
+          LATENCY_HOGS, LATENCY_SAMPLES, elapsed / MS_TO_NS(1));
+  kprintf("  min %llu us, avg %llu us, p50 %llu us, p99 %llu us, max %llu us\n",
+          latency_samples[0] / 1000, (total / LATENCY_SAMPLES) / 1000, p50 / 1000, p99 / 1000,
+          latency_samples[LATENCY_SAMPLES - 1] / 1000);
+  kprintf("  bound with a %llu us timeslice: %llu us\n",
+          sched_slice_for(curthread) / 1000, (LATENCY_HOGS * sched_slice_for(curthread)) / 1000);
+  sched_dump_stats();
+}
+MODULE_INIT(sched_latency_benchmark);
+#endif
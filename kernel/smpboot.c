@@ -7,6 +7,7 @@
 
 #include <kernel/acpi/acpi.h>
 #include <kernel/hw/apic.h>
+#include <kernel/hw/tsc.h>
 
 #include <kernel/mm.h>
 #include <kernel/printf.h>
@@ -112,6 +113,7 @@ void smp_init() {
   for (int i = 0; i < smpdata->count; i++) {
     uint16_t id = i + 1;
     smp_boot_ap(id, smpdata);
+    tsc_sync_source(id);
     system_num_cpus++;
   }
 
@@ -42,7 +42,7 @@
 
 ; TCB flag bits
 %define TCB_KERNEL  0 ; kernel context
-%define TCB_FPU     1 ; save fpu registers
+%define TCB_FPU     1 ; has fpu state
 %define TCB_DEBUG   2 ; save debug registers
 %define TCB_IRETQ   3 ; needs iretq
 %define TCB_SYSRET  4 ; needs sysret
@@ -133,12 +133,7 @@ sched_do_switch:
   mov dr7, rax
 .done_save_debug:
 
-  ; ==== save fpu registers
-  bt dword TCB_FLAGS(r8), TCB_FPU
-  jnc .done_save_fpu
-  mov r9, TCB_FPUSTATE(r8)
-  fxsave [r9]
-.done_save_fpu:
+  ; fpu registers are saved by fpu_switch_out and restored lazily on #NM
 
   mov rax, THREAD_PROCESS(rdi)
   push rsi
@@ -215,13 +210,6 @@ sched_do_switch:
   mov dr7, rax
 .done_load_debug:
 
- ; ==== load fpu registers
-  bt dword TCB_FLAGS(r8), TCB_FPU
-  jnc .done_load_fpu
-  mov r9, TCB_FPUSTATE(r8)
-  fxrstor [r9]
-.done_load_fpu:
-
   ; ==== load registers
   mov rax, TCB_RIP(r8)
   mov rsp, TCB_RSP(r8)
@@ -7,8 +7,35 @@
 #include <kernel/mm.h>
 #include <kernel/clock.h>
 #include <kernel/mutex.h>
+#include <kernel/proc.h>
+#include <kernel/sched.h>
+#include <kernel/string.h>
 #include <kernel/printf.h>
 #include <kernel/panic.h>
+#include <kernel/bits.h>
+
+#define ASSERT(x) kassert(x)
+#define DPRINTF(x, ...) kprintf("timer: " x, ##__VA_ARGS__)
+
+#define HRTIMER_QUEUE_MAX 512             // max pending hrtimers per cpu
+#define TIMER_BATCH_MAX   32              // max callbacks collected under the lock at once
+#define TIMER_RETRY_NS    US_TO_NS(20)    // delay before retrying a wakeup
+
+// timer wheel geometry
+#define WHEEL_TICK_NS     MS_TO_NS(1)
+#define WHEEL_LEVELS      6
+#define WHEEL_LVL_BITS    6
+#define WHEEL_LVL_SIZE    (1 << WHEEL_LVL_BITS)
+#define WHEEL_LVL_MASK    (WHEEL_LVL_SIZE - 1)
+#define WHEEL_CLK_SHIFT   3               // each level is 8 times coarser than the last
+#define WHEEL_CLK_MASK    ((1 << WHEEL_CLK_SHIFT) - 1)
+#define WHEEL_SLOTS       (WHEEL_LEVELS * WHEEL_LVL_SIZE)
+
+#define LVL_SHIFT(n)      ((n) * WHEEL_CLK_SHIFT)
+#define LVL_GRAN(n)       (1ULL << LVL_SHIFT(n))
+#define LVL_START(n)      ((uint64_t)(WHEEL_LVL_SIZE - 1) << (((n) - 1) * WHEEL_CLK_SHIFT))
+#define WHEEL_CUTOFF      LVL_START(WHEEL_LEVELS)
+#define WHEEL_MAX_DELTA   (WHEEL_CUTOFF - LVL_GRAN(WHEEL_LEVELS - 1))
 
 timer_device_t *global_periodic_timer;
 timer_device_t *global_one_shot_timer;
@@ -161,5 +188,538 @@ int timer_setval(uint16_t type, clock_t value) {
 //
 
 void timer_udelay(uint64_t us) {
-  todo();
+  uint64_t end = clock_get_nanos() + US_TO_NS(us);
+  while (clock_get_nanos() < end) {
+    cpu_pause();
+  }
+}
+
+//////////////////////////////
+// MARK: Timer queues
+
+/*
+ * Per-cpu timer queues.
+ *
+ * Hrtimers are kept in a binary min-heap and timeouts in a hierarchical timer
+ * wheel. The wheel has WHEEL_LEVELS levels of 64 slots and the granularity of
+ * each level is 8 times that of the one below. Timeouts are never cascaded
+ * between levels but instead placed directly into the slot of the level whose
+ * granularity fits the distance to their deadline. This keeps insertion and
+ * removal O(1) at the cost of some precision for distant timeouts. A bitmap of
+ * occupied slots per level makes finding the next expiry cheap.
+ *
+ * All expired timers are collected under the lock and their callbacks are run
+ * in a batch after it has been dropped, so callbacks may start new timers.
+ * Callbacks run in interrupt context on the cpu the timer was queued on.
+ */
+struct timer_cpu {
+  mtx_t lock;                       // spin lock
+  uint64_t next_alarm;              // deadline the alarm is armed for (ns)
+
+  /* hrtimers */
+  struct hrtimer **heap;
+  uint32_t count;
+
+  /* timeouts */
+  uint64_t clk;                     // next wheel tick to be processed
+  uint64_t pending[WHEEL_LEVELS];   // occupied slots (bitmap per level)
+  LIST_HEAD(struct timeout) slots[WHEEL_SLOTS];
+
+  struct timer_stats stats;
+};
+
+struct timer_call {
+  timer_cb_t fn;
+  void *arg;
+};
+
+static struct timer_cpu *timer_cpus[MAX_CPUS];
+static alarm_source_t *timer_alarm;
+
+// MARK: hrtimer heap
+
+static inline void heap_set(struct timer_cpu *tc, uint32_t i, struct hrtimer *timer) {
+  tc->heap[i] = timer;
+  timer->index = i;
+}
+
+static void heap_sift_up(struct timer_cpu *tc, uint32_t i) {
+  struct hrtimer *timer = tc->heap[i];
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (tc->heap[parent]->expires <= timer->expires)
+      break;
+    heap_set(tc, i, tc->heap[parent]);
+    i = parent;
+  }
+  heap_set(tc, i, timer);
+}
+
+static void heap_sift_down(struct timer_cpu *tc, uint32_t i) {
+  struct hrtimer *timer = tc->heap[i];
+  for (;;) {
+    uint32_t child = 2 * i + 1;
+    if (child >= tc->count)
+      break;
+    if (child + 1 < tc->count && tc->heap[child + 1]->expires < tc->heap[child]->expires)
+      child++;
+    if (timer->expires <= tc->heap[child]->expires)
+      break;
+    heap_set(tc, i, tc->heap[child]);
+    i = child;
+  }
+  heap_set(tc, i, timer);
+}
+
+static void heap_remove(struct timer_cpu *tc, struct hrtimer *timer) {
+  uint32_t i = timer->index;
+  ASSERT(i < tc->count && tc->heap[i] == timer);
+
+  struct hrtimer *last = tc->heap[--tc->count];
+  if (last != timer) {
+    heap_set(tc, i, last);
+    if (i > 0 && tc->heap[(i - 1) / 2]->expires > last->expires) {
+      heap_sift_up(tc, i);
+    } else {
+      heap_sift_down(tc, i);
+    }
+  }
+  timer->cpu = -1;
+}
+
+// MARK: timer wheel
+
+static uint64_t wheel_next_expiry(struct timer_cpu *tc) {
+  uint64_t next = UINT64_MAX;
+  for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+    uint64_t pending = tc->pending[lvl];
+    if (pending == 0)
+      continue;
+
+    // slots are expired when the clock reaches their first tick so start
+    // searching from the first slot at this level that has not been reached
+    uint64_t start = (tc->clk + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl);
+    int pos = (int)(start & WHEEL_LVL_MASK);
+    uint64_t rot = pos == 0 ? pending : (pending >> pos) | (pending << (WHEEL_LVL_SIZE - pos));
+    uint64_t tick = (start + bit_ffs64(rot)) << LVL_SHIFT(lvl);
+    next = min(next, tick);
+  }
+  return next;
+}
+
+static void wheel_add(struct timer_cpu *tc, struct timeout *timeout) {
+  uint64_t expires = max(timeout->expires, tc->clk);
+  uint64_t delta = expires - tc->clk;
+
+  int lvl = 0;
+  if (delta >= WHEEL_CUTOFF) {
+    expires = tc->clk + WHEEL_MAX_DELTA;
+    lvl = WHEEL_LEVELS - 1;
+  } else {
+    while (lvl < WHEEL_LEVELS - 1 && delta >= LVL_START(lvl + 1)) {
+      lvl++;
+    }
+  }
+
+  // round up so that the timeout never fires early
+  uint64_t pos = ((expires + LVL_GRAN(lvl) - 1) >> LVL_SHIFT(lvl)) & WHEEL_LVL_MASK;
+  timeout->slot = (uint16_t)(lvl * WHEEL_LVL_SIZE + pos);
+  LIST_ADD(&tc->slots[timeout->slot], timeout, list);
+  tc->pending[lvl] |= 1ULL << pos;
+}
+
+static void wheel_remove(struct timer_cpu *tc, struct timeout *timeout) {
+  uint16_t slot = timeout->slot;
+  LIST_REMOVE(&tc->slots[slot], timeout, list);
+  if (LIST_EMPTY(&tc->slots[slot])) {
+    tc->pending[slot / WHEEL_LVL_SIZE] &= ~(1ULL << (slot % WHEEL_LVL_SIZE));
+  }
+  timeout->cpu = -1;
+}
+
+// collects the timeouts from every slot that expires at the current clock tick.
+// returns false if the batch filled up before all slots were drained.
+static bool wheel_collect_tick(struct timer_cpu *tc, struct timer_call *batch, int *n, int max) {
+  uint64_t clk = tc->clk;
+  for (int lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+    int pos = (int)(clk & WHEEL_LVL_MASK);
+    if (tc->pending[lvl] & (1ULL << pos)) {
+      struct timeout *timeout;
+      while ((timeout = LIST_FIRST(&tc->slots[lvl * WHEEL_LVL_SIZE + pos])) != NULL) {
+        if (*n == max) {
+          return false;
+        }
+        batch[(*n)++] = (struct timer_call){ timeout->fn, timeout->arg };
+        wheel_remove(tc, timeout);
+        tc->stats.timeouts_expired++;
+      }
+    }
+
+    // higher levels are only reached once every slot of this level has passed
+    if (clk & WHEEL_CLK_MASK)
+      break;
+    clk >>= WHEEL_CLK_SHIFT;
+  }
+  return true;
+}
+
+static int wheel_collect(struct timer_cpu *tc, uint64_t now_tick, struct timer_call *batch, int max) {
+  int n = 0;
+  uint64_t next;
+  while ((next = wheel_next_expiry(tc)) <= now_tick) {
+    tc->clk = next;
+    if (!wheel_collect_tick(tc, batch, &n, max)) {
+      return n;
+    }
+    tc->clk++;
+  }
+
+  // nothing is pending before now so the clock can skip ahead
+  if (tc->clk <= now_tick) {
+    tc->clk = now_tick + 1;
+  }
+  return n;
+}
+
+// MARK: alarm
+
+// programs the alarm of the current cpu for the earliest pending timer
+static void timer_program_alarm(struct timer_cpu *tc, uint64_t now) {
+  uint64_t deadline = UINT64_MAX;
+  if (tc->count > 0) {
+    deadline = tc->heap[0]->expires;
+  }
+
+  uint64_t tick = wheel_next_expiry(tc);
+  if (tick != UINT64_MAX) {
+    deadline = min(deadline, tick * WHEEL_TICK_NS);
+  }
+
+  if (deadline == tc->next_alarm) {
+    return;
+  }
+
+  alarm_source_t *as = timer_alarm;
+  tc->next_alarm = deadline;
+  tc->stats.reprograms++;
+  if (deadline == UINT64_MAX) {
+    as->setval(as, 0);
+    return;
+  }
+
+  uint64_t delta = deadline > now ? deadline - now : 0;
+  as->setval(as, min(max(delta / as->scale_ns, 1), as->value_mask));
+}
+
+static void timer_alarm_irq_handler(struct trapframe *frame) {
+  struct timer_cpu *tc = timer_cpus[curcpu_id];
+  struct timer_call batch[TIMER_BATCH_MAX];
+  tc->stats.alarm_irqs++;
+
+  int n;
+  do {
+    uint64_t now = clock_get_nanos();
+    mtx_spin_lock(&tc->lock);
+    // the alarm has fired so nothing is armed anymore
+    tc->next_alarm = UINT64_MAX;
+
+    n = 0;
+    while (tc->count > 0 && tc->heap[0]->expires <= now && n < TIMER_BATCH_MAX) {
+      struct hrtimer *timer = tc->heap[0];
+      batch[n++] = (struct timer_call){ timer->fn, timer->arg };
+      heap_remove(tc, timer);
+      tc->stats.hrtimers_expired++;
+    }
+    n += wheel_collect(tc, now / WHEEL_TICK_NS, batch + n, TIMER_BATCH_MAX - n);
+    timer_program_alarm(tc, now);
+
+    if (n > 0) {
+      tc->stats.batches++;
+      tc->stats.max_batch = max(tc->stats.max_batch, (uint64_t) n);
+    }
+    mtx_spin_unlock(&tc->lock);
+
+    for (int i = 0; i < n; i++) {
+      batch[i].fn(batch[i].arg);
+    }
+  } while (n == TIMER_BATCH_MAX);
+  // if a callback asked for the current thread to be preempted the switch
+  // happens in interrupt_handler once the eoi has been sent
+}
+
+//
+
+void timer_init() {
+  if (curcpu_is_boot) {
+    timer_alarm = alarm_source_find_by_cap(ALARM_PER_CPU|ALARM_ONE_SHOT);
+    if (timer_alarm == NULL) {
+      panic("no per-cpu one-shot alarm source");
+    }
+    DPRINTF("using %s as alarm source\n", timer_alarm->name);
+  }
+
+  struct timer_cpu *tc = kmallocz(sizeof(struct timer_cpu));
+  mtx_init(&tc->lock, MTX_SPIN, "timer_cpu_lock");
+  tc->heap = kmalloc(HRTIMER_QUEUE_MAX * sizeof(struct hrtimer *));
+  tc->next_alarm = UINT64_MAX;
+  tc->clk = clock_get_nanos() / WHEEL_TICK_NS;
+  for (int i = 0; i < WHEEL_SLOTS; i++) {
+    LIST_INIT(&tc->slots[i]);
+  }
+  timer_cpus[curcpu_id] = tc;
+
+  // each cpu has its own alarm so init is called on every cpu
+  alarm_source_t *as = timer_alarm;
+  if (as->init(as, ALARM_ONE_SHOT, timer_alarm_irq_handler) < 0) {
+    panic("failed to init alarm source: %s", as->name);
+  }
+  as->enable(as);
+}
+
+// MARK: hrtimer api
+
+void hrtimer_init(struct hrtimer *timer, timer_cb_t fn, void *arg) {
+  memset(timer, 0, sizeof(struct hrtimer));
+  timer->fn = fn;
+  timer->arg = arg;
+  timer->cpu = -1;
+}
+
+/**
+ * Starts the timer on the current cpu so that it expires at the given time (in
+ * ns since boot). A pending timer is moved to the new deadline.
+ */
+int hrtimer_start(struct hrtimer *timer, uint64_t expires) {
+  if (hrtimer_is_pending(timer)) {
+    hrtimer_cancel(timer);
+  }
+
+  // stay on this cpu since the alarm can only be programmed locally
+  critical_enter();
+  struct timer_cpu *tc = timer_cpus[curcpu_id];
+  mtx_spin_lock(&tc->lock);
+  if (tc->count == HRTIMER_QUEUE_MAX) {
+    mtx_spin_unlock(&tc->lock);
+    critical_exit();
+    return -ENOSPC;
+  }
+
+  timer->expires = expires;
+  timer->cpu = curcpu_id;
+  tc->heap[tc->count] = timer;
+  heap_sift_up(tc, tc->count++);
+  if (expires < tc->next_alarm) {
+    timer_program_alarm(tc, clock_get_nanos());
+  }
+  mtx_spin_unlock(&tc->lock);
+  critical_exit();
+  return 0;
+}
+
+/**
+ * Cancels a pending timer. Returns true if the timer was pending. A timer whose
+ * callback is already about to run can not be cancelled anymore. The alarm is
+ * left as is since a spurious alarm is cheaper than reprogramming it.
+ */
+bool hrtimer_cancel(struct hrtimer *timer) {
+  int cpu = timer->cpu;
+  if (cpu < 0) {
+    return false;
+  }
+
+  struct timer_cpu *tc = timer_cpus[cpu];
+  mtx_spin_lock(&tc->lock);
+  bool pending = timer->cpu == cpu;
+  if (pending) {
+    heap_remove(tc, timer);
+  }
+  mtx_spin_unlock(&tc->lock);
+  return pending;
+}
+
+// MARK: timeout api
+
+void timeout_init(struct timeout *timeout, timer_cb_t fn, void *arg) {
+  memset(timeout, 0, sizeof(struct timeout));
+  timeout->fn = fn;
+  timeout->arg = arg;
+  timeout->cpu = -1;
+}
+
+/**
+ * Starts the timeout on the current cpu so that it expires at or shortly after
+ * the given time (in ns since boot). A pending timeout is moved to the new time.
+ */
+void timeout_start(struct timeout *timeout, uint64_t expires) {
+  if (timeout_is_pending(timeout)) {
+    timeout_cancel(timeout);
+  }
+
+  uint64_t now = clock_get_nanos();
+  uint64_t now_tick = now / WHEEL_TICK_NS;
+  // stay on this cpu since the alarm can only be programmed locally
+  critical_enter();
+  struct timer_cpu *tc = timer_cpus[curcpu_id];
+  mtx_spin_lock(&tc->lock);
+  if (tc->clk < now_tick && wheel_next_expiry(tc) > now_tick) {
+    // the wheel has not been advanced while the cpu was idle. catch it up so
+    // the timeout is not placed with a coarser granularity than needed
+    tc->clk = now_tick;
+  }
+
+  timeout->expires = (expires + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+  timeout->cpu = curcpu_id;
+  wheel_add(tc, timeout);
+  timer_program_alarm(tc, now);
+  mtx_spin_unlock(&tc->lock);
+  critical_exit();
+}
+
+/**
+ * Cancels a pending timeout in constant time. Returns true if the timeout
+ * was pending.
+ */
+bool timeout_cancel(struct timeout *timeout) {
+  int cpu = timeout->cpu;
+  if (cpu < 0) {
+    return false;
+  }
+
+  struct timer_cpu *tc = timer_cpus[cpu];
+  mtx_spin_lock(&tc->lock);
+  bool pending = timeout->cpu == cpu;
+  if (pending) {
+    wheel_remove(tc, timeout);
+  }
+  mtx_spin_unlock(&tc->lock);
+  return pending;
+}
+
+// MARK: sleeping
+
+static void timer_sleep_wakeup(void *arg) {
+  thread_t *td = arg;
+  struct hrtimer *timer = (struct hrtimer *) td->wchan;
+  if (td == curthread || !td_trylock(td)) {
+    // the thread has not finished switching out yet
+    hrtimer_start(timer, clock_get_nanos() + TIMER_RETRY_NS);
+    return;
+  }
+
+  sched_wakeup_thread(td);
+  td_unlock(td);
+}
+
+/**
+ * Puts the current thread to sleep for at least the given number of ns. The
+ * wakeup is driven by an hrtimer so the accuracy is that of the alarm source.
+ */
+void timer_sleep_ns(uint64_t ns) {
+  thread_t *td = curthread;
+  struct hrtimer timer;
+  hrtimer_init(&timer, timer_sleep_wakeup, td);
+
+  td_lock(td);
+  td->wchan = &timer;
+  td->wdmsg = "sleep";
+  if (hrtimer_start(&timer, clock_get_nanos() + ns) < 0) {
+    // no room in the queue so fall back to a busy wait
+    td->wchan = NULL;
+    td->wdmsg = NULL;
+    td_unlock(td);
+    timer_udelay(ns / 1000);
+    return;
+  }
+
+  sched_again(SCHED_SLEEPING);
+  td->wchan = NULL;
+  td->wdmsg = NULL;
+}
+
+//
+
+void timer_get_stats(int cpu, struct timer_stats *stats) {
+  ASSERT(cpu >= 0 && cpu < MAX_CPUS);
+  struct timer_cpu *tc = timer_cpus[cpu];
+  if (tc == NULL) {
+    memset(stats, 0, sizeof(struct timer_stats));
+    return;
+  }
+  memcpy(stats, &tc->stats, sizeof(struct timer_stats));
+}
+
+void timer_dump_pending_alarms() {
+  for (int i = 0; i < MAX_CPUS; i++) {
+    struct timer_cpu *tc = timer_cpus[i];
+    if (tc == NULL)
+      continue;
+
+    mtx_spin_lock(&tc->lock);
+    size_t timeouts = 0;
+    for (int j = 0; j < WHEEL_SLOTS; j++) {
+      struct timeout *timeout;
+      LIST_FOREACH(timeout, &tc->slots[j], list) {
+        timeouts++;
+      }
+    }
+
+    uint64_t next = tc->next_alarm;
+    uint32_t hrtimers = tc->count;
+    struct timer_stats stats = tc->stats;
+    mtx_spin_unlock(&tc->lock);
+
+    kprintf("timer: CPU#%d %u hrtimers, %zu timeouts pending, next alarm ", i, hrtimers, timeouts);
+    if (next == UINT64_MAX) {
+      kprintf("none\n");
+    } else {
+      kprintf("at %llu ns\n", next);
+    }
+    kprintf("timer: CPU#%d %llu alarms, %llu reprograms, %llu hrtimers and %llu timeouts expired in %llu batches (max %llu)\n",
+            i, stats.alarm_irqs, stats.reprograms, stats.hrtimers_expired, stats.timeouts_expired,
+            stats.batches, stats.max_batch);
+  }
+}
+
+// #define TIMER_SLEEP_BENCHMARK
+#ifdef TIMER_SLEEP_BENCHMARK
+#define SLEEP_SAMPLES 100
+
+static uint64_t sleep_total_alarms() {
+  uint64_t total = 0;
+  for (int i = 0; i < MAX_CPUS; i++) {
+    struct timer_stats stats;
+    timer_get_stats(i, &stats);
+    total += stats.alarm_irqs;
+  }
+  return total;
+}
+
+// measures how late sleeps wake up and how many alarm interrupts they take
+static void timer_sleep_benchmark() {
+  static const uint64_t durations[] = {
+    US_TO_NS(50), US_TO_NS(100), US_TO_NS(250), US_TO_NS(500), MS_TO_NS(1), MS_TO_NS(5),
+  };
+
+  kprintf("timer: sleep benchmark (%d samples each)\n", SLEEP_SAMPLES);
+  for (int i = 0; i < ARRAY_SIZE(durations); i++) {
+    uint64_t alarms = sleep_total_alarms();
+
+    uint64_t total = 0;
+    uint64_t worst = 0;
+    for (int j = 0; j < SLEEP_SAMPLES; j++) {
+      uint64_t start = clock_get_nanos();
+      timer_sleep_ns(durations[i]);
+      uint64_t late = clock_get_nanos() - start - durations[i];
+      total += late;
+      worst = max(worst, late);
+    }
+
+    alarms = sleep_total_alarms() - alarms;
+    kprintf("  %5llu us: avg late %llu ns, max late %llu ns, %llu alarms/sleep\n",
+            durations[i] / 1000, total / SLEEP_SAMPLES, worst,
+            alarms / SLEEP_SAMPLES);
+  }
+  timer_dump_pending_alarms();
 }
+MODULE_INIT(timer_sleep_benchmark);
+#endif
@@ -5,6 +5,9 @@
 #include <kernel/tqueue.h>
 #include <kernel/proc.h>
 #include <kernel/sched.h>
+#include <kernel/timer.h>
+#include <kernel/clock.h>
+#include <kernel/atomic.h>
 #include <kernel/panic.h>
 #include <kernel/mm.h>
 
@@ -23,7 +26,8 @@ void runq_add(struct runqueue *runq, thread_t *td) {
   td_lock_assert(td, MA_LOCKED);
 
   mtx_spin_lock(&runq->lock);
-  LIST_ADD_FRONT(&runq->head, td, rqlist);
+  // threads are run in the order they were queued
+  LIST_ADD(&runq->head, td, rqlist);
   atomic_fetch_add(&runq->count, 1);
 
   td->runq = runq;
@@ -34,7 +38,7 @@ void runq_remove(struct runqueue *runq, thread_t *td, bool *empty) {
   size_t count;
   mtx_spin_lock(&runq->lock);
   LIST_REMOVE(&runq->head, td, rqlist);
-  count = atomic_fetch_sub(&runq->count, 1);
+  count = atomic_fetch_sub(&runq->count, 1) - 1;
 
   td->runq = NULL;
   if (empty != NULL) {
@@ -44,14 +48,14 @@ void runq_remove(struct runqueue *runq, thread_t *td, bool *empty) {
 }
 
 thread_t *runq_next_thread(struct runqueue *runq, bool *empty) {
-  size_t count;
+  size_t count = 0;
   mtx_spin_lock(&runq->lock);
 
   thread_t *td = LIST_FIRST(&runq->head);
   if (td != NULL) {
     ASSERT(runq->count > 0);
     LIST_REMOVE(&runq->head, td, rqlist);
-    count = atomic_fetch_sub(&runq->count, 1);
+    count = atomic_fetch_sub(&runq->count, 1) - 1;
 
     // lock the thread (and return it locked)
     td_lock(td);
@@ -65,6 +69,31 @@ thread_t *runq_next_thread(struct runqueue *runq, bool *empty) {
   return td;
 }
 
+thread_t *runq_steal_thread(struct runqueue *runq, int cpu, bool *empty) {
+  mtx_spin_lock(&runq->lock);
+
+  thread_t *td;
+  LIST_FOREACH(td, &runq->head, rqlist) {
+    if (TDF2_HAS_AFFINITY(td) && !cpuset_test(td->cpuset, cpu)) {
+      continue;
+    }
+
+    // a thread that is still locked may not have been switched out yet
+    if (td_trylock(td)) {
+      LIST_REMOVE(&runq->head, td, rqlist);
+      atomic_fetch_sub(&runq->count, 1);
+      td->runq = NULL;
+      break;
+    }
+  }
+
+  if (empty != NULL) {
+    *empty = runq->count == 0;
+  }
+  mtx_spin_unlock(&runq->lock);
+  return td;
+}
+
 // =================================
 //            lockqueue
 // =================================
@@ -92,18 +121,135 @@ static void lockq_static_init() {
 STATIC_INIT(lockq_static_init);
 
 
-static void lockq_propagate_priorirty(struct lockqueue *lockq, thread_t *td) {
+// recomputes the priority of the most urgent waiter. called with lockq->lock held
+static void lockq_update_pri(struct lockqueue *lockq) {
+  uint8_t pri = UINT8_MAX;
+  for (int i = 0; i < 2; i++) {
+    thread_t *td = LIST_FIRST(&lockq->queues[i]);
+    if (td != NULL) {
+      pri = min(pri, td->priority);
+    }
+  }
+  lockq->pri = pri;
 }
 
-static void lockq_unblock_thread(struct lockqueue *lockq, thread_t *td) {
-  todo();
+// inserts the thread after all waiters of the same or higher priority
+static void lockq_insert_thread(tdqueue_t *queue, thread_t *td) {
+  thread_t *next;
+  LIST_FOREACH(next, queue, lqlist) {
+    if (next->priority > td->priority) {
+      break;
+    }
+  }
+
+  if (next == NULL) {
+    LIST_ADD(queue, td, lqlist);
+  } else if (next == LIST_FIRST(queue)) {
+    LIST_ADD_FRONT(queue, td, lqlist);
+  } else {
+    LIST_INSERT(queue, td, lqlist, LIST_PREV(next, lqlist));
+  }
+}
+
+// drops any priority lent to the thread by the locks it no longer owns.
+// called with the thread locked
+static void lockq_unlend_priority(thread_t *td) {
+  uint8_t pri = td->pri_base;
+  struct lockqueue *lockq;
+  LIST_FOREACH(lockq, &td->contested, owner_list) {
+    pri = min(pri, lockq->pri);
+  }
+  sched_set_priority(td, pri);
+}
+
+// lends the priority to the owner of the lockqueue and keeps walking the chain for
+// as long as the owner is blocked on another lock. the lockqueue locks are taken
+// hand over hand so at most one is held at a time. called with lockq->lock held
+// and returns with it released.
+static void lockq_propagate_priority(struct lockqueue *lockq, uint8_t pri) {
+  for (;;) {
+    thread_t *owner = lockq->owner;
+    if (owner == NULL) {
+      // the lock is in the middle of being released
+      mtx_spin_unlock(&lockq->lock);
+      return;
+    }
+
+    td_lock(owner);
+    mtx_spin_unlock(&lockq->lock);
+    if (owner->priority <= pri) {
+      // it already runs at least at this priority and so does everything it waits on
+      td_unlock(owner);
+      return;
+    }
+
+    sched_set_priority(owner, pri);
+    lockq = owner->lockq;
+    td_unlock(owner);
+    if (lockq == NULL) {
+      // the owner is running or ready and will now run sooner
+      return;
+    }
+
+    mtx_spin_lock(&lockq->lock);
+    if (owner->lockq != lockq) {
+      // it was woken up in the meantime
+      mtx_spin_unlock(&lockq->lock);
+      return;
+    }
+
+    // requeue it by its new priority before passing it on
+    tdqueue_t *queue = &lockq->queues[owner->lockq_num];
+    LIST_REMOVE(queue, owner, lqlist);
+    lockq_insert_thread(queue, owner);
+    lockq_update_pri(lockq);
+  }
+}
+
+// removes a blocked thread from the lockqueue and hands it back a lockq of its own.
+// called with the chain lock, lockq->lock and the thread lock held
+static void lockq_dequeue_thread(struct lockqueue_chain *chain, struct lockqueue *lockq, thread_t *td) {
+  LQ_ASSERT(td->lockq == lockq);
+  LIST_REMOVE(&lockq->queues[td->lockq_num], td, lqlist);
+  td->lockq = NULL;
+  td->lockobj = NULL;
+
+  // each blocked thread gave up its own lockq when it blocked
+  if (LIST_EMPTY(&lockq->queues[LQ_EXCL]) && LIST_EMPTY(&lockq->queues[LQ_SHRD])) {
+    // the last waiter takes the lockq itself
+    thread_t *owner = lockq->owner;
+    if (owner != NULL) {
+      // the lock is still held but no one is waiting on it anymore
+      td_lock(owner);
+      LIST_REMOVE(&owner->contested, lockq, owner_list);
+      lockq->owner = NULL;
+      lockq->pri = UINT8_MAX;
+      lockq_unlend_priority(owner);
+      td_unlock(owner);
+    }
+    LIST_REMOVE(&chain->head, lockq, chain_list);
+    td->own_lockq = lockq;
+  } else {
+    td->own_lockq = LIST_REMOVE_FIRST(&chain->free, chain_list);
+    LQ_ASSERT(td->own_lockq != NULL);
+  }
+}
+
+// called with the chain lock and lockq->lock held
+static void lockq_unblock_thread(struct lockqueue_chain *chain, struct lockqueue *lockq, thread_t *td) {
+  td_lock(td);
+  LQ_ASSERT(TDS_IS_BLOCKED(td));
+  lockq_dequeue_thread(chain, lockq, td);
+  sched_wakeup_thread(td);
+  td_unlock(td);
 }
 
 //
 
 struct lockqueue *lockq_alloc() {
   struct lockqueue *lockq = kmallocz(sizeof(struct lockqueue));
-  mtx_init(&lockq->lock, 0, "lockqueue_lock");
+  mtx_init(&lockq->lock, MTX_SPIN, "lockqueue_lock");
+  lockq->pri = UINT8_MAX;
   return lockq;
 }
 
@@ -130,23 +276,24 @@ struct lockqueue *lockq_lookup(struct lock_object *lock_obj) {
 void lockq_chain_lock(struct lock_object *lock_obj) {
   struct lockqueue_chain *chain = LQC_LOOKUP(lock_obj);
   if (chain != NULL)
-    mtx_lock(&chain->lock);
+    mtx_spin_lock(&chain->lock);
 }
 
 void lockq_chain_unlock(struct lock_object *lock_obj) {
   struct lockqueue_chain *chain = LQC_LOOKUP(lock_obj);
   if (chain != NULL)
-    mtx_unlock(&chain->lock);
+    mtx_spin_unlock(&chain->lock);
 }
 
 void lockq_wait(struct lockqueue *lockq, thread_t *owner, int queue) {
   LQ_ASSERT(queue == LQ_EXCL || queue == LQ_SHRD);
-  struct lockqueue_chain *chain = LQC_LOOKUP(lockq->lock_obj);
+  struct lock_object *lock_obj = lockq->lock_obj;
+  struct lockqueue_chain *chain = LQC_LOOKUP(lock_obj);
   LQ_ASSERT(chain != NULL);
   mtx_assert(&chain->lock, MA_OWNED);
 
   thread_t *td = curthread;
-  td_lock(td);
+  LQ_ASSERT(owner != td);
   if (lockq == td->own_lockq) {
     // there was no existing lockq for the lock so curthread has donated its own lockq to block on
     LIST_ADD(&chain->head, lockq, chain_list);
@@ -157,14 +304,28 @@ void lockq_wait(struct lockqueue *lockq, thread_t *owner, int queue) {
   td->own_lockq = NULL;
 
   mtx_spin_lock(&lockq->lock);
-  LIST_ADD(&lockq->queues[queue], td, lqlist);
-  mtx_spin_unlock(&lockq->lock);
+  if (owner != NULL && lockq->owner != owner) {
+    // the first waiter since the lock changed hands
+    LQ_ASSERT(lockq->owner == NULL);
+    td_lock(owner);
+    lockq->owner = owner;
+    LIST_ADD(&owner->contested, lockq, owner_list);
+    td_unlock(owner);
+  }
 
-  sched_again(SCHED_BLOCKED);
+  // the thread stays locked until it has switched out so it can not be woken
+  // up before it has actually blocked
+  td_lock(td);
+  td->lockobj = lock_obj;
+  td->lockq = lockq;
+  td->lockq_num = queue;
+  lockq_insert_thread(&lockq->queues[queue], td);
+  lockq_update_pri(lockq);
 
-  mtx_spin_lock(&lockq->lock);
-  LIST_REMOVE(&lockq->queues[queue], td, lqlist);
-  mtx_spin_unlock(&lockq->lock);
+  lockq_propagate_priority(lockq, td->priority);
+  mtx_spin_unlock(&chain->lock);
+
+  sched_again(SCHED_BLOCKED);
 }
 
 void lockq_remove(struct lockqueue *lockq, thread_t *td, int queue) {
@@ -173,48 +334,227 @@ void lockq_remove(struct lockqueue *lockq, thread_t *td, int queue) {
   LQ_ASSERT(chain != NULL);
   mtx_assert(&chain->lock, MA_OWNED);
 
+  td_lock_assert(td, MA_OWNED);
+  LQ_ASSERT(td->lockq_num == queue);
+
   mtx_spin_lock(&lockq->lock);
-  LIST_REMOVE(&lockq->queues[queue], td, lqlist);
+  lockq_dequeue_thread(chain, lockq, td);
+  lockq_update_pri(lockq);
+  mtx_spin_unlock(&lockq->lock);
+}
+
+void lockq_disown(struct lockqueue *lockq) {
+  struct lockqueue_chain *chain = LQC_LOOKUP(lockq->lock_obj);
+  mtx_assert(&chain->lock, MA_OWNED);
+
+  thread_t *td = curthread;
+  mtx_spin_lock(&lockq->lock);
+  if (lockq->owner == td) {
+    td_lock(td);
+    LIST_REMOVE(&td->contested, lockq, owner_list);
+    lockq->owner = NULL;
+    lockq_unlend_priority(td);
+    td_unlock(td);
+  }
   mtx_spin_unlock(&lockq->lock);
 }
 
 void lockq_signal(struct lockqueue *lockq, int queue) {
   LQ_ASSERT(queue == LQ_EXCL || queue == LQ_SHRD);
-  mtx_assert(&lockq->lock, MA_OWNED);
-
-  LIST_REMOVE(&lockq->queues[queue], curthread, lqlist);
+  struct lockqueue_chain *chain = LQC_LOOKUP(lockq->lock_obj);
+  mtx_assert(&chain->lock, MA_OWNED);
 
+  mtx_spin_lock(&lockq->lock);
+  thread_t *td = LIST_FIRST(&lockq->queues[queue]);
+  if (td != NULL) {
+    lockq_unblock_thread(chain, lockq, td);
+    lockq_update_pri(lockq);
+  }
+  mtx_spin_unlock(&lockq->lock);
 }
 
 void lockq_broadcast(struct lockqueue *lockq, int queue) {
-  todo();
+  LQ_ASSERT(queue == LQ_EXCL || queue == LQ_SHRD);
+  struct lockqueue_chain *chain = LQC_LOOKUP(lockq->lock_obj);
+  mtx_assert(&chain->lock, MA_OWNED);
+
+  mtx_spin_lock(&lockq->lock);
+  thread_t *td;
+  while ((td = LIST_FIRST(&lockq->queues[queue])) != NULL) {
+    lockq_unblock_thread(chain, lockq, td);
+  }
+  lockq_update_pri(lockq);
+  mtx_spin_unlock(&lockq->lock);
 }
 
 // =================================
 //            waitqueue
 // =================================
 
+#define WQ_ASSERT(x) kassert(x)
+
 #define WQC_TABLESIZE 64 // must be power of 2
 #define WQC_HASH(wchan) (((uintptr_t)(wchan) >> 4) & (WQC_TABLESIZE - 1))
 #define WQC_LOOKUP(wchan) (&waitq_chains[WQC_HASH(wchan)])
 
+#define WQ_TIMEOUT_RETRY_NS MS_TO_NS(1)
+
 struct waitqueue_chain {
   struct mtx lock; // chain spin lock
   LIST_HEAD(struct waitqueue) head;
+  LIST_HEAD(struct waitqueue) free;
 };
 static struct waitqueue_chain waitq_chains[WQC_TABLESIZE];
 
+// a timeout for a single wait. it lives on the stack of the waiting thread
+struct waitq_timeout {
+  struct timeout timeout;
+  thread_t *td;
+  const void *wchan;
+  volatile bool done; // the callback is done with it
+};
+
 static void waitq_static_init() {
   for (int i = 0; i < WQC_TABLESIZE; i++) {
     struct waitqueue_chain *chain = &waitq_chains[i];
     mtx_init(&chain->lock, MTX_SPIN, "waitqueue_chain_lock");
     LIST_INIT(&chain->head);
+    LIST_INIT(&chain->free);
   }
 }
 STATIC_INIT(waitq_static_init);
 
-//
+// removes a waiting thread from the waitqueue and hands it back a waitq of its own.
+// called with the chain lock and the thread lock held
+static void waitq_dequeue_thread(struct waitqueue_chain *chain, struct waitqueue *waitq, thread_t *td) {
+  WQ_ASSERT(td->wchan == waitq->wchan);
+  LIST_REMOVE(&waitq->queue, td, wqlist);
+  td->wchan = NULL;
+  td->wdmsg = NULL;
+
+  // each waiting thread gave up its own waitq when it started waiting
+  if (LIST_EMPTY(&waitq->queue)) {
+    // the last waiter takes the waitq itself
+    LIST_REMOVE(&chain->head, waitq, chain_list);
+    waitq->wchan = NULL;
+    td->own_waitq = waitq;
+  } else {
+    td->own_waitq = LIST_REMOVE_FIRST(&chain->free, chain_list);
+    WQ_ASSERT(td->own_waitq != NULL);
+  }
+}
+
+// called with the chain lock held
+static void waitq_unblock_thread(struct waitqueue_chain *chain, struct waitqueue *waitq, thread_t *td) {
+  td_lock(td);
+  WQ_ASSERT(TDS_IS_WAITING(td));
+  waitq_dequeue_thread(chain, waitq, td);
+  sched_wakeup_thread(td);
+  td_unlock(td);
+}
 
+static void waitq_timeout_cb(void *arg) {
+  struct waitq_timeout *wt = arg;
+  thread_t *td = wt->td;
+  const void *wchan = wt->wchan;
+  struct waitqueue_chain *chain = WQC_LOOKUP(wchan);
+
+  mtx_spin_lock(&chain->lock);
+  if (td->wchan != wchan) {
+    // the thread was woken up before the timeout fired
+    atomic_store_release(&wt->done, true);
+    mtx_spin_unlock(&chain->lock);
+    return;
+  }
+
+  if (td == curthread || !td_trylock(td)) {
+    // the thread has not finished switching out yet. the timeout is restarted
+    // under the chain lock so the thread can not miss it when cancelling
+    timeout_start(&wt->timeout, clock_get_nanos() + WQ_TIMEOUT_RETRY_NS);
+    mtx_spin_unlock(&chain->lock);
+    return;
+  }
+
+  struct waitqueue *waitq = waitq_lookup(wchan);
+  WQ_ASSERT(waitq != NULL);
+  td->flags2 |= TDF2_TIMEDOUT;
+  waitq_dequeue_thread(chain, waitq, td);
+  sched_wakeup_thread(td);
+  td_unlock(td);
+
+  atomic_store_release(&wt->done, true);
+  mtx_spin_unlock(&chain->lock);
+}
+
+static int waitq_wait_internal(struct waitqueue *waitq, const char *wdmsg, bool intr, uint64_t timeout) {
+  const void *wchan = waitq->wchan;
+  struct waitqueue_chain *chain = WQC_LOOKUP(wchan);
+  mtx_assert(&chain->lock, MA_OWNED);
+
+  thread_t *td = curthread;
+  td_lock(td);
+  if (intr && TDF2_WAS_INTRP(td)) {
+    // interrupted before we got to wait
+    td->flags2 &= ~TDF2_INTRP;
+    td_unlock(td);
+    if (waitq == td->own_waitq) {
+      waitq->wchan = NULL;
+    }
+    mtx_spin_unlock(&chain->lock);
+    return -EINTR;
+  }
+
+  if (waitq == td->own_waitq) {
+    // there was no existing waitq for the channel so curthread has donated its own
+    LIST_ADD(&chain->head, waitq, chain_list);
+  } else {
+    // we are queueing onto an existing waitq, give ours up to the free list
+    LIST_ADD(&chain->free, td->own_waitq, chain_list);
+  }
+  td->own_waitq = NULL;
+
+  // the thread stays locked until it has switched out so it can not be woken
+  // up before it has actually started waiting
+  td->wchan = wchan;
+  td->wdmsg = wdmsg;
+  if (intr) {
+    td->flags2 |= TDF2_WAITSIG;
+  }
+  LIST_ADD(&waitq->queue, td, wqlist);
+
+  struct waitq_timeout wt;
+  if (timeout > 0) {
+    timeout_init(&wt.timeout, waitq_timeout_cb, &wt);
+    wt.td = td;
+    wt.wchan = wchan;
+    wt.done = false;
+    timeout_start(&wt.timeout, clock_get_nanos() + timeout);
+  }
+  mtx_spin_unlock(&chain->lock);
+
+  sched_again(SCHED_SLEEPING);
+
+  if (timeout > 0 && !timeout_cancel(&wt.timeout)) {
+    // the timeout has fired so wait for the callback to let go of it
+    while (!atomic_load(&wt.done)) {
+      cpu_pause();
+    }
+  }
+
+  int res = 0;
+  td_lock(td);
+  if (TDF2_HAS_TIMEDOUT(td)) {
+    res = -ETIMEDOUT;
+  } else if (intr && TDF2_WAS_INTRP(td)) {
+    res = -EINTR;
+    td->flags2 &= ~TDF2_INTRP;
+  }
+  td->flags2 &= ~(TDF2_WAITSIG | TDF2_TIMEDOUT);
+  td_unlock(td);
+  return res;
+}
+
+//
 struct waitqueue *waitq_alloc() {
   struct waitqueue *waitq = kmallocz(sizeof(struct waitqueue));
   mtx_init(&waitq->lock, MTX_SPIN, "waitqueue_lock");
@@ -254,9 +594,80 @@ void waitq_chain_unlock(const void *wchan) {
 }
 
 void waitq_wait(struct waitqueue *waitq, const char *wdmsg) {
+  waitq_wait_internal(waitq, wdmsg, false, 0);
+}
+
+int waitq_wait_sig(struct waitqueue *waitq, const char *wdmsg) {
+  return waitq_wait_internal(waitq, wdmsg, true, 0);
+}
 
+int waitq_wait_timeout(struct waitqueue *waitq, const char *wdmsg, uint64_t timeout) {
+  return waitq_wait_internal(waitq, wdmsg, false, max(timeout, 1));
 }
 
 void waitq_remove(struct waitqueue *waitq, thread_t *td) {
+  td_lock_assert(td, MA_OWNED);
+  if (waitq == NULL) {
+    // the thread is sleeping on something other than a waitqueue
+    td->wchan = NULL;
+    td->wdmsg = NULL;
+    return;
+  }
+
+  struct waitqueue_chain *chain = WQC_LOOKUP(waitq->wchan);
+  mtx_assert(&chain->lock, MA_OWNED);
+  waitq_dequeue_thread(chain, waitq, td);
+}
 
+void waitq_signal(struct waitqueue *waitq) {
+  struct waitqueue_chain *chain = WQC_LOOKUP(waitq->wchan);
+  mtx_assert(&chain->lock, MA_OWNED);
+
+  thread_t *td = LIST_FIRST(&waitq->queue);
+  if (td != NULL) {
+    waitq_unblock_thread(chain, waitq, td);
+  }
+}
+
+void waitq_broadcast(struct waitqueue *waitq) {
+  struct waitqueue_chain *chain = WQC_LOOKUP(waitq->wchan);
+  mtx_assert(&chain->lock, MA_OWNED);
+
+  // the waitq is handed to the last thread once the queue is empty
+  bool last = false;
+  while (!last) {
+    thread_t *td = LIST_FIRST(&waitq->queue);
+    if (td == NULL) {
+      break;
+    }
+    last = td == LIST_LAST(&waitq->queue);
+    waitq_unblock_thread(chain, waitq, td);
+  }
+}
+
+bool waitq_interrupt(thread_t *td) {
+  td_lock(td);
+  td->flags2 |= TDF2_INTRP;
+  const void *wchan = td->wchan;
+  bool waiting = TDS_IS_WAITING(td) && TDF2_IS_WAITSIG(td);
+  td_unlock(td);
+  if (!waiting || wchan == NULL) {
+    return false;
+  }
+
+  struct waitqueue_chain *chain = WQC_LOOKUP(wchan);
+  mtx_spin_lock(&chain->lock);
+  td_lock(td);
+  bool woken = false;
+  // the thread may have been woken up in the meantime
+  if (td->wchan == wchan && TDS_IS_WAITING(td) && TDF2_IS_WAITSIG(td)) {
+    struct waitqueue *waitq = waitq_lookup(wchan);
+    WQ_ASSERT(waitq != NULL);
+    waitq_dequeue_thread(chain, waitq, td);
+    sched_wakeup_thread(td);
+    woken = true;
+  }
+  td_unlock(td);
+  mtx_spin_unlock(&chain->lock);
+  return woken;
 }
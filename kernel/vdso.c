@@ -0,0 +1,91 @@
+#include <kernel/vdso.h>
+#include <kernel/loadelf.h>
+#include <kernel/mm.h>
+#include <kernel/atomic.h>
+
+#include <kernel/cpu/cpu.h>
+
+#include <kernel/printf.h>
+#include <kernel/panic.h>
+
+#define ASSERT(x) kassert(x)
+#define DPRINTF(x, ...) kprintf("vdso: " x, ##__VA_ARGS__)
+
+/*
+ * The vdso is a small shared object that is linked into the kernel image and
+ * mapped into every process along with the vvar page. It lets programs read the
+ * time and the current cpu without a syscall. Both are mapped straight from the
+ * kernel image so every process shares the same physical pages.
+ */
+extern const uint8_t vdso_image_start[];
+extern const uint8_t vdso_image_end[];
+
+static union {
+  struct vdso_data data;
+  uint8_t bytes[PAGE_SIZE];
+} vvar_page __aligned(PAGE_SIZE);
+
+static struct vdso_data *vdso_data = &vvar_page.data;
+
+static void vdso_static_init() {
+  size_t size = vdso_image_end - vdso_image_start;
+  ASSERT(is_aligned((uintptr_t) vdso_image_start, PAGE_SIZE));
+  if (!elf_is_valid_file((void *) vdso_image_start, size)) {
+    panic("vdso: invalid image");
+  }
+
+  // the image is mapped as a single physical range
+  uintptr_t phys = virt_to_phys(vdso_image_start);
+  for (size_t off = PAGE_SIZE; off < size; off += PAGE_SIZE) {
+    if (virt_to_phys(vdso_image_start + off) != phys + off) {
+      panic("vdso: image is not physically contiguous");
+    }
+  }
+
+  vdso_data->has_rdtscp = cpuid_query_bit(CPUID_BIT_RDTSCP);
+  DPRINTF("%zu byte image\n", size);
+}
+STATIC_INIT(vdso_static_init);
+
+//
+
+/**
+ * Returns the vm descriptors that map the vvar page at `base` and the vdso image
+ * right above it. The image is what should be passed in AT_SYSINFO_EHDR.
+ */
+vm_desc_t *vdso_alloc_descs(uintptr_t base) {
+  size_t size = page_align(vdso_image_end - vdso_image_start);
+  vm_desc_t *vvar = vm_desc_alloc(VM_TYPE_PHYS, base, VDSO_VVAR_SIZE, VM_READ, "vvar",
+                                  (void *) virt_to_phys(&vvar_page));
+  vm_desc_t *image = vm_desc_alloc(VM_TYPE_PHYS, base + VDSO_VVAR_SIZE, size, VM_READ|VM_EXEC, "vdso",
+                                   (void *) virt_to_phys(vdso_image_start));
+  vvar->next = image;
+  return vvar;
+}
+
+// called by the clock code whenever new lockless clock parameters are published
+void vdso_update_clock(uint32_t mode, uint64_t mult, uint32_t shift, uint64_t base_count, uint64_t base_ns) {
+  struct vdso_data *vd = vdso_data;
+  atomic_fetch_add(&vd->seq, 1);
+  vd->clock_mode = mode;
+  vd->mult = mult;
+  vd->shift = shift;
+  vd->base_count = base_count;
+  vd->base_ns = base_ns;
+  atomic_fetch_add(&vd->seq, 1);
+}
+
+void vdso_set_boot_time(uint64_t epoch) {
+  struct vdso_data *vd = vdso_data;
+  atomic_fetch_add(&vd->seq, 1);
+  vd->boot_time = epoch;
+  atomic_fetch_add(&vd->seq, 1);
+}
+
+// forces userspace back onto the syscalls (eg. when the counter is not usable from userspace)
+void vdso_disable_clock() {
+  struct vdso_data *vd = vdso_data;
+  atomic_fetch_add(&vd->seq, 1);
+  vd->clock_mode = VDSO_CLOCK_NONE;
+  atomic_fetch_add(&vd->seq, 1);
+}
@@ -0,0 +1,18 @@
+;
+; vDSO Image
+;
+
+; The vdso shared object is built separately and embedded in the kernel image.
+; It is mapped into user processes directly so it must start on a page boundary
+; and the rest of its last page is padded out so no kernel data is exposed.
+section .rodata progbits alloc noexec nowrite align=4096
+
+global vdso_image_start
+global vdso_image_end
+
+align 4096
+vdso_image_start:
+  incbin "vdso.so"
+vdso_image_end:
+
+align 4096, db 0
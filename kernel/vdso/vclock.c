@@ -0,0 +1,129 @@
+// This file is compiled into the vdso image and runs in userspace.
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+
+#include <abi/vdso.h>
+
+#define NS_PER_SEC  1000000000ULL
+#define NS_PER_USEC 1000ULL
+
+// placed one page below the image by the linker script
+extern const struct vdso_data vvar_page __attribute__((visibility("hidden")));
+
+static inline long vdso_syscall(long n, long a1, long a2, long a3) {
+  unsigned long ret;
+  __asm volatile("syscall" : "=a" (ret) : "a" (n), "D" (a1), "S" (a2), "d" (a3) : "rcx", "r11", "memory");
+  return (long) ret;
+}
+
+static inline uint64_t vdso_rdtsc() {
+  uint32_t lo, hi;
+  __asm volatile("lfence; rdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+  return ((uint64_t) hi << 32) | lo;
+}
+
+// reads the monotonic time and boot time, returns 0 if they must come from the kernel
+static inline int vdso_read_time(uint64_t *ns, uint64_t *boot_time) {
+  const struct vdso_data *vd = &vvar_page;
+  uint32_t seq;
+  do {
+    while ((seq = __atomic_load_n(&vd->seq, __ATOMIC_ACQUIRE)) & 1) {
+      __asm volatile("pause");
+    }
+    if (vd->clock_mode != VDSO_CLOCK_TSC) {
+      return 0;
+    }
+
+    int64_t delta = (int64_t)(vdso_rdtsc() - vd->base_count);
+    if (delta < 0) {
+      delta = 0;
+    }
+    *ns = vd->base_ns + (uint64_t)(((__uint128_t) delta * vd->mult) >> vd->shift);
+    *boot_time = vd->boot_time;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&vd->seq, __ATOMIC_RELAXED) != seq);
+  return 1;
+}
+
+//
+
+int __vdso_clock_gettime(clockid_t clock, struct timespec *ts) {
+  uint64_t ns, boot_time;
+  switch (clock) {
+    case CLOCK_REALTIME:
+    case CLOCK_REALTIME_COARSE:
+    case CLOCK_MONOTONIC:
+    case CLOCK_MONOTONIC_RAW:
+    case CLOCK_MONOTONIC_COARSE:
+    case CLOCK_BOOTTIME:
+      break;
+    default:
+      return (int) vdso_syscall(SYS_clock_gettime, clock, (long) ts, 0);
+  }
+
+  if (!vdso_read_time(&ns, &boot_time)) {
+    return (int) vdso_syscall(SYS_clock_gettime, clock, (long) ts, 0);
+  }
+
+  if (clock == CLOCK_REALTIME || clock == CLOCK_REALTIME_COARSE) {
+    ns += boot_time * NS_PER_SEC;
+  }
+  ts->tv_sec = (time_t)(ns / NS_PER_SEC);
+  ts->tv_nsec = (long)(ns % NS_PER_SEC);
+  return 0;
+}
+
+int __vdso_gettimeofday(struct timeval *tv, void *tz) {
+  uint64_t ns, boot_time;
+  if (!vdso_read_time(&ns, &boot_time)) {
+    return (int) vdso_syscall(SYS_gettimeofday, (long) tv, (long) tz, 0);
+  }
+
+  if (tv) {
+    ns += boot_time * NS_PER_SEC;
+    tv->tv_sec = (time_t)(ns / NS_PER_SEC);
+    tv->tv_usec = (suseconds_t)((ns % NS_PER_SEC) / NS_PER_USEC);
+  }
+  if (tz) {
+    // struct timezone { int tz_minuteswest; int tz_dsttime; }
+    ((int *) tz)[0] = 0;
+    ((int *) tz)[1] = 0;
+  }
+  return 0;
+}
+
+time_t __vdso_time(time_t *t) {
+  uint64_t ns, boot_time;
+  time_t now;
+  if (vdso_read_time(&ns, &boot_time)) {
+    now = (time_t)(boot_time + ns / NS_PER_SEC);
+  } else {
+    struct timespec ts;
+    vdso_syscall(SYS_clock_gettime, CLOCK_REALTIME, (long) &ts, 0);
+    now = ts.tv_sec;
+  }
+
+  if (t) {
+    *t = now;
+  }
+  return now;
+}
+
+long __vdso_getcpu(unsigned *cpu, unsigned *node, void *unused) {
+  if (!vvar_page.has_rdtscp) {
+    return vdso_syscall(SYS_getcpu, (long) cpu, (long) node, (long) unused);
+  }
+
+  // the kernel stores the cpu id in IA32_TSC_AUX
+  uint32_t lo, hi, aux;
+  __asm volatile("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+  if (cpu) {
+    *cpu = aux;
+  }
+  if (node) {
+    *node = 0;
+  }
+  return 0;
+}
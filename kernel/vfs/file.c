@@ -5,6 +5,7 @@
 #include <kernel/vfs/file.h>
 #include <kernel/vfs/vnode.h>
 
+#include <kernel/mm/slab.h>
 #include <kernel/panic.h>
 #include <kernel/printf.h>
 #include <bitmap.h>
@@ -26,10 +27,17 @@ typedef struct ftable {
 #define FTABLE_LOCK(ftable) mtx_spin_lock(&(ftable)->lock)
 #define FTABLE_UNLOCK(ftable) mtx_spin_unlock(&(ftable)->lock)
 
+static kmem_cache_t *file_cache;
+
+static void file_early_init() {
+  file_cache = kmem_cache_create("file", sizeof(file_t), 0, 0);
+}
+EARLY_INIT(file_early_init);
+
 //
 
 __ref file_t *f_alloc(int fd, int flags, vnode_t *vnode, cstr_t real_path) {
-  file_t *file = kmallocz(sizeof(file_t));
+  file_t *file = kmem_cache_allocz(file_cache);
   file->fd = fd;
   file->flags = flags;
   file->type = vnode->type;
@@ -41,7 +49,7 @@ __ref file_t *f_alloc(int fd, int flags, vnode_t *vnode, cstr_t real_path) {
 }
 
 __ref file_t *f_dup(file_t *f) {
-  file_t *dup = kmallocz(sizeof(file_t));
+  file_t *dup = kmem_cache_allocz(file_cache);
   dup->fd = f->fd;
   dup->flags = f->flags;
   dup->type = f->type;
@@ -60,7 +68,7 @@ void f_cleanup(__move file_t **fref) {
 
   vn_release(&file->vnode);
   str_free(&file->real_path);
-  kfree(file);
+  kmem_cache_free(file_cache, file);
 }
 
 //
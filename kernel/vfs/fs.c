@@ -4,6 +4,7 @@
 
 #include <kernel/fs.h>
 #include <kernel/mm.h>
+#include <kernel/mm/reclaim.h>
 #include <kernel/proc.h>
 #include <kernel/device.h>
 #include <kernel/panic.h>
@@ -38,6 +39,22 @@ static void fs_early_init() {
 }
 EARLY_INIT(fs_early_init);
 
+static size_t fs_vcache_count(struct shrinker *shrinker) {
+  struct vcache_stats stats;
+  vcache_get_stats(fs_vcache, &stats);
+  return stats.entries;
+}
+
+static size_t fs_vcache_scan(struct shrinker *shrinker, size_t nr) {
+  return vcache_shrink(fs_vcache, nr);
+}
+
+static struct shrinker fs_vcache_shrinker = {
+  .name = "vcache",
+  .count = fs_vcache_count,
+  .scan = fs_vcache_scan,
+};
+
 //
 
 void fs_init() {
@@ -68,6 +85,7 @@ void fs_init() {
 
   fs_root_ve->parent = ve_getref(fs_root_ve);
   fs_vcache = vcache_alloc(fs_root_ve);
+  register_shrinker(&fs_vcache_shrinker);
 
   vn_release(&root_vn);
   vfs_release(&vfs);
@@ -465,6 +483,7 @@ ssize_t fs_kread(int fd, kio_t *kio) {
 
   // read the file
   vn_begin_data_read(vn);
+  vn_readahead(vn, &file->ra, file->offset, kio_remaining(kio));
   res = vn_read(vn, file->offset, kio);
   vn_end_data_read(vn);
   if (res < 0) {
@@ -835,7 +854,7 @@ int fs_stat(cstr_t path, struct stat *stat) {
   ventry_t *ve = NULL;
   int res;
 
-  if ((res = vresolve(fs_vcache, at_ve, path, 0, &ve)) < 0)
+  if ((res = vresolve(fs_vcache, at_ve, path, VR_UNLOCKED, &ve)) < 0)
     goto ret;
 
   vnode_t *vn = VN(ve);
@@ -855,7 +874,7 @@ int fs_lstat(cstr_t path, struct stat *stat) {
   ventry_t *ve = NULL;
   int res;
 
-  if ((res = vresolve(fs_vcache, at_ve, path, VR_NOFOLLOW, &ve)) < 0)
+  if ((res = vresolve(fs_vcache, at_ve, path, VR_NOFOLLOW|VR_UNLOCKED, &ve)) < 0)
     goto ret;
 
   vnode_t *vn = VN(ve);
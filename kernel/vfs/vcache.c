@@ -6,37 +6,105 @@
 #include <kernel/vfs/ventry.h>
 
 #include <kernel/mm.h>
+#include <kernel/proc.h>
+#include <kernel/atomic.h>
 #include <kernel/panic.h>
 #include <kernel/printf.h>
 #include <kernel/str.h>
 #include <kernel/kio.h>
 
-#include <rb_tree.h>
-
+/*
+ * Per-cpu lockless reader state.
+ *
+ * A reader publishes the vcache epoch it started in on its own cpu for the
+ * duration of a lockless lookup so that entries it may still be looking at are
+ * not freed under it.
+ */
+struct vcache_reader {
+  volatile uint64_t epoch; // epoch the current lookup started in (0 if none)
+  uint64_t hits;     // lockless lookups that found an entry
+  uint64_t misses;   // lockless lookups that found nothing
+  uint64_t neg_hits; // lockless lookups that found a negative entry
+  uint64_t retries;  // lockless lookups that raced with a writer
+} __aligned(64);
+
+/*
+ * The vcache maps absolute paths to ventries.
+ *
+ * Lookups do not take the vcache lock. Writers hold the lock and bump the
+ * sequence count before and after modifying the entries and a reader that sees
+ * an odd or changed count falls back to a locked lookup. Entries removed from
+ * the table are not freed right away but retired with the current epoch. The
+ * epoch is advanced each time the retired entries are reclaimed and an entry is
+ * freed once every active reader started in a later epoch, so a reader can always
+ * follow the links of the entries it has found even if they were removed in the
+ * meantime. The retired entries also keep their ventry reference which means a
+ * ventry found by a reader stays valid until the reader is done with it.
+ *
+ * Paths that are known not to exist are cached as negative entries. They hold a
+ * reference to the directory they were looked up in along with the child
+ * generation of the directory at the time, and are only trusted as long as no
+ * child has been added to the directory since.
+ *
+ * Once the cache grows past VCACHE_MAX_ENTRIES entries are evicted using the
+ * CLOCK algorithm. Lookups set the referenced bit of an entry and the hand gives
+ * every referenced entry a second chance before evicting it. Only leaf entries
+ * are evicted so the directory structure above cached entries stays intact.
+ */
 typedef struct vcache {
   struct ventry *root; // root reference
   mtx_t lock;
+  volatile uint32_t seq;
   size_t size;
   size_t capacity;
-  struct rb_tree *dir_map;
+  size_t nnegative;
   LIST_HEAD(struct vcache_entry) *entries;
+  LIST_HEAD(struct vcache_entry) clock; // all entries in clock order
+  struct vcache_entry *hand;
+  struct vcache_entry *retired; // entries waiting for readers to drain (newest first)
+  size_t nretired;
+  volatile uint64_t epoch; // reclaim epoch (starts at 1)
+  uint64_t reclaimed;
+  uint64_t evicted;
+  uint64_t hits;      // locked lookups that found an entry
+  uint64_t misses;    // locked lookups that found nothing
+  uint64_t neg_hits;  // locked lookups that found a negative entry
+  struct vcache_reader readers[MAX_CPUS];
 } vcache_t;
 
 struct vcache_entry {
   str_t path;   // path string
   hash_t hash;  // hash of the path
-  ventry_t *ve; // ventry reference
+  ventry_t *ve; // ventry reference (NULL for negative entries)
+  ventry_t *dir; // directory reference (negative entries)
+  uint32_t dir_gen; // directory child generation (negative entries)
+  volatile bool referenced;
+  struct vcache_dir *children; // cached children (V_DIR)
+  struct vcache_entry *parent; // parent entry if it was cached
   LIST_ENTRY(struct vcache_entry) list;
+  LIST_ENTRY(struct vcache_entry) clock_list;
+  struct vcache_entry *next_retired;
+  uint64_t retire_epoch; // epoch the entry was retired in
 };
 
+/*
+ * The cached children of a directory entry.
+ *
+ * Children are kept in an open-addressed table with linear probing keyed by the
+ * path hash. Removed slots are marked with a tombstone and the table is rebuilt
+ * once live and dead slots fill 3/4 of it.
+ */
 struct vcache_dir {
   size_t count;     // number of children
-  size_t capacity;  // capacity of children array
-  hash_t *children; // array of child (full path) hashes
+  size_t used;      // number of used slots including tombstones
+  size_t capacity;  // number of slots (power of two)
+  struct vcache_entry **slots;
 };
 
 #define VCACHE_LOCK(vcache) mtx_spin_lock(&(vcache)->lock)
 #define VCACHE_UNLOCK(vcache) mtx_spin_unlock(&(vcache)->lock)
+#define VCACHE_WRITE_BEGIN(vcache) atomic_fetch_add(&(vcache)->seq, 1)
+#define VCACHE_WRITE_END(vcache) atomic_fetch_add(&(vcache)->seq, 1)
 
 #define ASSERT(x) kassert(x)
 #define DPRINTF(str, args...)
@@ -44,6 +112,12 @@ struct vcache_dir {
 #define EPRINTF(fmt, ...) kprintf("vcache: %s: " fmt, __func__, ##__VA_ARGS__)
 
 #define VCACHE_INITIAL_SIZE 1024
+#define VCACHE_MAX_ENTRIES  4096
+#define VCACHE_DIR_INITIAL  8
+#define VCACHE_DIR_TOMBSTONE ((struct vcache_entry *) 1)
+
+#define VCACHE_IS_NEGATIVE(e) ((e)->ve == NULL)
+#define VCACHE_SLOT_USED(s) ((s) != NULL && (s) != VCACHE_DIR_TOMBSTONE)
 
 static const char *vtype_to_str[] = {
   [V_NONE] = "none",
@@ -56,55 +130,96 @@ static const char *vtype_to_str[] = {
   [V_SOCK] = "sock",
 };
 
+static int vcache_invalidate_entry_nolock(vcache_t *vcache, struct vcache_entry *entry);
 
-static inline struct vcache_entry *vcache_entry_alloc(cstr_t path, hash_t hash, ventry_t *ve) {
-  struct vcache_entry *entry = kmallocz(sizeof(struct vcache_entry));
-  entry->path = str_from_cstr(path);
-  entry->hash = hash;
-  entry->ve = ve_getref(ve); // take a reference
-  return entry;
-}
-
-static inline void vcache_entry_free(struct vcache_entry *entry) {
-  str_free(&entry->path);
-  ve_release(&entry->ve);
-  kfree(entry);
-}
 
-static inline struct vcache_dir *vcache_dir_alloc() {
+static inline struct vcache_dir *vcache_dir_alloc(size_t capacity) {
   struct vcache_dir *dir = kmallocz(sizeof(struct vcache_dir));
-  dir->capacity = 8;
-  dir->children = kmallocz(sizeof(hash_t) * dir->capacity);
+  dir->capacity = capacity;
+  dir->slots = kmallocz(sizeof(struct vcache_entry *) * dir->capacity);
   return dir;
 }
 
 static inline void vcache_dir_free(struct vcache_dir *dir) {
-  kfree(dir->children);
+  kfree(dir->slots);
   kfree(dir);
 }
 
-static inline void vcache_dir_add(struct vcache_dir *dir, hash_t hash) {
-  if (dir->count == dir->capacity) {
-    dir->capacity *= 2;
-    hash_t *children = kmallocz(sizeof(hash_t) * dir->capacity);
-    memcpy(children, dir->children, sizeof(hash_t) * dir->count);
-    kfree(dir->children);
-    dir->children = children;
+static void vcache_dir_insert_slot(struct vcache_dir *dir, struct vcache_entry *entry) {
+  size_t mask = dir->capacity - 1;
+  size_t i = entry->hash & mask;
+  while (VCACHE_SLOT_USED(dir->slots[i])) {
+    i = (i + 1) & mask;
+  }
+  if (dir->slots[i] == NULL) {
+    dir->used++;
+  }
+  dir->slots[i] = entry;
+  dir->count++;
+}
+
+static void vcache_dir_rehash(struct vcache_dir *dir, size_t capacity) {
+  struct vcache_entry **slots = dir->slots;
+  size_t old_capacity = dir->capacity;
+  dir->slots = kmallocz(sizeof(struct vcache_entry *) * capacity);
+  dir->capacity = capacity;
+  dir->count = 0;
+  dir->used = 0;
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (VCACHE_SLOT_USED(slots[i])) {
+      vcache_dir_insert_slot(dir, slots[i]);
+    }
+  }
+  kfree(slots);
+}
+
+static void vcache_dir_add(struct vcache_dir *dir, struct vcache_entry *entry) {
+  if ((dir->used + 1) * 4 > dir->capacity * 3) {
+    // grow if the table is mostly live entries otherwise just drop the tombstones
+    size_t capacity = (dir->count + 1) * 2 > dir->capacity ? dir->capacity * 2 : dir->capacity;
+    vcache_dir_rehash(dir, capacity);
   }
-  dir->children[dir->count++] = hash;
+  vcache_dir_insert_slot(dir, entry);
 }
 
-static inline bool vcache_dir_remove(struct vcache_dir *dir, hash_t hash) {
-  for (size_t i = 0; i < dir->count; i++) {
-    if (dir->children[i] == hash) {
-      memmove(dir->children+i, dir->children+i+1, sizeof(hash_t) * (dir->count-i-1));
+static bool vcache_dir_remove(struct vcache_dir *dir, struct vcache_entry *entry) {
+  size_t mask = dir->capacity - 1;
+  size_t i = entry->hash & mask;
+  while (dir->slots[i] != NULL) {
+    if (dir->slots[i] == entry) {
+      dir->slots[i] = VCACHE_DIR_TOMBSTONE;
       dir->count--;
       return true;
     }
+    i = (i + 1) & mask;
   }
   return false;
 }
 
+//
+
+static inline struct vcache_entry *vcache_entry_alloc(cstr_t path, hash_t hash, ventry_t *ve) {
+  struct vcache_entry *entry = kmallocz(sizeof(struct vcache_entry));
+  entry->path = str_from_cstr(path);
+  entry->hash = hash;
+  entry->ve = ve_getref(ve); // take a reference
+  entry->referenced = true;
+  return entry;
+}
+
+static inline void vcache_entry_free(struct vcache_entry *entry) {
+  str_free(&entry->path);
+  ve_release(&entry->ve);
+  ve_release(&entry->dir);
+  kfree(entry);
+}
+
+// returns true if a negative entry can still be trusted
+static inline bool vcache_negative_valid(struct vcache_entry *entry) {
+  ventry_t *dir = entry->dir;
+  return !V_ISDEAD(dir) && !VE_ISMOUNT(dir) && atomic_load(&dir->chld_gen) == entry->dir_gen;
+}
+
 static inline struct vcache_entry *vcache_find_entry(vcache_t *vcache, cstr_t path, hash_t hash) {
   LIST_FOR_IN(e, &vcache->entries[hash % vcache->capacity], list) {
     if (e->hash == hash && cstr_eq(cstr_from_str(e->path), path)) {
@@ -115,128 +230,226 @@ static inline struct vcache_entry *vcache_find_entry(vcache_t *vcache, cstr_t pa
 }
 
 static inline void vcache_insert_entry(vcache_t *vcache, struct vcache_entry *entry) {
+  // the entry must be fully initialized before lockless readers can reach it
+  atomic_signal_fence();
   LIST_ADD(&vcache->entries[entry->hash % vcache->capacity], entry, list);
+  LIST_ADD(&vcache->clock, entry, clock_list);
   vcache->size++;
+  if (VCACHE_IS_NEGATIVE(entry)) {
+    vcache->nnegative++;
+  }
 }
 
 static inline void vcache_remove_entry(vcache_t *vcache, struct vcache_entry *entry) {
   LIST_REMOVE(&vcache->entries[entry->hash % vcache->capacity], entry, list);
+  if (vcache->hand == entry) {
+    vcache->hand = LIST_NEXT(entry, clock_list);
+  }
+  LIST_REMOVE(&vcache->clock, entry, clock_list);
   vcache->size--;
+  if (VCACHE_IS_NEGATIVE(entry)) {
+    vcache->nnegative--;
+  }
 }
 
-static int vcache_invalidate_nolock(vcache_t *vcache, cstr_t path) {
-  hash_t hash = ve_hash_cstr(vcache->root, path);
-  DPRINTF("invalidating {:cstr} [hash=%llu]\n", &path, hash);
-  struct vcache_entry *entry = vcache_find_entry(vcache, path, hash);
-  if (!entry) {
-    return -1;
-  }
+// defers freeing of a removed entry until no lockless reader can still reach it
+static inline void vcache_retire_entry(vcache_t *vcache, struct vcache_entry *entry) {
+  entry->retire_epoch = vcache->epoch;
+  entry->next_retired = vcache->retired;
+  vcache->retired = entry;
+  vcache->nretired++;
+}
 
-  ventry_t *ve = entry->ve;
-  if (ve->type == V_DIR) {
-    // if entry is a directory, recursively invalidate all children before
-    // removing the vcache_dir itself
-    rb_node_t *rb_node = rb_tree_find_node(vcache->dir_map, ve_unique_id(ve));
-    ASSERT(!rb_node_is_nil(rb_node));
-    struct vcache_dir *direntry = rb_node->data;
-    // invalidate children recursively and do it in a while loop because
-    // the array will be modified as we go
-    while (direntry->count > 0) {
-      struct vcache_entry *child_entry = vcache_find_entry(vcache, path, direntry->children[0]);
-      if (child_entry) {
-        vcache_invalidate_nolock(vcache, cstr_from_str(child_entry->path));
-      } else {
-        EPRINTF("missing child entry %llu\n", &direntry->children[0]);
-        vcache_dir_remove(direntry, direntry->children[0]);
-      }
+// returns the epoch of the oldest active lockless reader or UINT64_MAX if none
+static uint64_t vcache_oldest_reader(vcache_t *vcache) {
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < MAX_CPUS; i++) {
+    uint64_t epoch = atomic_load(&vcache->readers[i].epoch);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
     }
+  }
+  return oldest;
+}
 
-    rb_tree_delete_node(vcache->dir_map, rb_node);
-    vcache_dir_free(direntry);
+// called with the lock held after the sequence count has been released
+static void vcache_reclaim_nolock(vcache_t *vcache) {
+  if (vcache->retired == NULL) {
+    return;
   }
 
-  // invalidate the vcache_entry itself and free it
-  vcache_remove_entry(vcache, entry);
-  vcache_entry_free(entry);
+  // readers that start in the new epoch can no longer reach the retired entries
+  // and the atomic increment orders their removal with the check below
+  atomic_fetch_add(&vcache->epoch, 1);
+  uint64_t oldest = vcache_oldest_reader(vcache);
 
-  if (cstr_eq(path, cstr_make("/"))) {
-    return 0; // root entry
+  // the list is ordered newest first so everything past the first entry retired
+  // before the oldest reader started can be freed
+  struct vcache_entry **link = &vcache->retired;
+  while (*link != NULL && (*link)->retire_epoch >= oldest) {
+    link = &(*link)->next_retired;
   }
 
-  // finally remove it from the parent's directory entry
-  cstr_t parent_path = cstr_dirname(path);
-  hash_t parent_hash = ve_hash_cstr(vcache->root, parent_path);
-  struct vcache_entry *parent = vcache_find_entry(vcache, parent_path, parent_hash);
-  if (parent) {
-    struct vcache_dir *direntry = rb_tree_find(vcache->dir_map, ve_unique_id(parent->ve));
-    DPRINTF("removing entry %llu from parent dir {:ve} [%p]\n", hash, parent->ve, direntry);
-    vcache_dir_remove(direntry, hash);
+  struct vcache_entry *entry = *link;
+  *link = NULL;
+  while (entry) {
+    struct vcache_entry *next = entry->next_retired;
+    vcache_entry_free(entry);
+    vcache->nretired--;
+    vcache->reclaimed++;
+    entry = next;
+  }
+}
+
+static int vcache_invalidate_entry_nolock(vcache_t *vcache, struct vcache_entry *entry) {
+  DPRINTF("invalidating {:str} [hash=%llu]\n", &entry->path, entry->hash);
+  struct vcache_dir *dir = entry->children;
+  if (dir != NULL) {
+    // invalidate the children first. removing a child only leaves a tombstone
+    // behind so the slots can be walked while they are being removed
+    for (size_t i = 0; i < dir->capacity; i++) {
+      if (VCACHE_SLOT_USED(dir->slots[i])) {
+        vcache_invalidate_entry_nolock(vcache, dir->slots[i]);
+      }
+    }
+    ASSERT(dir->count == 0);
+    entry->children = NULL;
+    vcache_dir_free(dir);
   }
 
+  // remove it from the parent directory
+  if (entry->parent != NULL) {
+    DPRINTF("removing entry %llu from parent {:str}\n", entry->hash, &entry->parent->path);
+    vcache_dir_remove(entry->parent->children, entry);
+    entry->parent = NULL;
+  }
+
+  // invalidate the vcache_entry itself and retire it
+  vcache_remove_entry(vcache, entry);
+  vcache_retire_entry(vcache, entry);
   return 0;
 }
 
+static int vcache_invalidate_nolock(vcache_t *vcache, cstr_t path) {
+  hash_t hash = ve_hash_cstr(vcache->root, path);
+  struct vcache_entry *entry = vcache_find_entry(vcache, path, hash);
+  if (!entry) {
+    return -1;
+  }
+  return vcache_invalidate_entry_nolock(vcache, entry);
+}
+
 static int vcache_invalidate_all_nolock(vcache_t *vcache) {
   for (size_t i = 0; i < vcache->capacity; i++) {
     struct vcache_entry *entry = LIST_FIRST(&vcache->entries[i]);
     while (entry) {
-      vcache_invalidate_nolock(vcache, cstr_from_str(entry->path));
+      vcache_invalidate_entry_nolock(vcache, entry);
       entry = LIST_FIRST(&vcache->entries[i]);
     }
   }
   return 0;
 }
 
+// evicts up to count unreferenced leaf entries and returns the number evicted
+static size_t vcache_evict_nolock(vcache_t *vcache, size_t count) {
+  size_t evicted = 0;
+  // two passes over the clock are enough to clear every referenced bit
+  size_t budget = 2 * vcache->size;
+  while (evicted < count && budget-- > 0) {
+    struct vcache_entry *entry = vcache->hand;
+    if (entry == NULL) {
+      entry = LIST_FIRST(&vcache->clock);
+      if (entry == NULL)
+        break;
+    }
+    vcache->hand = LIST_NEXT(entry, clock_list);
+
+    if (entry->referenced) {
+      entry->referenced = false;
+      continue;
+    }
+    if (entry->ve == vcache->root) {
+      continue; // keep the root
+    }
+    if (entry->children != NULL && entry->children->count > 0) {
+      continue; // only evict leaves
+    }
+
+    vcache_invalidate_entry_nolock(vcache, entry);
+    vcache->evicted++;
+    evicted++;
+  }
+  return evicted;
+}
+
+static void vcache_link_parent_nolock(vcache_t *vcache, struct vcache_entry *entry, cstr_t path) {
+  if (cstr_eq(path, cstr_make("/"))) {
+    return; // root entry
+  }
+
+  // add the entry to the parent directory
+  cstr_t parent_path = cstr_dirname(path);
+  hash_t parent_hash = ve_hash_cstr(vcache->root, parent_path);
+  struct vcache_entry *parent = vcache_find_entry(vcache, parent_path, parent_hash);
+  if (parent && parent->children) {
+    DPRINTF("adding entry %llu to parent {:str} [%p]\n", entry->hash, &parent->path, parent->children);
+    vcache_dir_add(parent->children, entry);
+    entry->parent = parent;
+  }
+}
+
 static inline int vcache_put_nolock(vcache_t *vcache, cstr_t path, ventry_t *ve) {
   hash_t hash = ve_hash_cstr(ve, path);
   DPRINTF("caching {:ve} at path {:cstr} [hash=%llu]\n", ve, &path, hash);
   struct vcache_entry *entry = vcache_find_entry(vcache, path, hash);
   if (entry) {
     if (entry->ve == ve) {
+      entry->referenced = true;
       return 0; // already exists
     }
-    // invalidate the old entry
-    vcache_invalidate_nolock(vcache, path);
-  }
-
-  if (ve->type == V_DIR) {
-    // if entry is a directory, add it to the directory map by its vnode id
-    if (rb_tree_find(vcache->dir_map, ve_unique_id(ve)) != NULL) {
-      panic("vcache: directory already exists in dir_map {:ve}\n", ve);
-      return -1;
-    }
-
-    struct vcache_dir *direntry = vcache_dir_alloc();
-    // DPRINTF("allocated dir for {:ve} [%p]\n", ve, direntry);
-    rb_tree_insert(vcache->dir_map, ve_unique_id(ve), direntry);
+    // invalidate the old (or negative) entry
+    vcache_invalidate_entry_nolock(vcache, entry);
   }
 
   // now add the ventry to the vcache
   entry = vcache_entry_alloc(path, hash, ve);
-  vcache_insert_entry(vcache, entry);
-  if (cstr_eq(path, cstr_make("/"))) {
-    return 0; // root entry
+  if (ve->type == V_DIR) {
+    entry->children = vcache_dir_alloc(VCACHE_DIR_INITIAL);
   }
+  vcache_link_parent_nolock(vcache, entry, path);
+  vcache_insert_entry(vcache, entry);
+  return 0;
+}
 
-  // add the entry hash to the parent directory
-  cstr_t parent_path = cstr_dirname(path);
-  hash_t parent_hash = ve_hash_cstr(vcache->root, parent_path);
-  struct vcache_entry *parent = vcache_find_entry(vcache, parent_path, parent_hash);
-  if (parent) {
-    struct vcache_dir *direntry = rb_tree_find(vcache->dir_map, ve_unique_id(parent->ve));
-    DPRINTF("adding entry %llu to parent dir {:ve} [%p]\n", hash, parent->ve, direntry);
-    vcache_dir_add(direntry, hash);
+static inline int vcache_put_negative_nolock(vcache_t *vcache, cstr_t path, ventry_t *dve) {
+  hash_t hash = ve_hash_cstr(vcache->root, path);
+  DPRINTF("caching negative entry {:cstr} in {:ve} [hash=%llu]\n", &path, dve, hash);
+  struct vcache_entry *entry = vcache_find_entry(vcache, path, hash);
+  if (entry) {
+    if (VCACHE_IS_NEGATIVE(entry) && entry->dir == dve) {
+      entry->dir_gen = atomic_load(&dve->chld_gen);
+      entry->referenced = true;
+      return 0;
+    }
+    vcache_invalidate_entry_nolock(vcache, entry);
   }
+
+  entry = vcache_entry_alloc(path, hash, NULL);
+  entry->dir = ve_getref(dve);
+  entry->dir_gen = atomic_load(&dve->chld_gen);
+  vcache_link_parent_nolock(vcache, entry, path);
+  vcache_insert_entry(vcache, entry);
   return 0;
 }
 
 //
 
 vcache_t *vcache_alloc(__ref ventry_t *root) {
-  vcache_t *vcache = kmallocz(sizeof(vcache_t));
+  vcache_t *vcache = kmalloca(sizeof(vcache_t), 64);
+  memset(vcache, 0, sizeof(vcache_t));
   vcache->root = ve_getref(root);
   vcache->capacity = VCACHE_INITIAL_SIZE;
-  vcache->dir_map = create_rb_tree();
+  vcache->epoch = 1;
   vcache->entries = kmallocz(sizeof(*vcache->entries) * vcache->capacity);
   mtx_init(&vcache->lock, MTX_SPIN, "vcache_lock");
   return vcache;
@@ -244,7 +457,8 @@ vcache_t *vcache_alloc(__ref ventry_t *root) {
 
 void vcache_free(vcache_t *vcache) {
   ASSERT(vcache->size == 0);
-  rb_tree_free(vcache->dir_map);
+  ASSERT(vcache_oldest_reader(vcache) == UINT64_MAX);
+  vcache_reclaim_nolock(vcache);
   ve_release(&vcache->root);
   kfree(vcache->entries);
 }
@@ -253,23 +467,105 @@ ventry_t *vcache_get_root(vcache_t *vcache) __ref {
   return vcache->root;
 }
 
-ventry_t *vcache_get(vcache_t *vcache, cstr_t path) __move {
-  VCACHE_LOCK(vcache);
+/**
+ * Looks up a path without taking the vcache lock. Returns 0 and the result if
+ * the lookup did not race with a writer, otherwise -EAGAIN. Entries whose
+ * ventry is dead and stale negative entries are reported as a race so the
+ * locked lookup can invalidate them.
+ */
+static int vcache_lookup_lockless(vcache_t *vcache, cstr_t path, hash_t hash, __move ventry_t **result, enum vcache_result *vres) {
+  int res = -EAGAIN;
+  critical_enter();
+  struct vcache_reader *reader = &vcache->readers[curcpu_id];
+  // the atomic store orders the reader against vcache_reclaim_nolock
+  atomic_store(&reader->epoch, atomic_load(&vcache->epoch));
+
+  uint32_t seq = atomic_load(&vcache->seq);
+  if ((seq & 1) == 0) {
+    struct vcache_entry *entry = vcache_find_entry(vcache, path, hash);
+    ventry_t *ve = entry ? entry->ve : NULL;
+    bool valid = entry == NULL || (ve ? !V_ISDEAD(ve) : vcache_negative_valid(entry));
+    if (atomic_load(&vcache->seq) == seq && valid) {
+      if (entry == NULL) {
+        *vres = VCACHE_MISS;
+        reader->misses++;
+      } else {
+        if (!entry->referenced) {
+          entry->referenced = true;
+        }
+
+        if (ve) {
+          // the ventry is kept alive by the entry until we are no longer active
+          *result = ve_getref(ve);
+          *vres = VCACHE_HIT;
+          reader->hits++;
+        } else {
+          *vres = VCACHE_NEGATIVE;
+          reader->neg_hits++;
+        }
+      }
+      res = 0;
+    }
+  }
+
+  if (res < 0) {
+    reader->retries++;
+  }
+  atomic_store_release(&reader->epoch, 0);
+  critical_exit();
+  return res;
+}
+
+/**
+ * Looks up a path in the cache. Returns VCACHE_HIT with a new reference to the
+ * cached ventry, VCACHE_NEGATIVE if the path is known not to exist or
+ * VCACHE_MISS if nothing is known about the path.
+ */
+enum vcache_result vcache_lookup(vcache_t *vcache, cstr_t path, __move ventry_t **result) {
   hash_t hash = ve_hash_cstr(vcache->root, path);
+  enum vcache_result vres;
+  if (vcache_lookup_lockless(vcache, path, hash, result, &vres) == 0) {
+    return vres;
+  }
+
+  VCACHE_LOCK(vcache);
   struct vcache_entry *entry = vcache_find_entry(vcache, path, hash);
   if (entry) {
-    if (entry->ve->state == V_DEAD) {
-      // invalidate the entry if its marked as dead
-      vcache_invalidate_nolock(vcache, path);
+    bool stale = VCACHE_IS_NEGATIVE(entry) ? !vcache_negative_valid(entry) : (entry->ve->state == V_DEAD);
+    if (stale) {
+      // invalidate the entry if its marked as dead or out of date
+      VCACHE_WRITE_BEGIN(vcache);
+      vcache_invalidate_entry_nolock(vcache, entry);
+      VCACHE_WRITE_END(vcache);
+      vcache->misses++;
+      vcache_reclaim_nolock(vcache);
+      VCACHE_UNLOCK(vcache);
+      return VCACHE_MISS;
+    }
+
+    entry->referenced = true;
+    if (VCACHE_IS_NEGATIVE(entry)) {
+      vcache->neg_hits++;
       VCACHE_UNLOCK(vcache);
-      return NULL;
+      return VCACHE_NEGATIVE;
     }
 
+    vcache->hits++;
+    *result = ve_getref(entry->ve); // return new reference
     VCACHE_UNLOCK(vcache);
-    return ve_getref(entry->ve); // return new reference
+    return VCACHE_HIT;
   }
+  vcache->misses++;
   VCACHE_UNLOCK(vcache);
-  return NULL;
+  return VCACHE_MISS;
+}
+
+ventry_t *vcache_get(vcache_t *vcache, cstr_t path) __move {
+  ventry_t *ve = NULL;
+  if (vcache_lookup(vcache, path, &ve) != VCACHE_HIT) {
+    return NULL;
+  }
+  return ve;
 }
 
 int vcache_put(vcache_t *vcache, cstr_t path, ventry_t *ve) {
@@ -282,25 +578,99 @@ int vcache_put(vcache_t *vcache, cstr_t path, ventry_t *ve) {
 
   ve_hash(ve);
   VCACHE_LOCK(vcache);
+  VCACHE_WRITE_BEGIN(vcache);
   int ret = vcache_put_nolock(vcache, path, ve);
+  if (vcache->size > VCACHE_MAX_ENTRIES) {
+    vcache_evict_nolock(vcache, vcache->size - VCACHE_MAX_ENTRIES);
+  }
+  VCACHE_WRITE_END(vcache);
+  vcache_reclaim_nolock(vcache);
+  VCACHE_UNLOCK(vcache);
+  return ret;
+}
+
+/**
+ * Records that the path does not exist in the directory dve. The directory
+ * must be locked and the last component of the path must have just failed to
+ * be looked up in it.
+ */
+int vcache_put_negative(vcache_t *vcache, cstr_t path, ventry_t *dve) {
+  if (dve->state == V_DEAD)
+    return -1;
+  if (!cstr_starts_with(path, '/')) {
+    EPRINTF("skipping invalid path {:cstr}\n", &path);
+    return -1;
+  }
+
+  VCACHE_LOCK(vcache);
+  VCACHE_WRITE_BEGIN(vcache);
+  int ret = vcache_put_negative_nolock(vcache, path, dve);
+  if (vcache->size > VCACHE_MAX_ENTRIES) {
+    vcache_evict_nolock(vcache, vcache->size - VCACHE_MAX_ENTRIES);
+  }
+  VCACHE_WRITE_END(vcache);
+  vcache_reclaim_nolock(vcache);
   VCACHE_UNLOCK(vcache);
   return ret;
 }
 
 int vcache_invalidate(vcache_t *vcache, cstr_t path) {
   VCACHE_LOCK(vcache);
+  VCACHE_WRITE_BEGIN(vcache);
   int res = vcache_invalidate_nolock(vcache, path);
+  VCACHE_WRITE_END(vcache);
+  vcache_reclaim_nolock(vcache);
   VCACHE_UNLOCK(vcache);
   return res;
 }
 
 int vcache_invalidate_all(vcache_t *vcache) {
   VCACHE_LOCK(vcache);
+  VCACHE_WRITE_BEGIN(vcache);
   int res = vcache_invalidate_all_nolock(vcache);
+  VCACHE_WRITE_END(vcache);
+  vcache_reclaim_nolock(vcache);
   VCACHE_UNLOCK(vcache);
   return res;
 }
 
+/**
+ * Evicts up to count of the least recently used entries to free memory and
+ * returns the number of entries that were evicted.
+ */
+size_t vcache_shrink(vcache_t *vcache, size_t count) {
+  VCACHE_LOCK(vcache);
+  VCACHE_WRITE_BEGIN(vcache);
+  size_t evicted = vcache_evict_nolock(vcache, count);
+  VCACHE_WRITE_END(vcache);
+  vcache_reclaim_nolock(vcache);
+  VCACHE_UNLOCK(vcache);
+  return evicted;
+}
+
+void vcache_get_stats(vcache_t *vcache, struct vcache_stats *stats) {
+  memset(stats, 0, sizeof(struct vcache_stats));
+  for (int i = 0; i < MAX_CPUS; i++) {
+    struct vcache_reader *reader = &vcache->readers[i];
+    stats->lockless_hits += reader->hits;
+    stats->hits += reader->hits;
+    stats->misses += reader->misses;
+    stats->neg_hits += reader->neg_hits;
+    stats->lockless_retries += reader->retries;
+  }
+
+  VCACHE_LOCK(vcache);
+  stats->hits += vcache->hits;
+  stats->misses += vcache->misses;
+  stats->neg_hits += vcache->neg_hits;
+  stats->entries = vcache->size;
+  stats->negative = vcache->nnegative;
+  stats->retired = vcache->nretired;
+  stats->reclaimed = vcache->reclaimed;
+  stats->evicted = vcache->evicted;
+  VCACHE_UNLOCK(vcache);
+}
+
 void vcache_dump(vcache_t *vcache) {
   VCACHE_LOCK(vcache);
   kprintf("{:$=<34} vcache dump {:$=>34}\n");
@@ -311,31 +681,30 @@ void vcache_dump(vcache_t *vcache) {
       struct vcache_entry *entry = LIST_FIRST(&vcache->entries[i]);
       while (entry) {
         ventry_t *ve = entry->ve;
-        const char *type = vtype_to_str[ve->type];
-        const char *state = V_ISALIVE(ve) ? "alive" : "dead";
-
-        char unique_id[32] = {0};
-        ksnprintf(unique_id, sizeof(unique_id)-1, "%u,%u", ve->vfs_id, ve->id);
-
         char entrystr[256] = {0};
-        ksnprintf(entrystr, sizeof(entrystr)-1, "",
-                  i, ve->vfs_id, ve->id, type, str_cptr(entry->path));
         kio_t kio = kio_new_writable(entrystr, sizeof(entrystr) - 1);
-        kio_sprintf(&kio, " {:>5zu} | {:>8s} | {:4s} | {:22llu} | {:28s} ", i, unique_id, type, entry->hash, str_cptr(entry->path));
-
-        if (V_ISDIR(ve)) {
-          struct vcache_dir *direntry = rb_tree_find(vcache->dir_map, ve_unique_id(ve));
-          ASSERT(direntry != NULL);
-          kio_sprintf(&kio, "(%zu", direntry->count);
-          if (direntry->count == 1) {
-            kio_sprintf(&kio, " entry)");
-          } else {
-            kio_sprintf(&kio, " entries)");
+        if (VCACHE_IS_NEGATIVE(entry)) {
+          kio_sprintf(&kio, " {:>5zu} | {:>8s} | {:4s} | {:22llu} | {:28s} ", i, "-", "neg", entry->hash, str_cptr(entry->path));
+          if (!vcache_negative_valid(entry))
+            kio_sprintf(&kio, " STALE");
+        } else {
+          const char *type = vtype_to_str[ve->type];
+          char unique_id[32] = {0};
+          ksnprintf(unique_id, sizeof(unique_id)-1, "%u,%u", ve->vfs_id, ve->id);
+          kio_sprintf(&kio, " {:>5zu} | {:>8s} | {:4s} | {:22llu} | {:28s} ", i, unique_id, type, entry->hash, str_cptr(entry->path));
+
+          if (entry->children != NULL) {
+            kio_sprintf(&kio, "(%zu", entry->children->count);
+            if (entry->children->count == 1) {
+              kio_sprintf(&kio, " entry)");
+            } else {
+              kio_sprintf(&kio, " entries)");
+            }
           }
-        }
 
-        if (V_ISDEAD(ve))
-          kio_sprintf(&kio, " DEAD");
+          if (V_ISDEAD(ve))
+            kio_sprintf(&kio, " DEAD");
+        }
         kio_write_ch(&kio, 0); // null terminate
 
         kprintf("%s\n", entrystr);
@@ -352,18 +721,19 @@ void vcache_dump(vcache_t *vcache) {
     for (size_t i = 0; i < vcache->capacity; i++) {
       struct vcache_entry *entry = LIST_FIRST(&vcache->entries[i]);
       while (entry) {
-        ventry_t *ve = entry->ve;
-        if (V_ISDIR(ve)) {
-          struct vcache_dir *direntry = rb_tree_find(vcache->dir_map, ve_unique_id(ve));
-          ASSERT(direntry != NULL);
-
+        struct vcache_dir *dir = entry->children;
+        if (dir != NULL) {
+          ventry_t *ve = entry->ve;
           char unique_id[32] = {0};
           ksnprintf(unique_id, sizeof(unique_id)-1, "%u,%u", ve->vfs_id, ve->id);
-          kprintf(" {:>5zu} | {:>8s} | {:18p} | ", i, unique_id, direntry);
-          for (size_t j = 0; j < direntry->count; j++) {
-            kprintf("%llu", direntry->children[j]);
-            if (j < direntry->count - 1) {
-              kprintf(", ");
+          kprintf(" {:>5zu} | {:>8s} | {:18p} | ", i, unique_id, dir);
+          size_t n = 0;
+          for (size_t j = 0; j < dir->capacity; j++) {
+            if (VCACHE_SLOT_USED(dir->slots[j])) {
+              kprintf("%llu", dir->slots[j]->hash);
+              if (++n < dir->count) {
+                kprintf(", ");
+              }
             }
           }
           kprintf("\n");
@@ -375,4 +745,11 @@ void vcache_dump(vcache_t *vcache) {
   }
   kprintf("{:$-<64}\n");
   VCACHE_UNLOCK(vcache);
+
+  struct vcache_stats stats;
+  vcache_get_stats(vcache, &stats);
+  kprintf("vcache: %zu entries (%zu negative), %llu evicted, %zu retired, %llu reclaimed\n",
+          stats.entries, stats.negative, stats.evicted, stats.retired, stats.reclaimed);
+  kprintf("vcache: %llu hits (%llu lockless), %llu misses, %llu negative hits, %llu lockless retries\n",
+          stats.hits, stats.lockless_hits, stats.misses, stats.neg_hits, stats.lockless_retries);
 }
@@ -20,6 +20,13 @@ static struct ventry_ops ve_default_ops = {
   .v_cleanup = NULL,
 };
 
+static kmem_cache_t *ventry_cache;
+
+static void ventry_early_init() {
+  ventry_cache = kmem_cache_create("ventry", sizeof(ventry_t), 0, 0);
+}
+EARLY_INIT(ventry_early_init);
+
 static hash_t ve_hash_default(cstr_t str) {
   uint64_t tmp[2] = {0, 0};
   murmur_hash_x86_128(cstr_ptr(str), (int) cstr_len(str), MURMUR3_SEED, tmp);
@@ -33,7 +40,7 @@ static bool ve_cmp_default(ventry_t *ve, cstr_t str) {
 //
 
 __ref ventry_t *ve_alloc_linked(cstr_t name, vnode_t *vn) {
-  ventry_t *entry = kmallocz(sizeof(ventry_t));
+  ventry_t *entry = kmem_cache_allocz(ventry_cache);
   entry->type = vn->type;
   entry->state = V_EMPTY;
   entry->name = str_from_cstr(name);
@@ -140,6 +147,13 @@ void ve_add_child(ventry_t *parent, ventry_t *child) {
   }
 }
 
+void ve_add_new_child(ventry_t *parent, ventry_t *child) {
+  ve_add_child(parent, child);
+  // the name may have been cached as missing so invalidate the negative
+  // vcache entries in the directory
+  atomic_fetch_add(&parent->chld_gen, 1);
+}
+
 void ve_remove_child(ventry_t *parent, ventry_t *child) {
   ve_release(&child->parent);
   LIST_REMOVE(&parent->children, child, list);
@@ -196,7 +210,7 @@ void ve_cleanup(__move ventry_t **veref) {
   ve_release(&ve->parent);
   vn_release(&ve->vn);
   str_free(&ve->name);
-  kfree(ve);
+  kmem_cache_free(ventry_cache, ve);
 }
 
 //
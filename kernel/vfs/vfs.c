@@ -49,6 +49,7 @@ __ref vfs_t *vfs_alloc(struct fs_type *type, int mount_flags) {
   vfs->ops = type->vfs_ops;
   vfs->vtable = vtable_alloc();
   mtx_init(&vfs->lock, MTX_RECURSIVE, "vfs_lock");
+  rw_init(&vfs->op_lock, 0, "vfs_op_lock");
   ref_init(&vfs->refcount);
   DPRINTF("allocated vfs id=%u <%p>\n", vfs->id, vfs);
   return vfs;
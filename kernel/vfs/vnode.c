@@ -8,7 +8,12 @@
 #include <kernel/vfs/file.h>
 
 #include <kernel/mm.h>
+#include <kernel/mm/pgtable.h>
+#include <kernel/atomic.h>
+#include <kernel/chan.h>
+#include <kernel/proc.h>
 #include <kernel/printf.h>
+#include <kernel/str.h>
 
 #define ASSERT(x) kassert(x)
 // #define DPRINTF(fmt, ...) kprintf("vnode: %s: " fmt, __func__, ##__VA_ARGS__)
@@ -20,6 +25,19 @@
 #define CHECK_NAMELEN(name) if (cstr_len(name) > NAME_MAX) return -ENAMETOOLONG;
 #define CHECK_SUPPORTED(vn, op) if (!(vn)->ops->op) return -ENOTSUP;
 
+#define RA_MIN_PAGES 4   // initial readahead window
+#define RA_MAX_PAGES 64  // largest readahead window (256KB)
+#define RA_QUEUE_SIZE 32
+
+static kmem_cache_t *vnode_cache;
+static struct vn_pgcache_stats vn_pgcache_stats;
+static chan_t *vn_ra_queue;
+
+static void vnode_early_init() {
+  vnode_cache = kmem_cache_create("vnode", sizeof(vnode_t), 0, 0);
+}
+EARLY_INIT(vnode_early_init);
+
 static inline mode_t vn_to_mode(vnode_t *vnode) {
   mode_t mode = 0;
   switch (vnode->type) {
@@ -35,10 +53,246 @@ static inline mode_t vn_to_mode(vnode_t *vnode) {
   return mode;
 }
 
+//
+// MARK: page cache
+//
+
+/*
+ * The page cache of a vnode is shared by read/write and by every mapping of the
+ * file, so a page is only ever fetched from the filesystem once. Lookups and
+ * inserts are done under the vnode lock but the lock is dropped while the
+ * filesystem fetches a missing page.
+ */
+
+// the vnode lock must be held
+static void vn_alloc_pgcache(vnode_t *vn) {
+  uint16_t order = pgcache_size_to_order(page_align(vn->size), PAGE_SIZE);
+  vn->pgcache = pgcache_alloc(order, PAGE_SIZE);
+  // file pages can always be read back in so they may be reclaimed
+  pgcache_set_reclaimable(vn->pgcache);
+}
+
+// returns a reference to the cached page at the page aligned offset off
+static int vn_cache_getpage(vnode_t *vn, size_t off, __move page_t **result) {
+  if (!vn_lock(vn))
+    return -EIO;
+
+  if (vn->pgcache == NULL) {
+    vn_alloc_pgcache(vn);
+  }
+
+  page_t *page = pgcache_lookup(vn->pgcache, off);
+  vn_unlock(vn);
+  if (page != NULL) {
+    atomic_fetch_add(&vn_pgcache_stats.hits, 1);
+    *result = page;
+    return 0;
+  }
+
+  int res = VN_OPS(vn)->v_getpage(vn, (off_t) off, &page);
+  if (res < 0) {
+    return res;
+  }
+  ASSERT(pg_flags_to_size(page->flags) == PAGE_SIZE);
+  atomic_fetch_add(&vn_pgcache_stats.misses, 1);
+
+  if (vn_lock(vn)) {
+    // someone else may have filled the slot while the lock was dropped
+    page_t *other = pgcache_lookup(vn->pgcache, off);
+    if (other != NULL) {
+      drop_pages(&page);
+      page = other;
+    } else {
+      pgcache_insert(vn->pgcache, off, getref(page), NULL);
+    }
+    vn_unlock(vn);
+  }
+
+  *result = page;
+  return 0;
+}
+
+// drops the cached pages overlapping [off, off+len)
+static void vn_cache_invalidate(vnode_t *vn, size_t off, size_t len) {
+  if (!vn_lock(vn))
+    return;
+
+  size_t end = page_align(off + len);
+  for (size_t pgoff = align_down(off, PAGE_SIZE); pgoff < end; pgoff += PAGE_SIZE) {
+    pgcache_remove(vn->pgcache, pgoff, NULL);
+  }
+  vn_unlock(vn);
+}
+
+// copies between the kio and the cached pages of the file. for writes (a kio
+// that is read out) every modified page is passed to v_putpage.
+static ssize_t vn_cache_rw(vnode_t *vn, size_t off, kio_t *kio) {
+  size_t end = min(off + kio_remaining(kio), vn->size);
+  size_t total = 0;
+  int res = 0;
+  while (off < end) {
+    size_t pgoff = align_down(off, PAGE_SIZE);
+    size_t len = min(pgoff + PAGE_SIZE, end) - off;
+    page_t *page;
+    if ((res = vn_cache_getpage(vn, pgoff, &page)) < 0) {
+      break;
+    }
+
+    size_t n;
+    void *ptr = kmap_local(page);
+    if (kio->dir == KIO_WRITE) {
+      n = kio_nwrite_in(kio, ptr, PAGE_SIZE, off - pgoff, len);
+    } else {
+      n = kio_nread_out(ptr, PAGE_SIZE, off - pgoff, len, kio);
+    }
+    kunmap_local(ptr);
+
+    if (kio->dir == KIO_READ && n > 0) {
+      res = VN_OPS(vn)->v_putpage(vn, (off_t) pgoff, getref(page));
+    }
+    drop_pages(&page);
+
+    total += n;
+    off += n;
+    if (res < 0 || n < len) {
+      break;
+    }
+  }
+
+  if (total == 0 && res < 0) {
+    return res;
+  }
+  return (ssize_t) total;
+}
+
+//
+// MARK: readahead
+//
+
+struct vn_ra_request {
+  vnode_t *vn;    // vnode reference
+  size_t start;   // first page
+  size_t count;   // number of pages
+};
+
+// brings the pages [start, start+count) into the page cache
+static void vn_ra_fill(vnode_t *vn, size_t start, size_t count) {
+  size_t i;
+  for (i = start; i < start + count; i++) {
+    page_t *page;
+    if (vn_cache_getpage(vn, PAGES_TO_SIZE(i), &page) < 0) {
+      break;
+    }
+    drop_pages(&page);
+  }
+  atomic_fetch_add(&vn_pgcache_stats.ra_pages, i - start);
+}
+
+static void vn_ra_request_free(void *data) {
+  struct vn_ra_request *req = data;
+  vn_release(&req->vn);
+  kfree(req);
+}
+
+// fills the queued windows in the background while the reader consumes the
+// pages before the async marker
+static noreturn void vn_ra_worker() {
+  struct vn_ra_request *req;
+  while (chan_recv(vn_ra_queue, chan_voidp(&req)) >= 0) {
+    vn_ra_fill(req->vn, req->start, req->count);
+    vn_ra_request_free(req);
+  }
+  panic("vnode: readahead queue closed");
+}
+
+static void vn_ra_submit(vnode_t *vn, size_t start, size_t count) {
+  size_t npages = SIZE_TO_PAGES(vn->size);
+  if (start >= npages)
+    return;
+  count = min(count, npages - start);
+
+  atomic_fetch_add(&vn_pgcache_stats.ra_windows, 1);
+  if (vn_ra_queue == NULL) {
+    vn_ra_fill(vn, start, count);
+    return;
+  }
+
+  struct vn_ra_request *req = kmalloc(sizeof(struct vn_ra_request));
+  req->vn = vn_getref(vn);
+  req->start = start;
+  req->count = count;
+  // if the queue is full the oldest request is dropped
+  chan_send(vn_ra_queue, chan_u64(req));
+}
+
+// returns the size of the first window for a read of req pages
+static size_t vn_ra_init_size(size_t req) {
+  size_t size = RA_MIN_PAGES;
+  while (size < req * 2 && size < RA_MAX_PAGES) {
+    size *= 2;
+  }
+  return size;
+}
+
+/**
+ * Updates the readahead state of a file for a read of len bytes at off and
+ * submits the next window when the access is sequential. Random reads shrink
+ * the window and do not read ahead. The pages of the read itself are fetched
+ * by vn_read.
+ */
+void vn_readahead(vnode_t *vn, struct file_ra *ra, off_t off, size_t len) {
+  if (!VN_OPS(vn)->v_getpage || off < 0 || (size_t) off >= vn->size || len == 0)
+    return;
+
+  size_t index = (size_t) off >> PAGE_SHIFT;
+  size_t end = SIZE_TO_PAGES(min((size_t) off + len, vn->size));
+  size_t req = end - index;
+  bool sequential = index == ra->next || index + 1 == ra->next;
+  ra->next = end;
+
+  if (!sequential) {
+    // random access
+    ra->start = index;
+    ra->size = max(ra->size / 2, req);
+    ra->async_size = 0;
+    atomic_fetch_add(&vn_pgcache_stats.ra_random, 1);
+    return;
+  }
+
+  size_t wend = ra->start + ra->size;
+  if (ra->size == 0 || index < ra->start || index >= wend) {
+    // start a new window at the read
+    ra->size = ra->size == 0 ? vn_ra_init_size(req) : min(max(ra->size * 2, req), RA_MAX_PAGES);
+    ra->start = index;
+    ra->async_size = ra->size > req ? ra->size - req : 0;
+    if (ra->async_size > 0) {
+      vn_ra_submit(vn, end, ra->async_size);
+    }
+  } else if (end > wend - ra->async_size) {
+    // the read crossed the async marker so move on to the next window
+    ra->start = wend;
+    ra->size = min(ra->size * 2, RA_MAX_PAGES);
+    ra->async_size = ra->size;
+    vn_ra_submit(vn, ra->start, ra->size);
+  }
+}
+
+static void vn_readahead_init() {
+  vn_ra_queue = chan_alloc(RA_QUEUE_SIZE, 0);
+  chan_set_free_cb(vn_ra_queue, vn_ra_request_free);
+
+  thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+  thread_setup_entry(td, (uintptr_t) vn_ra_worker);
+  td->name = str_fmt("readahead");
+  proc_add_thread(curproc, td);
+  thread_finish_setup_and_submit(td);
+}
+MODULE_INIT(vn_readahead_init);
+
 //
 
 __ref vnode_t *vn_alloc_empty(enum vtype type) {
-  vnode_t *vnode = kmallocz(sizeof(vnode_t));
+  vnode_t *vnode = kmem_cache_allocz(vnode_cache);
   vnode->id = 0;
   vnode->type = type;
   vnode->state = V_EMPTY;
@@ -62,8 +316,7 @@ __ref struct pgcache *vn_get_pgcache(vnode_t *vn) {
   }
 
   if (vn->pgcache == NULL) {
-    uint16_t order = pgcache_size_to_order(page_align(vn->size), PAGE_SIZE);
-    vn->pgcache = pgcache_alloc(order, PAGE_SIZE);
+    vn_alloc_pgcache(vn);
   }
 
   struct pgcache *pgcache = getref(vn->pgcache);
@@ -97,8 +350,9 @@ void vn_cleanup(__move vnode_t **vnref) {
   if (VN_OPS(vn)->v_cleanup)
     VN_OPS(vn)->v_cleanup(vn);
 
+  pgcache_free(&vn->pgcache);
   vfs_release(&vn->vfs);
-  kfree(vn);
+  kmem_cache_free(vnode_cache, vn);
 }
 
 //
@@ -128,24 +382,40 @@ int vn_close(vnode_t *vn) {
 }
 
 ssize_t vn_read(vnode_t *vn, off_t off, kio_t *kio) {
-  if (!VN_OPS(vn)->v_read) return -ENOTSUP;
+  if (!VN_OPS(vn)->v_read && !VN_OPS(vn)->v_getpage) return -ENOTSUP;
   if (off < 0) return -EINVAL;
   if (off >= vn->size)
     return 0;
 
+  if (VN_OPS(vn)->v_getpage) {
+    // read through the page cache
+    return vn_cache_rw(vn, (size_t) off, kio);
+  }
+
   // filesystem read
   return VN_OPS(vn)->v_read(vn, off, kio);
 }
 
 ssize_t vn_write(vnode_t *vn, off_t off, kio_t *kio) {
   if (VFS_ISRDONLY(vn->vfs)) return -EROFS;
-  if (!VN_OPS(vn)->v_write) return -ENOTSUP;
+  bool cached = VN_OPS(vn)->v_getpage && VN_OPS(vn)->v_putpage;
+  if (!VN_OPS(vn)->v_write && !cached) return -ENOTSUP;
   if (off < 0) return -EINVAL;
   if (off >= vn->size)
     return 0;
 
+  if (cached) {
+    // write through the page cache
+    return vn_cache_rw(vn, (size_t) off, kio);
+  }
+
   // filesystem write
-  return VN_OPS(vn)->v_write(vn, off, kio);
+  ssize_t res = VN_OPS(vn)->v_write(vn, off, kio);
+  if (res > 0 && vn->pgcache != NULL) {
+    // any cached copies of the written pages are now stale
+    vn_cache_invalidate(vn, (size_t) off, (size_t) res);
+  }
+  return res;
 }
 
 int vn_getpage(vnode_t *vn, off_t off, bool pgcache, __move page_t **result) {
@@ -154,13 +424,12 @@ int vn_getpage(vnode_t *vn, off_t off, bool pgcache, __move page_t **result) {
   if (off >= vn->size)
     return 0;
 
-  page_t *page;
-  if (pgcache && vn->pgcache && (page = pgcache_lookup(vn->pgcache, off)) != NULL) {
-    *result = page;
-    return 0;
+  if (pgcache) {
+    return vn_cache_getpage(vn, align_down(off, PAGE_SIZE), result);
   }
 
   // filesystem getpage
+  page_t *page;
   int res = VN_OPS(vn)->v_getpage(vn, off, &page);
   if (res < 0) {
     return res;
@@ -170,6 +439,14 @@ int vn_getpage(vnode_t *vn, off_t off, bool pgcache, __move page_t **result) {
   return 0;
 }
 
+void vn_get_pgcache_stats(struct vn_pgcache_stats *stats) {
+  stats->hits = atomic_load(&vn_pgcache_stats.hits);
+  stats->misses = atomic_load(&vn_pgcache_stats.misses);
+  stats->ra_windows = atomic_load(&vn_pgcache_stats.ra_windows);
+  stats->ra_pages = atomic_load(&vn_pgcache_stats.ra_pages);
+  stats->ra_random = atomic_load(&vn_pgcache_stats.ra_random);
+}
+
 //
 
 int vn_load(vnode_t *vn) {
@@ -291,7 +568,7 @@ int vn_create(ventry_t *dve, vnode_t *dvn, cstr_t name, mode_t mode, __move vent
   }
 
   assert_new_ventry_valid(ve);
-  ve_add_child(dve, ve);
+  ve_add_new_child(dve, ve);
   vfs_add_node(vfs, ve);
   vfs_end_write_op(vfs);
   // WRITE END
@@ -334,7 +611,7 @@ int vn_mknod(ventry_t *dve, vnode_t *dvn, cstr_t name, mode_t mode, dev_t dev, _
   assert_new_ventry_valid(ve);
   vnode_t *vn = VN(ve);
   vn->v_dev = device_get(dev);
-  ve_add_child(dve, ve);
+  ve_add_new_child(dve, ve);
   vfs_add_node(vfs, ve);
   vfs_end_write_op(vfs);
   // WRITE END
@@ -368,7 +645,7 @@ int vn_symlink(ventry_t *dve, vnode_t *dvn, cstr_t name, cstr_t target, __move v
   }
 
   assert_new_ventry_valid(ve);
-  ve_add_child(dve, ve);
+  ve_add_new_child(dve, ve);
   vfs_add_node(vfs, ve);
   vfs_end_write_op(vfs);
   // WRITE END
@@ -400,7 +677,7 @@ int vn_hardlink(ventry_t *dve, vnode_t *dvn, cstr_t name, vnode_t *target, __mov
   }
 
   assert_new_ventry_valid(ve);
-  ve_add_child(dve, ve);
+  ve_add_new_child(dve, ve);
   vfs_end_write_op(vfs);
   // WRITE END
 
@@ -462,7 +739,7 @@ int vn_mkdir(ventry_t *dve, vnode_t *dvn, cstr_t name, mode_t mode, __move ventr
   }
 
   assert_new_ventry_valid(ve);
-  ve_add_child(dve, ve);
+  ve_add_new_child(dve, ve);
   vfs_add_node(vfs, ve);
   vfs_end_write_op(vfs);
   // WRITE END
@@ -501,3 +778,74 @@ int vn_rmdir(ventry_t *dve, vnode_t *dvn, ventry_t *ve, vnode_t *vn) {
 
   return 0;
 }
+
+//
+
+// #define PGCACHE_READ_BENCHMARK
+#ifdef PGCACHE_READ_BENCHMARK
+#include <kernel/fs.h>
+#include <kernel/sched.h>
+#include <kernel/clock.h>
+
+#define BENCH_FILE "/usr/lib/libc.so"
+#define BENCH_PASSES 8
+#define BENCH_BUFSIZE SIZE_16KB
+
+// reads the whole file sequentially and returns the time it took in ns
+static uint64_t pgcache_bench_pass(int fd, void *buf, size_t *total) {
+  if (fs_lseek(fd, 0, SEEK_SET) < 0) {
+    panic("pgcache: failed to seek %s", BENCH_FILE);
+  }
+
+  size_t n = 0;
+  ssize_t res;
+  uint64_t start = clock_get_nanos();
+  while ((res = fs_read(fd, buf, BENCH_BUFSIZE)) > 0) {
+    n += res;
+  }
+  uint64_t elapsed = clock_get_nanos() - start;
+  if (res < 0) {
+    panic("pgcache: failed to read %s: %d", BENCH_FILE, (int) res);
+  }
+  *total = n;
+  return elapsed;
+}
+
+static void pgcache_bench_worker() {
+  // the initrd is mounted as the root after the module initializers have run
+  struct stat st;
+  while (fs_stat(cstr_make(BENCH_FILE), &st) < 0) {
+    sched_again(SCHED_YIELDED);
+  }
+
+  int fd = fs_open(cstr_make(BENCH_FILE), O_RDONLY, 0);
+  if (fd < 0) {
+    panic("pgcache: failed to open %s: %d", BENCH_FILE, fd);
+  }
+
+  void *buf = kmalloc(BENCH_BUFSIZE);
+  struct vn_pgcache_stats stats;
+  kprintf("pgcache: sequential read benchmark on %s (%lld bytes)\n", BENCH_FILE, st.st_size);
+  for (int i = 0; i < BENCH_PASSES; i++) {
+    size_t total;
+    uint64_t ns = pgcache_bench_pass(fd, buf, &total);
+    vn_get_pgcache_stats(&stats);
+    kprintf("  pass %d: %zu bytes in %llu us (%llu MB/s) [%llu hits, %llu misses, %llu readahead pages]\n",
+            i, total, ns / 1000, ns ? (total * 1000) / ns : 0, stats.hits, stats.misses, stats.ra_pages);
+  }
+
+  kfree(buf);
+  fs_close(fd);
+  thread_stop(curthread);
+  unreachable;
+}
+
+static void pgcache_read_benchmark() {
+  thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+  thread_setup_entry(td, (uintptr_t) pgcache_bench_worker);
+  td->name = str_fmt("pgcache bench");
+  proc_add_thread(curproc, td);
+  thread_finish_setup_and_submit(td);
+}
+MODULE_INIT(pgcache_read_benchmark);
+#endif
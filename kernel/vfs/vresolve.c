@@ -15,7 +15,9 @@
 #define MAX_LOOP 32 // resolve depth limit
 
 #define ASSERT(x) kassert(x)
-#define DPRINTF(fmt, ...) kprintf("vresolve: %s: " fmt, __func__, ##__VA_ARGS__)
+#define DPRINTF(fmt, ...)
+// #define DPRINTF(fmt, ...) kprintf("vresolve: %s: " fmt, __func__, ##__VA_ARGS__)
+#define EPRINTF(fmt, ...) kprintf("vresolve: %s: " fmt, __func__, ##__VA_ARGS__)
 
 #define goto_error(err) do { res = err; goto error; } while (0)
 
@@ -40,12 +42,16 @@ static int vresolve_internal(vcache_t *vcache, ventry_t *at, cstr_t path, int fl
   }
 
   // try the cache first
-  if (vresolve_cache(vcache, path, flags, depth, result) == 0) {
+  int res = vresolve_cache(vcache, path, flags, depth, result);
+  if (res == 0) {
     DPRINTF("cache hit: {:cstr} -> {:ve}\n", &path, *result);
 
     if (fullpath != NULL) // path is already a full path
       sbuf_write_cstr(fullpath, path);
     return 0;
+  } else if (res == -ENOENT && !(flags & (VR_PARENT|VR_EXCLUSV))) {
+    // the path is known not to exist and the caller does not need the parent
+    return -ENOENT;
   }
   // otherwise walk the full path (either due to VR_FULLWALK or a cache miss)
   return vresolve_fullwalk(vcache, at, path, flags, depth, fullpath, result);
@@ -100,7 +106,7 @@ static int vresolve_follow(vcache_t *vc, __move ventry_t **veref, int flags, boo
 
     // follow the symlink (and get locked result)
     if ((res = vresolve_internal(vc, at_ve, cstr_new(linkbuf, vn->size), 0, depth++, fullpath, &next_ve)) < 0) {
-      DPRINTF("failed to follow symlink: %s\n", linkbuf, res);
+      EPRINTF("failed to follow symlink: %s\n", linkbuf, res);
       goto error;
     }
 
@@ -148,14 +154,33 @@ int vresolve_cache(vcache_t *vc, cstr_t path, int flags, int depth, __move ventr
     return -EINVAL;
   }
 
-  ve = vcache_get(vc, path);
-  if (ve == NULL)
-    return -ENOENT;
+  switch (vcache_lookup(vc, path, &ve)) {
+    case VCACHE_HIT:
+      break;
+    case VCACHE_NEGATIVE:
+      return -ENOENT;
+    case VCACHE_MISS:
+      return -EAGAIN;
+  }
+
+  // an unlocked result that does not have to be followed is returned without
+  // ever taking the ventry lock as long as it and its vnode are still alive
+  if ((flags & VR_UNLOCKED) && !(flags & VR_EXCLUSV) &&
+      ((flags & VR_NOFOLLOW) || !(V_ISLNK(ve) || VE_ISMOUNT(ve))) &&
+      V_ISALIVE(ve) && V_ISALIVE(VN(ve)) && VN_ISLOADED(VN(ve))) {
+    if ((res = vresolve_validate_result(ve, flags)) < 0) {
+      ve_release(&ve);
+      return res;
+    }
+    *result = ve_moveref(&ve);
+    return 0;
+  }
+
   // lock the ventry
   if (!ve_lock(ve)) {
     vcache_invalidate(vc, path);
     ve_release(&ve);
-    return -ENOENT;
+    return -EAGAIN;
   }
 
   if (flags & VR_EXCLUSV)
@@ -210,6 +235,11 @@ int vresolve_fullwalk(vcache_t *vc, ventry_t *at, cstr_t path, int flags, int de
     return -ENOENT;
   }
 
+  // negative entries are only cached while curpath names the directory we are
+  // actually in (no '..' or symlinks so far) because creating the entry through
+  // any other path would not find them to replace them
+  bool canonical = true;
+
   // ======================== walk loop ========================
   // we should start and end each iteration with a locked ventry
   while (!path_is_null(part = path_next_part(part))) {
@@ -224,17 +254,38 @@ int vresolve_fullwalk(vcache_t *vc, ventry_t *at, cstr_t path, int flags, int de
 
     if (path_is_dot(part)) {
       continue;
-    } else if (path_is_dotdot(part)) {
+    }
+
+    // write the path part
+    size_t parent_len = sbuf_len(&curpath);
+    sbuf_write_char(&curpath, '/');
+    sbuf_write(&curpath, path_start(part), path_len(part));
+
+    if (path_is_dotdot(part)) {
+      canonical = false;
       next_ve = ve_getref(ve->parent);
       goto lock_next;
     }
-    // ld-musl-x86_64.so.1
-    // /lib/ld-musl-x86_64.so.1
 
-    vn_begin_data_read(vn);
-    res = vn_lookup(ve, vn, cstr_from_path(part), &next_ve);
-    vn_end_data_read(vn);
+    if (canonical && vcache_lookup(vc, cstr_from_sbuf(&curpath), &next_ve) == VCACHE_NEGATIVE) {
+      res = -ENOENT;
+    } else {
+      if (next_ve != NULL) {
+        // a cached entry still has to be looked up under the directory lock
+        ve_release(&next_ve);
+      }
+
+      vn_begin_data_read(vn);
+      res = vn_lookup(ve, vn, cstr_from_path(part), &next_ve);
+      vn_end_data_read(vn);
+      if (res == -ENOENT && canonical) {
+        vcache_put_negative(vc, cstr_from_sbuf(&curpath), ve);
+      }
+    }
+
     if (res < 0) {
+      // curpath is the path of the parent again
+      sbuf_truncate(&curpath, parent_len);
       if (is_last && res == -ENOENT) {
         if (flags & VR_EXCLUSV) {
           // exclusive create, last entry is missing so return parent with success
@@ -261,11 +312,11 @@ int vresolve_fullwalk(vcache_t *vc, ventry_t *at, cstr_t path, int flags, int de
     ve_unlock(ve);
     ve_release_swap(&ve, &next_ve);
 
-    // write the resolved path part
-    sbuf_write_char(&curpath, '/');
-    sbuf_write(&curpath, path_start(part), path_len(part));
     // cache the current path
     vcache_put(vc, cstr_from_sbuf(&curpath), ve);
+    if (V_ISLNK(ve)) {
+      canonical = false;
+    }
 
     // follow the symlink or mount point if needed
     if ((res = vresolve_follow(vc, &ve, flags, is_last, depth, fullpath, &ve)) < 0)
@@ -323,3 +374,83 @@ int vresolve_fullpath(vcache_t *vcache, ventry_t *at, cstr_t path, int flags, __
 int vresolve(vcache_t *vcache, ventry_t *at, cstr_t path, int flags, __move ventry_t **result) {
   return vresolve_internal(vcache, at, path, flags, 0, NULL, result);
 }
+
+//
+
+// #define VRESOLVE_BENCHMARK
+#ifdef VRESOLVE_BENCHMARK
+#include <kernel/fs.h>
+#include <kernel/proc.h>
+#include <kernel/sched.h>
+#include <kernel/clock.h>
+#include <kernel/atomic.h>
+#include <kernel/mm.h>
+
+#define BENCH_PATH "/vrbench/a/b/c/file"
+#define BENCH_LOOKUPS 20000
+#define BENCH_MAX_THREADS 8
+
+extern vcache_t *fs_vcache;
+static volatile int bench_exited;
+
+// alternates between stat and open/close of the same cached path
+static void vresolve_bench_worker() {
+  struct stat st;
+  cstr_t path = cstr_make(BENCH_PATH);
+  for (int i = 0; i < BENCH_LOOKUPS; i++) {
+    if (i % 4 == 3) {
+      int fd = fs_open(path, O_RDONLY, 0);
+      if (fd < 0) {
+        panic("vresolve: failed to open %s: %d", BENCH_PATH, fd);
+      }
+      fs_close(fd);
+    } else if (fs_stat(path, &st) < 0) {
+      panic("vresolve: failed to stat %s", BENCH_PATH);
+    }
+  }
+  atomic_fetch_add(&bench_exited, 1);
+  thread_stop(curthread);
+  unreachable;
+}
+
+// returns the average lookup time in ns with the given number of threads
+static uint64_t vresolve_bench_run(int nthreads) {
+  bench_exited = 0;
+  uint64_t start = clock_get_nanos();
+  for (int i = 0; i < nthreads; i++) {
+    thread_t *td = thread_alloc(TDF_KTHREAD, SIZE_16KB);
+    thread_setup_entry(td, (uintptr_t) vresolve_bench_worker);
+    td->name = str_fmt("vresolve bench %d", i);
+    cpuset_set(td->cpuset, i % system_num_cpus);
+    td->flags2 |= TDF2_AFFINITY;
+    proc_add_thread(curproc, td);
+    thread_finish_setup_and_submit(td);
+  }
+  while (bench_exited < nthreads) {
+    sched_again(SCHED_YIELDED);
+  }
+  uint64_t elapsed = clock_get_nanos() - start;
+  return elapsed / BENCH_LOOKUPS;
+}
+
+static void vresolve_benchmark() {
+  fs_mkdir(cstr_make("/vrbench"), 0777);
+  fs_mkdir(cstr_make("/vrbench/a"), 0777);
+  fs_mkdir(cstr_make("/vrbench/a/b"), 0777);
+  fs_mkdir(cstr_make("/vrbench/a/b/c"), 0777);
+  int fd = fs_create(cstr_make(BENCH_PATH), 0644);
+  if (fd < 0) {
+    panic("vresolve: failed to create %s", BENCH_PATH);
+  }
+  fs_close(fd);
+
+  kprintf("vresolve: parallel lookup benchmark on %s (%d lookups per thread)\n", BENCH_PATH, BENCH_LOOKUPS);
+  int max_threads = min(BENCH_MAX_THREADS, (int) system_num_cpus);
+  for (int n = 1; n <= max_threads; n *= 2) {
+    uint64_t ns = vresolve_bench_run(n);
+    kprintf("  %d threads: %llu ns per lookup round\n", n, ns);
+  }
+  vcache_dump(fs_vcache);
+}
+MODULE_INIT(vresolve_benchmark);
+#endif
@@ -0,0 +1,198 @@
+#include <buddy.h>
+
+#include <kernel/panic.h>
+#include <kernel/string.h>
+
+#ifndef _assert
+#define _assert(expr) kassert((expr))
+#endif
+
+#define LEFT(node) ((node) << 1)
+#define RIGHT(node) (((node) << 1) + 1)
+#define PARENT(node) ((node) >> 1)
+
+// value of a node of the given order when the whole block is free
+#define FULL(order) ((uint8_t)((order) + 1))
+
+static inline size_t node_start(buddy_t *bdy, size_t node, uint8_t order) {
+  return (node << order) - ((size_t)1 << bdy->depth);
+}
+
+static inline size_t node_end(buddy_t *bdy, size_t node, uint8_t order) {
+  return node_start(bdy, node, order) + ((size_t)1 << order);
+}
+
+static inline uint8_t combine(buddy_t *bdy, size_t node, uint8_t order) {
+  uint8_t l = bdy->tree[LEFT(node)];
+  uint8_t r = bdy->tree[RIGHT(node)];
+  if (l == FULL(order - 1) && r == FULL(order - 1)) {
+    return FULL(order);
+  }
+  return max(l, r);
+}
+
+// the children of a completely free or completely used node are stale and
+// must be brought up to date before descending into them
+static inline void push_down(buddy_t *bdy, size_t node, uint8_t order) {
+  uint8_t v = bdy->tree[node];
+  if (v == FULL(order)) {
+    bdy->tree[LEFT(node)] = FULL(order - 1);
+    bdy->tree[RIGHT(node)] = FULL(order - 1);
+  } else if (v == 0) {
+    bdy->tree[LEFT(node)] = 0;
+    bdy->tree[RIGHT(node)] = 0;
+  }
+}
+
+static void update_parents(buddy_t *bdy, size_t node, uint8_t order) {
+  while (node > 1) {
+    node = PARENT(node);
+    order++;
+
+    uint8_t v = combine(bdy, node, order);
+    if (bdy->tree[node] == v) {
+      break;
+    }
+    bdy->tree[node] = v;
+  }
+}
+
+static void mark_range(buddy_t *bdy, size_t node, uint8_t order, size_t start, size_t end, bool free) {
+  size_t nstart = node_start(bdy, node, order);
+  size_t nend = node_end(bdy, node, order);
+  if (end <= nstart || start >= nend) {
+    return;
+  }
+
+  if (start <= nstart && end >= nend) {
+    bdy->tree[node] = free ? FULL(order) : 0;
+    return;
+  }
+
+  push_down(bdy, node, order);
+  mark_range(bdy, LEFT(node), order - 1, start, end, free);
+  mark_range(bdy, RIGHT(node), order - 1, start, end, free);
+  bdy->tree[node] = combine(bdy, node, order);
+}
+
+static bool range_has_state(buddy_t *bdy, size_t node, uint8_t order, size_t start, size_t end, bool free) {
+  size_t nstart = node_start(bdy, node, order);
+  size_t nend = node_end(bdy, node, order);
+  if (end <= nstart || start >= nend) {
+    return true;
+  }
+
+  uint8_t v = bdy->tree[node];
+  if (v == FULL(order)) {
+    return free;
+  } else if (v == 0) {
+    return !free;
+  } else if (start <= nstart && end >= nend) {
+    // a partially free node can never be entirely in one state
+    return false;
+  }
+
+  return range_has_state(bdy, LEFT(node), order - 1, start, end, free) &&
+         range_has_state(bdy, RIGHT(node), order - 1, start, end, free);
+}
+
+//
+
+/**
+ * Returns the number of bytes needed for the tree of a buddy of the given depth.
+ */
+size_t buddy_tree_size(uint8_t depth) {
+  return (size_t)2 << depth;
+}
+
+/**
+ * Initializes a buddy covering 2^depth indices using the given tree storage.
+ * All indices start out as used and must be released with `buddy_mark_free`.
+ */
+void buddy_init(buddy_t *bdy, void *tree, uint8_t depth, uint8_t max_order) {
+  bdy->tree = tree;
+  bdy->depth = depth;
+  bdy->max_order = min(max_order, depth);
+  bdy->free = 0;
+  bdy->used = (size_t)1 << depth;
+  memset(tree, 0, buddy_tree_size(depth));
+}
+
+/**
+ * Allocates a naturally aligned block of 2^order indices and returns the index
+ * of the first one, or -1 if there is no free block large enough. The smallest
+ * block that satisfies the request is chosen to limit fragmentation.
+ */
+index_t buddy_alloc(buddy_t *bdy, uint8_t order) {
+  if (order > bdy->max_order || bdy->tree[1] < FULL(order)) {
+    return -1;
+  }
+
+  size_t node = 1;
+  uint8_t norder = bdy->depth;
+  while (norder > order) {
+    push_down(bdy, node, norder);
+    uint8_t l = bdy->tree[LEFT(node)];
+    uint8_t r = bdy->tree[RIGHT(node)];
+    if (l >= FULL(order) && (r < FULL(order) || l <= r)) {
+      node = LEFT(node);
+    } else {
+      node = RIGHT(node);
+    }
+    norder--;
+  }
+
+  _assert(bdy->tree[node] == FULL(order));
+  bdy->tree[node] = 0;
+  update_parents(bdy, node, norder);
+
+  size_t count = (size_t)1 << order;
+  bdy->free -= count;
+  bdy->used += count;
+  return (index_t) node_start(bdy, node, order);
+}
+
+/**
+ * Marks the n indices starting at index as free, merging them with any free
+ * buddies. The range does not need to match a previous allocation.
+ */
+void buddy_mark_free(buddy_t *bdy, index_t index, size_t n) {
+  _assert(index >= 0 && index + n <= ((size_t)1 << bdy->depth));
+  if (n == 0) {
+    return;
+  }
+
+  mark_range(bdy, 1, bdy->depth, index, index + n, true);
+  bdy->free += n;
+  bdy->used -= n;
+}
+
+/**
+ * Marks the n indices starting at index as used.
+ */
+void buddy_mark_used(buddy_t *bdy, index_t index, size_t n) {
+  _assert(index >= 0 && index + n <= ((size_t)1 << bdy->depth));
+  if (n == 0) {
+    return;
+  }
+
+  mark_range(bdy, 1, bdy->depth, index, index + n, false);
+  bdy->free -= n;
+  bdy->used += n;
+}
+
+/**
+ * Returns `true` if all n indices starting at index are free.
+ */
+bool buddy_is_free(buddy_t *bdy, index_t index, size_t n) {
+  _assert(index >= 0 && index + n <= ((size_t)1 << bdy->depth));
+  return range_has_state(bdy, 1, bdy->depth, index, index + n, true);
+}
+
+/**
+ * Returns `true` if all n indices starting at index are used.
+ */
+bool buddy_is_used(buddy_t *bdy, index_t index, size_t n) {
+  _assert(index >= 0 && index + n <= ((size_t)1 << bdy->depth));
+  return range_has_state(bdy, 1, bdy->depth, index, index + n, false);
+}
@@ -0,0 +1,34 @@
+#ifndef LIB_BUDDY_H
+#define LIB_BUDDY_H
+
+#include <kernel/base.h>
+
+/*
+ * A binary buddy tree.
+ *
+ * The tree is stored as an implicit complete binary tree of order `depth` where
+ * each node covers a naturally aligned block of 2^order indices. Every node holds
+ * the largest free order found beneath it plus one, with 0 meaning no free indices
+ * and `order + 1` meaning the whole block is free. Allocations, frees and arbitrary
+ * range updates all walk a single root-to-leaf path so they run in O(log n).
+ */
+typedef struct buddy {
+  uint8_t *tree;     // node array (1-indexed)
+  uint8_t depth;     // order of the root node
+  uint8_t max_order; // largest order that may be allocated
+  size_t free;       // the number of free indices
+  size_t used;       // the number of used indices
+} buddy_t;
+
+typedef ptrdiff_t index_t;
+
+size_t buddy_tree_size(uint8_t depth);
+void buddy_init(buddy_t *bdy, void *tree, uint8_t depth, uint8_t max_order);
+
+index_t buddy_alloc(buddy_t *bdy, uint8_t order);
+void buddy_mark_free(buddy_t *bdy, index_t index, size_t n);
+void buddy_mark_used(buddy_t *bdy, index_t index, size_t n);
+bool buddy_is_free(buddy_t *bdy, index_t index, size_t n);
+bool buddy_is_used(buddy_t *bdy, index_t index, size_t n);
+
+#endif
@@ -115,6 +115,11 @@ intvl_tree_t *create_intvl_tree() {
   return tree;
 }
 
+void intvl_tree_free(intvl_tree_t *tree) {
+  kfree(tree->events);
+  rb_tree_free(tree);
+}
+
 //
 
 intvl_node_t *intvl_tree_find(intvl_tree_t *tree, interval_t interval) {
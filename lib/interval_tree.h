@@ -68,6 +68,7 @@ typedef rb_tree_t intvl_tree_t;
 
 
 intvl_tree_t *create_intvl_tree();
+void intvl_tree_free(intvl_tree_t *tree);
 intvl_node_t *intvl_tree_find(intvl_tree_t *tree, interval_t interval);
 void *intvl_tree_get_point(intvl_tree_t *tree, uint64_t point);
 interval_t intvl_tree_find_free_gap(intvl_tree_t *tree, interval_t intvl, size_t align, intvl_node_t **prev_node);
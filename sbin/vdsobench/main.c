@@ -0,0 +1,90 @@
+// Compares the cost of the vdso time functions with the equivalent syscalls.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/auxv.h>
+
+#define DEFAULT_ITERS 1000000
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void report(const char *name, long iters, uint64_t start) {
+  uint64_t elapsed = now_ns() - start;
+  printf("  %-24s %8llu ns total, %6.1f ns/call\n", name,
+         (unsigned long long) elapsed, (double) elapsed / (double) iters);
+}
+
+int main(int argc, char **argv) {
+  long iters = argc > 1 ? strtol(argv[1], NULL, 10) : DEFAULT_ITERS;
+  if (iters <= 0) {
+    iters = DEFAULT_ITERS;
+  }
+
+  printf("vdsobench: %ld iterations, vdso at %p\n", iters, (void *) getauxval(AT_SYSINFO_EHDR));
+
+  struct timespec ts;
+  struct timeval tv;
+  volatile long sink = 0;
+  uint64_t start;
+
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sink += ts.tv_nsec;
+  }
+  report("clock_gettime (vdso)", iters, start);
+
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+    sink += ts.tv_nsec;
+  }
+  report("clock_gettime (syscall)", iters, start);
+
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    gettimeofday(&tv, NULL);
+    sink += tv.tv_usec;
+  }
+  report("gettimeofday (vdso)", iters, start);
+
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    syscall(SYS_gettimeofday, &tv, NULL);
+    sink += tv.tv_usec;
+  }
+  report("gettimeofday (syscall)", iters, start);
+
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    sink += time(NULL);
+  }
+  report("time (vdso)", iters, start);
+
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    sink += sched_getcpu();
+  }
+  report("sched_getcpu (vdso)", iters, start);
+
+  unsigned cpu;
+  start = now_ns();
+  for (long i = 0; i < iters; i++) {
+    syscall(SYS_getcpu, &cpu, NULL, NULL);
+    sink += cpu;
+  }
+  report("getcpu (syscall)", iters, start);
+
+  (void) sink;
+  return 0;
+}